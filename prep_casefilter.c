@@ -2,6 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 /* ===== types.h の内容 ===== */
 #define KEYWORD_LEN 15
@@ -9,10 +15,68 @@
 #define CHILD_BUCKETS (KEYWORD_LEN + 1)
 #define INIT_CAPACITY 1024
 
+/* ===== 仕様（長さ・k・文字種） =====
+ * 文字種は -DCASEFILTER_ALPHABET=N（2..10、既定 10 = A–J）。search_casefilter と同じ値でビルドすること。
+ * 文字種の外の文字を含む DB 行は長さ違いの行と同じく読み飛ばす。--max-k K で k <= K に要るキーだけ格納する。
+ * Case A の分割方式は --case-a（pairs / halves / thirds）で選ぶ。
+ */
+#ifndef CASEFILTER_ALPHABET
+#define CASEFILTER_ALPHABET 10
+#endif
+#if CASEFILTER_ALPHABET < 2 || CASEFILTER_ALPHABET > 10
+#error "CASEFILTER_ALPHABET must be between 2 and 10"
+#endif
+
 /* ===== index.h の内容 ===== */
 #define CASEFILTER_HPAIR_COUNT 10
-#define CASEFILTER_H_KEY_SPACE 1000000
-#define CASEFILTER_DEL_KEY_SPACE 10000000
+#define CASEFILTER_H_KEY_SPACE (CASEFILTER_ALPHABET * CASEFILTER_ALPHABET * CASEFILTER_ALPHABET * \
+                                CASEFILTER_ALPHABET * CASEFILTER_ALPHABET * CASEFILTER_ALPHABET)
+#define CASEFILTER_DEL_KEY_SPACE (CASEFILTER_H_KEY_SPACE * CASEFILTER_ALPHABET)
+
+/* k ごとの削除キーの側数（0 / 左 / 左右。探索側と同じ表） */
+static const uint8_t cf_del_sides[MAX_EDIT_DIST + 1] = {0, 0, 1, 2};
+
+/* Case A の分割方式（探索側と同じ表。近傍の半径と tier1 は探索だけが使う）。
+ * 群 g のキーは mask の文字を位置の昇順に並べた N 進値、スロットは キー + g * N^key_len。
+ * cover[k] は --max-k k で格納する群 */
+enum { CF_SCHEME_PAIRS, CF_SCHEME_HALVES, CF_SCHEME_THIRDS, CF_SCHEMES };
+
+typedef struct {
+    const char *name;
+    uint8_t groups;
+    uint8_t key_len;
+    uint16_t mask[CASEFILTER_HPAIR_COUNT];
+    uint16_t cover[MAX_EDIT_DIST + 1];
+} CfScheme;
+
+static const CfScheme cf_schemes[CF_SCHEMES] = {
+    {"pairs", 10, 6, {0x003F, 0x01C7, 0x0E07, 0x7007, 0x01F8, 0x0E38, 0x7038, 0x0FC0, 0x71C0, 0x7E00},
+     {0x001, 0x081, 0x381, 0x3FF}},
+    {"halves", 2, 6, {0x003F, 0x0FC0}, {0x1, 0x3, 0x3, 0x3}},
+    {"thirds", 3, 5, {0x001F, 0x03E0, 0x7C00}, {0x1, 0x3, 0x7, 0x7}},
+};
+
+static inline uint32_t cf_scheme_key_space(const CfScheme *sc) {
+    uint32_t n = 1;
+    for (int i = 0; i < sc->key_len; ++i) n *= CASEFILTER_ALPHABET;
+    return n;
+}
+
+/* v2 の spec セクションにそのまま書く */
+typedef struct {
+    uint32_t keyword_len;
+    uint32_t max_k;
+    uint32_t alphabet;
+    uint32_t h_pair_mask;
+    uint32_t d_sides;
+    uint32_t h_scheme;
+} CaseFilterSpec;
+
+static inline CaseFilterSpec casefilter_spec_for(int max_k, int scheme) {
+    CaseFilterSpec sp = {KEYWORD_LEN, (uint32_t)max_k, CASEFILTER_ALPHABET, cf_schemes[scheme].cover[max_k],
+                         cf_del_sides[max_k], (uint32_t)scheme};
+    return sp;
+}
 
 typedef struct PostingH {
     char key[6];
@@ -32,12 +96,71 @@ typedef struct PostingDel {
     struct PostingDel *next;
 } PostingDel;
 
+/*
+ * キーワード id の幅。idpos は id | del_pos << id_bits の 32bit 詰め。
+ *   narrow: id 20bit（≤ 2^20 件）。v1 は id を 3 バイトで書く
+ *   wide:   id 28bit（≤ 2^28 件）。v1 は 4 バイト。keyword_count が narrow を超えると自動で選ぶ
+ * 実行時の idpos はどちらも 4 バイトなので、探索側の差は id マスクが変数になるだけ。
+ */
+#define CASEFILTER_NARROW_ID_BITS 20
+#define CASEFILTER_WIDE_ID_BITS 28
+#define CASEFILTER_NARROW_ID_LIMIT (1 << CASEFILTER_NARROW_ID_BITS)
+#define CASEFILTER_MAX_KEYWORDS (1 << CASEFILTER_WIDE_ID_BITS)
+
+/*
+ * 詰めたポスティング（--packed-postings, v2 のみ）: id を w = cf_pack_bits(keyword_count) bit ずつ、
+ * i 番目を bit i*w からリトルエンディアンで並べる。search は 8 件組を 16 バイト読み 2 回で取り出すので、
+ * 列の末尾に CF_PACK_PAD バイトの余白を置く。D の del_pos は 4bit で別の列に詰める。
+ */
+#define CF_PACK_PAD 32
+#define CF_DPOS_BITS 4
+#define CF_PACKED_BYTES(n, bits) (((uint64_t)(n) * (uint64_t)(bits) + 7) / 8 + CF_PACK_PAD)
+
+static inline int cf_pack_bits(int keyword_count) {
+    int b = 1;
+    while ((1u << b) < (uint32_t)keyword_count) ++b;
+    return b;
+}
+
+/*
+ * 疎スロットディレクトリ（--sparse-dir）: 密な offsets[slots+1] の代わりに、連続する per 個のスロットを
+ * 64B のレコード 1 本にまとめる。cum[j] は群先頭からスロット j 末尾までの累積件数の下位 width bit、
+ * wrap の bit j はスロット j でその累積が 2^width を跨いだこと。1 スロットの件数が 2^width 未満なら
+ *   末尾(j) = cum[j] + (popcount(wrap[0..j]) << width)
+ * で復元でき、(start, len) は 1 ラインの読みと popcount だけで出る（総和ループなし）。
+ *   width 4: 96 スロット/レコード（約 0.67B/slot）、width 8: 48 スロット/レコード（約 1.33B/slot）
+ * width は索引ごとに小さくなる方を prep が選ぶ。件数が収まらない群は start の最上位 bit を立て、
+ * 下位 31bit を ovf 内の位置として ovf[pos..pos+per] に正確な offsets を置く。
+ */
+#define SDIR_CUM_BYTES 48
+#define SDIR_EXACT 0x80000000u
+
+typedef struct {
+    uint32_t start;               /* 群の先頭オフセット、または SDIR_EXACT | ovf 位置 */
+    uint32_t wrap[3];             /* 96bit: スロット j で累積が 2^width を跨いだら bit j */
+    uint8_t cum[SDIR_CUM_BYTES];  /* 累積件数の下位 width bit（width 4 なら下位 nibble が偶数スロット） */
+} SlotDirRec;
+
+typedef struct {
+    SlotDirRec *rec;   /* [groups]（NULL なら密 offsets を使う） */
+    uint32_t *ovf;     /* [ovf_words] */
+    size_t ovf_words;
+    int width;         /* 4 or 8 */
+    int per;           /* SDIR_CUM_BYTES * 8 / width */
+    uint32_t total;    /* 総ポスティング数 */
+} SlotDir;
+
+#define SDIR_GROUPS(slots, per) (((size_t)(slots) + (size_t)(per) - 1) / (size_t)(per))
+
 typedef struct {
     int key_space;
     int pair_count;
     int *offsets;
     uint32_t *counts;
     int *ids;
+    uint64_t *occ;  /* スロット占有ビットマップ（1bit/slot, 約1.25MB）: 空スロットで offsets を引かない */
+    uint64_t *fat;  /* fat postings: ids の代わりに codes[id] をポスティング順に並べたもの（NULL なら通常） */
+    SlotDir sdir;
 } HIndex;
 
 typedef struct {
@@ -45,6 +168,10 @@ typedef struct {
     int *offsets;
     uint32_t *counts;
     uint32_t *idpos;
+    uint64_t *occ;
+    SlotDir sdir;
+    int id_bits;       /* CASEFILTER_NARROW_ID_BITS / CASEFILTER_WIDE_ID_BITS */
+    uint32_t id_mask;  /* (1 << id_bits) - 1 */
 } DelIndex;
 
 typedef struct CaseFilterIndex {
@@ -54,14 +181,82 @@ typedef struct CaseFilterIndex {
     uint64_t *codes;
     HIndex hidx;
     DelIndex del7;
+    uint64_t *exact;       /* --exact-set: codes の開番地ハッシュ集合 [exact_cap]（空きは ~0。NULL なら無し） */
+    uint32_t exact_cap;
+    unsigned build_flags;  /* CASEFILTER_BUILD_*。casefilter_finalize 前に設定する */
+    int build_threads;     /* casefilter_finalize の構築スレッド数（0/1 は逐次） */
+    CaseFilterSpec spec;   /* 格納するキー（casefilter_create で k = 3 の既定。finalize 前に変えてよい） */
 } CaseFilterIndex;
 
+#define CASEFILTER_BUILD_FAT_POSTINGS 0x1u
+#define CASEFILTER_BUILD_SPARSE_DIR 0x2u
+#define CASEFILTER_BUILD_WIDE_IDS 0x4u  /* keyword_count が CASEFILTER_NARROW_ID_LIMIT を超えると自動で立つ */
+#define CASEFILTER_BUILD_EXACT_SET 0x8u
+#define CASEFILTER_BUILD_SORT_IDS 0x10u  /* finalize の最初に重複を除き、code 順に id を振り直す */
+#define CASEFILTER_BUILD_PACKED 0x20u    /* v2 の ids / idpos を詰めた列で書く（常駐の配列は変えない） */
+#define CASEFILTER_BUILD_NEIGHBOUR_SIG 0x40u  /* idpos の上位 8bit に近傍署名（wide では自動で外れる） */
+
 CaseFilterIndex *casefilter_create(int capacity);
 void casefilter_insert(CaseFilterIndex *idx, const char *word);
 void casefilter_finalize(CaseFilterIndex *idx);
 void casefilter_serialize(const CaseFilterIndex *idx, FILE *out);
+int casefilter_serialize_v2(const CaseFilterIndex *idx, FILE *out);
+void casefilter_report_v2(const CaseFilterIndex *idx, FILE *log);
 void casefilter_free(CaseFilterIndex *idx);
 
+/* v2形式: ヘッダ + セクション表 + ALIGN境界に揃えた実行時配列をそのまま格納（mmapで即利用可） */
+#define CASEFILTER_V2_MAGIC "CFIDXv2"
+#define CASEFILTER_V2_VERSION 2u
+#define CASEFILTER_V2_ALIGN 4096u
+#define CASEFILTER_V2_MAX_SECTIONS 16
+
+enum {
+    CF_SEC_CODES = 1,      /* uint64_t[keyword_count] */
+    CF_SEC_H_OFFSETS = 2,  /* int32_t[h_slots + 1] */
+    CF_SEC_H_IDS = 3,      /* int32_t[h_total] */
+    CF_SEC_D_OFFSETS = 4,  /* int32_t[del_key_space + 1] */
+    CF_SEC_D_IDPOS = 5,    /* uint32_t[d_total] (id20bit | del_pos<<20) */
+    CF_SEC_H_OCC = 6,      /* uint64_t[(h_slots + 63) / 64] */
+    CF_SEC_D_OCC = 7,      /* uint64_t[(del_key_space + 63) / 64] */
+    CF_SEC_H_FAT = 8,      /* uint64_t[h_total]: fat postings（H_IDS の代わり） */
+    CF_SEC_H_DIR_META = 9, /* uint32_t[2] = {width, total}: 疎ディレクトリ（H_OFFSETS の代わり） */
+    CF_SEC_H_DIR = 10,     /* SlotDirRec[groups] */
+    CF_SEC_H_DIR_OVF = 11, /* uint32_t[ovf_words] */
+    CF_SEC_D_DIR_META = 12,
+    CF_SEC_D_DIR = 13,
+    CF_SEC_D_DIR_OVF = 14,
+    CF_SEC_D_IDPOS_WIDE = 15, /* uint32_t[d_total] (id28bit | del_pos<<28)（D_IDPOS の代わり） */
+    CF_SEC_EXACT = 16,        /* uint64_t[2^m]: codes の開番地ハッシュ集合（--exact-set。空きは ~0） */
+    CF_SEC_SPEC = 17,         /* uint32_t[6]: CaseFilterSpec */
+    CF_SEC_H_IDS_PACKED = 18, /* uint8_t[CF_PACKED_BYTES(h_total, w)]: 詰めた id（H_IDS の代わり） */
+    CF_SEC_D_IDS_PACKED = 19, /* uint8_t[CF_PACKED_BYTES(d_total, w)]: 詰めた id（D_IDPOS の代わり） */
+    CF_SEC_D_POS_PACKED = 20, /* uint8_t[CF_PACKED_BYTES(d_total, 4)]: del_pos */
+    CF_SEC_D_IDPOS_SIG = 21   /* uint32_t[d_total] (id20bit | del_pos<<20 | 署名<<24)（D_IDPOS の代わり） */
+};
+
+#define OCC_WORDS(slots) (((size_t)(slots) + 63) / 64)
+
+static inline int occ_test(const uint64_t *occ, uint32_t slot) {
+    return (int)((occ[slot >> 6] >> (slot & 63)) & 1u);
+}
+
+typedef struct {
+    uint32_t id;
+    uint32_t elem_size;
+    uint64_t offset;  /* ファイル先頭からのバイト位置（ALIGN境界） */
+    uint64_t count;   /* 要素数 */
+} CaseFilterV2Section;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    int32_t keyword_count;
+    int32_t h_key_space;
+    int32_t h_pair_count;
+    int32_t del_key_space;
+} CaseFilterV2Header;
+
 static inline uint64_t casefilter_pack_delete(uint64_t code, int del_pos) {
     uint64_t low_mask = (del_pos == 0) ? 0 : ((1ULL << (del_pos * 4)) - 1ULL);
     uint64_t lower = code & low_mask;
@@ -69,6 +264,27 @@ static inline uint64_t casefilter_pack_delete(uint64_t code, int del_pos) {
     return lower | (upper << (del_pos * 4));
 }
 
+/*
+ * 近傍署名（--neighbour-sig, v2・narrow のみ）: narrow の idpos は 24bit しか使わないので、空いた上位 8bit に
+ * そのポスティングを作った削除後 14 文字のうちキーでない側の 7 文字の署名を置く。
+ * 署名は 7 文字を 3 / 2 / 2 文字の欄に分けたハッシュ（3 / 3 / 2 bit）。キー側が一致して反対側が
+ * 置換 1 個以内なら、少なくとも 2 欄は一致する（search はこれで codes を読まずに候補を落とす）。
+ */
+#define CF_DSIG_SHIFT 24
+
+static inline uint32_t cf_dsig(uint64_t half) {
+    uint32_t a = (uint32_t)(half & 0xFFF) * 0x9E3779B1u >> 29;
+    uint32_t b = (uint32_t)(half >> 12 & 0xFF) * 0x9E3779B1u >> 29;
+    uint32_t c = (uint32_t)(half >> 20 & 0xFF) * 0x9E3779B1u >> 30;
+    return a | b << 3 | c << 6;
+}
+
+/* 削除位置 pos、side 0（左7がキー）なら右7、1 なら左7の署名 */
+static inline uint32_t cf_dsig_at(uint64_t code, int pos, int side) {
+    uint64_t d = casefilter_pack_delete(code, pos);
+    return cf_dsig(side ? d & 0xFFFFFFF : d >> 28 & 0xFFFFFFF);
+}
+
 /* ===== build.c の内容 ===== */
 #define HPAIR_COUNT CASEFILTER_HPAIR_COUNT
 #define H_KEY_SPACE CASEFILTER_H_KEY_SPACE
@@ -82,7 +298,7 @@ static inline uint32_t pack_key6(const char *key) {
     uint32_t mul = 1;
     for (int i = 0; i < 6; ++i) {
         v += (((uint32_t)key[i] - 'A') & 0xF) * mul;
-        mul *= 10u;
+        mul *= CASEFILTER_ALPHABET;
     }
     return v;
 }
@@ -92,7 +308,7 @@ static inline uint32_t pack_key7(const char *key) {
     uint32_t mul = 1;
     for (int i = 0; i < 7; ++i) {
         v += (((uint32_t)key[i] - 'A') & 0xF) * mul;
-        mul *= 10u;
+        mul *= CASEFILTER_ALPHABET;
     }
     return v;
 }
@@ -114,6 +330,7 @@ CaseFilterIndex *casefilter_create(int capacity) {
     idx->keyword_cap = capacity > 0 ? capacity : 1024;
     idx->keywords = (char (*)[KEYWORD_LEN + 1])malloc(sizeof(char[KEYWORD_LEN + 1]) * idx->keyword_cap);
     idx->codes = (uint64_t *)malloc(sizeof(uint64_t) * idx->keyword_cap);
+    idx->spec = casefilter_spec_for(MAX_EDIT_DIST, CF_SCHEME_PAIRS);
     return idx;
 }
 
@@ -132,209 +349,1715 @@ void casefilter_insert(CaseFilterIndex *idx, const char *word) {
     idx->keyword_count++;
 }
 
-static void build_hindex(CaseFilterIndex *idx) {
-    HIndex *h = &idx->hidx;
-    h->key_space = H_KEY_SPACE;
-    h->pair_count = HPAIR_COUNT;
-    int slots = h->key_space * h->pair_count;
-    h->counts = (uint32_t *)calloc((size_t)slots, sizeof(uint32_t));
-    /* 1st pass: count */
-    for (int id = 0; id < idx->keyword_count; ++id) {
-        const char *w = idx->keywords[id];
-        char blocks[5][3];
-        for (int b = 0; b < 5; ++b) memcpy(blocks[b], w + b * 3, 3);
-        for (int p = 0; p < HPAIR_COUNT; ++p) {
-            char key[6];
-            memcpy(key, blocks[pair_i[p]], 3);
-            memcpy(key + 3, blocks[pair_j[p]], 3);
-            int slot = (int)(pack_key6(key) + (uint32_t)p * H_KEY_SPACE);
-            h->counts[slot]++;
+static uint64_t *build_occupancy(const uint32_t *counts, int slots) {
+    uint64_t *occ = (uint64_t *)calloc(OCC_WORDS(slots), sizeof(uint64_t));
+    if (!occ) return NULL;
+    for (int i = 0; i < slots; ++i) {
+        if (counts[i]) occ[i >> 6] |= 1ULL << (i & 63);
+    }
+    return occ;
+}
+
+/* ===== 構築用の大きな配列（huge page / NUMA） =====
+ * 件数表 hist・offsets・scatter 先・fat はスロット順にランダムに書くので、search_casefilter と同じ規則で確保する:
+ * --hugepages thp は 2MB 境界の匿名 mmap + madvise、2m / 1g は MAP_HUGETLB（足りなければ順に小さいページへ）、
+ * --numa interleave は mbind で全ノードに散らす。off なら malloc / calloc のまま。
+ */
+enum { CF_HUGE_OFF, CF_HUGE_THP, CF_HUGE_2M, CF_HUGE_1G };
+
+#define CF_HUGE_2M_BYTES ((size_t)2 << 20)
+#define CF_HUGE_1G_BYTES ((size_t)1 << 30)
+#define CF_HUGE_1G_MIN ((size_t)256 << 20)
+#define CF_ARRAY_MIN_BYTES CF_HUGE_2M_BYTES
+#define CF_NUMA_MAX_NODES 64
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define CF_MPOL_INTERLEAVE 3
+
+static int huge_policy = CF_HUGE_OFF;
+static int numa_interleave;
+
+typedef struct CfArray {
+    void *p;
+    size_t len;
+    struct CfArray *next;
+} CfArray;
+
+static CfArray *cf_arrays;
+static pthread_mutex_t cf_arrays_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static int set_hugepages(const char *mode) {
+    if (strcmp(mode, "off") == 0) huge_policy = CF_HUGE_OFF;
+#ifdef __linux__
+    else if (strcmp(mode, "thp") == 0) huge_policy = CF_HUGE_THP;
+    else if (strcmp(mode, "2m") == 0) huge_policy = CF_HUGE_2M;
+    else if (strcmp(mode, "1g") == 0) huge_policy = CF_HUGE_1G;
+#endif
+    else return 0;
+    return 1;
+}
+
+#ifdef __linux__
+/* /sys/devices/system/node/online（"0-1" など）。読めなければ node 0 だけ */
+static uint64_t numa_node_mask(void) {
+    uint64_t mask = 0;
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    char buf[256];
+    if (f && fgets(buf, sizeof(buf), f)) {
+        for (char *p = buf; *p && *p != '\n';) {
+            char *end;
+            long lo = strtol(p, &end, 10), hi = lo;
+            if (end == p) break;
+            if (*end == '-') hi = strtol(end + 1, &end, 10);
+            for (long i = lo; i <= hi && i < CF_NUMA_MAX_NODES; ++i) mask |= 1ULL << i;
+            p = *end == ',' ? end + 1 : end;
         }
     }
-    /* prefix sum -> offsets */
-    h->offsets = (int *)malloc(sizeof(int) * (size_t)(slots + 1));
-    h->offsets[0] = 0;
-    for (int i = 0; i < slots; ++i) {
-        h->offsets[i + 1] = h->offsets[i] + (int)h->counts[i];
-    }
-    int total_ids = h->offsets[slots];
-    h->ids = (int *)malloc(sizeof(int) * (size_t)total_ids);
-    int *cursor = (int *)malloc(sizeof(int) * (size_t)slots);
-    memcpy(cursor, h->offsets, sizeof(int) * (size_t)slots);
-    /* 2nd pass: fill postings */
-    for (int id = 0; id < idx->keyword_count; ++id) {
-        const char *w = idx->keywords[id];
-        char blocks[5][3];
-        for (int b = 0; b < 5; ++b) memcpy(blocks[b], w + b * 3, 3);
-        for (int p = 0; p < HPAIR_COUNT; ++p) {
-            char key[6];
-            memcpy(key, blocks[pair_i[p]], 3);
-            memcpy(key + 3, blocks[pair_j[p]], 3);
-            int slot = (int)(pack_key6(key) + (uint32_t)p * H_KEY_SPACE);
-            h->ids[cursor[slot]++] = id;
+    if (f) fclose(f);
+    return mask ? mask : 1;
+}
+
+static void *map_aligned(size_t len, size_t a) {
+    unsigned char *raw = (unsigned char *)mmap(NULL, len + a, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == (unsigned char *)MAP_FAILED) return NULL;
+    unsigned char *p = (unsigned char *)(((uintptr_t)raw + a - 1) & ~(uintptr_t)(a - 1));
+    if (p > raw) munmap(raw, (size_t)(p - raw));
+    if (p + len < raw + len + a) munmap(p + len, (size_t)(raw + len + a - (p + len)));
+    return p;
+}
+
+static void *map_hugetlb(size_t len, int shift) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void huge_fallback_warn(const char *what) {
+    static int warned;
+    if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "hugepages: %s ページの予約が足りないので小さいページに落とします\n", what);
+    }
+}
+
+static void *cf_map_array(size_t bytes, size_t *maplen) {
+    if (bytes < CF_ARRAY_MIN_BYTES || (huge_policy == CF_HUGE_OFF && !numa_interleave)) return NULL;
+    void *p = NULL;
+    size_t len = 0;
+    if (huge_policy == CF_HUGE_1G && bytes >= CF_HUGE_1G_MIN) {
+        len = (bytes + CF_HUGE_1G_BYTES - 1) & ~(CF_HUGE_1G_BYTES - 1);
+        if (!(p = map_hugetlb(len, 30))) huge_fallback_warn("1GB");
+    }
+    if (!p && huge_policy >= CF_HUGE_2M) {
+        len = (bytes + CF_HUGE_2M_BYTES - 1) & ~(CF_HUGE_2M_BYTES - 1);
+        if (!(p = map_hugetlb(len, 21))) huge_fallback_warn("2MB");
+    }
+    if (!p) {
+        len = (bytes + CF_HUGE_2M_BYTES - 1) & ~(CF_HUGE_2M_BYTES - 1);
+        if (!(p = map_aligned(len, CF_HUGE_2M_BYTES))) return NULL;
+        if (huge_policy != CF_HUGE_OFF) madvise(p, len, MADV_HUGEPAGE);
+    }
+    uint64_t mask = numa_node_mask();
+    /* 失敗しても既定の配置で動くので結果は見ない */
+    if (numa_interleave && (mask & (mask - 1))) {
+        (void)syscall(SYS_mbind, p, len, CF_MPOL_INTERLEAVE, &mask, (unsigned long)CF_NUMA_MAX_NODES + 1, 0);
+    }
+    *maplen = len;
+    return p;
+}
+#endif
+
+static void *cf_array_alloc(size_t bytes, int zero) {
+#ifdef __linux__
+    size_t len = 0;
+    void *p = cf_map_array(bytes, &len);
+    if (p) {
+        CfArray *a = (CfArray *)malloc(sizeof(CfArray));
+        if (!a) {
+            munmap(p, len);
+            return NULL;
+        }
+        a->p = p;
+        a->len = len;
+        pthread_mutex_lock(&cf_arrays_mu);
+        a->next = cf_arrays;
+        cf_arrays = a;
+        pthread_mutex_unlock(&cf_arrays_mu);
+        return p;
+    }
+#endif
+    return zero ? calloc(bytes ? bytes : 1, 1) : malloc(bytes ? bytes : 1);
+}
+
+static void cf_array_free(void *p) {
+    if (!p) return;
+    pthread_mutex_lock(&cf_arrays_mu);
+    for (CfArray **pp = &cf_arrays; *pp; pp = &(*pp)->next) {
+        CfArray *a = *pp;
+        if (a->p != p) continue;
+        *pp = a->next;
+        pthread_mutex_unlock(&cf_arrays_mu);
+        munmap(a->p, a->len);
+        free(a);
+        return;
+    }
+    pthread_mutex_unlock(&cf_arrays_mu);
+    free(p);
+}
+
+/* ===== CSR 構築: 1st pass（件数）→ prefix sum → 2nd pass（scatter） =====
+ * -j N ではキーワード id を N 個の連続範囲に分け、スレッドごとの件数表 hist[t] を作る。prefix sum 後の
+ * hist[t][slot] = offsets[slot] + (t より前のスレッドの件数) をそのまま書き込み位置にするので、
+ * 各スロット内は id 昇順（同じ id 内は emit 順）になり、逐次構築とバイト単位で同じ結果になる。
+ */
+#define CASEFILTER_MAX_BUILD_THREADS 64
+#define H_KEYS_PER_WORD HPAIR_COUNT
+#define D_KEYS_PER_WORD (KEYWORD_LEN * 2)
+
+/* キーワード w（id）1 件分の (slot, 値) を emit 順に書き出し、個数を返す。idx は del7.id_bits/id_mask だけ見る */
+typedef int (*EmitFn)(const CaseFilterIndex *idx, const char *w, int id, uint32_t *slot, uint32_t *val);
+
+/* spec.h_pair_mask の群だけ（k < 3 の索引は被覆に要らない群を持たない） */
+static int emit_h(const CaseFilterIndex *idx, const char *w, int id, uint32_t *slot, uint32_t *val) {
+    const CfScheme *sc = &cf_schemes[idx->spec.h_scheme];
+    if (idx->spec.h_scheme != CF_SCHEME_PAIRS) {
+        uint32_t space = cf_scheme_key_space(sc);
+        int n = 0;
+        for (int g = 0; g < sc->groups; ++g) {
+            if (!(idx->spec.h_pair_mask >> g & 1)) continue;
+            uint32_t v = 0, mul = 1;
+            for (int i = 0; i < KEYWORD_LEN; ++i) {
+                if (!(sc->mask[g] >> i & 1)) continue;
+                v += (((uint32_t)w[i] - 'A') & 0xF) * mul;
+                mul *= CASEFILTER_ALPHABET;
+            }
+            slot[n] = v + (uint32_t)g * space;
+            val[n++] = (uint32_t)id;
+        }
+        return n;
+    }
+    char blocks[5][3];
+    for (int b = 0; b < 5; ++b) memcpy(blocks[b], w + b * 3, 3);
+    int n = 0;
+    for (int p = 0; p < HPAIR_COUNT; ++p) {
+        if (!(idx->spec.h_pair_mask >> p & 1)) continue;
+        char key[6];
+        memcpy(key, blocks[pair_i[p]], 3);
+        memcpy(key + 3, blocks[pair_j[p]], 3);
+        slot[n] = pack_key6(key) + (uint32_t)p * H_KEY_SPACE;
+        val[n++] = (uint32_t)id;
+    }
+    return n;
+}
+
+/* 8 文字 c[0..8) から 1 文字消した 7 文字の pack_key7。pre[i] = c[0..i) の重み付き和（c[0] が N^0） */
+static inline uint32_t del8_key(const uint32_t *pre, int q) {
+    return pre[q] + (pre[8] - pre[q + 1]) / CASEFILTER_ALPHABET;
+}
+
+/*
+ * 削除位置 pos の左7は pos <= 7 なら w[0..8) から pos を消したもの（それ以外は w[0..7)）、
+ * 右7は pos >= 7 なら w[7..15) から pos-7 を消したもの（それ以外は w[8..15)）。
+ * 文字コピーの代わりに前半 8 文字・後半 8 文字の prefix 和から O(1) で出す。
+ * spec.d_sides が 1 なら左7だけ、0 なら何も出さない。--neighbour-sig ならキーでない側の署名も値に入れる
+ */
+static int emit_d(const CaseFilterIndex *idx, const char *w, int id, uint32_t *slot, uint32_t *val) {
+    const DelIndex *d = &idx->del7;
+    int sides = (int)idx->spec.d_sides;
+    if (!sides) return 0;
+    uint32_t lo[9], hi[9];
+    lo[0] = hi[0] = 0;
+    for (int i = 0, mul = 1; i < 8; ++i, mul *= CASEFILTER_ALPHABET) {
+        lo[i + 1] = lo[i] + (((uint32_t)w[i] - 'A') & 0xF) * (uint32_t)mul;
+        hi[i + 1] = hi[i] + (((uint32_t)w[7 + i] - 'A') & 0xF) * (uint32_t)mul;
+    }
+    uint32_t left7 = del8_key(lo, 7);   /* w[0..7) */
+    uint32_t right7 = del8_key(hi, 0);  /* w[8..15) */
+    int sig = (idx->build_flags & CASEFILTER_BUILD_NEIGHBOUR_SIG) != 0;
+    uint64_t code = 0;
+    for (int i = 0; sig && i < KEYWORD_LEN; ++i) code |= (uint64_t)(((uint32_t)w[i] - 'A') & 0xF) << (4 * i);
+    int n = 0;
+    for (int pos = 0; pos < KEYWORD_LEN; ++pos) {
+        uint32_t packed_idpos = ((uint32_t)id & d->id_mask) | ((uint32_t)pos << d->id_bits);
+        slot[n] = pos <= 7 ? del8_key(lo, pos) : left7;
+        val[n++] = packed_idpos | (sig ? cf_dsig_at(code, pos, 0) << CF_DSIG_SHIFT : 0);
+        if (sides < 2) continue;
+        slot[n] = pos >= 7 ? del8_key(hi, pos - 7) : right7;
+        val[n++] = packed_idpos | (sig ? cf_dsig_at(code, pos, 1) << CF_DSIG_SHIFT : 0);
+    }
+    return n;
+}
+
+typedef struct {
+    const CaseFilterIndex *idx;
+    EmitFn emit;
+    int slots;
+    int threads;
+    uint32_t *hist[CASEFILTER_MAX_BUILD_THREADS];  /* [slots]: 件数 → prefix sum 後は書き込み位置 */
+    uint64_t range_sum[CASEFILTER_MAX_BUILD_THREADS];
+    uint32_t *counts;
+    int *offsets;
+    uint32_t *out;
+} CsrBuild;
+
+typedef struct {
+    CsrBuild *b;
+    int t;
+    void (*fn)(CsrBuild *b, int t);
+} CsrTask;
+
+static inline void csr_range(long n, int t, int threads, long *lo, long *hi) {
+    *lo = n * t / threads;
+    *hi = n * (t + 1) / threads;
+}
+
+static void csr_count(CsrBuild *b, int t) {
+    long lo, hi;
+    csr_range(b->idx->keyword_count, t, b->threads, &lo, &hi);
+    uint32_t *h = b->hist[t];
+    uint32_t slot[D_KEYS_PER_WORD], val[D_KEYS_PER_WORD];
+    for (long id = lo; id < hi; ++id) {
+        int n = b->emit(b->idx, b->idx->keywords[id], (int)id, slot, val);
+        for (int k = 0; k < n; ++k) h[slot[k]]++;
+    }
+}
+
+/* スロット範囲ごと: スロット内のスレッド間 exclusive scan と、範囲内の総数 */
+static void csr_scan_local(CsrBuild *b, int t) {
+    long lo, hi;
+    csr_range(b->slots, t, b->threads, &lo, &hi);
+    uint64_t sum = 0;
+    for (long s = lo; s < hi; ++s) {
+        uint32_t c = 0;
+        for (int u = 0; u < b->threads; ++u) {
+            uint32_t x = b->hist[u][s];
+            b->hist[u][s] = c;
+            c += x;
         }
+        b->counts[s] = c;
+        sum += c;
     }
-    free(cursor);
+    b->range_sum[t] = sum;
+}
+
+/* range_sum は呼び出し側で exclusive scan 済み（= 範囲の先頭オフセット） */
+static void csr_scan_apply(CsrBuild *b, int t) {
+    long lo, hi;
+    csr_range(b->slots, t, b->threads, &lo, &hi);
+    uint32_t run = (uint32_t)b->range_sum[t];
+    for (long s = lo; s < hi; ++s) {
+        b->offsets[s] = (int)run;
+        for (int u = 0; u < b->threads; ++u) b->hist[u][s] += run;
+        run += b->counts[s];
+    }
+}
+
+static void csr_scatter(CsrBuild *b, int t) {
+    long lo, hi;
+    csr_range(b->idx->keyword_count, t, b->threads, &lo, &hi);
+    uint32_t *h = b->hist[t];
+    uint32_t slot[D_KEYS_PER_WORD], val[D_KEYS_PER_WORD];
+    for (long id = lo; id < hi; ++id) {
+        int n = b->emit(b->idx, b->idx->keywords[id], (int)id, slot, val);
+        for (int k = 0; k < n; ++k) b->out[h[slot[k]]++] = val[k];
+    }
+}
+
+static void *csr_thread(void *arg) {
+    CsrTask *task = (CsrTask *)arg;
+    task->fn(task->b, task->t);
+    return NULL;
+}
+
+/* 各段はスレッド間で独立なので、pthread_create に失敗した分は呼び出しスレッドで順に実行すればよい */
+static void csr_run(CsrBuild *b, void (*fn)(CsrBuild *b, int t)) {
+    CsrTask tasks[CASEFILTER_MAX_BUILD_THREADS];
+    pthread_t tids[CASEFILTER_MAX_BUILD_THREADS];
+    int started[CASEFILTER_MAX_BUILD_THREADS];
+    for (int t = 1; t < b->threads; ++t) {
+        tasks[t] = (CsrTask){b, t, fn};
+        started[t] = pthread_create(&tids[t], NULL, csr_thread, &tasks[t]) == 0;
+    }
+    fn(b, 0);
+    for (int t = 1; t < b->threads; ++t) {
+        if (started[t]) pthread_join(tids[t], NULL);
+        else fn(b, t);
+    }
+}
+
+/* counts / offsets / 値配列を作る。件数表が確保できない分だけスレッド数を減らす */
+static uint32_t *build_csr(const CaseFilterIndex *idx, EmitFn emit, int slots, uint32_t **counts, int **offsets) {
+    CsrBuild b;
+    memset(&b, 0, sizeof(b));
+    b.idx = idx;
+    b.emit = emit;
+    b.slots = slots;
+    int want = idx->build_threads < 1 ? 1 : idx->build_threads;
+    if (want > CASEFILTER_MAX_BUILD_THREADS) want = CASEFILTER_MAX_BUILD_THREADS;
+    while (b.threads < want && (b.hist[b.threads] = (uint32_t *)cf_array_alloc(sizeof(uint32_t) * (size_t)slots, 1))) {
+        b.threads++;
+    }
+    b.counts = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)slots);
+    b.offsets = (int *)cf_array_alloc(sizeof(int) * (size_t)(slots + 1), 0);
+    if (b.threads == 0 || !b.counts || !b.offsets) goto fail;
+
+    csr_run(&b, csr_count);
+    csr_run(&b, csr_scan_local);
+    uint64_t total = 0;
+    for (int t = 0; t < b.threads; ++t) {
+        uint64_t c = b.range_sum[t];
+        b.range_sum[t] = total;
+        total += c;
+    }
+    if (total > 0x7FFFFFFFu) goto fail;
+    csr_run(&b, csr_scan_apply);
+    b.offsets[slots] = (int)total;
+    b.out = (uint32_t *)cf_array_alloc(sizeof(uint32_t) * (size_t)(total > 0 ? total : 1), 0);
+    if (!b.out) goto fail;
+    csr_run(&b, csr_scatter);
+
+    for (int t = 0; t < b.threads; ++t) cf_array_free(b.hist[t]);
+    *counts = b.counts;
+    *offsets = b.offsets;
+    return b.out;
+
+fail:
+    for (int t = 0; t < b.threads; ++t) cf_array_free(b.hist[t]);
+    free(b.counts);
+    cf_array_free(b.offsets);
+    *counts = NULL;
+    *offsets = NULL;
+    return NULL;
+}
+
+static void build_hindex(CaseFilterIndex *idx) {
+    HIndex *h = &idx->hidx;
+    h->key_space = (int)cf_scheme_key_space(&cf_schemes[idx->spec.h_scheme]);
+    h->pair_count = cf_schemes[idx->spec.h_scheme].groups;
+    int slots = h->key_space * h->pair_count;
+    h->ids = (int *)build_csr(idx, emit_h, slots, &h->counts, &h->offsets);
+    if (h->ids) h->occ = build_occupancy(h->counts, slots);
 }
 
 static void build_dindex(CaseFilterIndex *idx) {
     DelIndex *d = &idx->del7;
     d->key_space = DEL_KEY_SPACE;
-    d->counts = (uint32_t *)calloc((size_t)d->key_space, sizeof(uint32_t));
-    /* 1st pass: count */
-    char del[14];
-    for (int id = 0; id < idx->keyword_count; ++id) {
-        const char *w = idx->keywords[id];
-        for (int pos = 0; pos < KEYWORD_LEN; ++pos) {
-            for (int i = 0, k = 0; i < KEYWORD_LEN; ++i) {
-                if (i == pos) continue;
-                del[k++] = w[i];
-            }
-            char left[7], right[7];
-            memcpy(left, del, 7);
-            memcpy(right, del + 7, 7);
-            d->counts[pack_key7(left)]++;
-            d->counts[pack_key7(right)]++;
+    d->idpos = build_csr(idx, emit_d, d->key_space, &d->counts, &d->offsets);
+    if (d->idpos) d->occ = build_occupancy(d->counts, d->key_space);
+}
+
+/* Case A 検証は codes しか見ないので、fat では id を持たずに codes を直に並べる（ランダム読み → 連続読み） */
+static void build_fat_postings(CaseFilterIndex *idx) {
+    HIndex *h = &idx->hidx;
+    int total = h->offsets[h->key_space * h->pair_count];
+    h->fat = (uint64_t *)cf_array_alloc(sizeof(uint64_t) * (size_t)(total > 0 ? total : 1), 0);
+    if (!h->fat) return;
+    for (int i = 0; i < total; ++i) h->fat[i] = idx->codes[h->ids[i]];
+    cf_array_free(h->ids);
+    h->ids = NULL;
+}
+
+/* 完全一致の集合: 占有率 1/2 以下の線形探査。ハッシュは search_casefilter の code_hash と同じ式 */
+#define EXACT_EMPTY (~0ULL)  /* code は 60bit なので衝突しない */
+
+static uint32_t exact_set_cap(int n) {
+    uint32_t cap = 64;
+    while (cap < (uint32_t)n * 2u) cap <<= 1;
+    return cap;
+}
+
+static inline uint32_t code_hash(uint64_t code, uint32_t cap) {
+    return (uint32_t)((code * 0x9E3779B97F4A7C15ULL) >> 32) & (cap - 1);
+}
+
+static void exact_set_add(uint64_t *set, uint32_t cap, uint64_t code) {
+    uint32_t h = code_hash(code, cap);
+    while (set[h] != EXACT_EMPTY && set[h] != code) h = (h + 1) & (cap - 1);
+    set[h] = code;
+}
+
+static uint64_t *exact_set_alloc(uint32_t cap) {
+    uint64_t *set = (uint64_t *)malloc(sizeof(uint64_t) * cap);
+    if (set) memset(set, 0xFF, sizeof(uint64_t) * cap);
+    return set;
+}
+
+static void build_exact_set(CaseFilterIndex *idx) {
+    idx->exact_cap = exact_set_cap(idx->keyword_count);
+    idx->exact = exact_set_alloc(idx->exact_cap);
+    for (int i = 0; idx->exact && i < idx->keyword_count; ++i) exact_set_add(idx->exact, idx->exact_cap, idx->codes[i]);
+}
+
+/* width で表したときの ovf 語数（収まらない群ごとに per+1 語） */
+static size_t slot_dir_ovf_words(const uint32_t *counts, int slots, int width) {
+    int per = SDIR_CUM_BYTES * 8 / width;
+    uint32_t lim = (1u << width) - 1;
+    size_t words = 0;
+    for (size_t s0 = 0; s0 < (size_t)slots; s0 += per) {
+        for (size_t s = s0; s < s0 + per && s < (size_t)slots; ++s) {
+            if (counts[s] > lim) { words += (size_t)per + 1; break; }
         }
     }
-    /* prefix sum -> offsets */
-    d->offsets = (int *)malloc(sizeof(int) * (size_t)(d->key_space + 1));
-    d->offsets[0] = 0;
-    for (int i = 0; i < d->key_space; ++i) {
-        d->offsets[i + 1] = d->offsets[i] + (int)d->counts[i];
-    }
-    int total_ids = d->offsets[d->key_space];
-    d->idpos = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)total_ids);
-    int *cursor = (int *)malloc(sizeof(int) * (size_t)d->key_space);
-    memcpy(cursor, d->offsets, sizeof(int) * (size_t)d->key_space);
-    /* 2nd pass: fill postings */
-    for (int id = 0; id < idx->keyword_count; ++id) {
-        const char *w = idx->keywords[id];
-        for (int pos = 0; pos < KEYWORD_LEN; ++pos) {
-            for (int i = 0, k = 0; i < KEYWORD_LEN; ++i) {
-                if (i == pos) continue;
-                del[k++] = w[i];
+    return words;
+}
+
+/* スロット件数から疎ディレクトリを作る（群の先頭オフセットは件数の累積）。密 offsets は v1 出力と fat 生成のため残す */
+static void build_slot_dir(const uint32_t *counts, int slots, SlotDir *sd) {
+    size_t w4 = slot_dir_ovf_words(counts, slots, 4);
+    size_t w8 = slot_dir_ovf_words(counts, slots, 8);
+    size_t size4 = SDIR_GROUPS(slots, SDIR_CUM_BYTES * 2) * sizeof(SlotDirRec) + w4 * sizeof(uint32_t);
+    size_t size8 = SDIR_GROUPS(slots, SDIR_CUM_BYTES) * sizeof(SlotDirRec) + w8 * sizeof(uint32_t);
+    int width = size4 <= size8 ? 4 : 8;
+    size_t words = width == 4 ? w4 : w8;
+    if (words >= SDIR_EXACT) return;  /* 表せないので密のまま */
+    int per = SDIR_CUM_BYTES * 8 / width;
+    size_t groups = SDIR_GROUPS(slots, per);
+    sd->rec = (SlotDirRec *)calloc(groups, sizeof(SlotDirRec));
+    sd->ovf = (uint32_t *)calloc(words + 1, sizeof(uint32_t));
+    if (!sd->rec || !sd->ovf) {
+        free(sd->rec); free(sd->ovf);
+        memset(sd, 0, sizeof(*sd));
+        return;
+    }
+    sd->ovf_words = words;
+    sd->width = width;
+    sd->per = per;
+    uint32_t lim = (1u << width) - 1;
+    size_t pos = 0;
+    uint32_t base = 0;  /* = offsets[s0] */
+    for (size_t g = 0; g < groups; ++g) {
+        size_t s0 = g * per;
+        int n = (size_t)slots - s0 < (size_t)per ? (int)((size_t)slots - s0) : per;
+        SlotDirRec *r = &sd->rec[g];
+        int fits = 1;
+        uint32_t group_total = 0;
+        for (int j = 0; j < n; ++j) {
+            fits &= counts[s0 + j] <= lim;
+            group_total += counts[s0 + j];
+        }
+        if (!fits) {
+            uint32_t *e = sd->ovf + pos;
+            uint32_t run = base;
+            for (int j = 0; j <= per; ++j) {
+                e[j] = run;
+                if (j < n) run += counts[s0 + j];
             }
-            char left[7], right[7];
-            memcpy(left, del, 7);
-            memcpy(right, del + 7, 7);
-            uint32_t packed_idpos = ((uint32_t)id & 0xFFFFFu) | ((uint32_t)pos << 20);
-            int lslot = pack_key7(left);
-            int rslot = pack_key7(right);
-            d->idpos[cursor[lslot]++] = packed_idpos;
-            d->idpos[cursor[rslot]++] = packed_idpos;
+            r->start = SDIR_EXACT | (uint32_t)pos;
+            pos += (size_t)per + 1;
+            base += group_total;
+            continue;
+        }
+        r->start = base;
+        base += group_total;
+        uint32_t cum = 0;
+        for (int j = 0; j < per; ++j) {  /* 末尾群の slots 以降は件数 0 として埋める */
+            uint32_t prev = cum;
+            cum += j < n ? counts[s0 + j] : 0;
+            if ((cum >> width) != (prev >> width)) r->wrap[j >> 5] |= 1u << (j & 31);
+            if (width == 8) r->cum[j] = (uint8_t)cum;
+            else r->cum[j >> 1] |= (uint8_t)((cum & lim) << ((j & 1) * 4));
         }
     }
-    free(cursor);
+    sd->total = base;
+}
+
+static void free_slot_dir(SlotDir *sd) {
+    free(sd->rec);
+    free(sd->ovf);
+}
+
+static int code_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * --sort-ids: codes を昇順に並べて重複を落とし、keywords を codes から作り直す。結果は存在判定だけなので
+ * id の対応は外に出さない。code は末尾の文字が最上位ニブルなので、末尾 6 文字（ペア 34）が同じ語が
+ * 連続した id になり、他のリストも共有ブロックごとに id が寄る（codes の参照が近くのラインに集まる）。
+ * 各リストは構築の順序どおり id 昇順のまま
+ */
+static void sort_keyword_ids(CaseFilterIndex *idx) {
+    if (idx->keyword_count < 2) return;
+    qsort(idx->codes, (size_t)idx->keyword_count, sizeof(uint64_t), code_cmp);
+    int n = 1;
+    for (int i = 1; i < idx->keyword_count; ++i) {
+        if (idx->codes[i] != idx->codes[n - 1]) idx->codes[n++] = idx->codes[i];
+    }
+    idx->keyword_count = n;
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < KEYWORD_LEN; ++j) idx->keywords[i][j] = (char)('A' + ((idx->codes[i] >> (4 * j)) & 0xF));
+        idx->keywords[i][KEYWORD_LEN] = '\0';
+    }
 }
 
 void casefilter_finalize(CaseFilterIndex *idx) {
     if (!idx) return;
+    if (idx->build_flags & CASEFILTER_BUILD_SORT_IDS) sort_keyword_ids(idx);
+    if (idx->keyword_count > CASEFILTER_NARROW_ID_LIMIT) idx->build_flags |= CASEFILTER_BUILD_WIDE_IDS;
+    if (idx->build_flags & CASEFILTER_BUILD_WIDE_IDS) idx->build_flags &= ~CASEFILTER_BUILD_NEIGHBOUR_SIG;
+    idx->del7.id_bits = (idx->build_flags & CASEFILTER_BUILD_WIDE_IDS) ? CASEFILTER_WIDE_ID_BITS
+                                                                      : CASEFILTER_NARROW_ID_BITS;
+    idx->del7.id_mask = (1u << idx->del7.id_bits) - 1;
     build_hindex(idx);
     build_dindex(idx);
+    if (idx->build_flags & CASEFILTER_BUILD_FAT_POSTINGS) build_fat_postings(idx);
+    if (idx->build_flags & CASEFILTER_BUILD_EXACT_SET) build_exact_set(idx);
+    if (idx->build_flags & CASEFILTER_BUILD_SPARSE_DIR) {
+        HIndex *h = &idx->hidx;
+        DelIndex *d = &idx->del7;
+        build_slot_dir(h->counts, h->key_space * h->pair_count, &h->sdir);
+        build_slot_dir(d->counts, d->key_space, &d->sdir);
+    }
 }
 
-static void serialize_hindex(const HIndex *hidx, FILE *out) {
-    int slots = hidx->key_space * hidx->pair_count;
-    fwrite(&hidx->key_space, sizeof(hidx->key_space), 1, out);
-    fwrite(&hidx->pair_count, sizeof(hidx->pair_count), 1, out);
+/* v1 の id 列: narrow は 3 バイト、wide は 4 バイトのリトルエンディアン。64KB ずつまとめて fwrite */
+#define WRITE_IDS_CHUNK 65536
+
+static void write_ids(const uint32_t *v, int n, int bytes, FILE *out) {
+    unsigned char buf[WRITE_IDS_CHUNK];
+    size_t used = 0;
+    for (int i = 0; i < n; ++i) {
+        if (used + 4 > sizeof(buf)) {
+            fwrite(buf, 1, used, out);
+            used = 0;
+        }
+        buf[used] = (unsigned char)(v[i] & 0xFFu);
+        buf[used + 1] = (unsigned char)((v[i] >> 8) & 0xFFu);
+        buf[used + 2] = (unsigned char)((v[i] >> 16) & 0xFFu);
+        buf[used + 3] = (unsigned char)((v[i] >> 24) & 0xFFu);
+        used += (size_t)bytes;
+    }
+    if (used) fwrite(buf, 1, used, out);
+}
+
+/* 出力のバッファリング（v1 の 3/4 バイト id、v2 の 4 バイト値と詰めた列） */
+typedef struct {
+    FILE *out;
+    size_t used;
+    uint64_t acc;  /* 詰めた列: まだバイトにならない bit（下位 nacc bit） */
+    int nacc;
+    unsigned char buf[WRITE_IDS_CHUNK];
+} OutBuf;
+
+static inline void outbuf_put(OutBuf *ob, uint32_t v, int bytes) {
+    if (ob->used + 4 > sizeof(ob->buf)) {
+        fwrite(ob->buf, 1, ob->used, ob->out);
+        ob->used = 0;
+    }
+    ob->buf[ob->used] = (unsigned char)(v & 0xFFu);
+    ob->buf[ob->used + 1] = (unsigned char)((v >> 8) & 0xFFu);
+    ob->buf[ob->used + 2] = (unsigned char)((v >> 16) & 0xFFu);
+    ob->buf[ob->used + 3] = (unsigned char)((v >> 24) & 0xFFu);
+    ob->used += (size_t)bytes;
+}
+
+/* v の下位 bits bit を続けて詰める（bit i*bits から。search 側の packed_get と同じ並び） */
+static inline void outbuf_put_bits(OutBuf *ob, uint32_t v, int bits) {
+    ob->acc |= (uint64_t)(v & ((1u << bits) - 1)) << ob->nacc;
+    ob->nacc += bits;
+    while (ob->nacc >= 8) {
+        if (ob->used == sizeof(ob->buf)) {
+            fwrite(ob->buf, 1, ob->used, ob->out);
+            ob->used = 0;
+        }
+        ob->buf[ob->used++] = (unsigned char)(ob->acc & 0xFFu);
+        ob->acc >>= 8;
+        ob->nacc -= 8;
+    }
+}
+
+/* 詰めた列の終わり: 端数の bit と 8 バイト読み用の余白 CF_PACK_PAD */
+static void outbuf_end_bits(OutBuf *ob) {
+    int pad = CF_PACK_PAD * 8 + (ob->nacc ? 8 - ob->nacc : 0);
+    for (; pad > 0; pad -= 8) outbuf_put_bits(ob, 0, 8);
+}
+
+static int outbuf_flush(OutBuf *ob) {
+    if (ob->used && fwrite(ob->buf, 1, ob->used, ob->out) != ob->used) return 0;
+    ob->used = 0;
+    return !ferror(ob->out);
+}
+
+/* 値の書き方: bits が 0 なら下位 bytes バイト、そうでなければ (v >> shift) の下位 bits bit を詰める */
+typedef struct {
+    int bytes;
+    int bits;
+    int shift;
+} ValFmt;
+
+static inline void outbuf_put_val(OutBuf *ob, uint32_t v, ValFmt fmt) {
+    if (fmt.bits) outbuf_put_bits(ob, v >> fmt.shift, fmt.bits);
+    else outbuf_put(ob, v, fmt.bytes);
+}
+
+/* 詰めた列のセクション: 常駐している値の列を書き出すときに詰める */
+typedef struct {
+    const uint32_t *vals;
+    uint64_t n;
+    ValFmt fmt;
+} PackedSrc;
+
+static int write_packed(void *arg, FILE *out) {
+    const PackedSrc *ps = (const PackedSrc *)arg;
+    OutBuf *ob = (OutBuf *)malloc(sizeof(OutBuf));
+    if (!ob) return 0;
+    ob->out = out;
+    ob->used = 0;
+    ob->acc = 0;
+    ob->nacc = 0;
+    for (uint64_t i = 0; i < ps->n; ++i) outbuf_put_val(ob, ps->vals[i], ps->fmt);
+    outbuf_end_bits(ob);
+    int ok = outbuf_flush(ob);
+    free(ob);
+    return ok;
+}
+
+/* v1 の counts 列: 最大件数が収まれば 16bit、そうでなければ 32bit（先頭 1 バイトが bit 数） */
+static void write_counts(const uint32_t *counts, int slots, FILE *out) {
     uint32_t maxc = 0;
-    for (int i = 0; i < slots; ++i) if (hidx->counts[i] > maxc) maxc = hidx->counts[i];
+    for (int i = 0; i < slots; ++i) if (counts[i] > maxc) maxc = counts[i];
     uint8_t count_bits = (maxc <= UINT16_MAX) ? 16 : 32;
     fwrite(&count_bits, 1, 1, out);
     if (count_bits == 16) {
-        uint16_t *tmp = (uint16_t *)malloc(sizeof(uint16_t) * (size_t)slots);
-        for (int i = 0; i < slots; ++i) tmp[i] = (uint16_t)hidx->counts[i];
-        fwrite(tmp, sizeof(uint16_t), (size_t)slots, out);
-        free(tmp);
+        uint16_t tmp[WRITE_IDS_CHUNK / sizeof(uint16_t)];
+        for (int i = 0; i < slots;) {
+            int n = 0;
+            for (; n < (int)(sizeof(tmp) / sizeof(tmp[0])) && i < slots; ++n, ++i) tmp[n] = (uint16_t)counts[i];
+            fwrite(tmp, sizeof(uint16_t), (size_t)n, out);
+        }
     } else {
-        fwrite(hidx->counts, sizeof(uint32_t), (size_t)slots, out);
+        fwrite(counts, sizeof(uint32_t), (size_t)slots, out);
     }
+}
+
+static void serialize_hindex(const HIndex *hidx, FILE *out, int id_bytes) {
+    int slots = hidx->key_space * hidx->pair_count;
+    fwrite(&hidx->key_space, sizeof(hidx->key_space), 1, out);
+    fwrite(&hidx->pair_count, sizeof(hidx->pair_count), 1, out);
+    write_counts(hidx->counts, slots, out);
     int total_ids = hidx->offsets[slots];
     fwrite(&total_ids, sizeof(total_ids), 1, out);
-    /* ids fit in 20bit (0..1e6), write as 3-byte little-endian to save space */
-    for (int i = 0; i < total_ids; ++i) {
-        uint32_t v = (uint32_t)hidx->ids[i];
-        unsigned char buf[3] = {(unsigned char)(v & 0xFFu),
-                                (unsigned char)((v >> 8) & 0xFFu),
-                                (unsigned char)((v >> 16) & 0xFFu)};
-        fwrite(buf, 1, 3, out);
-    }
+    /* narrow ids fit in 20bit (0..1e6), write as 3-byte little-endian to save space */
+    write_ids((const uint32_t *)hidx->ids, total_ids, id_bytes, out);
 }
 
-static void serialize_dindex(const DelIndex *didx, FILE *out) {
+static void serialize_dindex(const DelIndex *didx, FILE *out, int id_bytes) {
     fwrite(&didx->key_space, sizeof(didx->key_space), 1, out);
-    uint32_t maxc = 0;
-    for (int i = 0; i < didx->key_space; ++i) if (didx->counts[i] > maxc) maxc = didx->counts[i];
-    uint8_t count_bits = (maxc <= UINT16_MAX) ? 16 : 32;
-    fwrite(&count_bits, 1, 1, out);
-    if (count_bits == 16) {
-        uint16_t *tmp = (uint16_t *)malloc(sizeof(uint16_t) * (size_t)didx->key_space);
-        for (int i = 0; i < didx->key_space; ++i) tmp[i] = (uint16_t)didx->counts[i];
-        fwrite(tmp, sizeof(uint16_t), (size_t)didx->key_space, out);
-        free(tmp);
-    } else {
-        fwrite(didx->counts, sizeof(uint32_t), (size_t)didx->key_space, out);
-    }
+    write_counts(didx->counts, didx->key_space, out);
     int total_ids = didx->offsets[didx->key_space];
     fwrite(&total_ids, sizeof(total_ids), 1, out);
-    /* idpos packed to 3 bytes (id20bit | del_pos4bit) */
-    for (int i = 0; i < total_ids; ++i) {
-        uint32_t v = didx->idpos[i] & 0xFFFFFFu;
-        unsigned char buf[3] = {(unsigned char)(v & 0xFFu),
-                                (unsigned char)((v >> 8) & 0xFFu),
-                                (unsigned char)((v >> 16) & 0xFFu)};
-        fwrite(buf, 1, 3, out);
-    }
+    /* idpos packed to 3 bytes (id20bit | del_pos4bit)、wide は 4 バイト (id28bit | del_pos4bit) */
+    write_ids(didx->idpos, total_ids, id_bytes, out);
 }
 
 void casefilter_serialize(const CaseFilterIndex *idx, FILE *out) {
     if (!idx || !out) return;
     fwrite(&idx->keyword_count, sizeof(idx->keyword_count), 1, out);
     fwrite(idx->keywords, sizeof(char[KEYWORD_LEN + 1]), idx->keyword_count, out);
-    serialize_hindex(&idx->hidx, out);
-    serialize_dindex(&idx->del7, out);
+    /* wide かどうかは読み手が keyword_count から判断する（v1 に別のフラグは持たない） */
+    int id_bytes = idx->keyword_count > CASEFILTER_NARROW_ID_LIMIT ? 4 : 3;
+    serialize_hindex(&idx->hidx, out, id_bytes);
+    serialize_dindex(&idx->del7, out, id_bytes);
+}
+
+static int write_zeros(FILE *out, uint64_t n) {
+    static const unsigned char zeros[256];
+    while (n > 0) {
+        size_t chunk = n < sizeof(zeros) ? (size_t)n : sizeof(zeros);
+        if (fwrite(zeros, 1, chunk, out) != chunk) return 0;
+        n -= chunk;
+    }
+    return 1;
+}
+
+typedef struct {
+    uint32_t id;
+    uint32_t elem_size;
+    uint64_t count;
+    const void *data;
+    int (*write)(void *arg, FILE *out);  /* data が NULL のとき: count * elem_size バイトを逐次書き出す */
+    void *arg;
+} V2Source;
+
+/* 疎ディレクトリは META, DIR, OVF の 3 セクション（id は META から連番）。meta は呼び出し側が保持 */
+static int v2_collect_dir(V2Source *src, const SlotDir *sd, int slots, uint32_t meta_id, uint32_t *meta) {
+    meta[0] = (uint32_t)sd->width;
+    meta[1] = sd->total;
+    src[0] = (V2Source){meta_id, sizeof(uint32_t), 2, meta, NULL, NULL};
+    src[1] = (V2Source){meta_id + 1, sizeof(SlotDirRec), (uint64_t)SDIR_GROUPS(slots, sd->per), sd->rec, NULL, NULL};
+    src[2] = (V2Source){meta_id + 2, sizeof(uint32_t), (uint64_t)sd->ovf_words, sd->ovf, NULL, NULL};
+    return 3;
+}
+
+/* 詰めた列の書き方: [0] H の id、[1] D の id（idpos の下位 bits bit。bits <= id_bits）、[2] D の del_pos */
+static void packed_formats(ValFmt fmt[3], int keyword_count, int id_bits) {
+    int bits = cf_pack_bits(keyword_count);
+    fmt[0] = (ValFmt){0, bits, 0};
+    fmt[1] = (ValFmt){0, bits, 0};
+    fmt[2] = (ValFmt){0, CF_DPOS_BITS, id_bits};
+}
+
+static uint32_t idpos_section(int id_bits, unsigned build_flags) {
+    if (id_bits == CASEFILTER_WIDE_ID_BITS) return CF_SEC_D_IDPOS_WIDE;
+    return (build_flags & CASEFILTER_BUILD_NEIGHBOUR_SIG) ? CF_SEC_D_IDPOS_SIG : CF_SEC_D_IDPOS;
+}
+
+static int v2_collect_sections(const CaseFilterIndex *idx, V2Source *src, uint32_t meta[2][2], PackedSrc pk[3]) {
+    const HIndex *h = &idx->hidx;
+    const DelIndex *d = &idx->del7;
+    int h_slots = h->key_space * h->pair_count;
+    uint64_t h_total = (uint64_t)h->offsets[h_slots];
+    uint64_t d_total = (uint64_t)d->offsets[d->key_space];
+    int packed = (idx->build_flags & CASEFILTER_BUILD_PACKED) != 0;
+    int n = 0;
+    if (packed) {
+        ValFmt fmt[3];
+        packed_formats(fmt, idx->keyword_count, d->id_bits);
+        pk[0] = (PackedSrc){(const uint32_t *)h->ids, h_total, fmt[0]};
+        pk[1] = (PackedSrc){d->idpos, d_total, fmt[1]};
+        pk[2] = (PackedSrc){d->idpos, d_total, fmt[2]};
+    }
+    /* 節の順は stream_write_v2 と同じ（--stream でも同じバイト列になる） */
+    src[n++] = (V2Source){CF_SEC_CODES, sizeof(uint64_t), (uint64_t)idx->keyword_count, idx->codes, NULL, NULL};
+    if (h->sdir.rec) n += v2_collect_dir(src + n, &h->sdir, h_slots, CF_SEC_H_DIR_META, meta[0]);
+    else src[n++] = (V2Source){CF_SEC_H_OFFSETS, sizeof(int32_t), (uint64_t)h_slots + 1, h->offsets, NULL, NULL};
+    if (h->fat) src[n++] = (V2Source){CF_SEC_H_FAT, sizeof(uint64_t), h_total, h->fat, NULL, NULL};
+    else if (packed) src[n++] = (V2Source){CF_SEC_H_IDS_PACKED, 1, CF_PACKED_BYTES(h_total, pk[0].fmt.bits), NULL,
+                                           write_packed, &pk[0]};
+    else src[n++] = (V2Source){CF_SEC_H_IDS, sizeof(int32_t), h_total, h->ids, NULL, NULL};
+    if (d->sdir.rec) n += v2_collect_dir(src + n, &d->sdir, d->key_space, CF_SEC_D_DIR_META, meta[1]);
+    else src[n++] = (V2Source){CF_SEC_D_OFFSETS, sizeof(int32_t), (uint64_t)d->key_space + 1, d->offsets, NULL, NULL};
+    if (packed) {
+        src[n++] = (V2Source){CF_SEC_D_IDS_PACKED, 1, CF_PACKED_BYTES(d_total, pk[1].fmt.bits), NULL, write_packed, &pk[1]};
+        src[n++] = (V2Source){CF_SEC_D_POS_PACKED, 1, CF_PACKED_BYTES(d_total, pk[2].fmt.bits), NULL, write_packed, &pk[2]};
+    } else {
+        src[n++] = (V2Source){idpos_section(d->id_bits, idx->build_flags), sizeof(uint32_t), d_total, d->idpos, NULL,
+                              NULL};
+    }
+    src[n++] = (V2Source){CF_SEC_H_OCC, sizeof(uint64_t), (uint64_t)OCC_WORDS(h_slots), h->occ, NULL, NULL};
+    src[n++] = (V2Source){CF_SEC_D_OCC, sizeof(uint64_t), (uint64_t)OCC_WORDS(d->key_space), d->occ, NULL, NULL};
+    if (idx->exact) src[n++] = (V2Source){CF_SEC_EXACT, sizeof(uint64_t), idx->exact_cap, idx->exact, NULL, NULL};
+    src[n++] = (V2Source){CF_SEC_SPEC, sizeof(uint32_t), sizeof(CaseFilterSpec) / sizeof(uint32_t), &idx->spec, NULL, NULL};
+    return n;
+}
+
+static const char *v2_section_name(uint32_t id) {
+    switch (id) {
+    case CF_SEC_CODES: return "codes";
+    case CF_SEC_H_OFFSETS: return "h_offsets";
+    case CF_SEC_H_IDS: return "h_ids";
+    case CF_SEC_D_OFFSETS: return "d_offsets";
+    case CF_SEC_D_IDPOS: return "d_idpos";
+    case CF_SEC_D_IDPOS_WIDE: return "d_idpos_w";
+    case CF_SEC_D_IDPOS_SIG: return "d_idpos_s";
+    case CF_SEC_H_OCC: return "h_occ";
+    case CF_SEC_D_OCC: return "d_occ";
+    case CF_SEC_H_FAT: return "h_fat";
+    case CF_SEC_H_DIR_META: return "h_dir_meta";
+    case CF_SEC_H_DIR: return "h_dir";
+    case CF_SEC_H_DIR_OVF: return "h_dir_ovf";
+    case CF_SEC_D_DIR_META: return "d_dir_meta";
+    case CF_SEC_D_DIR: return "d_dir";
+    case CF_SEC_D_DIR_OVF: return "d_dir_ovf";
+    case CF_SEC_EXACT: return "exact";
+    case CF_SEC_SPEC: return "spec";
+    case CF_SEC_H_IDS_PACKED: return "h_ids_p";
+    case CF_SEC_D_IDS_PACKED: return "d_ids_p";
+    case CF_SEC_D_POS_PACKED: return "d_pos_p";
+    default: return "?";
+    }
+}
+
+/* セクションごとのサイズ（= mmap 後の常駐上限）を出す。200MB 制約に収まるかの判断用 */
+static void v2_report(const V2Source *src, int n, FILE *log) {
+    double total = 0.0;
+    for (int s = 0; s < n; ++s) {
+        double mb = (double)(src[s].count * src[s].elem_size) / (1024.0 * 1024.0);
+        fprintf(log, "  %-10s %10.1f MB\n", v2_section_name(src[s].id), mb);
+        total += mb;
+    }
+    fprintf(log, "  %-10s %10.1f MB\n", "total", total);
+}
+
+void casefilter_report_v2(const CaseFilterIndex *idx, FILE *log) {
+    V2Source src[CASEFILTER_V2_MAX_SECTIONS];
+    uint32_t meta[2][2];
+    PackedSrc pk[3];
+    v2_report(src, v2_collect_sections(idx, src, meta, pk), log);
+}
+
+/* ヘッダ（section_count 以外を設定済み）→ セクション表 → 各セクションの順に書く */
+static int v2_write(CaseFilterV2Header hdr, const V2Source *src, uint32_t nsec, FILE *out) {
+    hdr.section_count = nsec;
+    CaseFilterV2Section table[CASEFILTER_V2_MAX_SECTIONS];
+    memset(table, 0, sizeof(table));
+    uint64_t pos = sizeof(hdr) + sizeof(CaseFilterV2Section) * nsec;
+    for (uint32_t s = 0; s < nsec; ++s) {
+        pos = (pos + CASEFILTER_V2_ALIGN - 1) & ~(uint64_t)(CASEFILTER_V2_ALIGN - 1);
+        table[s].id = src[s].id;
+        table[s].elem_size = src[s].elem_size;
+        table[s].offset = pos;
+        table[s].count = src[s].count;
+        pos += src[s].count * src[s].elem_size;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1) return 0;
+    if (fwrite(table, sizeof(CaseFilterV2Section), nsec, out) != nsec) return 0;
+    uint64_t written = sizeof(hdr) + sizeof(CaseFilterV2Section) * nsec;
+    for (uint32_t s = 0; s < nsec; ++s) {
+        if (!write_zeros(out, table[s].offset - written)) return 0;
+        size_t n = (size_t)src[s].count;
+        if (!src[s].data && src[s].write) {
+            if (!src[s].write(src[s].arg, out)) return 0;
+        } else if (n && fwrite(src[s].data, src[s].elem_size, n, out) != n) {
+            return 0;
+        }
+        written = table[s].offset + src[s].count * src[s].elem_size;
+    }
+    return fflush(out) == 0;
+}
+
+static CaseFilterV2Header v2_header(int keyword_count, const CaseFilterSpec *spec) {
+    CaseFilterV2Header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CASEFILTER_V2_MAGIC, sizeof(hdr.magic));
+    hdr.version = CASEFILTER_V2_VERSION;
+    hdr.keyword_count = keyword_count;
+    hdr.h_key_space = (int32_t)cf_scheme_key_space(&cf_schemes[spec->h_scheme]);
+    hdr.h_pair_count = cf_schemes[spec->h_scheme].groups;
+    hdr.del_key_space = DEL_KEY_SPACE;
+    return hdr;
+}
+
+/* v2: stdout(パイプ可)へ逐次書き出すため、先にレイアウトを確定してからヘッダ→各セクションの順に出力 */
+int casefilter_serialize_v2(const CaseFilterIndex *idx, FILE *out) {
+    if (!idx || !out) return 0;
+    const HIndex *h = &idx->hidx;
+    const DelIndex *d = &idx->del7;
+    if (!h->occ || !d->occ || (!h->ids && !h->fat)) return 0;
+    if ((idx->build_flags & CASEFILTER_BUILD_EXACT_SET) && !idx->exact) return 0;
+    V2Source src[CASEFILTER_V2_MAX_SECTIONS];
+    uint32_t meta[2][2];
+    PackedSrc pk[3];
+    uint32_t nsec = (uint32_t)v2_collect_sections(idx, src, meta, pk);
+    return v2_write(v2_header(idx->keyword_count, &idx->spec), src, nsec, out);
 }
 
 void casefilter_free(CaseFilterIndex *idx) {
     if (!idx) return;
-    free(idx->hidx.offsets);
+    cf_array_free(idx->hidx.offsets);
     free(idx->hidx.counts);
-    free(idx->hidx.ids);
+    cf_array_free(idx->hidx.ids);
+    free(idx->hidx.occ);
+    cf_array_free(idx->hidx.fat);
+    free_slot_dir(&idx->hidx.sdir);
 
-    free(idx->del7.offsets);
+    cf_array_free(idx->del7.offsets);
     free(idx->del7.counts);
-    free(idx->del7.idpos);
+    cf_array_free(idx->del7.idpos);
+    free(idx->del7.occ);
+    free_slot_dir(&idx->del7.sdir);
 
     free(idx->keywords);
     free(idx->codes);
+    free(idx->exact);
     free(idx);
 }
 
+/* ===== シャード分割（--shards N）: 各シャードは独立した索引ファイル + テキストのマニフェスト =====
+ * マニフェスト（1行目がマジック）:
+ *   CFSHARDS 1 <range|hash> <shard数> <総キーワード数>
+ *   <キーワード数> <ファイル名>      … シャードごとに1行。ファイル名はマニフェストと同じディレクトリからの相対
+ * range は有効行の出現順に連続範囲で、hash は 15 文字の FNV-1a で振り分ける。
+ * 1 シャードずつ DB を読み直して構築・書き出し・解放するので、メモリは最大シャード 1 個分で済む。
+ */
+#define CASEFILTER_SHARD_MAGIC "CFSHARDS"
+#define CASEFILTER_MAX_SHARDS 4096
+
+enum { SHARD_BY_RANGE = 0, SHARD_BY_HASH = 1 };
+
+static inline uint32_t shard_hash(const char *w) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < KEYWORD_LEN; ++i) h = (h ^ (uint8_t)w[i]) * 16777619u;
+    return h;
+}
+
+/* rank は有効行の通し番号（range 用） */
+static inline int shard_of(const char *w, long rank, long total, int shards, int by) {
+    if (by == SHARD_BY_HASH) return (int)(shard_hash(w) % (uint32_t)shards);
+    return (int)(rank * shards / total);
+}
+
+/* DB の有効行（長さ KEYWORD_LEN で文字種の中）を先頭から順に読み、shard に属するものだけ返す。shards <= 1 なら全件 */
+typedef struct {
+    int shard;
+    int shards;
+    int by;
+    long total;  /* range 用: 有効行の総数 */
+    long rank;   /* 次の有効行の通し番号 */
+} DbScan;
+
+static int db_next(FILE *fp, DbScan *sc, char *buf) {
+    while (fgets(buf, KEYWORD_LEN + 2, fp)) {
+        if (buf[0] == '\0') continue;
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if ((int)strlen(buf) != KEYWORD_LEN) continue;
+        int in_alphabet = 1;
+        for (int i = 0; i < KEYWORD_LEN; ++i) in_alphabet &= (uint32_t)(unsigned char)buf[i] - 'A' < CASEFILTER_ALPHABET;
+        if (!in_alphabet) continue;
+        long r = sc->rank++;
+        if (sc->shards > 1 && shard_of(buf, r, sc->total, sc->shards, sc->by) != sc->shard) continue;
+        return 1;
+    }
+    return 0;
+}
+
+static void db_rewind(FILE *fp, DbScan *sc) {
+    rewind(fp);
+    sc->rank = 0;
+}
+
+static long db_count(FILE *fp, DbScan sc) {
+    char buf[KEYWORD_LEN + 2];
+    long n = 0;
+    db_rewind(fp, &sc);
+    while (db_next(fp, &sc, buf)) n++;
+    return n;
+}
+
+static int load_db(FILE *fp, CaseFilterIndex *index, DbScan sc) {
+    char buf[KEYWORD_LEN + 2];
+    while (db_next(fp, &sc, buf)) {
+        if (index->keyword_count >= CASEFILTER_MAX_KEYWORDS) {
+            fprintf(stderr, "too many keywords (max %d)\n", CASEFILTER_MAX_KEYWORDS);
+            return 0;
+        }
+        casefilter_insert(index, buf);
+    }
+    return 1;
+}
+
+/* ===== 外部メモリ構築（--stream） =====
+ * DB をキーワード順に読みながら (slot, 値) を H / D それぞれのバッファに溜め、満杯になったら slot で
+ * 安定ソートした run として一時ファイルに書き出す。run はキーワード id 順に並ぶので、(slot, run 番号) で
+ * k-way マージすると各スロット内は id 昇順になり、メモリ上の構築とバイト単位で同じ索引をそのまま書ける。
+ * 常駐するのはスロット件数（H/D 各 10M × 4 バイト = 80MB）と占有ビット・疎ディレクトリ、あとは
+ * --mem-limit の残りを run バッファ（書き出し時）とマージ用の読み込みバッファ（出力時）に使う。
+ * キーワード本体・codes は必要になった時点で DB を読み直して書く。--fat-postings は codes[id] の
+ * ランダム参照が要るので対象外。
+ */
+#define STREAM_DEFAULT_MEM_MB 256
+#define STREAM_MIN_RUN_BYTES (16u << 20)
+#define STREAM_MIN_READ_ENTRIES 512
+#define STREAM_SLOT_BITS 24  /* H / D とも slots <= 2^24 */
+
+typedef struct {
+    uint32_t slot;
+    uint32_t val;
+} SpillEnt;
+
+typedef struct {
+    int fd;             /* unlink 済みの一時ファイル */
+    uint64_t *run_off;  /* run k は エントリ [run_off[k], run_off[k + 1]) */
+    int runs;
+    int run_cap;
+    uint64_t total;
+    uint32_t *counts;   /* [slots] */
+    int slots;
+    SpillEnt *buf;      /* [cap]: 書き出し前の run */
+    size_t used;
+    size_t cap;
+} SpillSet;
+
+static int open_spill_file(const char *dir) {
+    if (!dir || !*dir) dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+    size_t len = strlen(dir) + 32;
+    char *path = (char *)malloc(len);
+    if (!path) return -1;
+    snprintf(path, len, "%s/cfspill.XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd >= 0) unlink(path);
+    free(path);
+    return fd;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t bytes, uint64_t off) {
+    const char *p = (const char *)buf;
+    while (bytes > 0) {
+        ssize_t w = pwrite(fd, p, bytes, (off_t)off);
+        if (w <= 0) return 0;
+        p += w;
+        bytes -= (size_t)w;
+        off += (uint64_t)w;
+    }
+    return 1;
+}
+
+static int pread_full(int fd, void *buf, size_t bytes, uint64_t off) {
+    char *p = (char *)buf;
+    while (bytes > 0) {
+        ssize_t r = pread(fd, p, bytes, (off_t)off);
+        if (r <= 0) return 0;
+        p += r;
+        bytes -= (size_t)r;
+        off += (uint64_t)r;
+    }
+    return 1;
+}
+
+/* slot で LSD radix（12bit × 2）。安定なので run 内の emit 順（= id 順）が保たれる */
+static void sort_by_slot(SpillEnt *a, SpillEnt *tmp, size_t n) {
+    enum { RADIX_BITS = 12, RADIX = 1 << RADIX_BITS };
+    size_t pos[RADIX];
+    for (int shift = 0; shift < STREAM_SLOT_BITS; shift += RADIX_BITS) {
+        memset(pos, 0, sizeof(pos));
+        for (size_t i = 0; i < n; ++i) pos[(a[i].slot >> shift) & (RADIX - 1)]++;
+        size_t sum = 0;
+        for (int b = 0; b < RADIX; ++b) {
+            size_t c = pos[b];
+            pos[b] = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < n; ++i) tmp[pos[(a[i].slot >> shift) & (RADIX - 1)]++] = a[i];
+        SpillEnt *t = a;
+        a = tmp;
+        tmp = t;
+    }
+    /* パス数が偶数なので結果は元の配列に戻っている */
+}
+
+static int spill_flush(SpillSet *sp, SpillEnt *scratch) {
+    if (sp->used == 0) return 1;
+    if (sp->runs + 1 >= sp->run_cap) {
+        int cap = sp->run_cap ? sp->run_cap * 2 : 64;
+        uint64_t *t = (uint64_t *)realloc(sp->run_off, sizeof(uint64_t) * (size_t)cap);
+        if (!t) return 0;
+        sp->run_off = t;
+        sp->run_cap = cap;
+    }
+    sort_by_slot(sp->buf, scratch, sp->used);
+    if (!pwrite_full(sp->fd, sp->buf, sizeof(SpillEnt) * sp->used, sp->total * sizeof(SpillEnt))) return 0;
+    sp->run_off[sp->runs++] = sp->total;
+    sp->total += sp->used;
+    sp->run_off[sp->runs] = sp->total;
+    sp->used = 0;
+    return 1;
+}
+
+static int spill_add(SpillSet *sp, SpillEnt *scratch, const uint32_t *slot, const uint32_t *val, int n) {
+    if (sp->used + (size_t)n > sp->cap && !spill_flush(sp, scratch)) return 0;
+    for (int k = 0; k < n; ++k) {
+        sp->counts[slot[k]]++;
+        sp->buf[sp->used++] = (SpillEnt){slot[k], val[k]};
+    }
+    return 1;
+}
+
+static void spill_free(SpillSet *sp) {
+    if (sp->fd >= 0) close(sp->fd);
+    free(sp->run_off);
+    free(sp->counts);
+    free(sp->buf);
+}
+
+typedef struct {
+    const SpillEnt *cur;
+    const SpillEnt *end;
+    uint64_t next;   /* 次に読むエントリ位置 */
+    uint64_t limit;  /* run の終端 */
+    SpillEnt *buf;
+} MergeRun;
+
+static inline int merge_less(const MergeRun *r, const int *heap, int a, int b) {
+    uint32_t sa = r[heap[a]].cur->slot, sb = r[heap[b]].cur->slot;
+    return sa < sb || (sa == sb && heap[a] < heap[b]);
+}
+
+static void merge_sift(const MergeRun *r, int *heap, int n, int i) {
+    for (;;) {
+        int l = 2 * i + 1, m = i;
+        if (l < n && merge_less(r, heap, l, m)) m = l;
+        if (l + 1 < n && merge_less(r, heap, l + 1, m)) m = l + 1;
+        if (m == i) return;
+        int t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+/* run を読み足す。0: 読み込み失敗、1: 続きあり、2: run 終了 */
+static int merge_refill(const SpillSet *sp, MergeRun *r, size_t per) {
+    if (r->next >= r->limit) return 2;
+    size_t n = r->limit - r->next < per ? (size_t)(r->limit - r->next) : per;
+    if (!pread_full(sp->fd, r->buf, sizeof(SpillEnt) * n, r->next * sizeof(SpillEnt))) return 0;
+    r->cur = r->buf;
+    r->end = r->buf + n;
+    r->next += n;
+    return 1;
+}
+
+/* 全 run を (slot, run 番号) 順にマージし、値を fmt で out へ書く */
+static int spill_merge(const SpillSet *sp, size_t budget, ValFmt fmt, FILE *out) {
+    int nr = sp->runs;
+    size_t per = nr ? budget / sizeof(SpillEnt) / (size_t)nr : 0;
+    if (per < STREAM_MIN_READ_ENTRIES) per = STREAM_MIN_READ_ENTRIES;
+    MergeRun *runs = (MergeRun *)calloc((size_t)(nr ? nr : 1), sizeof(MergeRun));
+    int *heap = (int *)malloc(sizeof(int) * (size_t)(nr ? nr : 1));
+    SpillEnt *arena = (SpillEnt *)malloc(sizeof(SpillEnt) * per * (size_t)(nr ? nr : 1));
+    OutBuf *ob = (OutBuf *)malloc(sizeof(OutBuf));
+    int ok = runs && heap && arena && ob;
+    int hn = 0;
+    for (int k = 0; ok && k < nr; ++k) {
+        runs[k].buf = arena + per * (size_t)k;
+        runs[k].next = sp->run_off[k];
+        runs[k].limit = sp->run_off[k + 1];
+        int st = merge_refill(sp, &runs[k], per);
+        if (st == 0) ok = 0;
+        else if (st == 1) heap[hn++] = k;
+    }
+    for (int i = hn / 2 - 1; ok && i >= 0; --i) merge_sift(runs, heap, hn, i);
+    if (ok) {
+        ob->out = out;
+        ob->used = 0;
+        ob->acc = 0;
+        ob->nacc = 0;
+    }
+    while (ok && hn > 0) {
+        MergeRun *r = &runs[heap[0]];
+        outbuf_put_val(ob, r->cur->val, fmt);
+        if (++r->cur == r->end) {
+            int st = merge_refill(sp, r, per);
+            if (st == 0) ok = 0;
+            else if (st == 2) heap[0] = heap[--hn];
+        }
+        merge_sift(runs, heap, hn, 0);
+    }
+    if (ok && fmt.bits) outbuf_end_bits(ob);
+    if (ok) ok = outbuf_flush(ob);
+    free(runs);
+    free(heap);
+    free(arena);
+    free(ob);
+    return ok;
+}
+
+typedef struct {
+    FILE *db;
+    DbScan scan;
+    int keyword_count;
+    SpillSet sp[2];      /* [0] = H, [1] = D */
+    size_t budget;       /* --mem-limit からスロット件数を除いた分 */
+    size_t read_budget;  /* マージ時の読み込みバッファ合計 */
+    int id_bytes;        /* v1 の id バイト数。v2 は 4 */
+    ValFmt packed[3];    /* --packed-postings の列（packed_formats） */
+} StreamBuild;
+
+static int stream_spill(StreamBuild *sb, const CaseFilterIndex *meta, size_t budget) {
+    /* H : D = 10 : 30 エントリ/キーワード。バッファ 2 本 + 共有のソート用 scratch（D と同じ大きさ） */
+    size_t unit = budget / (sizeof(SpillEnt) * (HPAIR_COUNT + 2 * D_KEYS_PER_WORD));
+    SpillSet *h = &sb->sp[0], *d = &sb->sp[1];
+    h->cap = unit * HPAIR_COUNT;
+    d->cap = unit * D_KEYS_PER_WORD;
+    h->buf = (SpillEnt *)malloc(sizeof(SpillEnt) * h->cap);
+    d->buf = (SpillEnt *)malloc(sizeof(SpillEnt) * d->cap);
+    SpillEnt *scratch = (SpillEnt *)malloc(sizeof(SpillEnt) * d->cap);
+    int ok = h->buf && d->buf && scratch;
+    char buf[KEYWORD_LEN + 2];
+    uint32_t slot[D_KEYS_PER_WORD], val[D_KEYS_PER_WORD];
+    db_rewind(sb->db, &sb->scan);
+    for (int id = 0; ok && db_next(sb->db, &sb->scan, buf); ++id) {
+        int n = emit_h(meta, buf, id, slot, val);
+        ok = spill_add(h, scratch, slot, val, n);
+        n = emit_d(meta, buf, id, slot, val);
+        if (ok) ok = spill_add(d, scratch, slot, val, n);
+    }
+    if (ok) ok = spill_flush(h, scratch) && spill_flush(d, scratch);
+    free(h->buf);
+    free(d->buf);
+    free(scratch);
+    h->buf = d->buf = NULL;
+    return ok;
+}
+
+static inline uint64_t stream_code(const char *buf) {
+    uint64_t code = 0;
+    for (int i = 0; i < KEYWORD_LEN; ++i) code |= ((uint64_t)(buf[i] - 'A') & 0xF) << (i * 4);
+    return code;
+}
+
+/* v1 の keywords 列 / v2 の codes 列を DB から作り直して書く */
+static int stream_write_keywords(StreamBuild *sb, FILE *out, int as_codes) {
+    char buf[KEYWORD_LEN + 2];
+    char rec[KEYWORD_LEN + 1];
+    db_rewind(sb->db, &sb->scan);
+    while (db_next(sb->db, &sb->scan, buf)) {
+        if (as_codes) {
+            uint64_t code = stream_code(buf);
+            fwrite(&code, sizeof(code), 1, out);
+        } else {
+            memcpy(rec, buf, KEYWORD_LEN);
+            rec[KEYWORD_LEN] = '\0';
+            fwrite(rec, sizeof(rec), 1, out);
+        }
+    }
+    return !ferror(out);
+}
+
+static int stream_write_codes(void *arg, FILE *out) {
+    return stream_write_keywords((StreamBuild *)arg, out, 1);
+}
+
+/* 件数から密 offsets（int32[slots + 1]）を書く */
+static int write_offsets(const uint32_t *counts, int slots, FILE *out) {
+    int32_t tmp[WRITE_IDS_CHUNK / sizeof(int32_t)];
+    int32_t run = 0;
+    for (int i = 0; i <= slots;) {
+        int n = 0;
+        for (; n < (int)(sizeof(tmp) / sizeof(tmp[0])) && i <= slots; ++n, ++i) {
+            tmp[n] = run;
+            if (i < slots) run += (int32_t)counts[i];
+        }
+        if (fwrite(tmp, sizeof(int32_t), (size_t)n, out) != (size_t)n) return 0;
+    }
+    return 1;
+}
+
+static int stream_write_h_offsets(void *arg, FILE *out) {
+    const SpillSet *sp = &((StreamBuild *)arg)->sp[0];
+    return write_offsets(sp->counts, sp->slots, out);
+}
+
+static int stream_write_d_offsets(void *arg, FILE *out) {
+    const SpillSet *sp = &((StreamBuild *)arg)->sp[1];
+    return write_offsets(sp->counts, sp->slots, out);
+}
+
+static int stream_write_h_vals(void *arg, FILE *out) {
+    StreamBuild *sb = (StreamBuild *)arg;
+    return spill_merge(&sb->sp[0], sb->read_budget, (ValFmt){4, 0, 0}, out);
+}
+
+static int stream_write_d_vals(void *arg, FILE *out) {
+    StreamBuild *sb = (StreamBuild *)arg;
+    return spill_merge(&sb->sp[1], sb->read_budget, (ValFmt){4, 0, 0}, out);
+}
+
+/* 詰めた列は run をもう一度マージしながら詰める（D は id と del_pos で 2 回） */
+static int stream_write_h_packed(void *arg, FILE *out) {
+    StreamBuild *sb = (StreamBuild *)arg;
+    return spill_merge(&sb->sp[0], sb->read_budget, sb->packed[0], out);
+}
+
+static int stream_write_d_packed(void *arg, FILE *out) {
+    StreamBuild *sb = (StreamBuild *)arg;
+    return spill_merge(&sb->sp[1], sb->read_budget, sb->packed[1], out);
+}
+
+static int stream_write_d_pos(void *arg, FILE *out) {
+    StreamBuild *sb = (StreamBuild *)arg;
+    return spill_merge(&sb->sp[1], sb->read_budget, sb->packed[2], out);
+}
+
+/* 完全一致の集合は常駐させる（1M 件で 16MB）。DB をもう一度読んで埋める */
+static uint64_t *stream_exact_set(StreamBuild *sb, uint32_t cap) {
+    uint64_t *set = exact_set_alloc(cap);
+    char buf[KEYWORD_LEN + 2];
+    db_rewind(sb->db, &sb->scan);
+    while (set && db_next(sb->db, &sb->scan, buf)) exact_set_add(set, cap, stream_code(buf));
+    return set;
+}
+
+static int stream_write_v1(StreamBuild *sb, FILE *out) {
+    fwrite(&sb->keyword_count, sizeof(sb->keyword_count), 1, out);
+    if (!stream_write_keywords(sb, out, 0)) return 0;
+    const SpillSet *h = &sb->sp[0], *d = &sb->sp[1];
+    int key_space = H_KEY_SPACE, pair_count = HPAIR_COUNT;
+    fwrite(&key_space, sizeof(key_space), 1, out);
+    fwrite(&pair_count, sizeof(pair_count), 1, out);
+    write_counts(h->counts, h->slots, out);
+    int total = (int)h->total;
+    fwrite(&total, sizeof(total), 1, out);
+    if (!spill_merge(h, sb->read_budget, (ValFmt){sb->id_bytes, 0, 0}, out)) return 0;
+    key_space = DEL_KEY_SPACE;
+    fwrite(&key_space, sizeof(key_space), 1, out);
+    write_counts(d->counts, d->slots, out);
+    total = (int)d->total;
+    fwrite(&total, sizeof(total), 1, out);
+    if (!spill_merge(d, sb->read_budget, (ValFmt){sb->id_bytes, 0, 0}, out)) return 0;
+    return fflush(out) == 0;
+}
+
+static int stream_write_v2(StreamBuild *sb, const CaseFilterIndex *meta, unsigned build_flags, FILE *out) {
+    const SpillSet *h = &sb->sp[0], *d = &sb->sp[1];
+    uint64_t *h_occ = build_occupancy(h->counts, h->slots);
+    uint64_t *d_occ = build_occupancy(d->counts, d->slots);
+    SlotDir hdir, ddir;
+    memset(&hdir, 0, sizeof(hdir));
+    memset(&ddir, 0, sizeof(ddir));
+    if (build_flags & CASEFILTER_BUILD_SPARSE_DIR) {
+        build_slot_dir(h->counts, h->slots, &hdir);
+        build_slot_dir(d->counts, d->slots, &ddir);
+    }
+    uint32_t exact_cap = exact_set_cap(sb->keyword_count);
+    uint64_t *exact = (build_flags & CASEFILTER_BUILD_EXACT_SET) ? stream_exact_set(sb, exact_cap) : NULL;
+    int ok = h_occ && d_occ && (exact || !(build_flags & CASEFILTER_BUILD_EXACT_SET));
+    size_t resident = 2 * sizeof(uint64_t) * OCC_WORDS(h->slots);
+    if (exact) resident += sizeof(uint64_t) * exact_cap;
+    if (hdir.rec) resident += SDIR_GROUPS(h->slots, hdir.per) * sizeof(SlotDirRec) + hdir.ovf_words * sizeof(uint32_t);
+    if (ddir.rec) resident += SDIR_GROUPS(d->slots, ddir.per) * sizeof(SlotDirRec) + ddir.ovf_words * sizeof(uint32_t);
+    sb->read_budget = sb->budget > resident ? sb->budget - resident : 0;
+    V2Source src[CASEFILTER_V2_MAX_SECTIONS];
+    uint32_t dmeta[2][2];
+    int n = 0;
+    src[n++] = (V2Source){CF_SEC_CODES, sizeof(uint64_t), (uint64_t)sb->keyword_count, NULL, stream_write_codes, sb};
+    if (hdir.rec) n += v2_collect_dir(src + n, &hdir, h->slots, CF_SEC_H_DIR_META, dmeta[0]);
+    else src[n++] = (V2Source){CF_SEC_H_OFFSETS, sizeof(int32_t), (uint64_t)h->slots + 1, NULL,
+                               stream_write_h_offsets, sb};
+    int packed = (build_flags & CASEFILTER_BUILD_PACKED) != 0;
+    const ValFmt *pf = sb->packed;
+    if (packed) src[n++] = (V2Source){CF_SEC_H_IDS_PACKED, 1, CF_PACKED_BYTES(h->total, pf[0].bits), NULL,
+                                      stream_write_h_packed, sb};
+    else src[n++] = (V2Source){CF_SEC_H_IDS, sizeof(int32_t), h->total, NULL, stream_write_h_vals, sb};
+    if (ddir.rec) n += v2_collect_dir(src + n, &ddir, d->slots, CF_SEC_D_DIR_META, dmeta[1]);
+    else src[n++] = (V2Source){CF_SEC_D_OFFSETS, sizeof(int32_t), (uint64_t)d->slots + 1, NULL,
+                               stream_write_d_offsets, sb};
+    if (packed) {
+        src[n++] = (V2Source){CF_SEC_D_IDS_PACKED, 1, CF_PACKED_BYTES(d->total, pf[1].bits), NULL,
+                              stream_write_d_packed, sb};
+        src[n++] = (V2Source){CF_SEC_D_POS_PACKED, 1, CF_PACKED_BYTES(d->total, pf[2].bits), NULL,
+                              stream_write_d_pos, sb};
+    } else {
+        src[n++] = (V2Source){idpos_section(meta->del7.id_bits, build_flags), sizeof(uint32_t), d->total, NULL,
+                              stream_write_d_vals, sb};
+    }
+    src[n++] = (V2Source){CF_SEC_H_OCC, sizeof(uint64_t), (uint64_t)OCC_WORDS(h->slots), h_occ, NULL, NULL};
+    src[n++] = (V2Source){CF_SEC_D_OCC, sizeof(uint64_t), (uint64_t)OCC_WORDS(d->slots), d_occ, NULL, NULL};
+    if (exact) src[n++] = (V2Source){CF_SEC_EXACT, sizeof(uint64_t), exact_cap, exact, NULL, NULL};
+    src[n++] = (V2Source){CF_SEC_SPEC, sizeof(uint32_t), sizeof(CaseFilterSpec) / sizeof(uint32_t), &meta->spec, NULL, NULL};
+    if (ok) ok = v2_write(v2_header(sb->keyword_count, &meta->spec), src, (uint32_t)n, out);
+    if (ok) {
+        fprintf(stderr, "index v2 (%d keywords, stream):\n", sb->keyword_count);
+        v2_report(src, n, stderr);
+    }
+    free(h_occ);
+    free(d_occ);
+    free(exact);
+    free_slot_dir(&hdir);
+    free_slot_dir(&ddir);
+    return ok;
+}
+
+/* sc で選んだキーワードを mem_limit バイト程度で索引化して out へ書く。キーワード数を返し、失敗時は -1 */
+static int build_stream(FILE *fp, DbScan sc, int format, unsigned build_flags, int max_k, int case_a,
+                        size_t mem_limit, const char *tmpdir, FILE *out) {
+    StreamBuild sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.db = fp;
+    sb.scan = sc;
+    sb.sp[0].fd = sb.sp[1].fd = -1;
+    long n = db_count(fp, sc);
+    if (n > CASEFILTER_MAX_KEYWORDS) {
+        fprintf(stderr, "too many keywords (max %d)\n", CASEFILTER_MAX_KEYWORDS);
+        return -1;
+    }
+    sb.keyword_count = (int)n;
+    sb.sp[0].slots = (int)cf_scheme_key_space(&cf_schemes[case_a]) * cf_schemes[case_a].groups;
+    sb.sp[1].slots = DEL_KEY_SPACE;
+    size_t fixed = sizeof(uint32_t) * (size_t)(sb.sp[0].slots + sb.sp[1].slots);
+    if (mem_limit < fixed + STREAM_MIN_RUN_BYTES) {
+        fprintf(stderr, "--mem-limit too small (need at least %zu MB)\n", (fixed + STREAM_MIN_RUN_BYTES) >> 20);
+        return -1;
+    }
+    size_t budget = mem_limit - fixed;
+
+    CaseFilterIndex meta;
+    memset(&meta, 0, sizeof(meta));
+    if (n > CASEFILTER_NARROW_ID_LIMIT) build_flags |= CASEFILTER_BUILD_WIDE_IDS;
+    if ((build_flags & CASEFILTER_BUILD_WIDE_IDS) && (build_flags & CASEFILTER_BUILD_NEIGHBOUR_SIG)) {
+        fprintf(stderr, "neighbour-sig: wide ids have no spare bits, written without signatures\n");
+        build_flags &= ~CASEFILTER_BUILD_NEIGHBOUR_SIG;
+    }
+    meta.build_flags = build_flags;
+    meta.del7.id_bits = (build_flags & CASEFILTER_BUILD_WIDE_IDS) ? CASEFILTER_WIDE_ID_BITS : CASEFILTER_NARROW_ID_BITS;
+    meta.del7.id_mask = (1u << meta.del7.id_bits) - 1;
+    meta.spec = casefilter_spec_for(max_k, case_a);
+    sb.id_bytes = n > CASEFILTER_NARROW_ID_LIMIT ? 4 : 3;
+    packed_formats(sb.packed, sb.keyword_count, meta.del7.id_bits);
+
+    int ok = 1;
+    for (int k = 0; ok && k < 2; ++k) {
+        sb.sp[k].counts = (uint32_t *)calloc((size_t)sb.sp[k].slots, sizeof(uint32_t));
+        sb.sp[k].fd = open_spill_file(tmpdir);
+        if (!sb.sp[k].counts) ok = 0;
+        else if (sb.sp[k].fd < 0) {
+            fprintf(stderr, "cannot create temp file in %s\n", tmpdir ? tmpdir : "$TMPDIR");
+            ok = 0;
+        }
+    }
+    if (ok && !stream_spill(&sb, &meta, budget)) {
+        fprintf(stderr, "failed to write spill runs\n");
+        ok = 0;
+    }
+    /* 出力時の run 読み込みバッファ。v2 は占有ビット・疎ディレクトリの分をさらに引く */
+    sb.budget = sb.read_budget = budget;
+    if (ok) {
+        ok = format == 2 ? stream_write_v2(&sb, &meta, build_flags, out) : stream_write_v1(&sb, out);
+        if (!ok) fprintf(stderr, "failed to write index\n");
+    }
+    spill_free(&sb.sp[0]);
+    spill_free(&sb.sp[1]);
+    return ok ? sb.keyword_count : -1;
+}
+
+static int write_index(const CaseFilterIndex *index, int format, FILE *out) {
+    if (format == 2) {
+        if (!casefilter_serialize_v2(index, out)) return 0;
+        fprintf(stderr, "index v2 (%d keywords):\n", index->keyword_count);
+        casefilter_report_v2(index, stderr);
+        return 1;
+    }
+    casefilter_serialize(index, out);
+    return !ferror(out);
+}
+
+typedef struct {
+    int format;
+    unsigned build_flags;
+    int threads;
+    int max_k;         /* --max-k: この k 以下に要るキーだけ格納する */
+    int case_a;        /* --case-a: CF_SCHEME_* */
+    int stream;        /* --stream: 外部メモリ構築 */
+    size_t mem_limit;  /* --stream のメモリ目安（バイト） */
+    const char *tmpdir;
+} PrepOptions;
+
+/* sc で選んだキーワードの索引を out に書き、キーワード数を返す。失敗時は -1 */
+static int build_one(FILE *fp, DbScan sc, const PrepOptions *opt, FILE *out) {
+    if (opt->stream) {
+        return build_stream(fp, sc, opt->format, opt->build_flags, opt->max_k, opt->case_a, opt->mem_limit,
+                            opt->tmpdir, out);
+    }
+    CaseFilterIndex *index = casefilter_create(INIT_CAPACITY);
+    index->spec = casefilter_spec_for(opt->max_k, opt->case_a);
+    index->build_flags = opt->build_flags;
+    index->build_threads = opt->threads;
+    db_rewind(fp, &sc);
+    int n = -1;
+    if (load_db(fp, index, sc)) {
+        int loaded = index->keyword_count;
+        casefilter_finalize(index);
+        if (opt->build_flags & CASEFILTER_BUILD_SORT_IDS) {
+            fprintf(stderr, "sort-ids: %d keywords, %d duplicates removed\n", index->keyword_count,
+                    loaded - index->keyword_count);
+        }
+        if ((opt->build_flags & ~index->build_flags) & CASEFILTER_BUILD_NEIGHBOUR_SIG) {
+            fprintf(stderr, "neighbour-sig: wide ids have no spare bits, written without signatures\n");
+        }
+        if (write_index(index, opt->format, out)) n = index->keyword_count;
+        else fprintf(stderr, "failed to write index\n");
+    }
+    casefilter_free(index);
+    return n;
+}
+
+static int build_shards(FILE *fp, const char *prefix, int shards, int by, const PrepOptions *opt) {
+    DbScan all = {0, 1, SHARD_BY_RANGE, 0, 0};
+    long total = db_count(fp, all);
+    if (total == 0) {
+        fprintf(stderr, "no keywords in DB\n");
+        return 0;
+    }
+    size_t plen = strlen(prefix);
+    char *path = (char *)malloc(plen + 16);
+    const char *slash = strrchr(prefix, '/');
+    const char *base = slash ? slash + 1 : prefix;
+    int *counts = (int *)calloc((size_t)shards, sizeof(int));
+    if (!path || !counts) {
+        free(path);
+        free(counts);
+        return 0;
+    }
+    int ok = 1;
+    long written = 0;  /* --sort-ids で重複を落とすと total より少ない */
+    for (int s = 0; ok && s < shards; ++s) {
+        DbScan sc = {s, shards, by, total, 0};
+        snprintf(path, plen + 16, "%s.%d", prefix, s);
+        FILE *out = fopen(path, "wb");
+        counts[s] = out ? build_one(fp, sc, opt, out) : -1;
+        ok = counts[s] >= 0;
+        written += counts[s];
+        if (out && fclose(out) != 0) ok = 0;
+        if (!ok) fprintf(stderr, "failed to write %s\n", path);
+    }
+    FILE *mf = ok ? fopen(prefix, "w") : NULL;
+    if (mf) {
+        fprintf(mf, "%s 1 %s %d %ld\n", CASEFILTER_SHARD_MAGIC, by == SHARD_BY_HASH ? "hash" : "range", shards, written);
+        for (int s = 0; s < shards; ++s) fprintf(mf, "%d %s.%d\n", counts[s], base, s);
+        if (fclose(mf) != 0) ok = 0;
+        if (ok) fprintf(stderr, "%d shards (%ld keywords) -> %s\n", shards, written, prefix);
+    } else if (ok) {
+        fprintf(stderr, "cannot write manifest %s\n", prefix);
+        ok = 0;
+    }
+    free(path);
+    free(counts);
+    return ok;
+}
+
 /* ===== main/prep_casefilter.c の main() ===== */
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-j N] [--format v1|v2] [--fat-postings] [--sparse-dir] [--wide-ids]\n"
+            "          [--exact-set] [--max-k K] [--case-a pairs|halves|thirds] [--sort-ids] [--packed-postings]\n"
+            "          [--neighbour-sig]\n"
+            "          <db_file>\n"
+            "       %s --shards N [--shard-by range|hash] -o <manifest> [options] <db_file>\n"
+            "  -j N            索引構築スレッド数（既定: 1。出力はスレッド数に依らず同一）\n"
+            "  --format v2     mmap可能なゼロコピー形式で出力（既定: v1）\n"
+            "  --fat-postings  Case A ポスティングに codes を直に格納（v2 のみ, 約 +40MB/1M件）\n"
+            "  --sparse-dir    slot offsets を疎ディレクトリで格納（v2 のみ, db_1 で 76MB → 約 19MB）\n"
+            "  --wide-ids      id 28bit 形式を強制（v2 のみ。2^20 件を超える DB では自動で選ばれる）\n"
+            "  --exact-set     完全一致の集合を持ち、完全一致・距離 1 を先に調べる（v2 のみ, 約 16MB/1M件）\n"
+            "  --max-k K       k <= K（0〜3、既定 3）の探索に要るペア・削除キーだけ格納する（v2 のみ。K が小さいほど索引が小さい）\n"
+            "  --case-a S      Case A の分割: pairs（既定, 3 文字×5 の 10 ペア）/ halves（6 文字×2、k>=2 で 1 置換近傍を引く）\n"
+            "                  / thirds（5 文字×3、k=3 で近傍を引く）。群が少ないほど索引が小さく、探索は引くスロットが増える（v2 のみ）\n"
+            "  --sort-ids      重複したキーワードを 1 つにし、code 順に id を振り直す（ポスティングの codes 参照が近くに寄る）\n"
+            "  --packed-postings  ids / idpos を id の bit 幅で詰め、del_pos を別の 4bit 列にする（v2 のみ, db_1 で 239MB → 196MB）\n"
+            "  --neighbour-sig  Case B の idpos の空き 8bit に反対側 7 文字の署名を入れ、codes を読む前に候補を落とす\n"
+            "                  （v2・narrow id のみ。索引の大きさは変わらない）\n"
+            "  --shards N      N 個の索引 <manifest>.0 .. .N-1 とマニフェスト <manifest> を書く\n"
+            "  --shard-by      range: 行順の連続範囲（既定） / hash: キーワードのハッシュ\n"
+            "  --stream        外部メモリ構築: 一時ファイルに run を書き出してマージ（--fat-postings / --sort-ids 以外と併用可）\n"
+            "  --mem-limit MB  --stream のメモリ目安（既定: %d。うちスロット件数に固定 80MB）\n"
+            "  --tmpdir DIR    --stream の一時ファイル置き場（既定: $TMPDIR または /tmp）\n"
+            "  --hugepages M   構築用の大きな配列を huge page に置く（off / thp / 2m / 1g。足りなければ小さいページへ）\n"
+            "  --numa M        off / interleave: 構築用の大きな配列を全 NUMA ノードに散らす（-j 向け）\n",
+            prog, prog, STREAM_DEFAULT_MEM_MB);
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <db_file>\n", argv[0]);
+    PrepOptions opt = {1, 0, 1, MAX_EDIT_DIST, CF_SCHEME_PAIRS, 0, (size_t)STREAM_DEFAULT_MEM_MB << 20, NULL};
+    int shards = 0;
+    int shard_by = SHARD_BY_RANGE;
+    const char *out_path = NULL;
+    const char *db_path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            opt.threads = atoi(argv[++i]);
+            if (opt.threads < 1 || opt.threads > CASEFILTER_MAX_BUILD_THREADS) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--format") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            const char *f = argv[++i];
+            if (strcmp(f, "v1") == 0) opt.format = 1;
+            else if (strcmp(f, "v2") == 0) opt.format = 2;
+            else { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--fat-postings") == 0) {
+            opt.build_flags |= CASEFILTER_BUILD_FAT_POSTINGS;
+        } else if (strcmp(argv[i], "--sparse-dir") == 0) {
+            opt.build_flags |= CASEFILTER_BUILD_SPARSE_DIR;
+        } else if (strcmp(argv[i], "--wide-ids") == 0) {
+            opt.build_flags |= CASEFILTER_BUILD_WIDE_IDS;
+        } else if (strcmp(argv[i], "--exact-set") == 0) {
+            opt.build_flags |= CASEFILTER_BUILD_EXACT_SET;
+        } else if (strcmp(argv[i], "--sort-ids") == 0) {
+            opt.build_flags |= CASEFILTER_BUILD_SORT_IDS;
+        } else if (strcmp(argv[i], "--packed-postings") == 0) {
+            opt.build_flags |= CASEFILTER_BUILD_PACKED;
+        } else if (strcmp(argv[i], "--neighbour-sig") == 0) {
+            opt.build_flags |= CASEFILTER_BUILD_NEIGHBOUR_SIG;
+        } else if (strcmp(argv[i], "--max-k") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            opt.max_k = atoi(argv[++i]);
+            if (opt.max_k < 0 || opt.max_k > MAX_EDIT_DIST) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--case-a") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            const char *a = argv[++i];
+            opt.case_a = CF_SCHEMES;
+            for (int s = 0; s < CF_SCHEMES; ++s) {
+                if (strcmp(a, cf_schemes[s].name) == 0) opt.case_a = s;
+            }
+            if (opt.case_a == CF_SCHEMES) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            shards = atoi(argv[++i]);
+            if (shards < 1 || shards > CASEFILTER_MAX_SHARDS) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--shard-by") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            const char *b = argv[++i];
+            if (strcmp(b, "range") == 0) shard_by = SHARD_BY_RANGE;
+            else if (strcmp(b, "hash") == 0) shard_by = SHARD_BY_HASH;
+            else { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            opt.stream = 1;
+        } else if (strcmp(argv[i], "--mem-limit") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            long mb = atol(argv[++i]);
+            if (mb < 1) { usage(argv[0]); return 1; }
+            opt.mem_limit = (size_t)mb << 20;
+        } else if (strcmp(argv[i], "--tmpdir") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            opt.tmpdir = argv[++i];
+        } else if (strcmp(argv[i], "--hugepages") == 0) {
+            if (i + 1 >= argc || !set_hugepages(argv[i + 1])) { usage(argv[0]); return 1; }
+            i++;
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            const char *m = argv[++i];
+            if (strcmp(m, "off") == 0) numa_interleave = 0;
+            else if (strcmp(m, "interleave") == 0) numa_interleave = 1;
+            else { usage(argv[0]); return 1; }
+        } else if (!db_path && argv[i][0] != '-') {
+            db_path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!db_path || (shards > 0) != (out_path != NULL)) {
+        usage(argv[0]);
         return 1;
     }
-    FILE *fp = fopen(argv[1], "r");
+    if ((opt.build_flags & ~CASEFILTER_BUILD_SORT_IDS) && opt.format != 2) {
+        fprintf(stderr, "--fat-postings / --sparse-dir / --wide-ids / --exact-set / --packed-postings / --neighbour-sig "
+                "require --format v2\n");
+        return 1;
+    }
+    /* 署名は narrow の idpos の空き bit に置くので、wide・詰めた列とは併用できない */
+    if ((opt.build_flags & CASEFILTER_BUILD_NEIGHBOUR_SIG) &&
+        (opt.build_flags & (CASEFILTER_BUILD_WIDE_IDS | CASEFILTER_BUILD_PACKED))) {
+        fprintf(stderr, "--neighbour-sig cannot be combined with --wide-ids / --packed-postings\n");
+        return 1;
+    }
+    /* v1 は仕様を書く場所が無いので既定の仕様（k = 3・A–J・pairs）だけ */
+    if (opt.format != 2 && (opt.max_k != MAX_EDIT_DIST || CASEFILTER_ALPHABET != 10 || opt.case_a != CF_SCHEME_PAIRS)) {
+        fprintf(stderr, "--max-k below %d, --case-a other than pairs and CASEFILTER_ALPHABET other than 10 "
+                "require --format v2\n", MAX_EDIT_DIST);
+        return 1;
+    }
+    if (opt.stream && (opt.build_flags & (CASEFILTER_BUILD_FAT_POSTINGS | CASEFILTER_BUILD_SORT_IDS))) {
+        fprintf(stderr, "--stream does not support --fat-postings / --sort-ids\n");
+        return 1;
+    }
+    FILE *fp = fopen(db_path, "r");
     if (!fp) {
-        fprintf(stderr, "cannot open %s\n", argv[1]);
+        fprintf(stderr, "cannot open %s\n", db_path);
         return 1;
     }
-
-    CaseFilterIndex *index = casefilter_create(INIT_CAPACITY);
-    char buf[KEYWORD_LEN + 2];
-    while (fgets(buf, sizeof(buf), fp)) {
-        if (buf[0] == '\0') continue;
-        buf[strcspn(buf, "\r\n")] = '\0';
-        if ((int)strlen(buf) != KEYWORD_LEN) continue;
-        casefilter_insert(index, buf);
+    if (shards > 0) {
+        int ok = build_shards(fp, out_path, shards, shard_by, &opt);
+        fclose(fp);
+        return ok ? 0 : 1;
     }
-    fclose(fp);
 
-    casefilter_finalize(index);
-    casefilter_serialize(index, stdout);
-    casefilter_free(index);
-    return 0;
+    DbScan all = {0, 1, SHARD_BY_RANGE, 0, 0};
+    int n = build_one(fp, all, &opt, stdout);
+    fclose(fp);
+    return n < 0 ? 1 : 0;
 }
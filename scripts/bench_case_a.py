@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""
+Compare the Case A partition schemes of prep_casefilter --case-a.
+
+For every dataset, builds one v2 index per scheme (pairs / halves / thirds),
+runs the same query file against each, checks that the outputs agree, and
+prints the index size, the Case A share of it (h_offsets + h_ids), the best
+elapsed time, throughput and peak RSS of the search.
+
+pairs stores 10 postings per keyword and probes 10 slots; halves stores 2 and
+thirds 3, paying for it with the 1-substitution neighbourhood of each group key
+at query time (see README "Case A の分割方式").
+
+Example:
+  python3 scripts/bench_case_a.py --datasets 100k,1
+  python3 scripts/bench_case_a.py --datasets 1 --schemes pairs,halves --prep-args '--sparse-dir'
+"""
+import argparse
+import os
+import sys
+
+from bench_common import build, run_search
+
+SCHEMES = ["pairs", "halves", "thirds"]
+
+
+def case_a_mb(report: str) -> float:
+    """Case A share (MB) of prep_casefilter's size report: h_* sections except h_occ."""
+    case_a = 0.0
+    for line in report.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[0].startswith("h_") and parts[0] != "h_occ":
+            case_a += float(parts[1])
+    return case_a
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Compare Case A partition schemes")
+    parser.add_argument("--prep", default="./prep_casefilter", help="prep_casefilter executable")
+    parser.add_argument("--search", default="./search_casefilter", help="search_casefilter executable")
+    parser.add_argument("--datasets", default="100k,1", help="comma separated test-data/db_<name> (default: 100k,1)")
+    parser.add_argument("--schemes", default=",".join(SCHEMES), help="comma separated (default: all)")
+    parser.add_argument("--test-data", default="test-data", help="directory with db_* / query_*")
+    parser.add_argument("--workdir", default="output", help="where to write the indexes")
+    parser.add_argument("--prep-args", default="", help="extra prep_casefilter options, e.g. '--sparse-dir'")
+    parser.add_argument("--search-args", default="", help="extra search_casefilter options, e.g. '-k 2'")
+    parser.add_argument("--repeat", type=int, default=3, help="runs per variant, best is reported (default: 3)")
+    parser.add_argument("--keep", action="store_true", help="keep the generated indexes")
+    args = parser.parse_args()
+
+    schemes = [s for s in args.schemes.split(",") if s]
+    for s in schemes:
+        if s not in SCHEMES:
+            sys.exit(f"unknown scheme: {s}")
+    os.makedirs(args.workdir, exist_ok=True)
+    rows = []
+    for name in [d for d in args.datasets.split(",") if d]:
+        db = os.path.join(args.test_data, f"db_{name}")
+        queries = os.path.join(args.test_data, f"query_{name}")
+        outputs = {}
+        for scheme in schemes:
+            path = os.path.join(args.workdir, f"index_bench_case_a_{scheme}_{name}")
+            case_a = case_a_mb(build(args.prep, db, path, ["--case-a", scheme, *args.prep_args.split()]))
+            size_mb = os.path.getsize(path) / (1024.0 * 1024.0)
+            elapsed, rss, out = run_search(args.search, queries, path, args.repeat, args.search_args.split())
+            nq = out.count(b"0") + out.count(b"1")
+            rows.append((name, scheme, size_mb, case_a, elapsed, nq / elapsed if elapsed > 0 else 0.0, rss))
+            outputs[scheme] = out
+            if not args.keep:
+                os.remove(path)
+        if len(set(outputs.values())) > 1:
+            sys.exit(f"{name}: scheme outputs differ")
+
+    print(f"{'dataset':<8} {'scheme':<7} {'index MB':>9} {'case A MB':>10} {'best s':>8} {'queries/s':>11} {'RSS MB':>8}")
+    for name, scheme, size_mb, case_a, elapsed, qps, rss in rows:
+        print(f"{name:<8} {scheme:<7} {size_mb:>9.1f} {case_a:>10.1f} {elapsed:>8.3f} {qps:>11.0f} {rss:>8.0f}")
+
+
+if __name__ == "__main__":
+    main()
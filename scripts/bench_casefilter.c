@@ -0,0 +1,447 @@
+/*
+ * casefilter のカーネルとクエリごとの遅延のマイクロベンチ。
+ *
+ * search_casefilter.c を main() 抜きで取り込むので、static なカーネル（pack_keyword, hamming_packed15/14,
+ * casefilter_pack_delete, pack_key6/7）は探索側がインライン展開するのと同じ形で測れる。
+ * クエリファイルの解析は従来の fgets と casefilter_parse_queries の両方で測る。
+ *
+ * ビルド:
+ *   gcc -O2 -march=native -pthread scripts/bench_casefilter.c -o bench_casefilter
+ * 実行:
+ *   ./bench_casefilter [--record] [--dataset NAME] [--records-dir DIR] [--rounds N]
+ *                      [--kernel NAME] [--planner NAME] <query_file> <index_file>
+ *
+ * --record ならベンチごとに 1 行を <records-dir>/bench_<dataset>.csv（既定 records/）に追記する。
+ */
+
+#define CASEFILTER_NO_MAIN
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../search_casefilter.c"
+#pragma GCC diagnostic pop
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BENCH_CSV_HEADER                                                                                      \
+    "timestamp_utc,dataset,query_file,index_file,keyword_count,kernel,planner,benchmark,ops,elapsed_seconds," \
+    "ns_per_op,mb_per_second,mean_us,p50_us,p99_us,p999_us"
+
+typedef struct {
+    const char *name;
+    long long ops;
+    double seconds;
+    double mb_per_second; /* < 0: 該当なし */
+    double mean_us, p50_us, p99_us, p999_us; /* < 0: 遅延のベンチではない */
+} BenchRow;
+
+/* 測るループをコンパイラに消させない */
+static volatile uint64_t bench_sink;
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--record] [--dataset NAME] [--records-dir DIR] [--rounds N]\n"
+            "          [--kernel auto|scalar|avx2|avx512] [--planner staged|cost] <query_file> <index_file>\n"
+            "  --rounds N  カーネルのベンチでクエリ列を回す回数（既定: 20）\n"
+            "  --kernel    query_latency の候補検証カーネル（既定: auto）\n"
+            "  --planner   query_latency の探索計画（既定: staged）\n",
+            prog);
+}
+
+static int bench_read_queries(const char *path, char (**out)[KEYWORD_LEN + 1]) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    int cap = 1024, n = 0;
+    char (*q)[KEYWORD_LEN + 1] = malloc(sizeof(*q) * (size_t)cap);
+    char line[64];
+    while (q && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strlen(line) != KEYWORD_LEN) continue;
+        if (n == cap) {
+            cap *= 2;
+            char (*nq)[KEYWORD_LEN + 1] = realloc(q, sizeof(*q) * (size_t)cap);
+            if (!nq) {
+                free(q);
+                q = NULL;
+                break;
+            }
+            q = nq;
+        }
+        memcpy(q[n++], line, KEYWORD_LEN + 1);
+    }
+    fclose(f);
+    if (!q) return -1;
+    *out = q;
+    return n;
+}
+
+static void bench_row(BenchRow *row, const char *name, long long ops, double seconds) {
+    row->name = name;
+    row->ops = ops;
+    row->seconds = seconds;
+    row->mb_per_second = -1.0;
+    row->mean_us = row->p50_us = row->p99_us = row->p999_us = -1.0;
+}
+
+/* ===== カーネル ===== */
+static void bench_pack_keyword(BenchRow *row, char (*q)[KEYWORD_LEN + 1], int n, int rounds) {
+    uint64_t acc = 0;
+    double t0 = bench_now();
+    for (int r = 0; r < rounds; ++r)
+        for (int i = 0; i < n; ++i) acc += pack_keyword(q[i]);
+    double t = bench_now() - t0;
+    bench_sink += acc;
+    bench_row(row, "pack_keyword", (long long)n * rounds, t);
+}
+
+/* (i, i + off) の組。周ごとに off を変えて、同じ code の組がキャッシュに居座らないようにする */
+static void bench_hamming(BenchRow *rows, const uint64_t *codes, int n, int rounds) {
+    uint64_t acc = 0;
+    double t0 = bench_now();
+    for (int r = 0; r < rounds; ++r) {
+        int off = (7 + r) % n;
+        for (int i = 0; i < n; ++i) {
+            int j = i + off < n ? i + off : i + off - n;
+            acc += (uint64_t)hamming_packed15(codes[i], codes[j]);
+        }
+    }
+    double t = bench_now() - t0;
+    bench_row(&rows[0], "hamming_packed15", (long long)n * rounds, t);
+
+    t0 = bench_now();
+    for (int r = 0; r < rounds; ++r) {
+        int off = (7 + r) % n;
+        for (int i = 0; i < n; ++i) {
+            int j = i + off < n ? i + off : i + off - n;
+            acc += (uint64_t)hamming_packed14(codes[i], codes[j]);
+        }
+    }
+    t = bench_now() - t0;
+    bench_row(&rows[1], "hamming_packed14", (long long)n * rounds, t);
+    bench_sink += acc;
+}
+
+static void bench_pack_delete(BenchRow *row, const uint64_t *codes, int n, int rounds) {
+    uint64_t acc = 0;
+    double t0 = bench_now();
+    for (int r = 0; r < rounds; ++r) {
+        int pos = r % KEYWORD_LEN;
+        for (int i = 0; i < n; ++i) {
+            acc ^= casefilter_pack_delete(codes[i], pos);
+            pos = pos + 1 < KEYWORD_LEN ? pos + 1 : 0;
+        }
+    }
+    double t = bench_now() - t0;
+    bench_sink += acc;
+    bench_row(row, "casefilter_pack_delete", (long long)n * rounds, t);
+}
+
+/* 探索と同じキーの窓: Case A のペアキー（6 文字）と Case B の半分（7 文字） */
+static void bench_pack_keys(BenchRow *rows, char (*q)[KEYWORD_LEN + 1], int n, int rounds) {
+    uint64_t acc = 0;
+    double t0 = bench_now();
+    for (int r = 0; r < rounds; ++r)
+        for (int i = 0; i < n; ++i) acc += pack_key6(q[i] + (i + r) % (KEYWORD_LEN - 6 + 1));
+    double t = bench_now() - t0;
+    bench_row(&rows[0], "pack_key6", (long long)n * rounds, t);
+
+    t0 = bench_now();
+    for (int r = 0; r < rounds; ++r)
+        for (int i = 0; i < n; ++i) acc += pack_key7(q[i] + (i + r) % (KEYWORD_LEN - 7 + 1));
+    t = bench_now() - t0;
+    bench_row(&rows[1], "pack_key7", (long long)n * rounds, t);
+    bench_sink += acc;
+}
+
+/* ===== クエリの解析 =====
+ * parse_fgets: 1 行ずつ fgets + strcspn + strlen で 16 バイトの文字列に（従来の探索の経路）。
+ * parse_queries: ファイルを mmap して casefilter_parse_queries で一括して 60bit コードに詰める。
+ * どちらも周ごとにファイルを開き直す（ページキャッシュには載ったまま）。
+ */
+static int bench_parse(BenchRow *rows, const char *path, int rounds) {
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_size <= 0) return 0;
+    size_t len = (size_t)st.st_size;
+    double mb = (double)len * rounds / (1024.0 * 1024.0);
+    size_t cap = len / (KEYWORD_LEN + 1) + 1;
+    char (*q)[KEYWORD_LEN + 1] = malloc(sizeof(*q) * cap);
+    if (!q) return 0;
+    long long lines = 0;
+    uint64_t acc = 0;
+    double t0 = bench_now();
+    for (int r = 0; r < rounds; ++r) {
+        FILE *f = fopen(path, "r");
+        if (!f) break;
+        char buf[KEYWORD_LEN + 2];
+        int n = 0;
+        while (fgets(buf, sizeof(buf), f)) {
+            buf[strcspn(buf, "\r\n")] = '\0';
+            if ((size_t)n == cap) {
+                char (*nq)[KEYWORD_LEN + 1] = realloc(q, sizeof(*q) * cap * 2);
+                if (!nq) break;
+                q = nq;
+                cap *= 2;
+            }
+            if ((int)strlen(buf) == KEYWORD_LEN) memcpy(q[n], buf, KEYWORD_LEN + 1);
+            else q[n][0] = '\0';
+            n++;
+        }
+        fclose(f);
+        acc += n ? (uint64_t)q[n / 2][0] : 0;
+        lines += n;
+    }
+    double t = bench_now() - t0;
+    free(q);
+    bench_row(&rows[0], "parse_fgets", lines, t);
+    rows[0].mb_per_second = t > 0 ? mb / t : 0.0;
+
+    lines = 0;
+    t0 = bench_now();
+    for (int r = 0; r < rounds; ++r) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) break;
+        char *buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (buf == MAP_FAILED) break;
+        uint64_t *codes = NULL;
+        int n = casefilter_parse_queries(buf, len, &codes);
+        munmap(buf, len);
+        if (n < 0) break;
+        acc += n ? codes[n / 2] : 0;
+        lines += n;
+        free(codes);
+    }
+    t = bench_now() - t0;
+    bench_sink += acc;
+    bench_row(&rows[1], "parse_queries", lines, t);
+    rows[1].mb_per_second = t > 0 ? mb / t : 0.0;
+    return 1;
+}
+
+/* ===== ロード =====
+ * load: casefilter_load だけ（v1 は読んで組み立て、v2 は写像するだけ）。
+ * load_touch: ロードに加えて全 code を 1 度読む（v2 もページフォールトの分を払う）。
+ */
+static CaseFilterIndex *bench_load(BenchRow *rows, const char *index_path) {
+    struct stat st;
+    double mb = stat(index_path, &st) == 0 ? (double)st.st_size / (1024.0 * 1024.0) : 0.0;
+
+    double t0 = bench_now();
+    CaseFilterIndex *idx = casefilter_load(index_path);
+    double t = bench_now() - t0;
+    if (!idx) return NULL;
+    bench_row(&rows[0], "load", 1, t);
+    rows[0].mb_per_second = t > 0 ? mb / t : 0.0;
+    casefilter_free(idx);
+
+    t0 = bench_now();
+    idx = casefilter_load(index_path);
+    if (!idx) return NULL;
+    uint64_t acc = 0;
+    for (int i = 0; i < idx->keyword_count; ++i) acc += idx->codes[i];
+    t = bench_now() - t0;
+    bench_sink += acc;
+    bench_row(&rows[1], "load_touch", 1, t);
+    rows[1].mb_per_second = t > 0 ? mb / t : 0.0;
+    return idx;
+}
+
+/* ===== クエリごとの遅延 ===== */
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    int i = (int)(p * (double)(n - 1) + 0.5);
+    return sorted[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+}
+
+static int bench_latency(BenchRow *row, const CaseFilterIndex *idx, char (*q)[KEYWORD_LEN + 1], int n) {
+    CaseFilterSearchCtx *ctx = casefilter_ctx_create(idx);
+    double *lat = malloc(sizeof(double) * (size_t)n);
+    if (!ctx || !lat) {
+        casefilter_ctx_free(ctx);
+        free(lat);
+        return 0;
+    }
+    long long hits = 0;
+    double total = 0.0;
+    for (int i = 0; i < n; ++i) {
+        double t0 = bench_now();
+        hits += casefilter_search_ctx(idx, ctx, q[i], MAX_EDIT_DIST);
+        lat[i] = (bench_now() - t0) * 1e6;
+        total += lat[i];
+    }
+    qsort(lat, (size_t)n, sizeof(double), cmp_double);
+    bench_row(row, "query_latency", n, total / 1e6);
+    row->mean_us = total / n;
+    row->p50_us = percentile(lat, n, 0.50);
+    row->p99_us = percentile(lat, n, 0.99);
+    row->p999_us = percentile(lat, n, 0.999);
+    fprintf(stderr, "query_latency: %lld hits / %d queries\n", hits, n);
+    free(lat);
+    casefilter_ctx_free(ctx);
+    return 1;
+}
+
+/* ===== 出力 ===== */
+static void print_rows(const BenchRow *rows, int nrows) {
+    printf("%-24s %12s %10s %10s %10s %10s %10s %10s\n", "benchmark", "ops", "seconds", "ns/op", "MB/s",
+           "p50 us", "p99 us", "p999 us");
+    for (int i = 0; i < nrows; ++i) {
+        const BenchRow *r = &rows[i];
+        printf("%-24s %12lld %10.4f %10.2f", r->name, r->ops, r->seconds,
+               r->ops > 0 ? r->seconds * 1e9 / (double)r->ops : 0.0);
+        if (r->mb_per_second >= 0) printf(" %10.1f", r->mb_per_second);
+        else printf(" %10s", "-");
+        if (r->p50_us >= 0) printf(" %10.2f %10.2f %10.2f\n", r->p50_us, r->p99_us, r->p999_us);
+        else printf(" %10s %10s %10s\n", "-", "-", "-");
+    }
+}
+
+static void csv_opt(FILE *csv, double v, const char *fmt) {
+    fputc(',', csv);
+    if (v >= 0) fprintf(csv, fmt, v);
+}
+
+static int record_rows(const char *records_dir, const char *dataset, const char *query_file, const char *index_file,
+                       int keyword_count, const char *planner, const BenchRow *rows, int nrows) {
+    if (mkdir(records_dir, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir records");
+        return 0;
+    }
+    char csv_path[512];
+    snprintf(csv_path, sizeof(csv_path), "%s/bench_%s.csv", records_dir, dataset);
+    int new_file = access(csv_path, F_OK) != 0;
+    FILE *csv = fopen(csv_path, "a");
+    if (!csv) {
+        perror("fopen csv");
+        return 0;
+    }
+    if (new_file) fprintf(csv, "%s\n", BENCH_CSV_HEADER);
+
+    time_t now = time(NULL);
+    struct tm tm_utc;
+    gmtime_r(&now, &tm_utc);
+    char ts_buf[32];
+    strftime(ts_buf, sizeof(ts_buf), "%Y-%m-%dT%H:%M:%SZ", &tm_utc);
+
+    for (int i = 0; i < nrows; ++i) {
+        const BenchRow *r = &rows[i];
+        fprintf(csv, "%s,%s,%s,%s,%d,%s,%s,%s,%lld,%.6f,%.3f", ts_buf, dataset, query_file, index_file,
+                keyword_count, casefilter_kernel_name(), planner, r->name, r->ops, r->seconds,
+                r->ops > 0 ? r->seconds * 1e9 / (double)r->ops : 0.0);
+        csv_opt(csv, r->mb_per_second, "%.1f");
+        csv_opt(csv, r->mean_us, "%.3f");
+        csv_opt(csv, r->p50_us, "%.3f");
+        csv_opt(csv, r->p99_us, "%.3f");
+        csv_opt(csv, r->p999_us, "%.3f");
+        fputc('\n', csv);
+    }
+    fclose(csv);
+    fprintf(stderr, "bench record appended to %s\n", csv_path);
+    return 1;
+}
+
+/* record_perf と同じ規則: query_<name> → <name> */
+static const char *infer_dataset(const char *query_file) {
+    const char *base = strrchr(query_file, '/');
+    base = base ? base + 1 : query_file;
+    return strncmp(base, "query_", 6) == 0 ? base + 6 : base;
+}
+
+int main(int argc, char **argv) {
+    int record = 0;
+    int rounds = 20;
+    const char *dataset = NULL;
+    const char *records_dir = "records";
+    const char *kernel = "auto";
+    const char *planner = "staged";
+    int idx = 1;
+    while (idx < argc && argv[idx][0] == '-' && argv[idx][1] == '-') {
+        if (strcmp(argv[idx], "--record") == 0) {
+            record = 1;
+            idx++;
+        } else if (strcmp(argv[idx], "--dataset") == 0 && idx + 1 < argc) {
+            dataset = argv[idx + 1];
+            idx += 2;
+        } else if (strcmp(argv[idx], "--records-dir") == 0 && idx + 1 < argc) {
+            records_dir = argv[idx + 1];
+            idx += 2;
+        } else if (strcmp(argv[idx], "--rounds") == 0 && idx + 1 < argc) {
+            rounds = atoi(argv[idx + 1]);
+            idx += 2;
+        } else if (strcmp(argv[idx], "--kernel") == 0 && idx + 1 < argc) {
+            kernel = argv[idx + 1];
+            idx += 2;
+        } else if (strcmp(argv[idx], "--planner") == 0 && idx + 1 < argc) {
+            planner = argv[idx + 1];
+            idx += 2;
+        } else {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - idx != 2 || rounds < 1) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+    const char *query_file = argv[idx];
+    const char *index_file = argv[idx + 1];
+    if (!dataset) dataset = infer_dataset(query_file);
+    if (!casefilter_select_kernel(kernel)) {
+        fprintf(stderr, "unsupported kernel: %s\n", kernel);
+        return 1;
+    }
+    if (!casefilter_select_planner(planner)) {
+        fprintf(stderr, "unknown planner: %s\n", planner);
+        return 1;
+    }
+
+    char (*queries)[KEYWORD_LEN + 1] = NULL;
+    int n = bench_read_queries(query_file, &queries);
+    if (n <= 0) {
+        fprintf(stderr, "no queries in %s\n", query_file);
+        return 1;
+    }
+    uint64_t *codes = malloc(sizeof(uint64_t) * (size_t)n);
+    if (!codes) return 1;
+    for (int i = 0; i < n; ++i) codes[i] = pack_keyword(queries[i]);
+
+    BenchRow rows[11];
+    int nrows = 0;
+    bench_pack_keyword(&rows[nrows++], queries, n, rounds);
+    bench_hamming(&rows[nrows], codes, n, rounds);
+    nrows += 2;
+    bench_pack_delete(&rows[nrows++], codes, n, rounds);
+    bench_pack_keys(&rows[nrows], queries, n, rounds);
+    nrows += 2;
+    if (bench_parse(&rows[nrows], query_file, rounds)) nrows += 2;
+
+    CaseFilterIndex *index = bench_load(&rows[nrows], index_file);
+    if (!index) {
+        fprintf(stderr, "failed to load index %s\n", index_file);
+        return 1;
+    }
+    nrows += 2;
+    if (!bench_latency(&rows[nrows++], index, queries, n)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    print_rows(rows, nrows);
+    int rc = 0;
+    if (record && !record_rows(records_dir, dataset, query_file, index_file, index->keyword_count, planner, rows, nrows)) rc = 1;
+    casefilter_free(index);
+    free(codes);
+    free(queries);
+    return rc;
+}
@@ -0,0 +1,44 @@
+"""
+Helpers shared by the bench_*.py drivers: build a v2 index with prep_casefilter
+and time search_casefilter runs over it.
+
+The drivers are run as `python3 scripts/bench_<name>.py`, so this module is
+importable from scripts/ without installing anything.
+"""
+import os
+import subprocess
+import sys
+import time
+
+
+def build(prep: str, db: str, out_path: str, extra: list) -> str:
+    """Run prep_casefilter --format v2 into out_path and return its stderr (the size report).
+
+    On failure the partial index is removed and the driver exits.
+    """
+    with open(out_path, "wb") as out:
+        r = subprocess.run([prep, "--format", "v2", *extra, db], stdout=out, stderr=subprocess.PIPE, text=True)
+    if r.returncode != 0:
+        os.remove(out_path)
+        sys.exit(f"prep failed for {db} ({' '.join(extra) or 'defaults'}): rc={r.returncode}")
+    return r.stderr
+
+
+def run_search(search: str, queries: str, index: str, repeat: int, extra: list = ()) -> tuple:
+    """Return (best elapsed seconds, peak RSS MB, output bytes) over `repeat` runs."""
+    best = None
+    rss = 0.0
+    output = b""
+    for _ in range(repeat):
+        t0 = time.perf_counter()
+        proc = subprocess.Popen([search, *extra, queries, index], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+        output = proc.stdout.read()
+        proc.stdout.close()
+        _, status, usage = os.wait4(proc.pid, 0)
+        elapsed = time.perf_counter() - t0
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        if proc.returncode != 0:
+            sys.exit(f"search failed on {index}: rc={proc.returncode}")
+        rss = max(rss, usage.ru_maxrss / 1024.0)
+        best = elapsed if best is None else min(best, elapsed)
+    return best, rss, output
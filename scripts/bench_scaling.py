@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""
+Run bench_casefilter across DB sizes and synthetic worst cases.
+
+For every dataset the v2 index is built with prep_casefilter if it is not
+already there, then bench_casefilter --record appends its rows to
+records/bench_<dataset>.csv, so scaling can be compared run over run.
+
+Datasets:
+  10k 20k 100k 500k 1   test-data/db_<name> + test-data/query_<name>
+  skew                  per-position Zipf over A-J ('A' dominates), long Case A / B lists
+  lowent                words drawn from a small alphabet (default 3 letters), huge posting lists
+
+Synthetic queries are half DB words with 1-4 random substitutions (hits and
+near misses). The other half are random skew words, or for lowent DB words
+with 4 positions set to letters outside the alphabet: guaranteed misses whose
+untouched blocks still land on the huge lists.
+
+Example:
+  gcc -O2 -march=native -pthread scripts/bench_casefilter.c -o bench_casefilter
+  python3 scripts/bench_scaling.py --datasets 10k,100k,1,skew,lowent
+"""
+import argparse
+import os
+import random
+import subprocess
+import sys
+
+from bench_common import build
+
+KEYWORD_LEN = 15
+LETTERS = "ABCDEFGHIJ"
+REAL_DATASETS = ["10k", "20k", "100k", "500k", "1"]
+SYNTHETIC_DATASETS = ["skew", "lowent"]
+
+
+def skew_word(rng: random.Random, weights: list) -> str:
+    return "".join(rng.choices(LETTERS, weights=weights, k=KEYWORD_LEN))
+
+
+def lowent_word(rng: random.Random, alphabet: str) -> str:
+    return "".join(rng.choice(alphabet) for _ in range(KEYWORD_LEN))
+
+
+def mutate(rng: random.Random, word: str, letters: str, edits: int) -> str:
+    w = list(word)
+    for pos in rng.sample(range(KEYWORD_LEN), edits):
+        w[pos] = rng.choice([c for c in letters if c != w[pos]] or letters)
+    return "".join(w)
+
+
+def generate(kind: str, size: int, queries: int, args, db_path: str, query_path: str) -> None:
+    """Write a synthetic DB and query file of `size` / `queries` lines."""
+    rng = random.Random(args.seed)
+    if kind == "skew":
+        weights = [1.0 / (r + 1) ** args.zipf for r in range(len(LETTERS))]
+        letters = LETTERS
+        db = [skew_word(rng, weights) for _ in range(size)]
+        other = lambda: skew_word(rng, weights)
+    else:
+        letters = LETTERS[: args.alphabet]
+        outside = LETTERS[args.alphabet:]
+        db = [lowent_word(rng, letters) for _ in range(size)]
+        other = lambda: mutate(rng, rng.choice(db), outside, 4)
+    with open(db_path, "w") as f:
+        f.write("\n".join(db) + "\n")
+    with open(query_path, "w") as f:
+        for i in range(queries):
+            f.write((mutate(rng, rng.choice(db), letters, rng.randint(1, 4)) if i % 2 == 0 else other()) + "\n")
+
+
+def dataset_files(name: str, args) -> tuple:
+    """Return (query file, index file) for a dataset, generating / building what is missing."""
+    if name in REAL_DATASETS:
+        db = os.path.join(args.test_data, f"db_{name}")
+        queries = os.path.join(args.test_data, f"query_{name}")
+    elif name in SYNTHETIC_DATASETS:
+        db = os.path.join(args.workdir, f"db_{name}_{args.synthetic_size}")
+        queries = os.path.join(args.workdir, f"query_{name}_{args.synthetic_size}")
+        if args.rebuild or not (os.path.exists(db) and os.path.exists(queries)):
+            generate(name, args.synthetic_size, args.synthetic_queries, args, db, queries)
+    else:
+        sys.exit(f"unknown dataset: {name}")
+    index = os.path.join(args.workdir, f"index_casefilter_{os.path.basename(db)[3:]}")
+    if args.rebuild or not os.path.exists(index):
+        build(args.prep, db, index, args.prep_args.split())
+    return queries, index
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Scaling runs of bench_casefilter")
+    parser.add_argument("--bench", default="./bench_casefilter", help="bench_casefilter executable")
+    parser.add_argument("--prep", default="./prep_casefilter", help="prep_casefilter executable")
+    parser.add_argument("--datasets", default=",".join(REAL_DATASETS + SYNTHETIC_DATASETS),
+                        help="comma separated (default: all)")
+    parser.add_argument("--test-data", default="test-data", help="directory with db_* / query_*")
+    parser.add_argument("--workdir", default="output", help="indexes and synthetic data go here")
+    parser.add_argument("--records-dir", default="records", help="where bench_<dataset>.csv is appended")
+    parser.add_argument("--prep-args", default="", help="extra prep_casefilter options, e.g. '--exact-set'")
+    parser.add_argument("--bench-args", default="", help="extra bench_casefilter options, e.g. '--planner cost'")
+    parser.add_argument("--synthetic-size", type=int, default=200000, help="synthetic DB lines (default: 200000)")
+    parser.add_argument("--synthetic-queries", type=int, default=20000, help="synthetic query lines (default: 20000)")
+    parser.add_argument("--zipf", type=float, default=1.5, help="skew: Zipf exponent over A-J (default: 1.5)")
+    parser.add_argument("--alphabet", type=int, default=3, help="lowent: letters used (default: 3)")
+    parser.add_argument("--seed", type=int, default=1, help="generator seed (default: 1)")
+    parser.add_argument("--rebuild", action="store_true", help="regenerate data and rebuild indexes")
+    parser.add_argument("--no-record", action="store_true", help="print only, do not append to records/")
+    args = parser.parse_args()
+    if not 2 <= args.alphabet < len(LETTERS):
+        sys.exit("--alphabet must be between 2 and 9")
+
+    os.makedirs(args.workdir, exist_ok=True)
+    for name in [d for d in args.datasets.split(",") if d]:
+        queries, index = dataset_files(name, args)
+        cmd = [args.bench, *args.bench_args.split(), "--dataset", name, "--records-dir", args.records_dir]
+        if not args.no_record:
+            cmd.append("--record")
+        print(f"== {name}: {queries} / {index}", flush=True)
+        r = subprocess.run([*cmd, queries, index])
+        if r.returncode != 0:
+            sys.exit(f"bench failed on {name}: rc={r.returncode}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""
+Measure the cost of wide (28-bit) keyword ids against narrow (20-bit) ones.
+
+Builds two v2 indexes of the same DB (narrow, and --wide-ids forced), runs the
+same query file against both, checks that the outputs agree, and prints the
+index size and throughput of each variant.
+
+Example:
+  python3 scripts/bench_wide_ids.py --db test-data/db_1 --queries test-data/query_1
+"""
+import argparse
+import os
+import sys
+
+from bench_common import build, run_search
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Compare narrow / wide keyword id throughput")
+    parser.add_argument("--prep", default="./prep_casefilter", help="prep_casefilter executable")
+    parser.add_argument("--search", default="./search_casefilter", help="search_casefilter executable")
+    parser.add_argument("--db", default="test-data/db_1", help="DB file to index")
+    parser.add_argument("--queries", default="test-data/query_1", help="query file")
+    parser.add_argument("--workdir", default="output", help="where to write the two indexes")
+    parser.add_argument("--repeat", type=int, default=3, help="runs per variant, best is reported (default: 3)")
+    parser.add_argument("--keep", action="store_true", help="keep the generated indexes")
+    args = parser.parse_args()
+
+    os.makedirs(args.workdir, exist_ok=True)
+    variants = [("narrow", []), ("wide", ["--wide-ids"])]
+    results = []
+    outputs = []
+    for name, extra in variants:
+        path = os.path.join(args.workdir, f"index_bench_{name}_ids")
+        build(args.prep, args.db, path, extra)
+        size_mb = os.path.getsize(path) / (1024.0 * 1024.0)
+        elapsed, _, out = run_search(args.search, args.queries, path, args.repeat)
+        nq = out.count(b"0") + out.count(b"1")
+        results.append((name, size_mb, elapsed, nq / elapsed if elapsed > 0 else 0.0))
+        outputs.append(out)
+        if not args.keep:
+            os.remove(path)
+
+    if outputs[0] != outputs[1]:
+        sys.exit("narrow and wide outputs differ")
+
+    print(f"{'variant':<8} {'index MB':>10} {'best s':>8} {'queries/s':>12}")
+    for name, size_mb, elapsed, qps in results:
+        print(f"{name:<8} {size_mb:>10.1f} {elapsed:>8.3f} {qps:>12.0f}")
+    base = results[0][3]
+    if base > 0:
+        print(f"wide / narrow throughput: {results[1][3] / base:.3f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""
+Reference client for `search_casefilter --serve`.
+
+Sends a query file in framed batches and prints the result line in the same
+format as a one-shot run ('0'/'1' per query, then a newline), so the output
+can be diffed against `search_casefilter <query_file> <index_file>`.
+
+Frame format (little endian):
+  request:  u32 n, then n * 15 bytes of queries (no newlines)
+  response: u32 n, then ceil(n / 8) bytes; query i hit <=> byte i/8 bit i%8
+
+Requests are written from a separate thread while responses are read, so
+several batches are in flight and the server's read / search / write stages
+overlap.
+
+Examples:
+  ./search_casefilter --serve /tmp/cf.sock output/index_casefilter_1 -j 4 &
+  python3 scripts/casefilter_client.py --socket /tmp/cf.sock test-data/query_1 > output/result_casefilter
+  python3 scripts/casefilter_client.py --spawn "./search_casefilter --serve - output/index_casefilter_1" test-data/query_1
+"""
+import argparse
+import shlex
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+KEYWORD_LEN = 15
+
+
+def read_queries(path: str) -> list:
+    """Lines with the wrong length are sent as invalid queries (the server answers 0, like a one-shot run)."""
+    out = []
+    with open(path, "rb") as f:
+        for line in f:
+            q = line.rstrip(b"\r\n")
+            out.append(q if len(q) == KEYWORD_LEN else b"?" * KEYWORD_LEN)
+    return out
+
+
+def recv_exact(rd, n: int) -> bytes:
+    buf = b""
+    while len(buf) < n:
+        chunk = rd(n - len(buf))
+        if not chunk:
+            sys.exit("server closed the connection")
+        buf += chunk
+    return buf
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Client for search_casefilter --serve")
+    target = parser.add_mutually_exclusive_group(required=True)
+    target.add_argument("--socket", help="Unix socket path of a running server")
+    target.add_argument("--spawn", help="command line of a stdin/stdout server to start (--serve -)")
+    parser.add_argument("--batch", type=int, default=4096, help="queries per request (default: 4096)")
+    parser.add_argument("--repeat", type=int, default=1, help="send the whole file this many times (default: 1)")
+    parser.add_argument("queries", help="query file")
+    args = parser.parse_args()
+
+    queries = read_queries(args.queries)
+    batches = [queries[i:i + args.batch] for i in range(0, len(queries), args.batch)] * args.repeat
+
+    proc = None
+    if args.socket:
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(args.socket)
+        send, rd = sock.sendall, sock.recv
+    else:
+        proc = subprocess.Popen(shlex.split(args.spawn), stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        send = lambda b: (proc.stdin.write(b), proc.stdin.flush())
+        rd = proc.stdout.read
+
+    def sender() -> None:
+        for b in batches:
+            send(struct.pack("<I", len(b)) + b"".join(b))
+        if proc:
+            proc.stdin.close()
+        else:
+            sock.shutdown(socket.SHUT_WR)
+
+    t0 = time.perf_counter()
+    th = threading.Thread(target=sender)
+    th.start()
+    bits = []
+    for b in batches:
+        (n,) = struct.unpack("<I", recv_exact(rd, 4))
+        if n != len(b):
+            sys.exit(f"response for {n} queries, expected {len(b)}")
+        packed = recv_exact(rd, (n + 7) // 8)
+        bits.append("".join("1" if packed[i >> 3] >> (i & 7) & 1 else "0" for i in range(n)))
+    th.join()
+    elapsed = time.perf_counter() - t0
+    if proc:
+        proc.wait()
+
+    result = "".join(bits[: len(bits) // args.repeat])
+    sys.stdout.write(result + "\n")
+    total = sum(len(b) for b in batches)
+    print(f"{total} queries in {len(batches)} batches, {elapsed:.3f}s", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,273 @@
+/*
+ * 直列化した索引を使わない DB × クエリの結合。
+ *
+ * search_casefilter.c を main() 抜きで取り込み、索引をメモリ上で組む（casefilter_create /
+ * casefilter_insert_code / casefilter_finalize）。どちら側も prep_casefilter や v1/v2 ファイルを通らない。
+ * 索引にする側は構築 + 探索の見積もりで選ぶ:
+ *
+ *   db:    DB を索引にして全クエリを引く（prep + search と同じ）
+ *   query: クエリを索引にして DB の各語を引き、距離 k 以内の全クエリに印を付ける
+ *          （casefilter_mark_codes。最初の一致で打ち切らない）
+ *
+ * どちらでも出力は `search_casefilter <query_file> <index_file>` と同じクエリごとの有無
+ * （'0'/'1' の 1 行か --output bits のフレーム）。DB の行は prep と同じ規則（ちょうど 15 文字で全て文字種の内）で、
+ * それ以外の行は飛ばす。長さの違うクエリ行は 0、文字種の外の文字はどの文字とも一致しない。
+ *
+ * ビルド:
+ *   gcc -O2 -march=native -pthread scripts/join_casefilter.c -o join_casefilter
+ * 実行:
+ *   ./join_casefilter [-k K] [-j N] [--side auto|db|query] [--output text|bits] <db_file> <query_file>
+ */
+
+#define CASEFILTER_NO_MAIN
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../search_casefilter.c"
+#pragma GCC diagnostic pop
+
+/*
+ * コスト見積もり（ns）。構築は 2 パスの scatter（1 語 40 ポスティング）と、ディレクトリの offsets / occ（固定）。
+ * 1 語の探索は計画とディレクトリ（ほぼ空のスロットでもキャッシュミス）の固定分 + 候補数 × 検証。
+ * 候補数は一様な語での平均リスト長 × 引くリスト数で、索引にした側の件数に比例する。
+ * 逆向きは 1 件目で止まらずスカラーで全候補を見るので、候補 1 件が重い。探索は -j で割り、構築は逐次。
+ * test-data の 10k〜1M の組（-march=native）で測った値
+ */
+#define JOIN_BUILD_NS 2500.0
+#define JOIN_BUILD_FIXED_NS 220e6
+#define JOIN_PROBE_NS 850.0
+#define JOIN_SCAN_NS 36.0
+#define JOIN_MARK_NS 90.0
+
+enum { JOIN_SIDE_AUTO, JOIN_SIDE_DB, JOIN_SIDE_QUERY };
+
+#define JOIN_CHUNK 4096
+
+typedef struct {
+    const CaseFilterIndex *idx;
+    const uint64_t *codes;  /* 探索する側 */
+    int n;
+    int k;
+    int invert;             /* 1: casefilter_mark_codes で marks に印を付ける */
+    int next;               /* __atomic: 次のチャンク */
+    int failed;             /* __atomic */
+    uint8_t *hits;          /* invert = 0: codes ごとの結果 */
+} JoinJob;
+
+typedef struct {
+    JoinJob *job;
+    uint64_t *marks;        /* invert = 1: このスレッドの印（索引の id ごとに 1bit） */
+} JoinWorker;
+
+static void *join_worker(void *arg) {
+    JoinWorker *w = (JoinWorker *)arg;
+    JoinJob *job = w->job;
+    CaseFilterSearchCtx *ctx = casefilter_ctx_create(job->idx);
+    if (!ctx) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    for (;;) {
+        int begin = __atomic_fetch_add(&job->next, JOIN_CHUNK, __ATOMIC_RELAXED);
+        if (begin >= job->n) break;
+        int m = job->n - begin < JOIN_CHUNK ? job->n - begin : JOIN_CHUNK;
+        if (!job->invert) {
+            casefilter_search_codes(job->idx, ctx, job->codes + begin, m, job->k, job->hits + begin);
+        } else if (!casefilter_mark_codes(job->idx, ctx, job->codes + begin, m, job->k, w->marks)) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    casefilter_ctx_free(ctx);
+    return NULL;
+}
+
+/* job を threads 本で回す。invert なら各スレッドの印を marks に OR する */
+static int join_run(JoinJob *job, int threads, uint64_t *marks, size_t words) {
+    JoinWorker *ws = (JoinWorker *)calloc((size_t)threads, sizeof(JoinWorker));
+    pthread_t *tids = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
+    int ok = ws && tids;
+    for (int t = 0; ok && t < threads; ++t) {
+        ws[t].job = job;
+        if (!job->invert) continue;
+        ws[t].marks = t == 0 ? marks : (uint64_t *)calloc(words, sizeof(uint64_t));
+        ok = ws[t].marks != NULL;
+    }
+    int started = 0;
+    for (; ok && started < threads - 1; ++started) {
+        if (pthread_create(&tids[started], NULL, join_worker, &ws[started + 1]) != 0) break;
+    }
+    if (ok) join_worker(&ws[0]);
+    for (int t = 0; t < started; ++t) pthread_join(tids[t], NULL);
+    for (int t = 1; ws && t < threads; ++t) {
+        if (!ws[t].marks) continue;
+        for (size_t i = 0; i < words; ++i) marks[i] |= ws[t].marks[i];
+        free(ws[t].marks);
+    }
+    free(ws);
+    free(tids);
+    return ok && !__atomic_load_n(&job->failed, __ATOMIC_RELAXED);
+}
+
+/* n 件を索引にして m 件で引く見積もり（秒） */
+static double join_cost(long n, long m, int k, int threads, int invert) {
+    const CfScheme *sc = &cf_schemes[CF_SCHEME_PAIRS];
+    double lists = popcount64(sc->cover[k]);
+    double cand = lists * (double)n / CASEFILTER_H_KEY_SPACE;
+    /* D のリストは 1 語あたり 15 × sides 本のキーが DEL_KEY_SPACE に散り、1 クエリは高々 16 スロットを引く */
+    if (cf_del_sides[k]) cand += 16.0 * KEYWORD_LEN * cf_del_sides[k] * (double)n / CASEFILTER_DEL_KEY_SPACE;
+    double build = JOIN_BUILD_FIXED_NS + JOIN_BUILD_NS * (double)n;
+    double probe = (double)m * (JOIN_PROBE_NS + (invert ? JOIN_MARK_NS : JOIN_SCAN_NS) * cand) / threads;
+    return (build + probe) * 1e-9;
+}
+
+/* codes を索引にする（DB 側は文字種の中の語だけ）。ids[i] は索引 id i の元の位置（NULL 可） */
+static CaseFilterIndex *join_build(const uint64_t *codes, int n, int k, int db_side, int *ids) {
+    CaseFilterIndex *idx = casefilter_create(n);
+    if (!idx) return NULL;
+    idx->spec = casefilter_spec_for(k, CF_SCHEME_PAIRS);
+    for (int i = 0; i < n; ++i) {
+        if (db_side && code_foreign(codes[i])) continue;
+        if (casefilter_insert_code(idx, codes[i]) && ids) ids[idx->keyword_count - 1] = i;
+    }
+    if (!casefilter_finalize(idx)) {
+        casefilter_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+static double join_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void join_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-k K] [-j N] [--side auto|db|query] [--output text|bits] <db_file> <query_file>\n"
+            "  -k K      編集距離 K 以内を探す（0〜3、既定 3）\n"
+            "  -j N      N スレッドで探索する（構築は逐次）\n"
+            "  --side    索引にする側。auto は構築 + 探索の見積もりが小さい方（既定）、db は prep + search と同じ向き、\n"
+            "            query はクエリを索引にして DB の各語から距離 K 以内の全クエリに印を付ける\n"
+            "  --output  text: '0'/'1' の 1 行（既定） / bits: u32le n + ceil(n/8) バイト（search --output bits と同じ）\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    int k = MAX_EDIT_DIST;
+    int threads = 1;
+    int side = JOIN_SIDE_AUTO;
+    int output = CF_OUTPUT_TEXT;
+    const char *paths[2] = {NULL, NULL};
+    int npaths = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            k = atoi(argv[++i]);
+            if (k < 0 || k > MAX_EDIT_DIST) { join_usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1) { join_usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--side") == 0 && i + 1 < argc) {
+            ++i;
+            if (strcmp(argv[i], "auto") == 0) side = JOIN_SIDE_AUTO;
+            else if (strcmp(argv[i], "db") == 0) side = JOIN_SIDE_DB;
+            else if (strcmp(argv[i], "query") == 0) side = JOIN_SIDE_QUERY;
+            else { join_usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            ++i;
+            if (strcmp(argv[i], "text") == 0) output = CF_OUTPUT_TEXT;
+            else if (strcmp(argv[i], "bits") == 0) output = CF_OUTPUT_BITS;
+            else { join_usage(argv[0]); return 1; }
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            join_usage(argv[0]);
+            return 1;
+        } else if (npaths < 2) {
+            paths[npaths++] = argv[i];
+        } else {
+            join_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (npaths != 2) {
+        join_usage(argv[0]);
+        return 1;
+    }
+
+    double t0 = join_now();
+    uint64_t *db = NULL, *qs = NULL;
+    int nd = read_queries(paths[0], &db);
+    if (nd < 0) {
+        fprintf(stderr, nd == -2 ? "failed to open db file\n" : "failed to read db file\n");
+        return 1;
+    }
+    int nq = read_queries(paths[1], &qs);
+    if (nq < 0) {
+        fprintf(stderr, nq == -2 ? "failed to open query file\n" : "failed to read query file\n");
+        free(db);
+        return 1;
+    }
+    long db_words = 0, q_words = 0;
+    for (int i = 0; i < nd; ++i) db_words += db[i] != CASEFILTER_NO_QUERY && !code_foreign(db[i]);
+    for (int i = 0; i < nq; ++i) q_words += qs[i] != CASEFILTER_NO_QUERY;
+    /* 見積もりは実際に並ぶスレッド数で割る */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int lanes = cpus > 0 && cpus < threads ? (int)cpus : threads;
+    double cost_db = join_cost(db_words, q_words, k, lanes, 0);
+    double cost_q = join_cost(q_words, db_words, k, lanes, 1);
+    int invert = side == JOIN_SIDE_QUERY || (side == JOIN_SIDE_AUTO && cost_q < cost_db);
+    double t1 = join_now();
+
+    char *results = (char *)malloc((size_t)(nq > 0 ? nq : 0) + 1);
+    uint8_t *hits = NULL;
+    int *ids = NULL;
+    uint64_t *marks = NULL;
+    CaseFilterIndex *idx = NULL;
+    int ok = results != NULL;
+    if (ok && !invert) {
+        hits = (uint8_t *)malloc((size_t)(nq > 0 ? nq : 1));
+        idx = hits ? join_build(db, nd, k, 1, NULL) : NULL;
+        ok = idx != NULL;
+    } else if (ok) {
+        ids = (int *)malloc(sizeof(int) * (size_t)(nq > 0 ? nq : 1));
+        idx = ids ? join_build(qs, nq, k, 0, ids) : NULL;
+        ok = idx != NULL;
+    }
+    double t2 = join_now();
+    if (ok) {
+        JoinJob job = {idx, invert ? db : qs, invert ? nd : nq, k, invert, 0, 0, hits};
+        size_t words = ((size_t)idx->keyword_count + 63) / 64 + 1;
+        if (invert) {
+            /* DB 側の不正な行（文字種の外を含む語）は引かない */
+            for (int i = 0; i < nd; ++i) {
+                if (code_foreign(db[i])) db[i] = CASEFILTER_NO_QUERY;
+            }
+            marks = (uint64_t *)calloc(words, sizeof(uint64_t));
+        }
+        ok = (!invert || marks) && join_run(&job, threads, marks, words);
+    }
+    double t3 = join_now();
+    if (ok) {
+        if (!invert) {
+            for (int i = 0; i < nq; ++i) results[i] = hits[i] ? '1' : '0';
+        } else {
+            memset(results, '0', (size_t)nq);
+            for (int id = 0; id < idx->keyword_count; ++id) {
+                if (occ_test(marks, (uint32_t)id)) results[ids[id]] = '1';
+            }
+        }
+        fprintf(stderr, "join: indexed %s (%d words), estimate db %.3fs / query %.3fs, read %.3fs build %.3fs probe %.3fs\n",
+                invert ? "query" : "db", idx->keyword_count, cost_db, cost_q, t1 - t0, t2 - t1, t3 - t2);
+        ok = write_results(results, nq, output);
+        if (!ok) fprintf(stderr, "failed to write results\n");
+    } else {
+        fprintf(stderr, "join failed (out of memory)\n");
+    }
+    casefilter_free(idx);
+    free(marks);
+    free(ids);
+    free(hits);
+    free(results);
+    free(db);
+    free(qs);
+    return ok ? 0 : 1;
+}
@@ -1,21 +1,148 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/* search_casefilter は環境変数で渡した fd に "load_seconds=… search_seconds=…" を書く
+ * （シャード manifest では load を分けられないので search_seconds だけ。無い値の列は空） */
+#define PHASE_FD_ENV "CASEFILTER_PHASE_FD"
+
+#define CSV_HEADER_BASE "timestamp_utc,executable,query_file,index_file,dataset,elapsed_seconds,hit_count,return_code"
+#define CSV_HEADER                                                                                   \
+    CSV_HEADER_BASE ",load_seconds,search_seconds,user_seconds,sys_seconds,max_rss_kb,major_faults," \
+                    "minor_faults,cycles,instructions,llc_misses,dtlb_misses"
+#define CSV_EXTRA_COLUMNS 11
 
 static void usage(const char *prog) {
     fprintf(stderr,
-            "Usage: %s [--record] [--dataset NAME] [--records-dir DIR] -- <cmd ...>\n"
-            "  cmd should be: <search_exe> <query_file> <index_file> [...]\n",
+            "Usage: %s [--record] [--dataset NAME] [--records-dir DIR] [--perf-counters] -- <cmd ...>\n"
+            "  cmd should be: <search_exe> <query_file> <index_file> [...]\n"
+            "  --perf-counters  also count cycles, instructions, LLC and dTLB misses via perf_event_open\n",
             prog);
 }
 
+/* ===== perf_event_open counters (optional; unsupported events are left empty in the CSV) ===== */
+enum { PC_CYCLES, PC_INSTRUCTIONS, PC_LLC_MISSES, PC_DTLB_MISSES, PC_COUNT };
+
+typedef struct {
+    int fd[PC_COUNT];
+} PerfCounters;
+
+static void perf_counters_open(PerfCounters *pc, pid_t pid) {
+#ifdef __linux__
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[PC_COUNT] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    };
+    for (int i = 0; i < PC_COUNT; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1; /* count the search binary only, not the fork/exec glue */
+        attr.inherit = 1;        /* include worker threads and shard processes */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        pc->fd[i] = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+    }
+#else
+    (void)pid;
+#endif
+}
+
+/* returns -1 for counters that could not be opened or read */
+static long long perf_counter_read(const PerfCounters *pc, int i) {
+    uint64_t v;
+    if (pc->fd[i] < 0 || read(pc->fd[i], &v, sizeof(v)) != (ssize_t)sizeof(v)) return -1;
+    return (long long)v;
+}
+
+static void perf_counters_close(PerfCounters *pc) {
+    for (int i = 0; i < PC_COUNT; ++i) {
+        if (pc->fd[i] >= 0) close(pc->fd[i]);
+        pc->fd[i] = -1;
+    }
+}
+
+static void csv_count(FILE *csv, long long v) {
+    if (v >= 0) fprintf(csv, ",%lld", v);
+    else fputc(',', csv);
+}
+
+/* Files created before the extra columns existed get the new header and empty trailing fields. */
+static int upgrade_csv(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (!in) return 0;
+    char line[4096];
+    if (!fgets(line, sizeof(line), in)) {
+        fclose(in);
+        return 1;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strcmp(line, CSV_HEADER_BASE) != 0) {
+        fclose(in);
+        return 1; /* already upgraded, or a layout we do not know about: leave it alone */
+    }
+    char tmp_path[600];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *tmp = fopen(tmp_path, "w");
+    if (!tmp) {
+        fclose(in);
+        return 0;
+    }
+    fprintf(tmp, "%s\n", CSV_HEADER);
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0]) continue;
+        fprintf(tmp, "%s%.*s\n", line, CSV_EXTRA_COLUMNS, ",,,,,,,,,,,");
+    }
+    fclose(in);
+    if (fclose(tmp) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return 0;
+    }
+    return 1;
+}
+
+/* Parse "load_seconds=X search_seconds=Y"; missing values stay negative. */
+static void parse_phases(const char *buf, double *load_s, double *search_s) {
+    const char *p = strstr(buf, "load_seconds=");
+    if (p) *load_s = atof(p + strlen("load_seconds="));
+    p = strstr(buf, "search_seconds=");
+    if (p) *search_s = atof(p + strlen("search_seconds="));
+}
+
+static void csv_seconds(FILE *csv, double v) {
+    if (v >= 0.0) fprintf(csv, ",%.6f", v);
+    else fputc(',', csv);
+}
+
+static double timeval_sec(const struct timeval *tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
 static const char *derive_dataset(const char *query_path) {
     const char *base = strrchr(query_path, '/');
     base = base ? base + 1 : query_path;
@@ -39,6 +166,7 @@ static double timespec_diff_sec(const struct timespec *a,
 
 int main(int argc, char **argv) {
     int record = 0;
+    int perf_counters = 0;
     const char *dataset_override = NULL;
     const char *records_dir = "records";
 
@@ -47,6 +175,9 @@ int main(int argc, char **argv) {
         if (strcmp(argv[idx], "--record") == 0) {
             record = 1;
             idx++;
+        } else if (strcmp(argv[idx], "--perf-counters") == 0) {
+            perf_counters = 1;
+            idx++;
         } else if (strcmp(argv[idx], "--dataset") == 0) {
             if (idx + 1 >= argc) {
                 usage(argv[0]);
@@ -86,7 +217,9 @@ int main(int argc, char **argv) {
     const char *index_file = cmd[2];
 
     int pipefd[2];
-    if (pipe(pipefd) != 0) {
+    int phasefd[2];
+    int gofd[2]; /* the child waits here until the counters are attached */
+    if (pipe(pipefd) != 0 || pipe(phasefd) != 0 || pipe(gofd) != 0) {
         perror("pipe");
         return 1;
     }
@@ -102,17 +235,35 @@ int main(int argc, char **argv) {
     if (pid == 0) {
         // child
         close(pipefd[0]);
+        close(phasefd[0]);
+        close(gofd[1]);
         if (dup2(pipefd[1], STDOUT_FILENO) == -1) {
             perror("dup2");
             _exit(1);
         }
         close(pipefd[1]);
+        char fdbuf[16];
+        snprintf(fdbuf, sizeof(fdbuf), "%d", phasefd[1]);
+        setenv(PHASE_FD_ENV, fdbuf, 1);
+        char go;
+        if (read(gofd[0], &go, 1) < 0) _exit(1);
+        close(gofd[0]);
         execvp(executable, cmd);
         perror("execvp");
         _exit(127);
     }
 
     close(pipefd[1]);
+    close(phasefd[1]);
+    close(gofd[0]);
+    PerfCounters pc;
+    for (int i = 0; i < PC_COUNT; ++i) pc.fd[i] = -1;
+    if (perf_counters) {
+        perf_counters_open(&pc, pid);
+        if (pc.fd[PC_CYCLES] < 0) perror("perf_event_open (counters will be empty)");
+    }
+    if (write(gofd[1], "g", 1) != 1) perror("write");
+    close(gofd[1]);
     FILE *out = fdopen(pipefd[0], "r");
     if (!out) {
         perror("fdopen");
@@ -133,9 +284,21 @@ int main(int argc, char **argv) {
     fclose(out);
 
     int status;
-    waitpid(pid, &status, 0);
+    struct rusage ru;
+    memset(&ru, 0, sizeof(ru));
+    wait4(pid, &status, 0, &ru);
     clock_gettime(CLOCK_MONOTONIC, &end_ts);
 
+    char phase_buf[256];
+    ssize_t phase_len = read(phasefd[0], phase_buf, sizeof(phase_buf) - 1);
+    close(phasefd[0]);
+    phase_buf[phase_len > 0 ? phase_len : 0] = '\0';
+    double load_s = -1.0, search_s = -1.0;
+    parse_phases(phase_buf, &load_s, &search_s);
+    long long counts[PC_COUNT];
+    for (int i = 0; i < PC_COUNT; ++i) counts[i] = perf_counter_read(&pc, i);
+    perf_counters_close(&pc);
+
     int return_code = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
     double elapsed = timespec_diff_sec(&end_ts, &start_ts);
 
@@ -150,6 +313,10 @@ int main(int argc, char **argv) {
         snprintf(csv_path, sizeof(csv_path), "%s/perf_%s.csv", records_dir, dataset);
 
         int new_file = access(csv_path, F_OK) != 0;
+        if (!new_file && !upgrade_csv(csv_path)) {
+            fprintf(stderr, "cannot add the new columns to %s\n", csv_path);
+            return return_code;
+        }
         FILE *csv = fopen(csv_path, "a");
         if (!csv) {
             perror("fopen");
@@ -163,11 +330,16 @@ int main(int argc, char **argv) {
         strftime(ts_buf, sizeof(ts_buf), "%Y-%m-%dT%H:%M:%SZ", &t);
 
         if (new_file) {
-            fprintf(csv,
-                    "timestamp_utc,executable,query_file,index_file,dataset,elapsed_seconds,hit_count,return_code\n");
+            fprintf(csv, "%s\n", CSV_HEADER);
         }
-        fprintf(csv, "%s,%s,%s,%s,%s,%.6f,%d,%d\n", ts_buf, executable, query_file,
+        fprintf(csv, "%s,%s,%s,%s,%s,%.6f,%d,%d", ts_buf, executable, query_file,
                 index_file, dataset, elapsed, hits, return_code);
+        csv_seconds(csv, load_s);
+        csv_seconds(csv, search_s);
+        fprintf(csv, ",%.6f,%.6f,%ld,%ld,%ld", timeval_sec(&ru.ru_utime), timeval_sec(&ru.ru_stime),
+                ru.ru_maxrss, ru.ru_majflt, ru.ru_minflt);
+        for (int i = 0; i < PC_COUNT; ++i) csv_count(csv, counts[i]);
+        fputc('\n', csv);
         fclose(csv);
 
         fprintf(stderr, "perf record appended to %s\n", csv_path);
@@ -1,7 +1,27 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  /* cpu_set_t / sched_setaffinity（--numa replicate のピン留め） */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 /* ===== types.h の内容 ===== */
 #define KEYWORD_LEN 15
@@ -9,10 +29,74 @@
 #define CHILD_BUCKETS (KEYWORD_LEN + 1)
 #define INIT_CAPACITY 1024
 
+/* ===== 仕様（長さ・k・文字種） =====
+ * 文字種は -DCASEFILTER_ALPHABET=N（2..10、既定 10 = A–J）でコンパイル時に決める。キーは N 進数なので
+ * スロット空間は N^6 / N^7 になる（prep と同じ値でビルドすること。違う索引は v2 のロードで弾く）。
+ * k は索引ごと（prep --max-k）と探索ごと（-k）に選べ、k が小さいほど引くペア・削除キーが減る。
+ * 長さ 15 は 5×3 ブロック・7+7 の削除キー・60bit の SWAR / SIMD カーネルに織り込んであり、変えられない。
+ */
+#ifndef CASEFILTER_ALPHABET
+#define CASEFILTER_ALPHABET 10
+#endif
+#if CASEFILTER_ALPHABET < 2 || CASEFILTER_ALPHABET > 10
+#error "CASEFILTER_ALPHABET must be between 2 and 10"
+#endif
+#define CF_FOREIGN 0xFu  /* 文字種の外の文字のニブル。どの DB 文字とも一致せず、その文字を含むキーは引かない */
+
 /* ===== index.h の内容 ===== */
 #define CASEFILTER_HPAIR_COUNT 10
-#define CASEFILTER_H_KEY_SPACE 1000000
-#define CASEFILTER_DEL_KEY_SPACE 10000000
+#define CASEFILTER_H_KEY_SPACE (CASEFILTER_ALPHABET * CASEFILTER_ALPHABET * CASEFILTER_ALPHABET * \
+                                CASEFILTER_ALPHABET * CASEFILTER_ALPHABET * CASEFILTER_ALPHABET)
+#define CASEFILTER_DEL_KEY_SPACE (CASEFILTER_H_KEY_SPACE * CASEFILTER_ALPHABET)
+
+/* Case B（indel=1）は k<=1 では起きず、k=2 は削除後の 14 文字が一致するので左 7 だけ、k=3 は左右を引く。 */
+static const uint8_t cf_del_sides[MAX_EDIT_DIST + 1] = {0, 0, 1, 2};
+
+/* ===== Case A の分割方式（prep --case-a） =====
+ * 群 g のキーは mask の文字を位置の昇順に並べた N 進値、スロットは キー + g * N^key_len。
+ * 格納する群が少ないほど ids が減り、代わりに探索で群キーの 1 置換近傍（高々 1 + key_len*(N-1) 本）を引く。
+ *   pairs:  5×3 ブロックの C(5,2) ペア。k 以下なら 5-k 個のブロックが一致するので、どの (5-k) 個の組も
+ *           いずれかのペアを含めば漏れない: k=3 は全 10、k=2 は {01,23,24,34}、k=1 は {01,23}、k=0 は {01}
+ *   halves: 文字 0..5 / 6..11 の 2 群（= ペア 01 / 23 と同じキー）。互いに素なので k 個の誤りならどちらかは
+ *           k/2 個以下: k>=2 は 1 置換近傍まで引く
+ *   thirds: 5 文字 × 3 群（キー空間 N^5）。k=3 ならどれかは 1 個以下なので近傍まで、k<=2 は完全一致だけ
+ * 文字種の外の文字は必ず誤りなので、それを 1 つ含む群は近傍のうちその文字を置き換えたキーだけ引く。
+ * tier1（--exact-set の距離 1）は互いに素な 2 群の完全一致リストで足りる。
+ */
+enum { CF_SCHEME_PAIRS, CF_SCHEME_HALVES, CF_SCHEME_THIRDS, CF_SCHEMES };
+
+typedef struct {
+    const char *name;
+    uint8_t groups;
+    uint8_t key_len;
+    uint16_t mask[CASEFILTER_HPAIR_COUNT];  /* 群 g のキーにする文字（bit i = 文字 i） */
+    uint16_t cover[MAX_EDIT_DIST + 1];     /* k で引く（--max-k で格納する）群 */
+    uint8_t radius[MAX_EDIT_DIST + 1];     /* k で群キーに許す置換（0 / 1） */
+    uint8_t tier1[2];
+} CfScheme;
+
+static const CfScheme cf_schemes[CF_SCHEMES] = {
+    {"pairs", 10, 6, {0x003F, 0x01C7, 0x0E07, 0x7007, 0x01F8, 0x0E38, 0x7038, 0x0FC0, 0x71C0, 0x7E00},
+     {0x001, 0x081, 0x381, 0x3FF}, {0, 0, 0, 0}, {0, 7}},
+    {"halves", 2, 6, {0x003F, 0x0FC0}, {0x1, 0x3, 0x3, 0x3}, {0, 0, 1, 1}, {0, 1}},
+    {"thirds", 3, 5, {0x001F, 0x03E0, 0x7C00}, {0x1, 0x3, 0x7, 0x7}, {0, 0, 0, 1}, {0, 1}},
+};
+
+static inline uint32_t cf_scheme_key_space(const CfScheme *sc) {
+    uint32_t n = 1;
+    for (int i = 0; i < sc->key_len; ++i) n *= CASEFILTER_ALPHABET;
+    return n;
+}
+
+/* 索引の仕様（v2 の spec セクション。無い索引は既定 = 15 文字・k=3・A–J・全ペア・左右） */
+typedef struct {
+    uint32_t keyword_len;
+    uint32_t max_k;        /* この索引で引ける最大の k */
+    uint32_t alphabet;
+    uint32_t h_pair_mask;  /* 格納した Case A の群 = cf_schemes[h_scheme].cover[max_k] */
+    uint32_t d_sides;      /* 格納した削除キー = cf_del_sides[max_k] */
+    uint32_t h_scheme;     /* CF_SCHEME_*（古い索引は 0 = pairs） */
+} CaseFilterSpec;
 
 typedef struct PostingH {
     char key[6];
@@ -32,12 +116,97 @@ typedef struct PostingDel {
     struct PostingDel *next;
 } PostingDel;
 
+/*
+ * キーワード id の幅。idpos は id | del_pos << id_bits の 32bit 詰め。
+ *   narrow: id 20bit（≤ 2^20 件）。v1 は id を 3 バイトで書く
+ *   wide:   id 28bit（≤ 2^28 件）。v1 は 4 バイト。keyword_count が narrow を超えると自動で選ぶ
+ * 実行時の idpos はどちらも 4 バイトなので、探索側の差は id マスクが変数になるだけ。
+ */
+#define CASEFILTER_NARROW_ID_BITS 20
+#define CASEFILTER_WIDE_ID_BITS 28
+#define CASEFILTER_NARROW_ID_LIMIT (1 << CASEFILTER_NARROW_ID_BITS)
+#define CASEFILTER_MAX_KEYWORDS (1 << CASEFILTER_WIDE_ID_BITS)
+
+/*
+ * 詰めたポスティング（--packed-postings, v2 のみ）: id を w = cf_pack_bits(keyword_count) bit ずつ、
+ * i 番目を bit i*w からリトルエンディアンで並べる（db_1 なら 20bit、H 10M 件で 40MB → 25MB）。
+ * 値は 8 バイト読み 1 回とシフトで取り出せるので、リスト先頭へ直に飛べる（offsets はエントリ単位のまま）。
+ * 8 件はちょうど w バイトなので、リスト内の 8 件組はどれも先頭の bit 位置 & 7（phase）が同じになる。
+ * ベクトル版は phase ごとの表（PackLut）で 16 バイト読み 2 回 + pshufb + シフトにより 8 件をまとめて戻す。
+ * 8 件組は組の先頭から 30 バイトまで読むので、列の末尾に CF_PACK_PAD バイトの余白を置く。
+ * D の del_pos は 4bit で別の列に詰める。探索は id しか読まないので、走査で触るのは id の列だけ。
+ */
+#define CF_PACK_PAD 32
+#define CF_DPOS_BITS 4
+#define CF_PACK_SHUF_BITS 25  /* 8 件組の 4 バイト窓に phase 込みで収まる幅の上限（それより広ければ gather） */
+#define CF_PACKED_BYTES(n, bits) (((uint64_t)(n) * (uint64_t)(bits) + 7) / 8 + CF_PACK_PAD)
+
+static inline int cf_pack_bits(int keyword_count) {
+    int b = 1;
+    while ((1u << b) < (uint32_t)keyword_count) ++b;
+    return b;
+}
+
+typedef struct {
+    int bits;               /* 0 なら詰めていない */
+    uint8_t hi[8];          /* [phase] 後半 4 件を読む位置（組の先頭からのバイト数） */
+    uint8_t ctl[8][32];     /* [phase] pshufb: 件 j の 4 バイト窓（前半 4 件は下位 128bit、後半は上位） */
+    uint32_t shift[8][8];   /* [phase] 窓の中での件 j の bit 位置 */
+} PackLut;
+
+static void pack_lut_init(PackLut *lut, int bits) {
+    memset(lut, 0, sizeof(*lut));
+    lut->bits = bits;
+    for (int ph = 0; ph < 8; ++ph) {
+        lut->hi[ph] = (uint8_t)((ph + 4 * bits) >> 3);
+        for (int j = 0; j < 8; ++j) {
+            int s = ph + j * bits - (j < 4 ? 0 : 8 * lut->hi[ph]);
+            for (int t = 0; t < 4; ++t) lut->ctl[ph][j * 4 + t] = (uint8_t)((s >> 3) + t);
+            lut->shift[ph][j] = (uint32_t)(s & 7);
+        }
+    }
+}
+
+/*
+ * 疎スロットディレクトリ（--sparse-dir）: 密な offsets[slots+1] の代わりに、連続する per 個のスロットを
+ * 64B のレコード 1 本にまとめる。cum[j] は群先頭からスロット j 末尾までの累積件数の下位 width bit、
+ * wrap の bit j はスロット j でその累積が 2^width を跨いだこと。1 スロットの件数が 2^width 未満なら
+ *   末尾(j) = cum[j] + (popcount(wrap[0..j]) << width)
+ * で復元でき、(start, len) は 1 ラインの読みと popcount だけで出る（総和ループなし）。
+ *   width 4: 96 スロット/レコード（約 0.67B/slot）、width 8: 48 スロット/レコード（約 1.33B/slot）
+ * width は索引ごとに小さくなる方を prep が選ぶ。件数が収まらない群は start の最上位 bit を立て、
+ * 下位 31bit を ovf 内の位置として ovf[pos..pos+per] に正確な offsets を置く。
+ */
+#define SDIR_CUM_BYTES 48
+#define SDIR_EXACT 0x80000000u
+
+typedef struct {
+    uint32_t start;               /* 群の先頭オフセット、または SDIR_EXACT | ovf 位置 */
+    uint32_t wrap[3];             /* 96bit: スロット j で累積が 2^width を跨いだら bit j */
+    uint8_t cum[SDIR_CUM_BYTES];  /* 累積件数の下位 width bit（width 4 なら下位 nibble が偶数スロット） */
+} SlotDirRec;
+
+typedef struct {
+    SlotDirRec *rec;   /* [groups]（NULL なら密 offsets を使う） */
+    uint32_t *ovf;     /* [ovf_words] */
+    size_t ovf_words;
+    int width;         /* 4 or 8 */
+    int per;           /* SDIR_CUM_BYTES * 8 / width */
+    uint32_t total;    /* 総ポスティング数 */
+} SlotDir;
+
+#define SDIR_GROUPS(slots, per) (((size_t)(slots) + (size_t)(per) - 1) / (size_t)(per))
+
 typedef struct {
     int key_space;
     int pair_count;
     int *offsets;
     uint32_t *counts;
     int *ids;
+    uint64_t *occ;  /* スロット占有ビットマップ（1bit/slot, 約1.25MB）: 空スロットで offsets を引かない */
+    uint64_t *fat;  /* fat postings: ids の代わりに codes[id] をポスティング順に並べたもの（NULL なら通常） */
+    uint8_t *pids;  /* 詰めたポスティング: ids の代わりに id を pack.bits bit ずつ並べたもの */
+    SlotDir sdir;
 } HIndex;
 
 typedef struct {
@@ -45,6 +214,12 @@ typedef struct {
     int *offsets;
     uint32_t *counts;
     uint32_t *idpos;
+    uint8_t *pids;  /* 詰めたポスティング: idpos の代わりに id 部だけを並べたもの */
+    uint64_t *occ;
+    SlotDir sdir;
+    int id_bits;       /* CASEFILTER_NARROW_ID_BITS / CASEFILTER_WIDE_ID_BITS */
+    uint32_t id_mask;  /* (1 << id_bits) - 1 */
+    int sig;           /* idpos の上位 8bit が近傍署名（--neighbour-sig、narrow のみ） */
 } DelIndex;
 
 typedef struct CaseFilterIndex {
@@ -54,12 +229,253 @@ typedef struct CaseFilterIndex {
     uint64_t *codes;
     HIndex hidx;
     DelIndex del7;
+    PackLut pack;     /* hidx.pids / del7.pids の幅と取り出し表（詰めていなければ bits = 0） */
+    void *map_base;   /* v2: mmap領域（NULLなら各配列はヒープ所有） */
+    size_t map_size;
+    const uint64_t *exact;          /* 完全一致の集合 [exact_cap]（v2 の --exact-set。NULL なら段階探索なし） */
+    uint32_t exact_cap;
+    struct CaseFilterDelta *delta;  /* 追加分（casefilter_delta_insert。NULL なら無し） */
+    uint64_t *tomb;                 /* 削除済み base id の bitmap（NULL なら削除無し） */
+    uint64_t *dead_codes;           /* 削除済み base キーワードの code 集合（fat postings 用, 空きは ~0） */
+    int dead_cap;
+    int dead_count;
+    CaseFilterSpec spec;
+    struct CaseFilterLoad *load;    /* v1 の並列ロードが D を組み立て中（casefilter_load_async。NULL なら完成済み） */
+    struct CaseFilterCache *cache;  /* クエリ結果の cache（casefilter_cache_attach。NULL なら無し） */
 } CaseFilterIndex;
 
 CaseFilterIndex *casefilter_deserialize(FILE *in);
+CaseFilterIndex *casefilter_map_v2(int fd);
+CaseFilterIndex *casefilter_load(const char *path);
+/* codes と HIndex が揃った時点で返す。v1 の DelIndex は threads 本の裏スレッドが組み続ける（v2 は写像するだけ） */
+CaseFilterIndex *casefilter_load_async(const char *path, int threads);
+/* 裏の組み立てを手伝って終わるまで待つ。失敗していれば 0（索引は casefilter_free するだけ） */
+int casefilter_load_wait(CaseFilterIndex *idx);
+/* 探索の計数: -DCASEFILTER_STATS でビルドしたときだけ ctx に積む（無効なら計数のコードも ctx のメンバも消える） */
+#define CF_STAT_BUCKETS 20  /* 1 クエリの仕事量（引いたスロット + 候補）の log2 ヒストグラム */
+enum { CF_PHASE_EXACT, CF_PHASE_TIER1, CF_PHASE_A, CF_PHASE_B, CF_PHASE_DELTA, CF_PHASES };
+
+typedef struct {
+    uint64_t queries;
+    uint64_t hits;
+    uint64_t h_probe, h_empty;  /* Case A のディレクトリを引いたスロット / そのうち空 */
+    uint64_t d_probe, d_empty;
+    uint64_t cand_a, cand_b, cand_delta;  /* 検証した候補（リスト長の和） */
+    uint64_t cand_b_sig;                  /* cand_b のうち近傍署名を通って codes を読んだもの */
+    uint64_t hit_phase[CF_PHASES];
+    uint64_t hit_pair[CASEFILTER_HPAIR_COUNT];  /* tier1 / Case A で当たったペア（分割方式の群） */
+    uint64_t scheme_queries[CF_SCHEMES];        /* 分割方式ごとのクエリ数（hit_pair の見出しに使う） */
+    uint64_t hit_dpos[KEYWORD_LEN];             /* Case B で当たったキーを作った削除位置（共有キーは最初の位置） */
+    uint64_t work_hist[2][CF_STAT_BUCKETS];     /* [0] 外れ / [1] ヒット */
+    uint64_t cache_lookups, cache_hits;         /* 結果 cache を引いたクエリ / そのうち cache が答えた数 */
+    uint64_t cache_folded;                      /* 同じ組の前のクエリと同じ code で、探さずに結果を写した数 */
+} CaseFilterStats;
+
+/* 探索用スクラッチ（visited世代カウンタ）。スレッドごとに1つ持てば casefilter_search_ctx は再入可能 */
+typedef struct {
+    uint32_t *visited;
+    int cap;
+    uint32_t gen;
+#ifdef CASEFILTER_STATS
+    CaseFilterStats stats;
+#endif
+} CaseFilterSearchCtx;
+
+CaseFilterSearchCtx *casefilter_ctx_create(const CaseFilterIndex *idx);
+void casefilter_ctx_free(CaseFilterSearchCtx *ctx);
+int casefilter_ctx_stats(const CaseFilterSearchCtx *ctx, CaseFilterStats *sum);
+void casefilter_stats_print(const CaseFilterStats *st, FILE *out);
+int casefilter_search_ctx(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, const char *query, int k);
 int casefilter_search(const CaseFilterIndex *idx, const char *query, int k);
+void casefilter_search_batch(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx,
+                             const char (*queries)[KEYWORD_LEN + 1], int n, int k, uint8_t *hits);
+/* pack_keyword 済みのクエリで探す。CASEFILTER_NO_QUERY は外れ */
+#define CASEFILTER_NO_QUERY UINT64_MAX
+/* casefilter_load_async の索引で DelIndex がまだ無いとき、Case A で外れたクエリの hits はこれになる */
+#define CASEFILTER_DEFERRED 2
+void casefilter_search_codes(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, const uint64_t *codes, int n, int k,
+                             uint8_t *hits);
+/* CASEFILTER_DEFERRED だったクエリの残り（Case B と delta）。DelIndex が揃うまで待つ */
+void casefilter_search_deferred(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, const uint64_t *codes, int n,
+                                int k, uint8_t *hits);
+int casefilter_parse_queries(const char *buf, size_t len, uint64_t **codes);
+int casefilter_delta_insert(CaseFilterIndex *idx, const char *word);
+int casefilter_delta_delete(CaseFilterIndex *idx, const char *word);
+int casefilter_delta_apply(CaseFilterIndex *idx, FILE *log);
+CaseFilterIndex *casefilter_merge(const CaseFilterIndex *idx);
+/* prep を通さずに heap の索引を組む（join 用）。insert は長さの違う語・満杯で 0、finalize は prep の
+ * 密 offsets・pairs と同じ CSR を作る（失敗なら 0）。spec は finalize 前に変えてよい */
+CaseFilterIndex *casefilter_create(int capacity);
+int casefilter_insert(CaseFilterIndex *idx, const char *word);
+int casefilter_insert_code(CaseFilterIndex *idx, uint64_t code);
+int casefilter_finalize(CaseFilterIndex *idx);
+/* 逆向きの探索: codes の各語から距離 k 以内にある索引の全キーワード id の bit を marks に立てる（1 件目で止めない）。
+ * pairs で fat・delta の無い索引だけ（それ以外は何もせず 0） */
+int casefilter_mark_codes(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, const uint64_t *codes, int n, int k,
+                          uint64_t *marks);
+/* クエリ結果の cache: code → 0/1（作ったときの k だけ）。entries は 8 の倍数の 2 冪に切り上げ、8 件の組ごとの CLOCK で
+ * 追い出す。attach した索引が所有して casefilter_free で解放し、delta を変えると空にする。スレッド間で共有してよい */
+typedef struct CaseFilterCache CaseFilterCache;
+CaseFilterCache *casefilter_cache_create(size_t entries, int k);
+void casefilter_cache_attach(CaseFilterIndex *idx, CaseFilterCache *cache);
+void casefilter_cache_clear(CaseFilterCache *cache);
+void casefilter_cache_free(CaseFilterCache *cache);
+/* base + delta を持つ索引を共有し、merge を別スレッドで回して差し替える */
+typedef struct CaseFilterLive CaseFilterLive;
+CaseFilterLive *casefilter_live_create(CaseFilterIndex *idx);
+const CaseFilterIndex *casefilter_live_acquire(CaseFilterLive *lv);
+void casefilter_live_release(CaseFilterLive *lv);
+int casefilter_live_insert(CaseFilterLive *lv, const char *word);
+int casefilter_live_delete(CaseFilterLive *lv, const char *word);
+int casefilter_live_merge_async(CaseFilterLive *lv);
+int casefilter_live_merge_wait(CaseFilterLive *lv);
+int casefilter_live_swap(CaseFilterLive *lv, CaseFilterIndex *idx);
+void casefilter_live_free(CaseFilterLive *lv);
+int casefilter_select_kernel(const char *name);
+const char *casefilter_kernel_name(void);
+int casefilter_select_planner(const char *name);
+int casefilter_set_hugepages(const char *mode);
+int casefilter_set_numa(const char *mode);
+int casefilter_numa_nodes(void);
+int casefilter_numa_pin(int node);
+CaseFilterIndex *casefilter_replicate(const CaseFilterIndex *idx, int node);
 void casefilter_free(CaseFilterIndex *idx);
 
+/* v2形式: ヘッダ + セクション表 + ALIGN境界に揃えた実行時配列をそのまま格納（mmapで即利用可） */
+#define CASEFILTER_V2_MAGIC "CFIDXv2"
+#define CASEFILTER_V2_VERSION 2u
+#define CASEFILTER_V2_ALIGN 4096u
+#define CASEFILTER_V2_MAX_SECTIONS 16
+
+enum {
+    CF_SEC_CODES = 1,      /* uint64_t[keyword_count] */
+    CF_SEC_H_OFFSETS = 2,  /* int32_t[h_slots + 1] */
+    CF_SEC_H_IDS = 3,      /* int32_t[h_total] */
+    CF_SEC_D_OFFSETS = 4,  /* int32_t[del_key_space + 1] */
+    CF_SEC_D_IDPOS = 5,    /* uint32_t[d_total] (id20bit | del_pos<<20) */
+    CF_SEC_H_OCC = 6,      /* uint64_t[(h_slots + 63) / 64] */
+    CF_SEC_D_OCC = 7,      /* uint64_t[(del_key_space + 63) / 64] */
+    CF_SEC_H_FAT = 8,      /* uint64_t[h_total]: fat postings（H_IDS の代わり） */
+    CF_SEC_H_DIR_META = 9, /* uint32_t[2] = {width, total}: 疎ディレクトリ（H_OFFSETS の代わり） */
+    CF_SEC_H_DIR = 10,     /* SlotDirRec[groups] */
+    CF_SEC_H_DIR_OVF = 11, /* uint32_t[ovf_words] */
+    CF_SEC_D_DIR_META = 12,
+    CF_SEC_D_DIR = 13,
+    CF_SEC_D_DIR_OVF = 14,
+    CF_SEC_D_IDPOS_WIDE = 15, /* uint32_t[d_total] (id28bit | del_pos<<28)（D_IDPOS の代わり） */
+    CF_SEC_EXACT = 16,        /* uint64_t[2^m]: codes の開番地ハッシュ集合（--exact-set。空きは ~0） */
+    CF_SEC_SPEC = 17,         /* uint32_t[6]: CaseFilterSpec（無ければ既定の仕様） */
+    CF_SEC_H_IDS_PACKED = 18, /* uint8_t[CF_PACKED_BYTES(h_total, w)]: 詰めた id（H_IDS の代わり） */
+    CF_SEC_D_IDS_PACKED = 19, /* uint8_t[CF_PACKED_BYTES(d_total, w)]: 詰めた id（D_IDPOS の代わり） */
+    CF_SEC_D_POS_PACKED = 20, /* uint8_t[CF_PACKED_BYTES(d_total, 4)]: del_pos（探索では読まない） */
+    CF_SEC_D_IDPOS_SIG = 21   /* uint32_t[d_total] (id20bit | del_pos<<20 | 署名<<24)（D_IDPOS の代わり） */
+};
+
+static inline CaseFilterSpec casefilter_spec_for(int max_k, int scheme) {
+    CaseFilterSpec sp = {KEYWORD_LEN, (uint32_t)max_k, CASEFILTER_ALPHABET, cf_schemes[scheme].cover[max_k],
+                         cf_del_sides[max_k], (uint32_t)scheme};
+    return sp;
+}
+
+#define CF_SCHEME(idx) (&cf_schemes[(idx)->spec.h_scheme])
+
+#define OCC_WORDS(slots) (((size_t)(slots) + 63) / 64)
+
+static inline int occ_test(const uint64_t *occ, uint32_t slot) {
+    return (int)((occ[slot >> 6] >> (slot & 63)) & 1u);
+}
+
+/* 64bit範囲内でのビット並列popcount（HAKMEM法） */
+static inline int popcount64(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+}
+
+/* wrap の bit [0, j) の数 */
+static inline uint32_t sdir_wraps(const SlotDirRec *r, uint32_t j) {
+    uint64_t w0 = r->wrap[0] | (uint64_t)r->wrap[1] << 32;
+    if (j < 64) return (uint32_t)popcount64(w0 & ((1ULL << j) - 1));
+    return (uint32_t)(popcount64(w0) + popcount64(r->wrap[2] & ((1ULL << (j - 64)) - 1)));
+}
+
+static inline uint32_t sdir_cum(const SlotDirRec *r, uint32_t j, int width) {
+    if (width == 8) return r->cum[j];
+    return (r->cum[j >> 1] >> ((j & 1) * 4)) & 0xFu;
+}
+
+static inline int sdir_range(const SlotDirRec *r, const uint32_t *ovf, uint32_t j, int width, int *start) {
+    if (r->start & SDIR_EXACT) {
+        const uint32_t *e = ovf + (r->start & ~SDIR_EXACT) + j;
+        *start = (int)e[0];
+        return (int)(e[1] - e[0]);
+    }
+    uint32_t hi = sdir_wraps(r, j);
+    uint32_t s = j ? sdir_cum(r, j - 1, width) + (hi << width) : 0;
+    uint32_t e = sdir_cum(r, j, width) + ((hi + ((r->wrap[j >> 5] >> (j & 31)) & 1u)) << width);
+    *start = (int)(r->start + s);
+    return (int)(e - s);
+}
+
+/* slot の (start, len) を引く。offsets が NULL なら疎ディレクトリ（per は定数除算にするため分岐） */
+static inline int slot_range(const int *offsets, const SlotDir *sd, uint32_t slot, int *start) {
+    if (offsets) {
+        *start = offsets[slot];
+        return offsets[slot + 1] - *start;
+    }
+    if (sd->width == 4) {
+        return sdir_range(&sd->rec[slot / (SDIR_CUM_BYTES * 2)], sd->ovf, slot % (SDIR_CUM_BYTES * 2), 4, start);
+    }
+    return sdir_range(&sd->rec[slot / SDIR_CUM_BYTES], sd->ovf, slot % SDIR_CUM_BYTES, 8, start);
+}
+
+/* 詰めた列の i 番目（bits <= 28 なので 8 バイト読みに収まる） */
+static inline uint32_t packed_get(const uint8_t *p, int bits, size_t i) {
+    uint64_t pos = (uint64_t)i * (uint64_t)bits, w;
+    memcpy(&w, p + (pos >> 3), sizeof(w));
+    return (uint32_t)(w >> (pos & 7)) & ((1u << bits) - 1);
+}
+
+/* ポスティング i 番目の id（H は ids / 詰めた列、D は idpos / 詰めた列。fat の H には id が無い） */
+static inline int h_id(const CaseFilterIndex *idx, int i) {
+    return idx->hidx.pids ? (int)packed_get(idx->hidx.pids, idx->pack.bits, (size_t)i) : idx->hidx.ids[i];
+}
+
+static inline int d_id(const CaseFilterIndex *idx, int i) {
+    return idx->del7.pids ? (int)packed_get(idx->del7.pids, idx->pack.bits, (size_t)i)
+                          : (int)(idx->del7.idpos[i] & idx->del7.id_mask);
+}
+
+/* ポスティング i 番目が載っているバイト（先読み用） */
+static inline const void *h_vals_at(const CaseFilterIndex *idx, int i) {
+    if (idx->hidx.fat) return idx->hidx.fat + i;
+    if (idx->hidx.pids) return idx->hidx.pids + (((uint64_t)i * (uint64_t)idx->pack.bits) >> 3);
+    return idx->hidx.ids + i;
+}
+
+static inline const void *d_vals_at(const CaseFilterIndex *idx, int i) {
+    if (idx->del7.pids) return idx->del7.pids + (((uint64_t)i * (uint64_t)idx->pack.bits) >> 3);
+    return idx->del7.idpos + i;
+}
+
+typedef struct {
+    uint32_t id;
+    uint32_t elem_size;
+    uint64_t offset;  /* ファイル先頭からのバイト位置（ALIGN境界） */
+    uint64_t count;   /* 要素数 */
+} CaseFilterV2Section;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    int32_t keyword_count;
+    int32_t h_key_space;
+    int32_t h_pair_count;
+    int32_t del_key_space;
+} CaseFilterV2Header;
+
 static inline uint64_t casefilter_pack_delete(uint64_t code, int del_pos) {
     uint64_t low_mask = (del_pos == 0) ? 0 : ((1ULL << (del_pos * 4)) - 1ULL);
     uint64_t lower = code & low_mask;
@@ -67,34 +483,354 @@ static inline uint64_t casefilter_pack_delete(uint64_t code, int del_pos) {
     return lower | (upper << (del_pos * 4));
 }
 
+/*
+ * 近傍署名（prep --neighbour-sig）: narrow の idpos の空いた上位 8bit に、そのポスティングを作った削除後
+ * 14 文字のうちキーでない側の 7 文字の署名がある（3 / 2 / 2 文字の欄のハッシュを 3 / 3 / 2 bit）。
+ * キー側が一致していれば、反対側の置換が max_sub = 1 個以内のとき少なくとも 2 欄、0 個なら 3 欄とも一致する。
+ * 探索は dslot ごとに通り得る署名の表（256bit）を作り、表に無いポスティングは codes を読まずに落とす。
+ */
+#define CF_DSIG_SHIFT 24
+
+static inline uint32_t cf_dsig(uint64_t half) {
+    uint32_t a = (uint32_t)(half & 0xFFF) * 0x9E3779B1u >> 29;
+    uint32_t b = (uint32_t)(half >> 12 & 0xFF) * 0x9E3779B1u >> 29;
+    uint32_t c = (uint32_t)(half >> 20 & 0xFF) * 0x9E3779B1u >> 30;
+    return a | b << 3 | c << 6;
+}
+
+/* 削除位置 pos、side 0（左7がキー）なら右7、1 なら左7の署名 */
+static inline uint32_t cf_dsig_at(uint64_t code, int pos, int side) {
+    uint64_t d = casefilter_pack_delete(code, pos);
+    return cf_dsig(side ? d & 0xFFFFFFF : d >> 28 & 0xFFFFFFF);
+}
+
+/* 受理表 acc（256bit、bit 位置 = 署名）に idpos の署名があるか */
+static inline int dsig_pass(const uint64_t acc[4], uint32_t idpos) {
+    uint32_t s = idpos >> CF_DSIG_SHIFT;
+    return (int)(acc[s >> 6] >> (s & 63) & 1);
+}
+
+/* ===== 索引配列の確保（huge page / NUMA） =====
+ * offsets / ids / idpos / codes / occ は 100MB 超をランダムに引くので、4KB ページだとほぼ毎回 dTLB を外す。
+ * 大きな配列は cf_array_alloc で確保し、方針に応じて匿名 mmap にする:
+ *   --hugepages thp: 2MB 境界に揃えて madvise(MADV_HUGEPAGE)（THP が無効ならただの 4KB ページ）
+ *   --hugepages 2m / 1g: MAP_HUGETLB（予約が無ければ 1g → 2m → thp の順に落とす。1g は 256MB 以上の配列だけ）
+ *   --numa interleave: mbind(MPOL_INTERLEAVE) で全ノードに散らす
+ *   --numa replicate: casefilter_replicate がノードごとに複製を作る（その間は MPOL_PREFERRED でノードに寄せる）
+ * 方針が off なら malloc のまま。mmap した配列は cf_arrays に登録し、cf_array_free が munmap / free を選ぶ。
+ * v2 のファイル写像は huge page にならないので、方針が有効なら探索で引く配列を確保した領域へ写してから閉じる。
+ */
+enum { CF_HUGE_OFF, CF_HUGE_THP, CF_HUGE_2M, CF_HUGE_1G };
+enum { CF_NUMA_OFF, CF_NUMA_INTERLEAVE, CF_NUMA_REPLICATE };
+
+#define CF_HUGE_2M_BYTES ((size_t)2 << 20)
+#define CF_HUGE_1G_BYTES ((size_t)1 << 30)
+#define CF_HUGE_1G_MIN ((size_t)256 << 20)  /* これ未満の配列に 1GB ページは無駄が大きい */
+#define CF_ARRAY_MIN_BYTES CF_HUGE_2M_BYTES  /* これ未満は常に malloc */
+#define CF_NUMA_MAX_NODES 64
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define CF_MPOL_PREFERRED 1  /* <numaif.h>（libnuma）に頼らず mbind を直に呼ぶ */
+#define CF_MPOL_INTERLEAVE 3
+
+static int huge_policy = CF_HUGE_OFF;
+static int numa_policy = CF_NUMA_OFF;
+static __thread int cf_bind_node = -1;  /* casefilter_replicate の間だけ複製先ノード */
+
+typedef struct CfArray {
+    void *p;
+    size_t len;  /* munmap する長さ */
+    struct CfArray *next;
+} CfArray;
+
+static CfArray *cf_arrays;
+static pthread_mutex_t cf_arrays_mu = PTHREAD_MUTEX_INITIALIZER;
+
+int casefilter_set_hugepages(const char *mode) {
+    int p;
+    if (strcmp(mode, "off") == 0) p = CF_HUGE_OFF;
+    else if (strcmp(mode, "thp") == 0) p = CF_HUGE_THP;
+    else if (strcmp(mode, "2m") == 0) p = CF_HUGE_2M;
+    else if (strcmp(mode, "1g") == 0) p = CF_HUGE_1G;
+    else return 0;
+#ifndef __linux__
+    if (p != CF_HUGE_OFF) return 0;
+#endif
+    huge_policy = p;
+    return 1;
+}
+
+int casefilter_set_numa(const char *mode) {
+    int p;
+    if (strcmp(mode, "off") == 0) p = CF_NUMA_OFF;
+    else if (strcmp(mode, "interleave") == 0) p = CF_NUMA_INTERLEAVE;
+    else if (strcmp(mode, "replicate") == 0) p = CF_NUMA_REPLICATE;
+    else return 0;
+#ifndef __linux__
+    if (p != CF_NUMA_OFF) return 0;
+#endif
+    numa_policy = p;
+    return 1;
+}
+
+/* cpulist / online 形式（"0-3,8,10-11"）を読み、各番号 i < max で fn(i) を呼ぶ。読めなければ 0 */
+static int read_id_list(const char *path, int max, void (*fn)(int i, void *arg), void *arg) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    char buf[4096];
+    int ok = fgets(buf, sizeof(buf), f) != NULL;
+    fclose(f);
+    for (char *p = buf; ok && *p && *p != '\n';) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p) break;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        for (long i = lo; i <= hi && i < max; ++i) fn((int)i, arg);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return ok;
+}
+
+static void add_node_bit(int i, void *arg) {
+    ((uint64_t *)arg)[0] |= 1ULL << i;
+}
+
+/* オンラインのノード集合（読めない環境では node 0 だけ） */
+static uint64_t numa_node_mask(void) {
+    uint64_t mask = 0;
+    if (!read_id_list("/sys/devices/system/node/online", CF_NUMA_MAX_NODES, add_node_bit, &mask) || !mask) mask = 1;
+    return mask;
+}
+
+int casefilter_numa_nodes(void) {
+    return popcount64(numa_node_mask());
+}
+
+static void add_cpu(int i, void *arg) {
+    CPU_SET(i, (cpu_set_t *)arg);
+}
+
+/* 呼び出しスレッドを node 番目（オンラインのノードを小さい順に数える）のノードの CPU に留める */
+int casefilter_numa_pin(int node) {
+#ifdef __linux__
+    uint64_t mask = numa_node_mask();
+    for (int id = 0; id < CF_NUMA_MAX_NODES; ++id) {
+        if (!((mask >> id) & 1) || node-- > 0) continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (!read_id_list(path, CPU_SETSIZE, add_cpu, &set) || CPU_COUNT(&set) == 0) return 0;
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+#else
+    (void)node;
+#endif
+    return 0;
+}
+
+#ifdef __linux__
+/* 2 の冪 a に揃えた len バイトの匿名領域（前後の余りは返す） */
+static void *map_aligned(size_t len, size_t a) {
+    unsigned char *raw = (unsigned char *)mmap(NULL, len + a, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == (unsigned char *)MAP_FAILED) return NULL;
+    unsigned char *p = (unsigned char *)(((uintptr_t)raw + a - 1) & ~(uintptr_t)(a - 1));
+    if (p > raw) munmap(raw, (size_t)(p - raw));
+    if (p + len < raw + len + a) munmap(p + len, (size_t)(raw + len + a - (p + len)));
+    return p;
+}
+
+static void *map_hugetlb(size_t len, int shift) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* 初めて触る前に方針を付ける。失敗しても既定の配置で動くので無視する */
+static void place_pages(void *p, size_t len) {
+    uint64_t mask;
+    int mode;
+    if (cf_bind_node >= 0) {
+        mask = 0;
+        uint64_t online = numa_node_mask();
+        for (int id = 0, k = cf_bind_node; id < CF_NUMA_MAX_NODES; ++id) {
+            if (((online >> id) & 1) && k-- == 0) mask = 1ULL << id;
+        }
+        mode = CF_MPOL_PREFERRED;
+    } else if (numa_policy == CF_NUMA_INTERLEAVE) {
+        mask = numa_node_mask();
+        mode = CF_MPOL_INTERLEAVE;
+    } else {
+        return;
+    }
+    if (!mask || (mode == CF_MPOL_INTERLEAVE && popcount64(mask) < 2)) return;
+    (void)syscall(SYS_mbind, p, len, mode, &mask, (unsigned long)CF_NUMA_MAX_NODES + 1, 0);
+}
+
+static void huge_fallback_warn(const char *what) {
+    static int warned;
+    if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "hugepages: %s ページの予約が足りないので小さいページに落とします\n", what);
+    }
+}
+
+/* 方針どおりの匿名領域。*maplen に munmap する長さを返す（NULL なら方針なし・失敗で malloc に任せる） */
+static void *cf_map_array(size_t bytes, size_t *maplen) {
+    int numa = cf_bind_node >= 0 || numa_policy == CF_NUMA_INTERLEAVE;
+    if (bytes < CF_ARRAY_MIN_BYTES || (huge_policy == CF_HUGE_OFF && !numa)) return NULL;
+    void *p = NULL;
+    size_t len = 0;
+    if (huge_policy == CF_HUGE_1G && bytes >= CF_HUGE_1G_MIN) {
+        len = (bytes + CF_HUGE_1G_BYTES - 1) & ~(CF_HUGE_1G_BYTES - 1);
+        if (!(p = map_hugetlb(len, 30))) huge_fallback_warn("1GB");
+    }
+    if (!p && huge_policy >= CF_HUGE_2M) {
+        len = (bytes + CF_HUGE_2M_BYTES - 1) & ~(CF_HUGE_2M_BYTES - 1);
+        if (!(p = map_hugetlb(len, 21))) huge_fallback_warn("2MB");
+    }
+    if (!p) {
+        len = (bytes + CF_HUGE_2M_BYTES - 1) & ~(CF_HUGE_2M_BYTES - 1);
+        if (!(p = map_aligned(len, CF_HUGE_2M_BYTES))) return NULL;
+        if (huge_policy != CF_HUGE_OFF) madvise(p, len, MADV_HUGEPAGE);
+    }
+    place_pages(p, len);
+    *maplen = len;
+    return p;
+}
+#endif
+
+/* 大きな索引配列の確保。zero なら 0 埋め（匿名 mmap は最初から 0） */
+static void *cf_array_alloc(size_t bytes, int zero) {
+#ifdef __linux__
+    size_t len = 0;
+    void *p = cf_map_array(bytes, &len);
+    if (p) {
+        CfArray *a = (CfArray *)malloc(sizeof(CfArray));
+        if (!a) {
+            munmap(p, len);
+            return NULL;
+        }
+        a->p = p;
+        a->len = len;
+        pthread_mutex_lock(&cf_arrays_mu);
+        a->next = cf_arrays;
+        cf_arrays = a;
+        pthread_mutex_unlock(&cf_arrays_mu);
+        return p;
+    }
+#endif
+    return zero ? calloc(bytes ? bytes : 1, 1) : malloc(bytes ? bytes : 1);
+}
+
+static void cf_array_free(void *p) {
+    if (!p) return;
+    pthread_mutex_lock(&cf_arrays_mu);
+    for (CfArray **pp = &cf_arrays; *pp; pp = &(*pp)->next) {
+        CfArray *a = *pp;
+        if (a->p != p) continue;
+        *pp = a->next;
+        pthread_mutex_unlock(&cf_arrays_mu);
+        munmap(a->p, a->len);
+        free(a);
+        return;
+    }
+    pthread_mutex_unlock(&cf_arrays_mu);
+    free(p);
+}
+
 /* ===== build.c のデシリアライズ部分 ===== */
 static int fread_exact(void *dst, size_t size, size_t n, FILE *in) {
     return fread(dst, size, n, in) == n;
 }
 
+/* offsets から占有ビットマップを起こす（v1 と occ セクションの無い v2 用） */
+static uint64_t *occ_from_offsets(const int *offsets, int slots) {
+    uint64_t *occ = (uint64_t *)cf_array_alloc(OCC_WORDS(slots) * sizeof(uint64_t), 1);
+    if (!occ) return NULL;
+    for (int i = 0; i < slots; ++i) {
+        if (offsets[i + 1] > offsets[i]) occ[i >> 6] |= 1ULL << (i & 63);
+    }
+    return occ;
+}
+
+/* v1 の id 列: narrow は 3 バイト、wide は 4 バイトのリトルエンディアン。
+ * 3 バイトは 4 バイト読んで上を落とす（最後の 1 件だけは列の外を読まないようバイトで組む） */
+static void decode_ids(uint32_t *dst, const unsigned char *src, int n, int bytes) {
+    if (n <= 0) return;
+    if (bytes == 4) {
+        memcpy(dst, src, sizeof(uint32_t) * (size_t)n);
+        return;
+    }
+    for (int i = 0; i < n - 1; ++i) {
+        uint32_t v;
+        memcpy(&v, src + (size_t)i * 3, sizeof(v));
+        dst[i] = v & 0xFFFFFF;
+    }
+    const unsigned char *p = src + (size_t)(n - 1) * 3;
+    dst[n - 1] = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+
+static int read_ids(uint32_t *dst, int n, int bytes, FILE *in) {
+    unsigned char buf[3 << 14];  /* 3 と 4 の公倍数 */
+    int per = (int)sizeof(buf) / bytes;
+    for (int i = 0; i < n; i += per) {
+        int m = n - i < per ? n - i : per;
+        if (fread(buf, (size_t)bytes, (size_t)m, in) != (size_t)m) return 0;
+        decode_ids(dst + i, buf, m, bytes);
+    }
+    return 1;
+}
+
+/* v1 の keywords 列の 1 件（15 文字 + NUL）を 60bit コードに */
+static inline uint64_t v1_keyword_code(const char *w) {
+    uint64_t code = 0;
+    for (int j = 0; j < KEYWORD_LEN; ++j) code |= ((uint64_t)(w[j] - 'A') & 0xF) << (j * 4);
+    return code;
+}
+
+static void set_id_bits(DelIndex *d, int bits) {
+    d->id_bits = bits;
+    d->id_mask = (1u << bits) - 1;
+}
+
+/* 入力は信頼しない: 復号した v1 の id が keyword_count 未満か。pos_bits > 0（DelIndex）なら
+ * 上に載った削除位置も KEYWORD_LEN 未満か検査する（v2 の casefilter_map_v2 と同じ条件） */
+static int v1_ids_valid(const uint32_t *v, int n, int keyword_count, int pos_bits) {
+    uint32_t mask = pos_bits ? (1u << pos_bits) - 1 : ~0u;
+    for (int i = 0; i < n; ++i) {
+        if ((v[i] & mask) >= (uint32_t)keyword_count || (pos_bits && (v[i] >> pos_bits) >= KEYWORD_LEN)) return 0;
+    }
+    return 1;
+}
+
 CaseFilterIndex *casefilter_deserialize(FILE *in) {
     if (!in) return NULL;
     CaseFilterIndex *idx = (CaseFilterIndex *)calloc(1, sizeof(CaseFilterIndex));
-    if (!fread_exact(&idx->keyword_count, sizeof(idx->keyword_count), 1, in)) { free(idx); return NULL; }
+    if (!fread_exact(&idx->keyword_count, sizeof(idx->keyword_count), 1, in) ||
+        idx->keyword_count < 0 || idx->keyword_count > CASEFILTER_MAX_KEYWORDS) {
+        free(idx);
+        return NULL;
+    }
+    /* v1 は keyword_count で id 幅が決まる（prep 側と同じ規則） */
+    int wide = idx->keyword_count > CASEFILTER_NARROW_ID_LIMIT;
+    int id_bytes = wide ? 4 : 3;
+    set_id_bits(&idx->del7, wide ? CASEFILTER_WIDE_ID_BITS : CASEFILTER_NARROW_ID_BITS);
     idx->keyword_cap = idx->keyword_count;
     idx->keywords = (char (*)[KEYWORD_LEN + 1])malloc(sizeof(char[KEYWORD_LEN + 1]) * idx->keyword_cap);
-    idx->codes = (uint64_t *)malloc(sizeof(uint64_t) * idx->keyword_cap);
+    idx->codes = (uint64_t *)cf_array_alloc(sizeof(uint64_t) * (size_t)idx->keyword_cap, 0);
     if (!fread_exact(idx->keywords, sizeof(char[KEYWORD_LEN + 1]), idx->keyword_count, in)) {
-        free(idx->keywords); free(idx->codes); free(idx); return NULL;
-    }
-    for (int i = 0; i < idx->keyword_count; ++i) {
-        uint64_t code = 0;
-        for (int j = 0; j < KEYWORD_LEN; ++j) {
-            uint64_t nib = (uint64_t)(idx->keywords[i][j] - 'A') & 0xF;
-            code |= nib << (j * 4);
-        }
-        idx->codes[i] = code;
+        free(idx->keywords); cf_array_free(idx->codes); free(idx); return NULL;
     }
+    for (int i = 0; i < idx->keyword_count; ++i) idx->codes[i] = v1_keyword_code(idx->keywords[i]);
 
     /* HIndex deserialize (counts -> offsets -> ids) */
     uint8_t count_bits = 0;
     if (!fread_exact(&idx->hidx.key_space, sizeof(idx->hidx.key_space), 1, in)) goto fail;
     if (!fread_exact(&idx->hidx.pair_count, sizeof(idx->hidx.pair_count), 1, in)) goto fail;
+    /* v1 は仕様を持たないので既定（k = 3 の全ペア・両側の削除キー）で、キー空間がこのビルドと同じものだけ */
+    if (idx->hidx.key_space != CASEFILTER_H_KEY_SPACE || idx->hidx.pair_count != CASEFILTER_HPAIR_COUNT) goto fail;
+    idx->spec = casefilter_spec_for(MAX_EDIT_DIST, CF_SCHEME_PAIRS);
     int h_slots = idx->hidx.key_space * idx->hidx.pair_count;
     if (!fread_exact(&count_bits, 1, 1, in)) goto fail;
     idx->hidx.counts = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)h_slots);
@@ -106,22 +842,24 @@ CaseFilterIndex *casefilter_deserialize(FILE *in) {
     } else {
         if (!fread_exact(idx->hidx.counts, sizeof(uint32_t), h_slots, in)) goto fail;
     }
-    idx->hidx.offsets = (int *)malloc(sizeof(int) * (size_t)(h_slots + 1));
+    idx->hidx.offsets = (int *)cf_array_alloc(sizeof(int) * (size_t)(h_slots + 1), 0);
     idx->hidx.offsets[0] = 0;
     for (int i = 0; i < h_slots; ++i) idx->hidx.offsets[i + 1] = idx->hidx.offsets[i] + (int)idx->hidx.counts[i];
     int h_total_ids_file = 0;
     if (!fread_exact(&h_total_ids_file, sizeof(h_total_ids_file), 1, in)) goto fail;
     int h_total_ids = idx->hidx.offsets[h_slots];
     if (h_total_ids != h_total_ids_file) goto fail;
-    idx->hidx.ids = (int *)malloc(sizeof(int) * (size_t)h_total_ids);
-    for (int i = 0; i < h_total_ids; ++i) {
-        unsigned char buf[3];
-        if (fread(buf, 1, 3, in) != 3) goto fail;
-        idx->hidx.ids[i] = (int)(buf[0] | (buf[1] << 8) | (buf[2] << 16));
+    idx->hidx.occ = occ_from_offsets(idx->hidx.offsets, h_slots);
+    if (!idx->hidx.occ) goto fail;
+    idx->hidx.ids = (int *)cf_array_alloc(sizeof(int) * (size_t)h_total_ids, 0);
+    if (!idx->hidx.ids || !read_ids((uint32_t *)idx->hidx.ids, h_total_ids, id_bytes, in) ||
+        !v1_ids_valid((const uint32_t *)idx->hidx.ids, h_total_ids, idx->keyword_count, 0)) {
+        goto fail;
     }
 
     /* DelIndex deserialize */
     if (!fread_exact(&idx->del7.key_space, sizeof(idx->del7.key_space), 1, in)) goto fail;
+    if (idx->del7.key_space != CASEFILTER_DEL_KEY_SPACE) goto fail;
     if (!fread_exact(&count_bits, 1, 1, in)) goto fail;
     idx->del7.counts = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)idx->del7.key_space);
     if (count_bits == 16) {
@@ -132,18 +870,19 @@ CaseFilterIndex *casefilter_deserialize(FILE *in) {
     } else {
         if (!fread_exact(idx->del7.counts, sizeof(uint32_t), idx->del7.key_space, in)) goto fail;
     }
-    idx->del7.offsets = (int *)malloc(sizeof(int) * (size_t)(idx->del7.key_space + 1));
+    idx->del7.offsets = (int *)cf_array_alloc(sizeof(int) * (size_t)(idx->del7.key_space + 1), 0);
     idx->del7.offsets[0] = 0;
     for (int i = 0; i < idx->del7.key_space; ++i) idx->del7.offsets[i + 1] = idx->del7.offsets[i] + (int)idx->del7.counts[i];
     int del_total_ids_file = 0;
     if (!fread_exact(&del_total_ids_file, sizeof(del_total_ids_file), 1, in)) goto fail;
     int del_total_ids = idx->del7.offsets[idx->del7.key_space];
     if (del_total_ids != del_total_ids_file) goto fail;
-    idx->del7.idpos = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)del_total_ids);
-    for (int i = 0; i < del_total_ids; ++i) {
-        unsigned char buf[3];
-        if (fread(buf, 1, 3, in) != 3) goto fail;
-        idx->del7.idpos[i] = (uint32_t)(buf[0] | (buf[1] << 8) | (buf[2] << 16));
+    idx->del7.occ = occ_from_offsets(idx->del7.offsets, idx->del7.key_space);
+    if (!idx->del7.occ) goto fail;
+    idx->del7.idpos = (uint32_t *)cf_array_alloc(sizeof(uint32_t) * (size_t)del_total_ids, 0);
+    if (!idx->del7.idpos || !read_ids(idx->del7.idpos, del_total_ids, id_bytes, in) ||
+        !v1_ids_valid(idx->del7.idpos, del_total_ids, idx->keyword_count, idx->del7.id_bits)) {
+        goto fail;
     }
     return idx;
 
@@ -152,228 +891,4622 @@ fail:
     return NULL;
 }
 
-void casefilter_free(CaseFilterIndex *idx) {
-    if (!idx) return;
-    free(idx->hidx.offsets);
-    free(idx->hidx.counts);
-    free(idx->hidx.ids);
+/* ===== 探索で引く配列の写し（v2 の huge page 化と --numa replicate） ===== */
+/* ファイル写像の [p, p + bytes) のうち丸ごと含むページを捨てる（読み直せば戻るので失敗しても困らない） */
+static void drop_pages(const void *p, size_t bytes) {
+    uintptr_t pg = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t b = ((uintptr_t)p + pg - 1) & ~(pg - 1), e = ((uintptr_t)p + bytes) & ~(pg - 1);
+    if (e > b) madvise((void *)b, (size_t)(e - b), MADV_DONTNEED);
+}
 
-    free(idx->del7.offsets);
-    free(idx->del7.counts);
-    free(idx->del7.idpos);
+static size_t sdir_groups(const SlotDir *sd, int slots) {
+    return sd->rec ? SDIR_GROUPS(slots, sd->per) : 0;
+}
 
-    free(idx->keywords);
-    free(idx->codes);
-    free(idx);
+/*
+ * src の探索で引く配列を cf_array_alloc（呼び出し時の方針）へ写し、全部揃ったら dst のポインタを差し替える。
+ * 1 つでも確保できなければ確保した分を捨てて 0 を返し、dst はそのまま。
+ * drop_src なら写し終えた元のページ（v2 のファイル写像）を手放し、写しと元が同時に常駐する量を抑える。
+ */
+static int index_place(CaseFilterIndex *dst, const CaseFilterIndex *src, int drop_src) {
+    int h_slots = src->hidx.key_space * src->hidx.pair_count;
+    int d_slots = src->del7.key_space;
+    size_t h_total = src->hidx.offsets ? (size_t)src->hidx.offsets[h_slots] : src->hidx.sdir.total;
+    size_t d_total = src->del7.offsets ? (size_t)src->del7.offsets[d_slots] : src->del7.sdir.total;
+    struct {
+        void **to;
+        const void *from;
+        size_t bytes;
+    } a[] = {
+        {(void **)&dst->codes, src->codes, sizeof(uint64_t) * (size_t)src->keyword_count},
+        {(void **)&dst->hidx.offsets, src->hidx.offsets, sizeof(int) * ((size_t)h_slots + 1)},
+        {(void **)&dst->hidx.ids, src->hidx.ids, sizeof(int) * h_total},
+        {(void **)&dst->hidx.fat, src->hidx.fat, sizeof(uint64_t) * h_total},
+        {(void **)&dst->hidx.pids, src->hidx.pids, (size_t)CF_PACKED_BYTES(h_total, src->pack.bits)},
+        {(void **)&dst->hidx.occ, src->hidx.occ, sizeof(uint64_t) * OCC_WORDS(h_slots)},
+        {(void **)&dst->hidx.sdir.rec, src->hidx.sdir.rec, sizeof(SlotDirRec) * sdir_groups(&src->hidx.sdir, h_slots)},
+        {(void **)&dst->hidx.sdir.ovf, src->hidx.sdir.ovf, sizeof(uint32_t) * src->hidx.sdir.ovf_words},
+        {(void **)&dst->del7.offsets, src->del7.offsets, sizeof(int) * ((size_t)d_slots + 1)},
+        {(void **)&dst->del7.idpos, src->del7.idpos, sizeof(uint32_t) * d_total},
+        {(void **)&dst->del7.pids, src->del7.pids, (size_t)CF_PACKED_BYTES(d_total, src->pack.bits)},
+        {(void **)&dst->del7.occ, src->del7.occ, sizeof(uint64_t) * OCC_WORDS(d_slots)},
+        {(void **)&dst->del7.sdir.rec, src->del7.sdir.rec, sizeof(SlotDirRec) * sdir_groups(&src->del7.sdir, d_slots)},
+        {(void **)&dst->del7.sdir.ovf, src->del7.sdir.ovf, sizeof(uint32_t) * src->del7.sdir.ovf_words},
+        {(void **)(void *)&dst->exact, src->exact, sizeof(uint64_t) * src->exact_cap},
+    };
+    enum { N = sizeof(a) / sizeof(a[0]) };
+    void *copy[N] = {0};
+    for (int i = 0; i < N; ++i) {
+        if (!a[i].from) continue;
+        if (!(copy[i] = cf_array_alloc(a[i].bytes, 0))) {
+            for (int j = 0; j < i; ++j) cf_array_free(copy[j]);
+            return 0;
+        }
+        memcpy(copy[i], a[i].from, a[i].bytes);
+        if (drop_src) drop_pages(a[i].from, a[i].bytes);
+    }
+    for (int i = 0; i < N; ++i) {
+        if (a[i].from) *a[i].to = copy[i];
+    }
+    return 1;
 }
 
-/* ===== search.c の内容 ===== */
-static const uint8_t pair_i[10] = {0,0,0,0,1,1,1,2,2,3};
-static const uint8_t pair_j[10] = {1,2,3,4,2,3,4,3,4,4};
+static void free_if_heap(const CaseFilterIndex *idx, void *p);
 
-/* 64bit範囲内でのビット並列popcount（HAKMEM法） */
-static inline int popcount64(uint64_t x) {
-    x = x - ((x >> 1) & 0x5555555555555555ULL);
-    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
-    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
-    return (x * 0x0101010101010101ULL) >> 56;
+/* v2: 配列を写してファイル写像を閉じる。以後はヒープ所有の索引と同じに扱う */
+static int index_unmap(CaseFilterIndex *idx) {
+    uint64_t *h_occ = idx->hidx.occ, *d_occ = idx->del7.occ;
+    if (!index_place(idx, idx, 1)) return 0;
+    free_if_heap(idx, h_occ);  /* occ セクションの無い v2 で補った分 */
+    free_if_heap(idx, d_occ);
+    munmap(idx->map_base, idx->map_size);
+    idx->map_base = NULL;
+    idx->map_size = 0;
+    return 1;
 }
 
-/* SWAR Hamming: nibble-pack 15/14文字を popcount でまとめて判定 */
-static inline uint64_t pack_keyword(const char *word) {
-    uint64_t v = 0;
-    for (int i = 0; i < KEYWORD_LEN; ++i) {
-        uint64_t nib = (uint64_t)(word[i] - 'A') & 0xF;
-        v |= nib << (i * 4);
+/*
+ * --numa replicate: node 番目のノードに寄せた複製。delta / tombstone を持つ索引は複製しない（更新が片方にしか
+ * 入らなくなる）。keywords などの探索に要らない配列は持たない。
+ */
+CaseFilterIndex *casefilter_replicate(const CaseFilterIndex *idx, int node) {
+    if (!idx || idx->delta || idx->tomb || idx->dead_codes) return NULL;
+    CaseFilterIndex *r = (CaseFilterIndex *)malloc(sizeof(CaseFilterIndex));
+    if (!r) return NULL;
+    *r = *idx;
+    r->keywords = NULL;
+    r->cache = NULL;  /* cache は元の索引のもの。複製には呼び出し側がノードごとに付ける */
+    r->hidx.counts = NULL;
+    r->del7.counts = NULL;
+    r->map_base = NULL;
+    r->map_size = 0;
+    cf_bind_node = node;
+    int ok = index_place(r, idx, 0);
+    cf_bind_node = -1;
+    if (!ok) {
+        free(r);
+        return NULL;
     }
-    return v;
+    return r;
 }
 
-static inline int hamming_packed15(uint64_t a, uint64_t b) {
-    uint64_t x = a ^ b;
-    x |= (x >> 1);
-    x |= (x >> 2);
-    x &= 0x1111111111111111ULL;
-    return popcount64(x);
+/* ===== v2 (mmap) ロード ===== */
+/* 表に id のセクションがあるか（中身は見ない）。任意・択一のセクションは「無い」と「壊れている」を分け、
+ * 壊れた索引が既定や別の形式に落ちて黙って違う探索をしないようにする */
+static int v2_has_section(const CaseFilterV2Section *table, uint32_t nsec, uint32_t id) {
+    for (uint32_t s = 0; s < nsec; ++s) {
+        if (table[s].id == id) return 1;
+    }
+    return 0;
 }
 
-static inline int hamming_packed14(uint64_t a, uint64_t b) {
-    uint64_t x = a ^ b;
-    x |= (x >> 1);
-    x |= (x >> 2);
-    x &= 0x11111111111111ULL;  /* 14ニブル分のマスク（56bit） */
-    return popcount64(x);
+/* 要素数を問わずに引く版（疎ディレクトリの ovf など長さがデータ依存のもの） */
+static const void *v2_section_any(const unsigned char *base, size_t size, const CaseFilterV2Section *table,
+                                  uint32_t nsec, uint32_t id, uint32_t elem_size, uint64_t *count) {
+    for (uint32_t s = 0; s < nsec; ++s) {
+        const CaseFilterV2Section *sec = &table[s];
+        if (sec->id != id) continue;
+        if (sec->elem_size != elem_size) return NULL;
+        if (sec->offset % CASEFILTER_V2_ALIGN) return NULL;
+        if (sec->offset > size || sec->count > (size - sec->offset) / elem_size) return NULL;
+        *count = sec->count;
+        return base + sec->offset;
+    }
+    return NULL;
 }
 
-static inline uint32_t pack_key6(const char *key) {
-    uint32_t v = 0;
-    uint32_t mul = 1;
-    for (int i = 0; i < 6; ++i) {
-        v += (((uint32_t)key[i] - 'A') & 0xF) * mul;
-        mul *= 10u;
-    }
-    return v;
+static const void *v2_section(const unsigned char *base, size_t size, const CaseFilterV2Section *table,
+                              uint32_t nsec, uint32_t id, uint32_t elem_size, uint64_t count) {
+    uint64_t n = 0;
+    const void *p = v2_section_any(base, size, table, nsec, id, elem_size, &n);
+    return p && n == count ? p : NULL;
 }
 
-static inline uint32_t pack_key7(const char *key) {
-    uint32_t v = 0;
-    uint32_t mul = 1;
-    for (int i = 0; i < 7; ++i) {
-        v += (((uint32_t)key[i] - 'A') & 0xF) * mul;
-        mul *= 10u;
+/* 入力は信頼しない: 探索時に範囲外参照が起きないよう offsets の単調性と id 範囲だけは検査する */
+static int v2_check_csr(const int *offsets, int slots, int total) {
+    if (offsets[0] != 0 || offsets[slots] != total) return 0;
+    for (int i = 0; i < slots; ++i) {
+        if (offsets[i + 1] < offsets[i]) return 0;
     }
-    return v;
+    return 1;
 }
 
-int casefilter_search(const CaseFilterIndex *idx, const char *query, int k) {
-    if (!idx || !query || (int)strlen(query) != KEYWORD_LEN) return 0;
-    int kw_count = idx->keyword_count;
-    static uint32_t *visited_buf = NULL;
-    static int visited_cap = 0;
-    static uint32_t gen = 1;
-    if (kw_count > visited_cap) {
-        free(visited_buf);
-        visited_buf = (uint32_t *)calloc((size_t)kw_count, sizeof(uint32_t));
-        visited_cap = kw_count;
-        gen = 1;
-    }
-    if (!visited_buf) return 0;
-    gen++;
-    if (gen == 0) {
-        memset(visited_buf, 0, sizeof(uint32_t) * (size_t)visited_cap);
-        gen = 1;
-    }
-    uint32_t *visited = visited_buf;
-
-    /* Case A: Hamming<=3 via pair keys */
-    char blocks[5][3];
-    for (int b = 0; b < 5; ++b) memcpy(blocks[b], query + b * 3, 3);
-    uint64_t qcode = pack_keyword(query);
-    int order[10];
-    struct { int start; int len; char key[6]; } pairs[10];
-    for (int p = 0; p < 10; ++p) {
-        order[p] = p;
-        memcpy(pairs[p].key, blocks[pair_i[p]], 3);
-        memcpy(pairs[p].key + 3, blocks[pair_j[p]], 3);
-        uint32_t packed = pack_key6(pairs[p].key);
-        int slot = (int)(packed + (uint32_t)p * CASEFILTER_H_KEY_SPACE);
-        pairs[p].start = idx->hidx.offsets[slot];
-        pairs[p].len = idx->hidx.offsets[slot + 1] - pairs[p].start;
+/* 仕様セクション。無い索引（古い v2）は k = 3・pairs の既定（壊れていれば既定にせず失敗）。被覆はこのビルドの表と一致するものだけ受ける
+ * （ここでは文字種・長さ・k・分割方式と格納した群 / 削除キーを見る。キー空間は呼び出し側がヘッダと突き合わせる） */
+static int v2_read_spec(const unsigned char *base, size_t size, const CaseFilterV2Section *table, uint32_t nsec,
+                        CaseFilterSpec *spec) {
+    uint64_t n = 0;
+    *spec = casefilter_spec_for(MAX_EDIT_DIST, CF_SCHEME_PAIRS);
+    if (!v2_has_section(table, nsec, CF_SEC_SPEC)) return 1;
+    const uint32_t *w = (const uint32_t *)v2_section_any(base, size, table, nsec, CF_SEC_SPEC, sizeof(uint32_t), &n);
+    if (!w) return 0;
+    if (n < sizeof(CaseFilterSpec) / sizeof(uint32_t)) return 0;
+    CaseFilterSpec sp;
+    memcpy(&sp, w, sizeof(sp));
+    if (sp.keyword_len != KEYWORD_LEN || sp.alphabet != CASEFILTER_ALPHABET || sp.max_k > MAX_EDIT_DIST ||
+        sp.h_scheme >= CF_SCHEMES || sp.h_pair_mask != cf_schemes[sp.h_scheme].cover[sp.max_k] ||
+        sp.d_sides != cf_del_sides[sp.max_k]) {
+        return 0;
     }
-    /* sort keys by posting length (small→大) to早期ヒット狙い */
-    for (int i = 0; i < 10; ++i) {
-        for (int j = i + 1; j < 10; ++j) {
-            if (pairs[order[i]].len > pairs[order[j]].len) {
-                int tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+    *spec = sp;
+    return 1;
+}
+
+/* 疎ディレクトリ: 各群の先頭が前の群の末尾と一致することを検査（= 密 offsets の単調性と同値）。総数を返す */
+static int v2_map_dir(const unsigned char *base, size_t size, const CaseFilterV2Section *table, uint32_t nsec,
+                      uint32_t meta_id, int slots, SlotDir *sd) {
+    const uint32_t *meta = (const uint32_t *)v2_section(base, size, table, nsec, meta_id, sizeof(uint32_t), 2);
+    if (!meta || (meta[0] != 4 && meta[0] != 8) || meta[1] >= SDIR_EXACT) return -1;
+    sd->width = (int)meta[0];
+    sd->per = SDIR_CUM_BYTES * 8 / sd->width;
+    sd->total = meta[1];
+    size_t groups = SDIR_GROUPS(slots, sd->per);
+    uint64_t words = 0;
+    sd->rec = (SlotDirRec *)v2_section(base, size, table, nsec, meta_id + 1, sizeof(SlotDirRec), (uint64_t)groups);
+    sd->ovf = (uint32_t *)v2_section_any(base, size, table, nsec, meta_id + 2, sizeof(uint32_t), &words);
+    if (!sd->rec || !sd->ovf) return -1;
+    sd->ovf_words = (size_t)words;
+    uint64_t pos = 0;
+    for (size_t g = 0; g < groups; ++g) {
+        const SlotDirRec *r = &sd->rec[g];
+        uint64_t start, end;
+        if (r->start & SDIR_EXACT) {
+            uint64_t p = r->start & ~SDIR_EXACT;
+            if (p + (uint64_t)sd->per + 1 > words) return -1;
+            const uint32_t *e = sd->ovf + p;
+            for (int j = 0; j < sd->per; ++j) {
+                if (e[j + 1] < e[j]) return -1;
+            }
+            start = e[0];
+            end = e[sd->per];
+        } else {
+            /* 復元した累積（= sdir_range の末尾）が単調であること。wrap は先頭から数え上げる */
+            uint32_t hi = 0, prev = 0;
+            for (uint32_t j = 0; j < (uint32_t)sd->per; ++j) {
+                hi += (r->wrap[j >> 5] >> (j & 31)) & 1u;
+                uint32_t full = sdir_cum(r, j, sd->width) + (hi << sd->width);
+                if (full < prev) return -1;
+                prev = full;
             }
+            start = r->start;
+            end = start + prev;
         }
+        if (start != pos) return -1;
+        pos = end;
     }
+    if (pos != sd->total) return -1;
+    return (int)pos;
+}
 
-    for (int oi = 0; oi < 10; ++oi) {
-        int p = order[oi];
-        if (pairs[p].len == 0) continue;
-        const int *ids = idx->hidx.ids + pairs[p].start;
-        for (int i = 0; i < pairs[p].len; ++i) {
-            int id = ids[i];
-            if (visited[id] == gen) continue;
-            visited[id] = gen;
-            int hd = hamming_packed15(qcode, idx->codes[id]);
-            if (hd <= k) return 1;
-        }
-    }
+CaseFilterIndex *casefilter_map_v2(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CaseFilterV2Header)) return NULL;
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return NULL;
+    const unsigned char *base = (const unsigned char *)map;
 
-    gen++;
+    CaseFilterV2Header hdr;
+    memcpy(&hdr, base, sizeof(hdr));
+    if (memcmp(hdr.magic, CASEFILTER_V2_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != CASEFILTER_V2_VERSION ||
+        hdr.section_count == 0 || hdr.section_count > CASEFILTER_V2_MAX_SECTIONS ||
+        hdr.keyword_count < 0 || hdr.keyword_count > CASEFILTER_MAX_KEYWORDS ||
+        hdr.del_key_space != CASEFILTER_DEL_KEY_SPACE ||
+        size < sizeof(hdr) + sizeof(CaseFilterV2Section) * hdr.section_count) {
+        munmap(map, size);
+        return NULL;
+    }
+    CaseFilterV2Section table[CASEFILTER_V2_MAX_SECTIONS];
+    memcpy(table, base + sizeof(hdr), sizeof(CaseFilterV2Section) * hdr.section_count);
+    uint32_t nsec = hdr.section_count;
+    /* H のキー空間と群数は分割方式で決まる */
+    CaseFilterSpec spec;
+    if (!v2_read_spec(base, size, table, nsec, &spec) ||
+        hdr.h_key_space != (int32_t)cf_scheme_key_space(&cf_schemes[spec.h_scheme]) ||
+        hdr.h_pair_count != cf_schemes[spec.h_scheme].groups) {
+        munmap(map, size);
+        return NULL;
+    }
 
-    /* Case B: delete-one -> 14char Hamming<=1 */
-    char qdel[14];
-    for (int pos = 0; pos < KEYWORD_LEN; ++pos) {
-        uint64_t qdel_code = casefilter_pack_delete(qcode, pos);
-        memcpy(qdel, query, pos);
-        memcpy(qdel + pos, query + pos + 1, KEYWORD_LEN - pos - 1);
-        char left[7], right[7];
-        memcpy(left, qdel, 7);
-        memcpy(right, qdel + 7, 7);
-
-        int lslot = (int)pack_key7(left);
-        int lstart = idx->del7.offsets[lslot];
-        int lend = idx->del7.offsets[lslot + 1];
-        if (lend > lstart) {
-            const uint32_t *idpos = idx->del7.idpos + lstart;
-            int count = lend - lstart;
-            for (int i = 0; i < count; ++i) {
-                uint32_t v = idpos[i];
-                int id = (int)(v & 0xFFFFF);
-                if (visited[id] == gen) continue;
-                uint64_t kwdel_code = casefilter_pack_delete(idx->codes[id], (int)((v >> 20) & 0xF));
-                int hd14 = hamming_packed14(qdel_code, kwdel_code);
-                if (2 + hd14 <= k) {
-                    visited[id] = gen;
-                    return 1;
-                }
-            }
-        }
+    CaseFilterIndex *idx = (CaseFilterIndex *)calloc(1, sizeof(CaseFilterIndex));
+    if (!idx) { munmap(map, size); return NULL; }
+    idx->spec = spec;
+    idx->map_base = map;
+    idx->map_size = size;
+    idx->keyword_count = hdr.keyword_count;
+    idx->keyword_cap = hdr.keyword_count;
+    idx->hidx.key_space = hdr.h_key_space;
+    idx->hidx.pair_count = hdr.h_pair_count;
+    idx->del7.key_space = hdr.del_key_space;
+    int h_slots = hdr.h_key_space * hdr.h_pair_count;
 
-        int rslot = (int)pack_key7(right);
-        int rstart = idx->del7.offsets[rslot];
-        int rend = idx->del7.offsets[rslot + 1];
-        if (rend > rstart) {
-            const uint32_t *idpos = idx->del7.idpos + rstart;
-            int count = rend - rstart;
-            for (int i = 0; i < count; ++i) {
-                uint32_t v = idpos[i];
-                int id = (int)(v & 0xFFFFF);
-                if (visited[id] == gen) continue;
-                uint64_t kwdel_code = casefilter_pack_delete(idx->codes[id], (int)((v >> 20) & 0xF));
-                int hd14 = hamming_packed14(qdel_code, kwdel_code);
-                if (2 + hd14 <= k) {
-                    visited[id] = gen;
-                    return 1;
-                }
-            }
+    /* 総ポスティング数はディレクトリ（密 offsets か疎ディレクトリ）末尾から決まるので、先に引く */
+    idx->codes = (uint64_t *)v2_section(base, size, table, nsec, CF_SEC_CODES, sizeof(uint64_t),
+                                        (uint64_t)hdr.keyword_count);
+    if (!idx->codes) goto fail;
+    /* 以下、択一・任意のセクションは「表にある」ことで選び、選んだものが検査に通らなければ失敗 */
+    int h_total, d_total;
+    if (v2_has_section(table, nsec, CF_SEC_H_OFFSETS)) {
+        idx->hidx.offsets = (int *)v2_section(base, size, table, nsec, CF_SEC_H_OFFSETS, sizeof(int32_t),
+                                              (uint64_t)h_slots + 1);
+        if (!idx->hidx.offsets) goto fail;
+        h_total = idx->hidx.offsets[h_slots];
+        if (h_total < 0 || !v2_check_csr(idx->hidx.offsets, h_slots, h_total)) goto fail;
+    } else {
+        h_total = v2_map_dir(base, size, table, nsec, CF_SEC_H_DIR_META, h_slots, &idx->hidx.sdir);
+        if (h_total < 0) goto fail;
+    }
+    if (v2_has_section(table, nsec, CF_SEC_D_OFFSETS)) {
+        idx->del7.offsets = (int *)v2_section(base, size, table, nsec, CF_SEC_D_OFFSETS, sizeof(int32_t),
+                                              (uint64_t)hdr.del_key_space + 1);
+        if (!idx->del7.offsets) goto fail;
+        d_total = idx->del7.offsets[hdr.del_key_space];
+        if (d_total < 0 || !v2_check_csr(idx->del7.offsets, hdr.del_key_space, d_total)) goto fail;
+    } else {
+        d_total = v2_map_dir(base, size, table, nsec, CF_SEC_D_DIR_META, hdr.del_key_space, &idx->del7.sdir);
+        if (d_total < 0) goto fail;
+    }
+    /* H は ids / fat / 詰めた id のどれか 1 つ。詰めた列の幅は keyword_count で決まる（v1 の id 幅と同じ規則） */
+    int pack_bits = cf_pack_bits(hdr.keyword_count);
+    if (v2_has_section(table, nsec, CF_SEC_H_IDS)) {
+        idx->hidx.ids = (int *)v2_section(base, size, table, nsec, CF_SEC_H_IDS, sizeof(int32_t), (uint64_t)h_total);
+    } else if (v2_has_section(table, nsec, CF_SEC_H_FAT)) {
+        idx->hidx.fat = (uint64_t *)v2_section(base, size, table, nsec, CF_SEC_H_FAT, sizeof(uint64_t),
+                                               (uint64_t)h_total);
+    } else {
+        idx->hidx.pids = (uint8_t *)v2_section(base, size, table, nsec, CF_SEC_H_IDS_PACKED, 1,
+                                               CF_PACKED_BYTES(h_total, pack_bits));
+    }
+    /* idpos のセクション種別で id 幅が決まる。narrow は 2^20 件までしか表せない */
+    set_id_bits(&idx->del7, CASEFILTER_NARROW_ID_BITS);
+    if (v2_has_section(table, nsec, CF_SEC_D_IDPOS)) {
+        idx->del7.idpos = (uint32_t *)v2_section(base, size, table, nsec, CF_SEC_D_IDPOS, sizeof(uint32_t),
+                                                 (uint64_t)d_total);
+        if (!idx->del7.idpos || hdr.keyword_count > CASEFILTER_NARROW_ID_LIMIT) goto fail;
+    } else if (v2_has_section(table, nsec, CF_SEC_D_IDPOS_SIG)) {
+        idx->del7.idpos = (uint32_t *)v2_section(base, size, table, nsec, CF_SEC_D_IDPOS_SIG, sizeof(uint32_t),
+                                                 (uint64_t)d_total);
+        idx->del7.sig = 1;
+        if (!idx->del7.idpos || hdr.keyword_count > CASEFILTER_NARROW_ID_LIMIT) goto fail;
+    } else if (v2_has_section(table, nsec, CF_SEC_D_IDPOS_WIDE)) {
+        set_id_bits(&idx->del7, CASEFILTER_WIDE_ID_BITS);
+        idx->del7.idpos = (uint32_t *)v2_section(base, size, table, nsec, CF_SEC_D_IDPOS_WIDE, sizeof(uint32_t),
+                                                 (uint64_t)d_total);
+    } else if (v2_section(base, size, table, nsec, CF_SEC_D_POS_PACKED, 1, CF_PACKED_BYTES(d_total, CF_DPOS_BITS))) {
+        /* 詰めた D は id と del_pos の 2 列。del_pos は探索で読まないので、揃っていることだけ確かめて写像に残す */
+        set_id_bits(&idx->del7, CASEFILTER_WIDE_ID_BITS);
+        idx->del7.pids = (uint8_t *)v2_section(base, size, table, nsec, CF_SEC_D_IDS_PACKED, 1,
+                                               CF_PACKED_BYTES(d_total, pack_bits));
+    }
+    if ((!idx->hidx.ids && !idx->hidx.fat && !idx->hidx.pids) || (!idx->del7.idpos && !idx->del7.pids)) goto fail;
+    if (idx->hidx.pids || idx->del7.pids) pack_lut_init(&idx->pack, pack_bits);
+    /* occ が無い古い v2 は密 offsets から補う（疎ディレクトリの索引は必ず occ を持つ） */
+    if (v2_has_section(table, nsec, CF_SEC_H_OCC)) {
+        idx->hidx.occ = (uint64_t *)v2_section(base, size, table, nsec, CF_SEC_H_OCC, sizeof(uint64_t),
+                                               (uint64_t)OCC_WORDS(h_slots));
+        if (!idx->hidx.occ) goto fail;
+    } else if (idx->hidx.offsets) {
+        idx->hidx.occ = occ_from_offsets(idx->hidx.offsets, h_slots);
+    }
+    if (v2_has_section(table, nsec, CF_SEC_D_OCC)) {
+        idx->del7.occ = (uint64_t *)v2_section(base, size, table, nsec, CF_SEC_D_OCC, sizeof(uint64_t),
+                                               (uint64_t)OCC_WORDS(hdr.del_key_space));
+        if (!idx->del7.occ) goto fail;
+    } else if (idx->del7.offsets) {
+        idx->del7.occ = occ_from_offsets(idx->del7.offsets, hdr.del_key_space);
+    }
+    if (!idx->hidx.occ || !idx->del7.occ) goto fail;
+    for (int i = 0; !idx->hidx.fat && i < h_total; ++i) {
+        if ((uint32_t)h_id(idx, i) >= (uint32_t)hdr.keyword_count) goto fail;
+    }
+    uint32_t pos_mask = idx->del7.sig ? (1u << (CF_DSIG_SHIFT - idx->del7.id_bits)) - 1 : ~0u;
+    for (int i = 0; idx->del7.idpos && i < d_total; ++i) {
+        uint32_t v = idx->del7.idpos[i];
+        if ((v & idx->del7.id_mask) >= (uint32_t)hdr.keyword_count ||
+            ((v >> idx->del7.id_bits) & pos_mask) >= KEYWORD_LEN) {
+            goto fail;
         }
     }
+    for (int i = 0; idx->del7.pids && i < d_total; ++i) {
+        if ((uint32_t)d_id(idx, i) >= (uint32_t)hdr.keyword_count) goto fail;
+    }
+    uint64_t exact_cap = 0;
+    int has_exact = v2_has_section(table, nsec, CF_SEC_EXACT);
+    idx->exact = (const uint64_t *)v2_section_any(base, size, table, nsec, CF_SEC_EXACT, sizeof(uint64_t), &exact_cap);
+    /* 2 冪で件数より大きいこと（空きが必ずある）。探査は cap 回で打ち切るので中身は検査しない */
+    if (has_exact && (!idx->exact || (exact_cap & (exact_cap - 1)) || exact_cap <= (uint64_t)hdr.keyword_count ||
+                      exact_cap > UINT32_MAX)) {
+        goto fail;
+    }
+    idx->exact_cap = (uint32_t)exact_cap;
+    if ((huge_policy != CF_HUGE_OFF || numa_policy == CF_NUMA_INTERLEAVE) && !index_unmap(idx)) goto fail;
+    return idx;
 
-    return 0;
+fail:
+    casefilter_free(idx);
+    return NULL;
 }
 
-/* ===== main/search_casefilter.c の main() ===== */
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <query_file> <index_file>\n", argv[0]);
-        return 1;
-    }
-    FILE *idx = fopen(argv[2], "rb");
-    if (!idx) {
-        fprintf(stderr, "cannot open %s\n", argv[2]);
-        return 1;
-    }
-    CaseFilterIndex *index = casefilter_deserialize(idx);
-    fclose(idx);
-    if (!index) {
-        fprintf(stderr, "failed to load index\n");
-        return 1;
-    }
+/* ===== v1 の並列ロード（casefilter_load_async） =====
+ * ファイルを写像し、codes・HIndex・DelIndex の組み立てをチャンク単位のタスクに分けて複数スレッドで回す。
+ * counts → offsets は 2 パス: チャンクごとの件数和と占有ビット（SUM）→ 前のチャンクまでの和から書く（FILL）。
+ * タスクは H の組（codes を含む）→ D の組の順に番号を振って若い順に取るので、H が先に揃う。
+ * 呼び出し側は H の組だけ手伝って返り、D は裏のスレッドが組み続ける（写像には先に MADV_WILLNEED を掛けて
+ * 読み込みを先行させる）。探索は D が揃うまで Case B をクエリごとに後回しにする（CASEFILTER_DEFERRED）。
+ */
+#define CF_LOAD_SLOT_CHUNK (1 << 18)  /* 64 の倍数（占有ビットの語がチャンクをまたがない） */
+#define CF_LOAD_ID_CHUNK (1 << 20)
+#define CF_LOAD_H 1
+#define CF_LOAD_D 2
 
-    FILE *qf = fopen(argv[1], "r");
-    if (!qf) {
-        fprintf(stderr, "cannot open %s\n", argv[1]);
-        casefilter_free(index);
-        return 1;
+enum { CF_TASK_SUM, CF_TASK_CODES, CF_TASK_IDS, CF_TASK_FILL };
+
+typedef struct {
+    uint8_t kind;
+    uint8_t side;  /* 0: H / 1: D */
+    int begin, end;
+} CfLoadTask;
+
+typedef struct CaseFilterLoad {
+    CaseFilterIndex *idx;
+    unsigned char *map;
+    size_t map_size;
+    const unsigned char *kw;
+    const unsigned char *counts[2], *ids[2];
+    int count_bytes[2];
+    int id_bytes;
+    int slots[2];
+    int total[2];        /* ファイルに書かれた総ポスティング数 */
+    int *offsets[2];
+    uint32_t *vals[2];   /* hidx.ids / del7.idpos */
+    uint64_t *occ[2];
+    int64_t *chunk_sum[2];
+    CfLoadTask *tasks;
+    int ntask, h_tasks;  /* [0, h_tasks) が H の組 */
+    int next;            /* __atomic: 次に取るタスク */
+    int left[2][2];      /* 側ごとの残り: [0] FILL 以外 / [1] FILL */
+    int ready;           /* __atomic: CF_LOAD_H | CF_LOAD_D（失敗しても立てて待ち手を起こす） */
+    int failed;          /* __atomic */
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    pthread_t *tids;
+    int nthreads;
+} CaseFilterLoad;
+
+static inline uint32_t load_count(const CaseFilterLoad *ld, int s, int i) {
+    if (ld->count_bytes[s] == 2) {
+        uint16_t c;
+        memcpy(&c, ld->counts[s] + (size_t)i * 2, sizeof(c));
+        return c;
     }
+    uint32_t c;
+    memcpy(&c, ld->counts[s] + (size_t)i * 4, sizeof(c));
+    return c;
+}
 
-    char buf[KEYWORD_LEN + 2];
-    while (fgets(buf, sizeof(buf), qf)) {
-        buf[strcspn(buf, "\r\n")] = '\0';
-        if ((int)strlen(buf) != KEYWORD_LEN) {
-            putchar('0');
-            continue;
+static void load_task(CaseFilterLoad *ld, const CfLoadTask *t) {
+    int s = t->side;
+    switch (t->kind) {
+    case CF_TASK_CODES:
+        for (int i = t->begin; i < t->end; ++i) {
+            ld->idx->codes[i] = v1_keyword_code((const char *)ld->kw + (size_t)i * (KEYWORD_LEN + 1));
+        }
+        break;
+    case CF_TASK_SUM: {
+        int64_t sum = 0;
+        for (int i = t->begin; i < t->end; ++i) {
+            uint32_t c = load_count(ld, s, i);
+            sum += c;
+            if (c) ld->occ[s][i >> 6] |= 1ULL << (i & 63);
+        }
+        ld->chunk_sum[s][t->begin / CF_LOAD_SLOT_CHUNK] = sum;
+        break;
+    }
+    case CF_TASK_IDS:
+        decode_ids(ld->vals[s] + t->begin, ld->ids[s] + (size_t)t->begin * (size_t)ld->id_bytes, t->end - t->begin,
+                   ld->id_bytes);
+        /* 範囲外の id は FILL の前に失敗にする（早期開始の探索は件数の不一致と同じく打ち切る） */
+        if (!v1_ids_valid(ld->vals[s] + t->begin, t->end - t->begin, ld->idx->keyword_count,
+                          s ? ld->idx->del7.id_bits : 0)) {
+            __atomic_store_n(&ld->failed, 1, __ATOMIC_RELAXED);
+        }
+        break;
+    case CF_TASK_FILL: {
+        if (__atomic_load_n(&ld->failed, __ATOMIC_RELAXED)) break;
+        int64_t at = 0;
+        for (int c = 0; c < t->begin / CF_LOAD_SLOT_CHUNK; ++c) at += ld->chunk_sum[s][c];
+        int *off = ld->offsets[s];
+        if (t->begin == 0) off[0] = 0;
+        for (int i = t->begin; i < t->end; ++i) {
+            at += load_count(ld, s, i);
+            off[i + 1] = (int)at;
+        }
+        break;
+    }
+    }
+}
+
+/* [0, limit) のタスクを 1 つ取る。無ければ -1（limit の外は取らずに残す） */
+static int load_take(CaseFilterLoad *ld, int limit) {
+    int i = __atomic_load_n(&ld->next, __ATOMIC_RELAXED);
+    do {
+        if (i >= limit) return -1;
+    } while (!__atomic_compare_exchange_n(&ld->next, &i, i + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return i;
+}
+
+static void load_run(CaseFilterLoad *ld, int limit) {
+    for (int i; (i = load_take(ld, limit)) >= 0;) {
+        const CfLoadTask *t = &ld->tasks[i];
+        int s = t->side;
+        if (t->kind == CF_TASK_FILL) {
+            /* その側の SUM が全部終わってから（取った時点で SUM は全て誰かが持っているので待てば終わる） */
+            pthread_mutex_lock(&ld->mu);
+            while (ld->left[s][0] > 0) pthread_cond_wait(&ld->cv, &ld->mu);
+            pthread_mutex_unlock(&ld->mu);
+        }
+        load_task(ld, t);
+        pthread_mutex_lock(&ld->mu);
+        if (t->kind != CF_TASK_FILL && --ld->left[s][0] == 0) {
+            int64_t total = 0;
+            for (int c = 0; c * CF_LOAD_SLOT_CHUNK < ld->slots[s]; ++c) total += ld->chunk_sum[s][c];
+            if (total != ld->total[s]) __atomic_store_n(&ld->failed, 1, __ATOMIC_RELAXED);
+            pthread_cond_broadcast(&ld->cv);
+        }
+        if (t->kind == CF_TASK_FILL && --ld->left[s][1] == 0) {
+            __atomic_or_fetch(&ld->ready, s ? CF_LOAD_D : CF_LOAD_H, __ATOMIC_RELEASE);
+            pthread_cond_broadcast(&ld->cv);
+        }
+        pthread_mutex_unlock(&ld->mu);
+    }
+}
+
+static void *load_thread(void *arg) {
+    CaseFilterLoad *ld = (CaseFilterLoad *)arg;
+    load_run(ld, ld->ntask);
+    return NULL;
+}
+
+/* bits が揃うまで待つ。失敗していれば 0 */
+static int load_wait_bits(CaseFilterLoad *ld, int bits) {
+    pthread_mutex_lock(&ld->mu);
+    while ((ld->ready & bits) != bits) pthread_cond_wait(&ld->cv, &ld->mu);
+    pthread_mutex_unlock(&ld->mu);
+    return !__atomic_load_n(&ld->failed, __ATOMIC_RELAXED);
+}
+
+/* 探索側: DelIndex を引いてよいか（組み立て中・失敗なら 0） */
+static inline int index_d_ready(const CaseFilterIndex *idx) {
+    const CaseFilterLoad *ld = idx->load;
+    return !ld || ((__atomic_load_n(&ld->ready, __ATOMIC_ACQUIRE) & CF_LOAD_D) &&
+                   !__atomic_load_n(&ld->failed, __ATOMIC_RELAXED));
+}
+
+/* 探索側: DelIndex が揃うまで待つ（索引は共有のまま。解放は casefilter_load_wait） */
+static int index_wait_d(const CaseFilterIndex *idx) {
+    return !idx->load || load_wait_bits(idx->load, CF_LOAD_D);
+}
+
+/* 写像の *p から bytes バイトを取って進める。足りなければ NULL */
+static const unsigned char *load_span(const unsigned char **p, const unsigned char *end, size_t bytes) {
+    const unsigned char *q = *p;
+    if ((size_t)(end - q) < bytes) return NULL;
+    *p = q + bytes;
+    return q;
+}
+
+static int load_i32(const unsigned char **p, const unsigned char *end, int32_t *v) {
+    const unsigned char *q = load_span(p, end, sizeof(*v));
+    if (q) memcpy(v, q, sizeof(*v));
+    return q != NULL;
+}
+
+/* 写像上の v1 のセクション位置を読む（並びは casefilter_deserialize と同じ）。大きさが合わなければ 0 */
+static int load_layout(CaseFilterLoad *ld, CaseFilterIndex *idx) {
+    const unsigned char *p = ld->map, *end = ld->map + ld->map_size;
+    if (!load_i32(&p, end, &idx->keyword_count) || idx->keyword_count < 0 ||
+        idx->keyword_count > CASEFILTER_MAX_KEYWORDS) {
+        return 0;
+    }
+    ld->id_bytes = idx->keyword_count > CASEFILTER_NARROW_ID_LIMIT ? 4 : 3;
+    if (!(ld->kw = load_span(&p, end, (size_t)idx->keyword_count * (KEYWORD_LEN + 1)))) return 0;
+    if (!load_i32(&p, end, &idx->hidx.key_space) || !load_i32(&p, end, &idx->hidx.pair_count)) return 0;
+    if (idx->hidx.key_space != CASEFILTER_H_KEY_SPACE || idx->hidx.pair_count != CASEFILTER_HPAIR_COUNT) return 0;
+    ld->slots[0] = idx->hidx.key_space * idx->hidx.pair_count;
+    for (int s = 0; s < 2; ++s) {
+        if (s) {
+            if (!load_i32(&p, end, &idx->del7.key_space) || idx->del7.key_space != CASEFILTER_DEL_KEY_SPACE) return 0;
+            ld->slots[1] = idx->del7.key_space;
+        }
+        const unsigned char *bits = load_span(&p, end, 1);
+        if (!bits) return 0;
+        ld->count_bytes[s] = *bits == 16 ? 2 : 4;
+        int32_t total;
+        if (!(ld->counts[s] = load_span(&p, end, (size_t)ld->slots[s] * (size_t)ld->count_bytes[s])) ||
+            !load_i32(&p, end, &total) || total < 0) {
+            return 0;
+        }
+        ld->total[s] = total;
+        if (!(ld->ids[s] = load_span(&p, end, (size_t)total * (size_t)ld->id_bytes))) return 0;
+    }
+    return 1;
+}
+
+static int load_tasks(CaseFilterLoad *ld, int keyword_count) {
+    int n = 0;
+    for (int s = 0; s < 2; ++s) {
+        n += 2 * ((ld->slots[s] + CF_LOAD_SLOT_CHUNK - 1) / CF_LOAD_SLOT_CHUNK);
+        n += (ld->total[s] + CF_LOAD_ID_CHUNK - 1) / CF_LOAD_ID_CHUNK;
+    }
+    n += (keyword_count + CF_LOAD_ID_CHUNK - 1) / CF_LOAD_ID_CHUNK;
+    ld->tasks = (CfLoadTask *)malloc(sizeof(CfLoadTask) * (size_t)n);
+    if (!ld->tasks) return 0;
+    n = 0;
+    for (int s = 0; s < 2; ++s) {
+        for (int b = 0; b < ld->slots[s]; b += CF_LOAD_SLOT_CHUNK) {
+            ld->tasks[n++] = (CfLoadTask){CF_TASK_SUM, (uint8_t)s, b,
+                                          ld->slots[s] - b < CF_LOAD_SLOT_CHUNK ? ld->slots[s] : b + CF_LOAD_SLOT_CHUNK};
+        }
+        for (int b = 0; s == 0 && b < keyword_count; b += CF_LOAD_ID_CHUNK) {
+            ld->tasks[n++] = (CfLoadTask){CF_TASK_CODES, 0, b,
+                                          keyword_count - b < CF_LOAD_ID_CHUNK ? keyword_count : b + CF_LOAD_ID_CHUNK};
+        }
+        for (int b = 0; b < ld->total[s]; b += CF_LOAD_ID_CHUNK) {
+            ld->tasks[n++] = (CfLoadTask){CF_TASK_IDS, (uint8_t)s, b,
+                                          ld->total[s] - b < CF_LOAD_ID_CHUNK ? ld->total[s] : b + CF_LOAD_ID_CHUNK};
+        }
+        int first = n;
+        for (int b = 0; b < ld->slots[s]; b += CF_LOAD_SLOT_CHUNK) {
+            ld->tasks[n++] = (CfLoadTask){CF_TASK_FILL, (uint8_t)s, b,
+                                          ld->slots[s] - b < CF_LOAD_SLOT_CHUNK ? ld->slots[s] : b + CF_LOAD_SLOT_CHUNK};
+        }
+        ld->left[s][1] = n - first;
+        ld->left[s][0] = first - (s ? ld->h_tasks : 0);
+        if (s == 0) ld->h_tasks = n;
+    }
+    ld->ntask = n;
+    return 1;
+}
+
+/* 写像と配列を確保してタスクを並べる（スレッドはまだ無い）。失敗したら写像ごと捨てて NULL */
+static CaseFilterIndex *load_v1_start(unsigned char *map, size_t size) {
+    CaseFilterIndex *idx = (CaseFilterIndex *)calloc(1, sizeof(CaseFilterIndex));
+    CaseFilterLoad *ld = (CaseFilterLoad *)calloc(1, sizeof(CaseFilterLoad));
+    if (!idx || !ld) {
+        free(idx);
+        free(ld);
+        munmap(map, size);
+        return NULL;
+    }
+    ld->idx = idx;
+    ld->map = map;
+    ld->map_size = size;
+    pthread_mutex_init(&ld->mu, NULL);
+    pthread_cond_init(&ld->cv, NULL);
+    idx->load = ld;
+    if (!load_layout(ld, idx) || !load_tasks(ld, idx->keyword_count)) goto fail;
+    set_id_bits(&idx->del7, ld->id_bytes == 4 ? CASEFILTER_WIDE_ID_BITS : CASEFILTER_NARROW_ID_BITS);
+    idx->spec = casefilter_spec_for(MAX_EDIT_DIST, CF_SCHEME_PAIRS);
+    idx->keyword_cap = idx->keyword_count;
+    idx->codes = (uint64_t *)cf_array_alloc(sizeof(uint64_t) * (size_t)idx->keyword_count, 0);
+    idx->hidx.offsets = (int *)cf_array_alloc(sizeof(int) * ((size_t)ld->slots[0] + 1), 0);
+    idx->hidx.occ = (uint64_t *)cf_array_alloc(OCC_WORDS(ld->slots[0]) * sizeof(uint64_t), 1);
+    idx->hidx.ids = (int *)cf_array_alloc(sizeof(int) * (size_t)ld->total[0], 0);
+    idx->del7.offsets = (int *)cf_array_alloc(sizeof(int) * ((size_t)ld->slots[1] + 1), 0);
+    idx->del7.occ = (uint64_t *)cf_array_alloc(OCC_WORDS(ld->slots[1]) * sizeof(uint64_t), 1);
+    idx->del7.idpos = (uint32_t *)cf_array_alloc(sizeof(uint32_t) * (size_t)ld->total[1], 0);
+    if (!idx->codes || !idx->hidx.offsets || !idx->hidx.occ || !idx->hidx.ids || !idx->del7.offsets ||
+        !idx->del7.occ || !idx->del7.idpos) {
+        goto fail;
+    }
+    ld->offsets[0] = idx->hidx.offsets;
+    ld->offsets[1] = idx->del7.offsets;
+    ld->occ[0] = idx->hidx.occ;
+    ld->occ[1] = idx->del7.occ;
+    ld->vals[0] = (uint32_t *)idx->hidx.ids;
+    ld->vals[1] = idx->del7.idpos;
+    for (int s = 0; s < 2; ++s) {
+        ld->chunk_sum[s] = (int64_t *)calloc((size_t)(ld->slots[s] / CF_LOAD_SLOT_CHUNK + 1), sizeof(int64_t));
+        if (!ld->chunk_sum[s]) goto fail;
+    }
+    madvise(map, size, MADV_WILLNEED);
+    return idx;
+
+fail:
+    ld->ready = CF_LOAD_H | CF_LOAD_D;  /* スレッドが無いので casefilter_load_wait は片付けるだけ */
+    ld->failed = 1;
+    ld->next = ld->ntask;
+    casefilter_free(idx);
+    return NULL;
+}
+
+int casefilter_load_wait(CaseFilterIndex *idx) {
+    if (!idx || !idx->load) return idx != NULL;
+    CaseFilterLoad *ld = idx->load;
+    load_run(ld, ld->ntask);  /* 残っているタスクを手伝う */
+    int ok = load_wait_bits(ld, CF_LOAD_H | CF_LOAD_D);
+    for (int t = 0; t < ld->nthreads; ++t) pthread_join(ld->tids[t], NULL);
+    munmap(ld->map, ld->map_size);
+    pthread_mutex_destroy(&ld->mu);
+    pthread_cond_destroy(&ld->cv);
+    free(ld->tids);
+    free(ld->tasks);
+    free(ld->chunk_sum[0]);
+    free(ld->chunk_sum[1]);
+    free(ld);
+    idx->load = NULL;
+    return ok;
+}
+
+CaseFilterIndex *casefilter_load_async(const char *path, int threads) {
+    FILE *in = fopen(path, "rb");
+    if (!in) return NULL;
+    char magic[8] = {0};
+    size_t n = fread(magic, 1, sizeof(magic), in);
+    CaseFilterIndex *idx = NULL;
+    struct stat st;
+    if (n == sizeof(magic) && memcmp(magic, CASEFILTER_V2_MAGIC, sizeof(magic)) == 0) {
+        idx = casefilter_map_v2(fileno(in));
+        fclose(in);
+        return idx;
+    }
+    unsigned char *map = NULL;
+    if (fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = (unsigned char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+        if (map == (unsigned char *)MAP_FAILED) map = NULL;
+    }
+    if (!map) {
+        /* 写像できない入力は従来どおり逐次に読む */
+        if (fseek(in, 0, SEEK_SET) == 0) idx = casefilter_deserialize(in);
+        fclose(in);
+        return idx;
+    }
+    fclose(in);
+    if (!(idx = load_v1_start(map, (size_t)st.st_size))) return NULL;
+    CaseFilterLoad *ld = idx->load;
+    if (threads < 1) threads = 1;
+    ld->tids = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)threads);
+    for (; ld->tids && ld->nthreads < threads; ++ld->nthreads) {
+        if (pthread_create(&ld->tids[ld->nthreads], NULL, load_thread, ld) != 0) break;
+    }
+    /* H の組を手伝ってから H を待つ（裏のスレッドが作れなければ全部ここで組む） */
+    load_run(ld, ld->nthreads ? ld->h_tasks : ld->ntask);
+    if (!load_wait_bits(ld, CF_LOAD_H)) {
+        casefilter_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+/* 先頭のマジックで v2(mmap) / v1 を振り分け、v1 は組み立て終わるまで待つ */
+CaseFilterIndex *casefilter_load(const char *path) {
+    CaseFilterIndex *idx = casefilter_load_async(path, 1);
+    if (idx && !casefilter_load_wait(idx)) {
+        casefilter_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+/* v2 でロード時に補った配列（mmap 外）だけを解放対象にする */
+static void free_if_heap(const CaseFilterIndex *idx, void *p) {
+    const unsigned char *b = (const unsigned char *)idx->map_base;
+    const unsigned char *q = (const unsigned char *)p;
+    if (p && (q < b || q >= b + idx->map_size)) cf_array_free(p);
+}
+
+static void delta_free(struct CaseFilterDelta *dl);
+
+void casefilter_free(CaseFilterIndex *idx) {
+    if (!idx) return;
+    casefilter_load_wait(idx);  /* 裏で組み立て中の配列を書き終えてから */
+    delta_free(idx->delta);
+    free(idx->tomb);
+    free(idx->dead_codes);
+    casefilter_cache_free(idx->cache);
+    if (idx->map_base) {
+        /* v2: 各配列は mmap 領域内を指すだけなので個別解放しない */
+        free_if_heap(idx, idx->hidx.occ);
+        free_if_heap(idx, idx->del7.occ);
+        munmap(idx->map_base, idx->map_size);
+        free(idx);
+        return;
+    }
+    /* v1・merge・写し終えた v2 / 複製: 大きな配列は cf_array_alloc 由来（fat / sdir / exact は v2 から写したときだけ） */
+    cf_array_free(idx->hidx.offsets);
+    free(idx->hidx.counts);
+    cf_array_free(idx->hidx.ids);
+    cf_array_free(idx->hidx.fat);
+    cf_array_free(idx->hidx.pids);
+    cf_array_free(idx->hidx.occ);
+    cf_array_free(idx->hidx.sdir.rec);
+    cf_array_free(idx->hidx.sdir.ovf);
+
+    cf_array_free(idx->del7.offsets);
+    free(idx->del7.counts);
+    cf_array_free(idx->del7.idpos);
+    cf_array_free(idx->del7.pids);
+    cf_array_free(idx->del7.occ);
+    cf_array_free(idx->del7.sdir.rec);
+    cf_array_free(idx->del7.sdir.ovf);
+
+    free(idx->keywords);
+    cf_array_free(idx->codes);
+    cf_array_free((void *)idx->exact);
+    free(idx);
+}
+
+/* ===== search.c の内容 ===== */
+static const uint8_t pair_i[10] = {0,0,0,0,1,1,1,2,2,3};
+static const uint8_t pair_j[10] = {1,2,3,4,2,3,4,3,4,4};
+
+/* SWAR Hamming: nibble-pack 15/14文字を popcount でまとめて判定 */
+static inline uint64_t pack_keyword(const char *word) {
+    uint64_t v = 0;
+    for (int i = 0; i < KEYWORD_LEN; ++i) {
+        uint32_t d = (uint32_t)(unsigned char)word[i] - 'A';
+        v |= (uint64_t)(d < CASEFILTER_ALPHABET ? d : CF_FOREIGN) << (i * 4);
+    }
+    return v;
+}
+
+/* word が全て文字種の中か（DB 側の語は文字種の外を持てない） */
+static inline int word_in_alphabet(const char *word) {
+    for (int i = 0; i < KEYWORD_LEN; ++i) {
+        if ((uint32_t)(unsigned char)word[i] - 'A' >= CASEFILTER_ALPHABET) return 0;
+    }
+    return 1;
+}
+
+static inline int hamming_packed15(uint64_t a, uint64_t b) {
+    uint64_t x = a ^ b;
+    x |= (x >> 1);
+    x |= (x >> 2);
+    x &= 0x1111111111111111ULL;
+    return popcount64(x);
+}
+
+static inline int hamming_packed14(uint64_t a, uint64_t b) {
+    uint64_t x = a ^ b;
+    x |= (x >> 1);
+    x |= (x >> 2);
+    x &= 0x11111111111111ULL;  /* 14ニブル分のマスク（56bit） */
+    return popcount64(x);
+}
+
+static inline uint32_t pack_key6(const char *key) {
+    uint32_t v = 0;
+    uint32_t mul = 1;
+    for (int i = 0; i < 6; ++i) {
+        v += (((uint32_t)key[i] - 'A') & 0xF) * mul;
+        mul *= CASEFILTER_ALPHABET;
+    }
+    return v;
+}
+
+static inline uint32_t pack_key7(const char *key) {
+    uint32_t v = 0;
+    uint32_t mul = 1;
+    for (int i = 0; i < 7; ++i) {
+        v += (((uint32_t)key[i] - 'A') & 0xF) * mul;
+        mul *= CASEFILTER_ALPHABET;
+    }
+    return v;
+}
+
+CaseFilterSearchCtx *casefilter_ctx_create(const CaseFilterIndex *idx) {
+    if (!idx) return NULL;
+    CaseFilterSearchCtx *ctx = (CaseFilterSearchCtx *)calloc(1, sizeof(CaseFilterSearchCtx));
+    if (!ctx) return NULL;
+    ctx->cap = idx->keyword_count > 0 ? idx->keyword_count : 1;
+    ctx->visited = (uint32_t *)calloc((size_t)ctx->cap, sizeof(uint32_t));
+    if (!ctx->visited) { free(ctx); return NULL; }
+    ctx->gen = 1;
+    return ctx;
+}
+
+void casefilter_ctx_free(CaseFilterSearchCtx *ctx) {
+    if (!ctx) return;
+    free(ctx->visited);
+    free(ctx);
+}
+
+/* ctx の計数を sum に足す。計数なしのビルドでは何もせず 0 */
+int casefilter_ctx_stats(const CaseFilterSearchCtx *ctx, CaseFilterStats *sum) {
+#ifdef CASEFILTER_STATS
+    if (!ctx || !sum) return 0;
+    const uint64_t *src = (const uint64_t *)&ctx->stats;
+    uint64_t *dst = (uint64_t *)sum;
+    for (size_t i = 0; i < sizeof(CaseFilterStats) / sizeof(uint64_t); ++i) dst[i] += src[i];
+    return 1;
+#else
+    (void)ctx;
+    (void)sum;
+    return 0;
+#endif
+}
+
+static double stat_ratio(uint64_t a, uint64_t b) {
+    return b ? (double)a / (double)b : 0.0;
+}
+
+void casefilter_stats_print(const CaseFilterStats *st, FILE *out) {
+    static const char *phase[CF_PHASES] = {"exact", "tier1", "case_a", "case_b", "delta"};
+    uint64_t q = st->queries;
+    fprintf(out, "stats: %llu queries, %llu hits (%.1f%%)\n", (unsigned long long)q, (unsigned long long)st->hits,
+            100.0 * stat_ratio(st->hits, q));
+    fprintf(out, "  H slots   %12llu probed  %5.1f%% empty  %6.2f/query\n", (unsigned long long)st->h_probe,
+            100.0 * stat_ratio(st->h_empty, st->h_probe), stat_ratio(st->h_probe, q));
+    fprintf(out, "  D slots   %12llu probed  %5.1f%% empty  %6.2f/query\n", (unsigned long long)st->d_probe,
+            100.0 * stat_ratio(st->d_empty, st->d_probe), stat_ratio(st->d_probe, q));
+    fprintf(out, "  candidates  A %llu (%.2f/query)  B %llu (%.2f/query)  delta %llu\n",
+            (unsigned long long)st->cand_a, stat_ratio(st->cand_a, q), (unsigned long long)st->cand_b,
+            stat_ratio(st->cand_b, q), (unsigned long long)st->cand_delta);
+    if (st->cand_b_sig != st->cand_b) {
+        fprintf(out, "  neighbour-sig  B %llu past signatures (%.1f%%, %.2f/query)\n", (unsigned long long)st->cand_b_sig,
+                100.0 * stat_ratio(st->cand_b_sig, st->cand_b), stat_ratio(st->cand_b_sig, q));
+    }
+    if (st->cache_lookups) {
+        fprintf(out, "  cache     %12llu lookups  %5.1f%% hit  %llu folded in batch (not counted as queries above)\n",
+                (unsigned long long)st->cache_lookups, 100.0 * stat_ratio(st->cache_hits, st->cache_lookups),
+                (unsigned long long)st->cache_folded);
+    }
+    fprintf(out, "  hits by phase:");
+    for (int p = 0; p < CF_PHASES; ++p) fprintf(out, " %s %llu", phase[p], (unsigned long long)st->hit_phase[p]);
+    /* 見出しは一番多く引いた分割方式で。pairs はブロック番号の組、それ以外は群の文字範囲 */
+    int sc = CF_SCHEME_PAIRS;
+    for (int s = 1; s < CF_SCHEMES; ++s) sc = st->scheme_queries[s] > st->scheme_queries[sc] ? s : sc;
+    fprintf(out, "\n  hits by %s key (tier1 + case_a):", sc == CF_SCHEME_PAIRS ? "pair" : cf_schemes[sc].name);
+    for (int p = 0; p < cf_schemes[sc].groups; ++p) {
+        uint32_t m = cf_schemes[sc].mask[p];
+        if (sc == CF_SCHEME_PAIRS) fprintf(out, " %d%d:", pair_i[p], pair_j[p]);
+        else fprintf(out, " %d-%d:", __builtin_ctz(m), 31 - __builtin_clz(m));
+        fprintf(out, "%llu", (unsigned long long)st->hit_pair[p]);
+    }
+    fprintf(out, "\n  case_b hits by deletion key (first query position):");
+    for (int i = 0; i < KEYWORD_LEN; ++i) fprintf(out, " %d:%llu", i, (unsigned long long)st->hit_dpos[i]);
+    fprintf(out, "\n  work per query (slots + candidates):\n  %-13s %12s %12s\n", "range", "miss", "hit");
+    for (int b = 0; b < CF_STAT_BUCKETS; ++b) {
+        if (!st->work_hist[0][b] && !st->work_hist[1][b]) continue;
+        char range[32];
+        snprintf(range, sizeof(range), "%llu-%llu", (unsigned long long)((1ULL << b) - 1),
+                 (unsigned long long)((2ULL << b) - 2));
+        fprintf(out, "  %-13s %12llu %12llu\n", b == CF_STAT_BUCKETS - 1 ? "larger" : range,
+                (unsigned long long)st->work_hist[0][b], (unsigned long long)st->work_hist[1][b]);
+    }
+}
+
+/* 1 クエリ分の計数。QueryPlan が指し、クエリの終わりに ctx へ畳む */
+#ifdef CASEFILTER_STATS
+typedef struct {
+    uint32_t h_probe, h_empty, d_probe, d_empty;
+    uint32_t cand_a, cand_b, cand_delta;
+    uint32_t cand_b_sig;
+    int phase;  /* ヒットした段（外れは -1） */
+    int where;  /* tier1 / A: ペア（群）番号、B: 削除位置 */
+    int scheme;
+} QueryStats;
+#define CF_STAT(x) do { x; } while (0)
+#else
+#define CF_STAT(x) ((void)0)
+#endif
+
+/* 世代を進める。一周したら visited を 0 クリアして取り違えを防ぐ */
+static inline uint32_t ctx_next_gen(CaseFilterSearchCtx *ctx) {
+    if (++ctx->gen == 0) {
+        memset(ctx->visited, 0, sizeof(uint32_t) * (size_t)ctx->cap);
+        ctx->gen = 1;
+    }
+    return ctx->gen;
+}
+
+/* nibble 単位の不一致ビット（各ニブルの最下位bitに立てる） */
+static inline uint64_t nibble_diff(uint64_t x) {
+    x |= (x >> 1);
+    x |= (x >> 2);
+    return x & 0x1111111111111111ULL;
+}
+
+/*
+ * Case B の厳密判定: q, w から1文字ずつ（pq, pk）削除した14文字同士の Hamming 最小値が max_sub 以下か。
+ * E[i]=q[i]!=w[i], S[i]=q[i+1]!=w[i], T[i]=q[i]!=w[i+1] の前置和 pe/ps/pt を使うと
+ *   pq<=pk: pe[pq] + (ps[pk]-ps[pq]) + (|E| - pe[pk+1])
+ *   pk< pq: pe[pk] + (pt[pq]-pt[pk]) + (|E| - pe[pq+1])
+ * となり、全 (pq, pk) の最小を O(15) で求められる。
+ * 14文字の各位置 j は E[j]/S[j](or T[j])/E[j+1] のどれかで比較されるので、3つとも不一致な位置数が
+ * 下限になる。候補の大半はこの下限だけで落ちる。
+ * 1回で id に対する結論が出るので、棄却した id は visited に残して再検証しない。
+ */
+static inline int indel1_within(uint64_t q, uint64_t w, int max_sub) {
+    uint64_t e = nibble_diff(q ^ w) & 0x111111111111111ULL;
+    uint64_t sd = nibble_diff((q >> 4) ^ w) & 0x11111111111111ULL;
+    uint64_t td = nibble_diff(q ^ (w >> 4)) & 0x11111111111111ULL;
+    uint64_t both = e & (e >> 4);
+    int lb1 = popcount64(both & sd);
+    int lb2 = popcount64(both & td);
+    if ((lb1 < lb2 ? lb1 : lb2) > max_sub) return 0;
+    int tot = popcount64(e);
+    int pe = 0, ps = 0, pt = 0;
+    int min_f = 1 << 20, min_g = 1 << 20, best = 1 << 20;
+    for (int i = 0; i < KEYWORD_LEN; ++i) {
+        int ei = (int)((e >> (4 * i)) & 1u);
+        /* pq<=pk=i */
+        if (pe - ps < min_f) min_f = pe - ps;
+        int c1 = min_f + ps - (pe + ei);
+        /* pk<pq=i */
+        int c2 = min_g + pt - (pe + ei);
+        if (c1 < best) best = c1;
+        if (c2 < best) best = c2;
+        if (pe - pt < min_g) min_g = pe - pt;
+        pe += ei;
+        ps += (int)((sd >> (4 * i)) & 1u);
+        pt += (int)((td >> (4 * i)) & 1u);
+    }
+    return tot + best <= max_sub;
+}
+
+/* ===== 候補検証カーネル（posting run 単位, CPUID で実行時選択） ===== */
+/*
+ * scan_h: ids[0..n) に Hamming(qcode, codes[id]) <= k があるか
+ * scan_d: idpos[0..n) に indel1_within(qcode, codes[id], max_sub) を満たす id があるか（id = idpos & id_mask）
+ * scan_hfat: fat postings（codes を直に並べた run）に Hamming <= k があるか
+ * scan_hp / scan_dp: 詰めた id 列の [start, start+n) で scan_h / scan_d と同じ判定。8 件組を PackLut の表で
+ *   id に戻し（幅が広ければ bit 位置から gather）、そのまま codes の gather に渡す（展開用のバッファは無い）
+ * scan_ds: scan_d の近傍署名版。署名が acc に無いレーンは codes を gather しない
+ * ベクトル版は codes を 4/8 レーンまとめて gather するため visited を使わない（重複は再計算するだけで結果は同じ）。
+ * scan_h / scan_d の NULL はスカラー経路（visited で重複候補を飛ばす）。
+ */
+typedef int (*ScanHFn)(const uint64_t *codes, const int *ids, int n, uint64_t qcode, int k);
+typedef int (*ScanDFn)(const uint64_t *codes, const uint32_t *idpos, uint32_t id_mask, int n, uint64_t qcode,
+                       int max_sub);
+typedef int (*ScanHFatFn)(const uint64_t *fat, int n, uint64_t qcode, int k);
+typedef int (*ScanDSigFn)(const uint64_t *codes, const uint32_t *idpos, uint32_t id_mask, int n, uint64_t qcode,
+                          int max_sub, const uint64_t *acc);
+typedef int (*ScanPackedFn)(const uint64_t *codes, const uint8_t *pids, const PackLut *lut, int start, int n,
+                            uint64_t qcode, int lim);
+
+typedef struct {
+    const char *name;
+    ScanHFn scan_h;
+    ScanDFn scan_d;
+    ScanHFatFn scan_hfat;
+    ScanPackedFn scan_hp;  /* lim = k */
+    ScanPackedFn scan_dp;  /* lim = max_sub */
+    ScanDSigFn scan_ds;
+} VerifyKernel;
+
+static int scan_hfat_scalar(const uint64_t *fat, int n, uint64_t qcode, int k) {
+    for (int i = 0; i < n; ++i) {
+        if (hamming_packed15(qcode, fat[i]) <= k) return 1;
+    }
+    return 0;
+}
+
+static VerifyKernel verify_kernel = {"scalar", NULL, NULL, scan_hfat_scalar, NULL, NULL, NULL};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CF_HAVE_X86_KERNELS 1
+
+/* マスク後の不一致ビットは各ニブルの最下位bitのみ = 1バイト最大2bit なので、
+ * バイト内で2bitを足してから SAD で64bitレーンに集計すれば popcount になる（VPOPCNTQ 不要） */
+__attribute__((target("avx2")))
+static inline __m256i nibcount_avx2(__m256i x) {
+    const __m256i lo = _mm256_set1_epi8(0x01);
+    __m256i b = _mm256_add_epi8(_mm256_and_si256(x, lo), _mm256_and_si256(_mm256_srli_epi64(x, 4), lo));
+    return _mm256_sad_epu8(b, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static inline __m256i nibdiff_avx2(__m256i x, __m256i mask) {
+    x = _mm256_or_si256(x, _mm256_srli_epi64(x, 1));
+    x = _mm256_or_si256(x, _mm256_srli_epi64(x, 2));
+    return _mm256_and_si256(x, mask);
+}
+
+__attribute__((target("avx2")))
+static int scan_h_avx2(const uint64_t *codes, const int *ids, int n, uint64_t qcode, int k) {
+    const __m256i q = _mm256_set1_epi64x((long long)qcode);
+    const __m256i m15 = _mm256_set1_epi64x(0x111111111111111LL);
+    const __m256i lim = _mm256_set1_epi64x(k + 1);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i vi = _mm_loadu_si128((const __m128i *)(ids + i));
+        __m256i c = _mm256_i32gather_epi64((const long long *)codes, vi, 8);
+        __m256i cnt = nibcount_avx2(nibdiff_avx2(_mm256_xor_si256(c, q), m15));
+        __m256i hit = _mm256_cmpgt_epi64(lim, cnt);
+        if (!_mm256_testz_si256(hit, hit)) return 1;
+    }
+    for (; i < n; ++i) {
+        if (hamming_packed15(qcode, codes[ids[i]]) <= k) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static int scan_hfat_avx2(const uint64_t *fat, int n, uint64_t qcode, int k) {
+    const __m256i q = _mm256_set1_epi64x((long long)qcode);
+    const __m256i m15 = _mm256_set1_epi64x(0x111111111111111LL);
+    const __m256i lim = _mm256_set1_epi64x(k + 1);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(fat + i));
+        __m256i cnt = nibcount_avx2(nibdiff_avx2(_mm256_xor_si256(c, q), m15));
+        __m256i hit = _mm256_cmpgt_epi64(lim, cnt);
+        if (!_mm256_testz_si256(hit, hit)) return 1;
+    }
+    return scan_hfat_scalar(fat + i, n - i, qcode, k);
+}
+
+/* indel1_within の下限（E&E'&S / E&E'&T）をレーン並列で求め、通過レーンだけスカラーで厳密判定 */
+__attribute__((target("avx2")))
+static inline int d_lanes_avx2(__m256i w, uint64_t qcode, int max_sub, int live) {
+    const __m256i q = _mm256_set1_epi64x((long long)qcode);
+    const __m256i q4 = _mm256_set1_epi64x((long long)(qcode >> 4));
+    const __m256i m15 = _mm256_set1_epi64x(0x111111111111111LL);
+    const __m256i m14 = _mm256_set1_epi64x(0x11111111111111LL);
+    const __m256i lim = _mm256_set1_epi64x(max_sub + 1);
+    __m256i e = nibdiff_avx2(_mm256_xor_si256(w, q), m15);
+    __m256i sd = nibdiff_avx2(_mm256_xor_si256(w, q4), m14);
+    __m256i td = nibdiff_avx2(_mm256_xor_si256(_mm256_srli_epi64(w, 4), q), m14);
+    __m256i both = _mm256_and_si256(e, _mm256_srli_epi64(e, 4));
+    __m256i lb1 = nibcount_avx2(_mm256_and_si256(both, sd));
+    __m256i lb2 = nibcount_avx2(_mm256_and_si256(both, td));
+    __m256i pass = _mm256_or_si256(_mm256_cmpgt_epi64(lim, lb1), _mm256_cmpgt_epi64(lim, lb2));
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(pass)) & live;
+    if (!mask) return 0;
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, w);
+    for (; mask; mask &= mask - 1) {
+        if (indel1_within(qcode, lanes[__builtin_ctz((unsigned)mask)], max_sub)) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static int scan_d_avx2(const uint64_t *codes, const uint32_t *idpos, uint32_t id_mask, int n, uint64_t qcode,
+                       int max_sub) {
+    const __m128i idmask = _mm_set1_epi32((int)id_mask);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i vi = _mm_and_si128(_mm_loadu_si128((const __m128i *)(idpos + i)), idmask);
+        if (d_lanes_avx2(_mm256_i32gather_epi64((const long long *)codes, vi, 8), qcode, max_sub, 0xF)) return 1;
+    }
+    for (; i < n; ++i) {
+        if (indel1_within(qcode, codes[idpos[i] & id_mask], max_sub)) return 1;
+    }
+    return 0;
+}
+
+/* idpos 8 件の署名を受理表 acc（8 本の 32bit 語）で引く。通るレーンは符号 bit が立つ */
+__attribute__((target("avx2")))
+static inline __m256i dsig_pass8_avx2(__m256i v, __m256i acc) {
+    __m256i sig = _mm256_srli_epi32(v, CF_DSIG_SHIFT);
+    __m256i w = _mm256_permutevar8x32_epi32(acc, _mm256_srli_epi32(sig, 5));
+    return _mm256_slli_epi32(_mm256_srlv_epi32(w, _mm256_and_si256(sig, _mm256_set1_epi32(31))), 31);
+}
+
+__attribute__((target("avx2")))
+static int scan_ds_avx2(const uint64_t *codes, const uint32_t *idpos, uint32_t id_mask, int n, uint64_t qcode,
+                        int max_sub, const uint64_t *acc) {
+    const __m256i accv = _mm256_loadu_si256((const __m256i *)acc);
+    const __m256i idmask = _mm256_set1_epi32((int)id_mask);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(idpos + i));
+        __m256i pass = dsig_pass8_avx2(v, accv);
+        int live = _mm256_movemask_ps(_mm256_castsi256_ps(pass));
+        if (!live) continue;
+        __m256i vi = _mm256_and_si256(v, idmask);
+        if ((live & 0xF) &&
+            d_lanes_avx2(_mm256_mask_i32gather_epi64(_mm256_setzero_si256(), (const long long *)codes,
+                                                     _mm256_castsi256_si128(vi),
+                                                     _mm256_cvtepi32_epi64(_mm256_castsi256_si128(pass)), 8),
+                         qcode, max_sub, live & 0xF)) {
+            return 1;
+        }
+        if ((live >> 4) &&
+            d_lanes_avx2(_mm256_mask_i32gather_epi64(_mm256_setzero_si256(), (const long long *)codes,
+                                                     _mm256_extracti128_si256(vi, 1),
+                                                     _mm256_cvtepi32_epi64(_mm256_extracti128_si256(pass, 1)), 8),
+                         qcode, max_sub, live >> 4)) {
+            return 1;
+        }
+    }
+    for (; i < n; ++i) {
+        if (dsig_pass(acc, idpos[i]) && indel1_within(qcode, codes[idpos[i] & id_mask], max_sub)) return 1;
+    }
+    return 0;
+}
+
+/* 詰めた列の 8 件組（先頭 g, phase は lut の表で決まる）→ 32bit id 8 本。件 j は 32bit 要素 j */
+__attribute__((target("avx2")))
+static inline __m256i unpack8_shuf_avx2(const uint8_t *g, const PackLut *lut, int ph, __m256i idmask) {
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)g)),
+                                        _mm_loadu_si128((const __m128i *)(g + lut->hi[ph])), 1);
+    v = _mm256_shuffle_epi8(v, _mm256_loadu_si256((const __m256i *)lut->ctl[ph]));
+    return _mm256_and_si256(_mm256_srlv_epi32(v, _mm256_loadu_si256((const __m256i *)lut->shift[ph])), idmask);
+}
+
+/* 詰めた列の 4 件（幅が CF_PACK_SHUF_BITS を超えるときと 8 件組の残り）: off はレーンごとの bit 位置 */
+__attribute__((target("avx2")))
+static inline __m256i unpack4_avx2(const uint8_t *pids, __m256i off, __m256i idmask) {
+    __m256i w = _mm256_i64gather_epi64((const long long *)(const void *)pids, _mm256_srli_epi64(off, 3), 1);
+    return _mm256_and_si256(_mm256_srlv_epi64(w, _mm256_and_si256(off, _mm256_set1_epi64x(7))), idmask);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pack_offsets4(int start, int bits) {
+    long long b0 = (long long)start * bits;
+    return _mm256_set_epi64x(b0 + 3LL * bits, b0 + 2LL * bits, b0 + bits, b0);
+}
+
+__attribute__((target("avx2")))
+static int scan_hp_avx2(const uint64_t *codes, const uint8_t *pids, const PackLut *lut, int start, int n,
+                        uint64_t qcode, int k) {
+    const int bits = lut->bits;
+    const __m256i q = _mm256_set1_epi64x((long long)qcode);
+    const __m256i m15 = _mm256_set1_epi64x(0x111111111111111LL);
+    const __m256i lim = _mm256_set1_epi64x(k + 1);
+    const __m256i idmask = _mm256_set1_epi64x((long long)((1u << bits) - 1));
+    int i = 0;
+    if (bits <= CF_PACK_SHUF_BITS) {
+        const __m256i idmask32 = _mm256_set1_epi32((int)((1u << bits) - 1));
+        const uint8_t *g = pids + (((uint64_t)start * bits) >> 3);
+        int ph = (int)(((uint64_t)start * bits) & 7);
+        for (; i + 8 <= n; i += 8, g += bits) {
+            __m256i v = unpack8_shuf_avx2(g, lut, ph, idmask32);
+            __m256i c0 = _mm256_i32gather_epi64((const long long *)codes, _mm256_castsi256_si128(v), 8);
+            __m256i c1 = _mm256_i32gather_epi64((const long long *)codes, _mm256_extracti128_si256(v, 1), 8);
+            __m256i hit = _mm256_or_si256(_mm256_cmpgt_epi64(lim, nibcount_avx2(nibdiff_avx2(_mm256_xor_si256(c0, q), m15))),
+                                          _mm256_cmpgt_epi64(lim, nibcount_avx2(nibdiff_avx2(_mm256_xor_si256(c1, q), m15))));
+            if (!_mm256_testz_si256(hit, hit)) return 1;
+        }
+    }
+    const __m256i step = _mm256_set1_epi64x(4LL * bits);
+    __m256i off = pack_offsets4(start + i, bits);
+    for (; i + 4 <= n; i += 4, off = _mm256_add_epi64(off, step)) {
+        __m256i c = _mm256_i64gather_epi64((const long long *)codes, unpack4_avx2(pids, off, idmask), 8);
+        __m256i cnt = nibcount_avx2(nibdiff_avx2(_mm256_xor_si256(c, q), m15));
+        __m256i hit = _mm256_cmpgt_epi64(lim, cnt);
+        if (!_mm256_testz_si256(hit, hit)) return 1;
+    }
+    for (; i < n; ++i) {
+        if (hamming_packed15(qcode, codes[packed_get(pids, bits, (size_t)start + i)]) <= k) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static int scan_dp_avx2(const uint64_t *codes, const uint8_t *pids, const PackLut *lut, int start, int n,
+                        uint64_t qcode, int max_sub) {
+    const int bits = lut->bits;
+    const __m256i idmask = _mm256_set1_epi64x((long long)((1u << bits) - 1));
+    int i = 0;
+    if (bits <= CF_PACK_SHUF_BITS) {
+        const __m256i idmask32 = _mm256_set1_epi32((int)((1u << bits) - 1));
+        const uint8_t *g = pids + (((uint64_t)start * bits) >> 3);
+        int ph = (int)(((uint64_t)start * bits) & 7);
+        for (; i + 8 <= n; i += 8, g += bits) {
+            __m256i v = unpack8_shuf_avx2(g, lut, ph, idmask32);
+            if (d_lanes_avx2(_mm256_i32gather_epi64((const long long *)codes, _mm256_castsi256_si128(v), 8), qcode,
+                             max_sub, 0xF) ||
+                d_lanes_avx2(_mm256_i32gather_epi64((const long long *)codes, _mm256_extracti128_si256(v, 1), 8), qcode,
+                             max_sub, 0xF))
+                return 1;
+        }
+    }
+    const __m256i step = _mm256_set1_epi64x(4LL * bits);
+    __m256i off = pack_offsets4(start + i, bits);
+    for (; i + 4 <= n; i += 4, off = _mm256_add_epi64(off, step)) {
+        __m256i w = _mm256_i64gather_epi64((const long long *)codes, unpack4_avx2(pids, off, idmask), 8);
+        if (d_lanes_avx2(w, qcode, max_sub, 0xF)) return 1;
+    }
+    for (; i < n; ++i) {
+        if (indel1_within(qcode, codes[packed_get(pids, bits, (size_t)start + i)], max_sub)) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i nibcount_avx512(__m512i x) {
+    const __m512i lo = _mm512_set1_epi8(0x01);
+    __m512i b = _mm512_add_epi8(_mm512_and_si512(x, lo), _mm512_and_si512(_mm512_srli_epi64(x, 4), lo));
+    return _mm512_sad_epu8(b, _mm512_setzero_si512());
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i nibdiff_avx512(__m512i x, __m512i mask) {
+    x = _mm512_or_si512(x, _mm512_srli_epi64(x, 1));
+    x = _mm512_or_si512(x, _mm512_srli_epi64(x, 2));
+    return _mm512_and_si512(x, mask);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int scan_h_avx512(const uint64_t *codes, const int *ids, int n, uint64_t qcode, int k) {
+    const __m512i q = _mm512_set1_epi64((long long)qcode);
+    const __m512i m15 = _mm512_set1_epi64(0x111111111111111LL);
+    const __m512i lim = _mm512_set1_epi64(k + 1);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i vi = _mm256_loadu_si256((const __m256i *)(ids + i));
+        __m512i c = _mm512_i32gather_epi64(vi, (const void *)codes, 8);
+        __m512i cnt = nibcount_avx512(nibdiff_avx512(_mm512_xor_si512(c, q), m15));
+        if (_mm512_cmplt_epu64_mask(cnt, lim)) return 1;
+    }
+    for (; i < n; ++i) {
+        if (hamming_packed15(qcode, codes[ids[i]]) <= k) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int scan_hfat_avx512(const uint64_t *fat, int n, uint64_t qcode, int k) {
+    const __m512i q = _mm512_set1_epi64((long long)qcode);
+    const __m512i m15 = _mm512_set1_epi64(0x111111111111111LL);
+    const __m512i lim = _mm512_set1_epi64(k + 1);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i c = _mm512_loadu_si512((const void *)(fat + i));
+        __m512i cnt = nibcount_avx512(nibdiff_avx512(_mm512_xor_si512(c, q), m15));
+        if (_mm512_cmplt_epu64_mask(cnt, lim)) return 1;
+    }
+    return scan_hfat_scalar(fat + i, n - i, qcode, k);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline int d_lanes_avx512(__m512i w, uint64_t qcode, int max_sub, __mmask8 live) {
+    const __m512i q = _mm512_set1_epi64((long long)qcode);
+    const __m512i q4 = _mm512_set1_epi64((long long)(qcode >> 4));
+    const __m512i m15 = _mm512_set1_epi64(0x111111111111111LL);
+    const __m512i m14 = _mm512_set1_epi64(0x11111111111111LL);
+    const __m512i lim = _mm512_set1_epi64(max_sub + 1);
+    __m512i e = nibdiff_avx512(_mm512_xor_si512(w, q), m15);
+    __m512i sd = nibdiff_avx512(_mm512_xor_si512(w, q4), m14);
+    __m512i td = nibdiff_avx512(_mm512_xor_si512(_mm512_srli_epi64(w, 4), q), m14);
+    __m512i both = _mm512_and_si512(e, _mm512_srli_epi64(e, 4));
+    __mmask8 pass = (_mm512_cmplt_epu64_mask(nibcount_avx512(_mm512_and_si512(both, sd)), lim) |
+                     _mm512_cmplt_epu64_mask(nibcount_avx512(_mm512_and_si512(both, td)), lim)) & live;
+    if (!pass) return 0;
+    uint64_t lanes[8];
+    _mm512_storeu_si512((void *)lanes, w);
+    for (unsigned m = pass; m; m &= m - 1) {
+        if (indel1_within(qcode, lanes[__builtin_ctz(m)], max_sub)) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int scan_d_avx512(const uint64_t *codes, const uint32_t *idpos, uint32_t id_mask, int n, uint64_t qcode,
+                         int max_sub) {
+    const __m256i idmask = _mm256_set1_epi32((int)id_mask);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i vi = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(idpos + i)), idmask);
+        if (d_lanes_avx512(_mm512_i32gather_epi64(vi, (const void *)codes, 8), qcode, max_sub, 0xFF)) return 1;
+    }
+    for (; i < n; ++i) {
+        if (indel1_within(qcode, codes[idpos[i] & id_mask], max_sub)) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int scan_ds_avx512(const uint64_t *codes, const uint32_t *idpos, uint32_t id_mask, int n, uint64_t qcode,
+                          int max_sub, const uint64_t *acc) {
+    const __m256i accv = _mm256_loadu_si256((const __m256i *)acc);
+    const __m256i idmask = _mm256_set1_epi32((int)id_mask);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(idpos + i));
+        __mmask8 live = (__mmask8)_mm256_movemask_ps(_mm256_castsi256_ps(dsig_pass8_avx2(v, accv)));
+        if (!live) continue;
+        __m512i w = _mm512_mask_i32gather_epi64(_mm512_setzero_si512(), live, _mm256_and_si256(v, idmask),
+                                                (const void *)codes, 8);
+        if (d_lanes_avx512(w, qcode, max_sub, live)) return 1;
+    }
+    for (; i < n; ++i) {
+        if (dsig_pass(acc, idpos[i]) && indel1_within(qcode, codes[idpos[i] & id_mask], max_sub)) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i unpack8_avx512(const uint8_t *pids, __m512i off, __m512i idmask) {
+    __m512i w = _mm512_i64gather_epi64(_mm512_srli_epi64(off, 3), (const void *)pids, 1);
+    return _mm512_and_si512(_mm512_srlv_epi64(w, _mm512_and_si512(off, _mm512_set1_epi64(7))), idmask);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i pack_offsets8(int start, int bits) {
+    long long b0 = (long long)start * bits, b = bits;
+    return _mm512_set_epi64(b0 + 7 * b, b0 + 6 * b, b0 + 5 * b, b0 + 4 * b, b0 + 3 * b, b0 + 2 * b, b0 + b, b0);
+}
+
+/* 8 件組の id → codes。幅が CF_PACK_SHUF_BITS 以下なら pshufb 版（unpack8_shuf_avx2 と同じ表）、超えれば gather 版 */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i packed_codes8_avx512(const uint64_t *codes, const uint8_t *pids, const PackLut *lut,
+                                           const uint8_t *g, int ph, __m512i off) {
+    const int bits = lut->bits;
+    if (bits <= CF_PACK_SHUF_BITS) {
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)g)),
+                                            _mm_loadu_si128((const __m128i *)(g + lut->hi[ph])), 1);
+        v = _mm256_shuffle_epi8(v, _mm256_loadu_si256((const __m256i *)lut->ctl[ph]));
+        v = _mm256_and_si256(_mm256_srlv_epi32(v, _mm256_loadu_si256((const __m256i *)lut->shift[ph])),
+                             _mm256_set1_epi32((int)((1u << bits) - 1)));
+        return _mm512_i32gather_epi64(v, (const void *)codes, 8);
+    }
+    return _mm512_i64gather_epi64(unpack8_avx512(pids, off, _mm512_set1_epi64((long long)((1u << bits) - 1))),
+                                  (const void *)codes, 8);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int scan_hp_avx512(const uint64_t *codes, const uint8_t *pids, const PackLut *lut, int start, int n,
+                          uint64_t qcode, int k) {
+    const int bits = lut->bits;
+    const __m512i q = _mm512_set1_epi64((long long)qcode);
+    const __m512i m15 = _mm512_set1_epi64(0x111111111111111LL);
+    const __m512i lim = _mm512_set1_epi64(k + 1);
+    const __m512i step = _mm512_set1_epi64(8LL * bits);
+    const uint8_t *g = pids + (((uint64_t)start * bits) >> 3);
+    int ph = (int)(((uint64_t)start * bits) & 7);
+    __m512i off = pack_offsets8(start, bits);
+    int i = 0;
+    for (; i + 8 <= n; i += 8, g += bits, off = _mm512_add_epi64(off, step)) {
+        __m512i c = packed_codes8_avx512(codes, pids, lut, g, ph, off);
+        __m512i cnt = nibcount_avx512(nibdiff_avx512(_mm512_xor_si512(c, q), m15));
+        if (_mm512_cmplt_epu64_mask(cnt, lim)) return 1;
+    }
+    for (; i < n; ++i) {
+        if (hamming_packed15(qcode, codes[packed_get(pids, bits, (size_t)start + i)]) <= k) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int scan_dp_avx512(const uint64_t *codes, const uint8_t *pids, const PackLut *lut, int start, int n,
+                          uint64_t qcode, int max_sub) {
+    const int bits = lut->bits;
+    const __m512i step = _mm512_set1_epi64(8LL * bits);
+    const uint8_t *g = pids + (((uint64_t)start * bits) >> 3);
+    int ph = (int)(((uint64_t)start * bits) & 7);
+    __m512i off = pack_offsets8(start, bits);
+    int i = 0;
+    for (; i + 8 <= n; i += 8, g += bits, off = _mm512_add_epi64(off, step)) {
+        if (d_lanes_avx512(packed_codes8_avx512(codes, pids, lut, g, ph, off), qcode, max_sub, 0xFF)) return 1;
+    }
+    for (; i < n; ++i) {
+        if (indel1_within(qcode, codes[packed_get(pids, bits, (size_t)start + i)], max_sub)) return 1;
+    }
+    return 0;
+}
+#endif
+
+/* name: "auto" / "scalar" / "avx2" / "avx512"。CPU が対応しない指定は 0 を返して現状維持。
+ * スレッド起動前に1回呼ぶこと（verify_kernel はプロセス共通） */
+int casefilter_select_kernel(const char *name) {
+    int is_auto = !name || strcmp(name, "auto") == 0;
+    if (!is_auto && strcmp(name, "scalar") == 0) {
+        VerifyKernel k = {"scalar", NULL, NULL, scan_hfat_scalar, NULL, NULL, NULL};
+        verify_kernel = k;
+        return 1;
+    }
+#ifdef CF_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    int has512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    int has2 = __builtin_cpu_supports("avx2");
+    if ((is_auto || strcmp(name, "avx512") == 0) && has512) {
+        VerifyKernel k = {"avx512", scan_h_avx512, scan_d_avx512, scan_hfat_avx512, scan_hp_avx512, scan_dp_avx512,
+                          scan_ds_avx512};
+        verify_kernel = k;
+        return 1;
+    }
+    if ((is_auto || strcmp(name, "avx2") == 0) && has2) {
+        VerifyKernel k = {"avx2", scan_h_avx2, scan_d_avx2, scan_hfat_avx2, scan_hp_avx2, scan_dp_avx2, scan_ds_avx2};
+        verify_kernel = k;
+        return 1;
+    }
+#endif
+    if (is_auto) {
+        VerifyKernel k = {"scalar", NULL, NULL, scan_hfat_scalar, NULL, NULL, NULL};
+        verify_kernel = k;
+        return 1;
+    }
+    return 0;
+}
+
+const char *casefilter_kernel_name(void) {
+    return verify_kernel.name;
+}
+
+/* クエリ1件分の探索計画: スロット番号とポスティング範囲。バッチ版はこれを段階的に埋め、間にプリフェッチを挟む */
+typedef struct {
+    uint64_t qcode;
+    uint16_t hmask;    /* 完全一致で引く Case A の群（k の被覆から文字種の外を含む群を除いたもの） */
+    uint16_t hsub;     /* 1 置換近傍も引く群（分割方式の radius[k] が 1 のときだけ） */
+    uint16_t foreign;  /* bit i: 文字 i が文字種の外 */
+    uint8_t scheme;
+    int8_t hfix[CASEFILTER_HPAIR_COUNT];  /* 群内で外の文字の順位（近傍はその文字だけ置き換える）。無ければ -1 */
+    uint32_t hslot[CASEFILTER_HPAIR_COUNT];
+    int hstart[CASEFILTER_HPAIR_COUNT];
+    int hlen[CASEFILTER_HPAIR_COUNT];
+    uint8_t order[CASEFILTER_HPAIR_COUNT];
+    uint32_t dslot[KEYWORD_LEN * 2];  /* Case B の左7/右7スロット（重複除去済み） */
+    int dstart[KEYWORD_LEN * 2];
+    int dlen[KEYWORD_LEN * 2];
+    int dslot_count;
+    int8_t dsub;                        /* Case B の max_sub（k - 2） */
+    uint8_t dsrc[KEYWORD_LEN * 2];      /* [pos * 2 + side]: その削除キーが落ちた dslot 番号（引かなければ 0xFF） */
+    uint64_t dacc[KEYWORD_LEN * 2][4];  /* 近傍署名: dslot ごとに通り得る署名（plan_resolve_d が作る） */
+    uint8_t visit[CASEFILTER_HPAIR_COUNT + KEYWORD_LEN * 2];  /* cost 計画: < 10 は H ペア、以降は 10 + dslot 番号 */
+    int visit_count;
+#ifdef CASEFILTER_STATS
+    uint8_t dpos[KEYWORD_LEN * 2];  /* dslot を作った削除位置 */
+    QueryStats *st;
+#endif
+} QueryPlan;
+
+#ifdef CASEFILTER_STATS
+static inline void stat_begin(QueryPlan *pl, QueryStats *st) {
+    memset(st, 0, sizeof(*st));
+    st->phase = -1;
+    st->scheme = pl->scheme;
+    pl->st = st;
+}
+
+static inline void stat_hit(const QueryPlan *pl, int phase, int where) {
+    pl->st->phase = phase;
+    pl->st->where = where;
+}
+
+static void stat_fold(CaseFilterSearchCtx *ctx, const QueryStats *q) {
+    CaseFilterStats *s = &ctx->stats;
+    s->queries++;
+    s->scheme_queries[q->scheme]++;
+    s->h_probe += q->h_probe;
+    s->h_empty += q->h_empty;
+    s->d_probe += q->d_probe;
+    s->d_empty += q->d_empty;
+    s->cand_a += q->cand_a;
+    s->cand_b += q->cand_b;
+    s->cand_b_sig += q->cand_b_sig;
+    s->cand_delta += q->cand_delta;
+    if (q->phase >= 0) {
+        s->hits++;
+        s->hit_phase[q->phase]++;
+        if (q->phase == CF_PHASE_TIER1 || q->phase == CF_PHASE_A) s->hit_pair[q->where]++;
+        if (q->phase == CF_PHASE_B) s->hit_dpos[q->where]++;
+    }
+    uint64_t work = (uint64_t)q->h_probe + q->d_probe + q->cand_a + q->cand_b + q->cand_delta;
+    int b = 63 - __builtin_clzll(work + 1);
+    s->work_hist[q->phase >= 0][b < CF_STAT_BUCKETS ? b : CF_STAT_BUCKETS - 1]++;
+}
+#endif
+
+/* スロット番号の計算のみ（索引メモリには触れない） */
+static inline uint32_t code_digit(uint64_t code, int i) {
+    return (uint32_t)((code >> (4 * i)) & 0xF);
+}
+
+/* 文字種の外の文字（CF_FOREIGN）の位置の bitmap */
+static inline uint32_t code_foreign(uint64_t code) {
+    uint32_t foreign = 0;
+    for (int i = 0; i < KEYWORD_LEN; ++i) foreign |= (uint32_t)(code_digit(code, i) >= CASEFILTER_ALPHABET) << i;
+    return foreign;
+}
+
+#define CF_BLOCK_SPACE ((uint32_t)(CASEFILTER_ALPHABET * CASEFILTER_ALPHABET * CASEFILTER_ALPHABET))
+
+/* ブロック b（3 文字）の N 進値 */
+static inline uint32_t block_key(uint64_t code, int b) {
+    return code_digit(code, 3 * b) + CASEFILTER_ALPHABET * (code_digit(code, 3 * b + 1) +
+                                                            CASEFILTER_ALPHABET * code_digit(code, 3 * b + 2));
+}
+
+/* 8 文字から 1 文字消した 7 文字のキー。pre[i] = 先頭 i 文字の重み付き和 */
+static inline uint32_t del8_key(const uint32_t *pre, int q) {
+    return pre[q] + (pre[8] - pre[q + 1]) / CASEFILTER_ALPHABET;
+}
+
+/* lo: 文字 0..7、hi: 文字 7..14 の prefix 和 */
+static inline void del_prefix_sums(uint64_t code, uint32_t *lo, uint32_t *hi) {
+    lo[0] = hi[0] = 0;
+    for (uint32_t i = 0, mul = 1; i < 8; ++i, mul *= CASEFILTER_ALPHABET) {
+        lo[i + 1] = lo[i] + code_digit(code, (int)i) * mul;
+        hi[i + 1] = hi[i] + code_digit(code, 7 + (int)i) * mul;
+    }
+}
+
+/* mask の文字を位置の昇順に並べた N 進値（pairs ならペアキーと同じ値）。外の文字は 0 として数える */
+static inline uint32_t group_key(uint64_t code, uint32_t mask) {
+    uint32_t v = 0, mul = 1;
+    for (int i = 0; i < KEYWORD_LEN; ++i) {
+        if (!(mask >> i & 1)) continue;
+        uint32_t d = code_digit(code, i);
+        v += (d < CASEFILTER_ALPHABET ? d : 0) * mul;
+        mul *= CASEFILTER_ALPHABET;
+    }
+    return v;
+}
+
+/* pairs のスロットと引くペアの mask（delta は分割方式に依らずこの形で持つ） */
+static inline unsigned pair_slots(uint64_t code, uint32_t foreign, int k, uint32_t *hslot) {
+    uint32_t blk[5];
+    for (int b = 0; b < 5; ++b) blk[b] = block_key(code, b);
+    unsigned hmask = cf_schemes[CF_SCHEME_PAIRS].cover[k];
+    for (int p = 0; p < CASEFILTER_HPAIR_COUNT; ++p) {
+        if (foreign & (7u << (3 * pair_i[p]) | 7u << (3 * pair_j[p]))) {
+            hmask &= ~(1u << p);
+            hslot[p] = (uint32_t)p * CASEFILTER_H_KEY_SPACE;  /* 引かないが範囲内に置く */
+            continue;
+        }
+        hslot[p] = blk[pair_i[p]] + CF_BLOCK_SPACE * blk[pair_j[p]] + (uint32_t)p * CASEFILTER_H_KEY_SPACE;
+    }
+    return hmask;
+}
+
+/* halves / thirds: 外の文字が 1 つの群は近傍（その文字の置き換え）だけ、2 つ以上なら引かない */
+static inline void group_slots(QueryPlan *pl, const CfScheme *sc, uint32_t foreign, int k) {
+    uint32_t space = cf_scheme_key_space(sc);
+    unsigned hmask = 0, hsub = 0;
+    for (int g = 0; g < CASEFILTER_HPAIR_COUNT; ++g) {
+        pl->hfix[g] = -1;
+        pl->hslot[g] = 0;
+        if (g >= sc->groups || !(sc->cover[k] >> g & 1)) continue;
+        pl->hslot[g] = group_key(pl->qcode, sc->mask[g]) + (uint32_t)g * space;
+        uint32_t f = foreign & sc->mask[g];
+        if (!f) {
+            hmask |= 1u << g;
+            hsub |= (unsigned)sc->radius[k] << g;
+        } else if (sc->radius[k] && !(f & (f - 1))) {
+            hsub |= 1u << g;
+            pl->hfix[g] = (int8_t)popcount64(sc->mask[g] & (f - 1));
+        }
+    }
+    pl->hmask = (uint16_t)hmask;
+    pl->hsub = (uint16_t)hsub;
+}
+
+/* 削除後の反対側の署名が s の (削除位置, 側) を dslot の受理表 acc に足す。max_sub = 0 なら s だけ、
+ * 1 なら 3 欄のうち 2 欄が一致する署名全て（bit 位置 = 署名。欄 c が 64bit 語、a | b << 3 が語内の位置） */
+static inline void dsig_accept(uint64_t acc[4], uint32_t s, int max_sub) {
+    uint32_t a = s & 7, b = s >> 3 & 7, c = s >> 6;
+    if (max_sub <= 0) {
+        acc[c] |= 1ULL << (s & 63);
+        return;
+    }
+    if (max_sub > 1) {
+        acc[0] = acc[1] = acc[2] = acc[3] = ~0ULL;
+        return;
+    }
+    for (int w = 0; w < 4; ++w) acc[w] |= 1ULL << (a | b << 3);  /* a, b が一致 */
+    acc[c] |= 0x0101010101010101ULL << a;                       /* a, c が一致 */
+    acc[c] |= 0xFFULL << (b << 3);                               /* b, c が一致 */
+}
+
+/* キーは code のニブルから直接作る（pack_key6 / pack_key7 と同じ値。merge の emit とも同じ式）。
+ * k の被覆に入らない群・削除キーと、文字種の外の文字（CF_FOREIGN）を含むキーは引かない。
+ * 外の文字は必ず不一致なので、それを含むキーが一致する DB 語は無く、被覆の議論は残りの文字で成り立つ */
+static inline void plan_slots_code(QueryPlan *pl, const CfScheme *sc, uint64_t code, int k) {
+    if (k < 0) k = 0;
+    if (k > MAX_EDIT_DIST) k = MAX_EDIT_DIST;
+    pl->qcode = code;
+    uint32_t foreign = code_foreign(code);
+    pl->foreign = (uint16_t)foreign;
+    pl->scheme = (uint8_t)(sc - cf_schemes);
+    if (pl->scheme == CF_SCHEME_PAIRS) {
+        pl->hmask = (uint16_t)pair_slots(code, foreign, k, pl->hslot);
+        pl->hsub = 0;
+    } else {
+        group_slots(pl, sc, foreign, k);
+    }
+    /* 同じ文字の連続を削除しても同じ14文字列になるので連の先頭だけ。さらに pos>=7 の左7と pos<=7 の右7は
+     * 全て同一キーになるため、スロット単位で重複を落とす（最大30 → 16） */
+    pl->dslot_count = 0;
+    pl->dsub = (int8_t)(k - 2);
+    memset(pl->dsrc, 0xFF, sizeof(pl->dsrc));
+    int sides = cf_del_sides[k];
+    if (!sides) return;
+    uint32_t lo[9], hi[9];
+    del_prefix_sums(code, lo, hi);
+    for (int pos = 0; pos < KEYWORD_LEN; ++pos) {
+        if (pos > 0 && code_digit(code, pos) == code_digit(code, pos - 1)) continue;
+        uint32_t keys[2] = {pos <= 7 ? del8_key(lo, pos) : del8_key(lo, 7),
+                            pos >= 7 ? del8_key(hi, pos - 7) : del8_key(hi, 0)};
+        uint32_t span[2] = {pos <= 7 ? 0xFFu & ~(1u << pos) : 0x7Fu, pos >= 7 ? 0x7F80u & ~(1u << pos) : 0x7F00u};
+        for (int side = 0; side < sides; ++side) {
+            if (foreign & span[side]) continue;
+            int j = 0;
+            while (j < pl->dslot_count && pl->dslot[j] != keys[side]) ++j;
+            if (j == pl->dslot_count) {
+                CF_STAT(pl->dpos[pl->dslot_count] = (uint8_t)pos);
+                pl->dslot[pl->dslot_count++] = keys[side];
+            }
+            pl->dsrc[pos * 2 + side] = (uint8_t)j;
+        }
+    }
+}
+
+static inline void plan_slots(QueryPlan *pl, const CfScheme *sc, const char *query, int k) {
+    plan_slots_code(pl, sc, pack_keyword(query), k);
+}
+
+static inline void plan_resolve_h_pair(const CaseFilterIndex *idx, QueryPlan *pl, int p) {
+    uint32_t slot = pl->hslot[p];
+    pl->hstart[p] = 0;
+    pl->hlen[p] = 0;
+    if (!(pl->hmask >> p & 1)) return;
+    if (occ_test(idx->hidx.occ, slot)) pl->hlen[p] = slot_range(idx->hidx.offsets, &idx->hidx.sdir, slot, &pl->hstart[p]);
+    CF_STAT(pl->st->h_probe++; pl->st->h_empty += pl->hlen[p] == 0);
+}
+
+/* Case A のディレクトリを引く。done のペアは検証済みとして長さ 0 にする */
+static inline void plan_resolve_h(const CaseFilterIndex *idx, QueryPlan *pl, unsigned done) {
+    for (int p = 0; p < CASEFILTER_HPAIR_COUNT; ++p) {
+        pl->order[p] = (uint8_t)p;
+        if (done >> p & 1) {
+            pl->hstart[p] = 0;
+            pl->hlen[p] = 0;
+            continue;
+        }
+        plan_resolve_h_pair(idx, pl, p);
+    }
+}
+
+/* staged: Case A を長さ順に並べる */
+static inline void plan_order_h(QueryPlan *pl) {
+    /* sort keys by posting length (small→大) to早期ヒット狙い */
+    for (int i = 0; i < CASEFILTER_HPAIR_COUNT; ++i) {
+        for (int j = i + 1; j < CASEFILTER_HPAIR_COUNT; ++j) {
+            if (pl->hlen[pl->order[i]] > pl->hlen[pl->order[j]]) {
+                uint8_t tmp = pl->order[i]; pl->order[i] = pl->order[j]; pl->order[j] = tmp;
+            }
+        }
+    }
+}
+
+/* 近傍署名の受理表: dslot ごとに、そのスロットに落ちた全ての (削除位置, 側) の反対側を足す。
+ * 同じスロットに左7と右7、複数の削除位置が重なっても、正しい組のポスティングはその組の署名で通る */
+static inline void plan_dsig(QueryPlan *pl) {
+    memset(pl->dacc, 0, sizeof(pl->dacc[0]) * (size_t)pl->dslot_count);
+    for (int i = 0; i < KEYWORD_LEN * 2; ++i) {
+        if (pl->dsrc[i] != 0xFF) dsig_accept(pl->dacc[pl->dsrc[i]], cf_dsig_at(pl->qcode, i >> 1, i & 1), pl->dsub);
+    }
+}
+
+/* Case B のディレクトリを引く（Case A で外れたクエリだけ） */
+static inline void plan_resolve_d(const CaseFilterIndex *idx, QueryPlan *pl) {
+    if (idx->del7.sig) plan_dsig(pl);
+    for (int d = 0; d < pl->dslot_count; ++d) {
+        pl->dstart[d] = 0;
+        pl->dlen[d] = 0;
+        if (occ_test(idx->del7.occ, pl->dslot[d])) {
+            pl->dlen[d] = slot_range(idx->del7.offsets, &idx->del7.sdir, pl->dslot[d], &pl->dstart[d]);
+        }
+        CF_STAT(pl->st->d_probe++; pl->st->d_empty += pl->dlen[d] == 0);
+    }
+}
+
+static int dead_code_has(const CaseFilterIndex *idx, uint64_t code);
+
+/* code の開番地集合（完全一致・削除集合）: 線形探査、空きは CODE_SET_EMPTY。prep の code_hash と同じ式 */
+#define CODE_SET_EMPTY (~0ULL)  /* code は 60bit なので衝突しない */
+
+static inline uint32_t code_hash(uint64_t code, uint32_t cap) {
+    return (uint32_t)((code * 0x9E3779B97F4A7C15ULL) >> 32) & (cap - 1);
+}
+
+/* 段階探索 1: 完全一致（ほぼ 1 ライン）。削除済みの code なら外れ扱い */
+static inline int probe_exact(const CaseFilterIndex *idx, uint64_t qcode) {
+    uint32_t mask = idx->exact_cap - 1;
+    uint32_t h = code_hash(qcode, idx->exact_cap);
+    for (uint32_t n = 0; n < idx->exact_cap; ++n, h = (h + 1) & mask) {
+        if (idx->exact[h] == qcode) return !idx->dead_count || !dead_code_has(idx, qcode);
+        if (idx->exact[h] == CODE_SET_EMPTY) return 0;
+    }
+    return 0;
+}
+
+/* 削除済みの base id か（tombstone が無ければ常に 0） */
+static inline int base_dead(const CaseFilterIndex *idx, int id) {
+    return idx->tomb && occ_test(idx->tomb, (uint32_t)id);
+}
+
+/* tombstone 付きの fat run: id が無いので、Hamming を通った候補の code を削除集合と突き合わせる */
+static int scan_hfat_live(const CaseFilterIndex *idx, const uint64_t *fat, int n, uint64_t qcode, int k) {
+    for (int i = 0; i < n; ++i) {
+        if (hamming_packed15(qcode, fat[i]) <= k && !dead_code_has(idx, fat[i])) return 1;
+    }
+    return 0;
+}
+
+/* H リストの範囲 [start, start+len) を Hamming<=k で検証する */
+static int scan_h_run(const CaseFilterIndex *idx, uint32_t *visited, uint32_t gen, const QueryPlan *pl, int start,
+                      int len, int k) {
+    if (len == 0) return 0;
+    CF_STAT(pl->st->cand_a += (uint32_t)len);
+    if (idx->hidx.fat) {
+        const uint64_t *fat = idx->hidx.fat + start;
+        return idx->dead_count ? scan_hfat_live(idx, fat, len, pl->qcode, k)
+                               : verify_kernel.scan_hfat(fat, len, pl->qcode, k);
+    }
+    /* ベクトル版はどのレーンが通ったかを返さないので、tombstone があればスカラーで id を見る */
+    if (idx->hidx.pids) {
+        if (verify_kernel.scan_hp && !idx->tomb) {
+            return verify_kernel.scan_hp(idx->codes, idx->hidx.pids, &idx->pack, start, len, pl->qcode, k);
+        }
+    } else if (verify_kernel.scan_h && !idx->tomb) {
+        return verify_kernel.scan_h(idx->codes, idx->hidx.ids + start, len, pl->qcode, k);
+    }
+    for (int i = start; i < start + len; ++i) {
+        int id = h_id(idx, i);
+        if (visited[id] == gen) continue;
+        visited[id] = gen;
+        int hd = hamming_packed15(pl->qcode, idx->codes[id]);
+        if (hd <= k && !base_dead(idx, id)) return 1;
+    }
+    return 0;
+}
+
+/* 群 p の完全一致リスト */
+static inline int scan_h_pair(const CaseFilterIndex *idx, uint32_t *visited, uint32_t gen, const QueryPlan *pl, int p,
+                              int k) {
+    return scan_h_run(idx, visited, gen, pl, pl->hstart[p], pl->hlen[p], k);
+}
+
+/* 群 g の 1 置換近傍: キーの 1 文字を別の文字にしたスロットを引いて検証する（完全一致は scan_h_pair が見る）。
+ * hfix があればその文字（キー上は 0 として数えた外の文字）を全ての文字に置き換えたものだけ */
+static int scan_h_subs(const CaseFilterIndex *idx, uint32_t *visited, uint32_t gen, const QueryPlan *pl, int g, int k) {
+    const CfScheme *sc = CF_SCHEME(idx);
+    uint32_t mul = 1;
+    for (int i = 0, r = 0; i < KEYWORD_LEN; ++i) {
+        if (!(sc->mask[g] >> i & 1)) continue;
+        if (pl->hfix[g] < 0 || pl->hfix[g] == r) {
+            uint32_t d = pl->hfix[g] < 0 ? code_digit(pl->qcode, i) : 0;
+            uint32_t rest = pl->hslot[g] - d * mul;
+            for (uint32_t c = 0; c < CASEFILTER_ALPHABET; ++c) {
+                if (c == d && pl->hfix[g] < 0) continue;
+                uint32_t slot = rest + c * mul;
+                int start = 0, len = 0;
+                if (occ_test(idx->hidx.occ, slot)) len = slot_range(idx->hidx.offsets, &idx->hidx.sdir, slot, &start);
+                CF_STAT(pl->st->h_probe++; pl->st->h_empty += len == 0);
+                if (scan_h_run(idx, visited, gen, pl, start, len, k)) return 1;
+            }
+        }
+        mul *= CASEFILTER_ALPHABET;
+        ++r;
+    }
+    return 0;
+}
+
+/* Case A の近傍（hsub の群。pairs では常に空） */
+static int verify_case_a_subs(const CaseFilterIndex *idx, uint32_t *visited, uint32_t gen, const QueryPlan *pl,
+                              int k) {
+    for (int g = 0; g < CASEFILTER_HPAIR_COUNT; ++g) {
+        if (!(pl->hsub >> g & 1) || !scan_h_subs(idx, visited, gen, pl, g, k)) continue;
+        CF_STAT(stat_hit(pl, CF_PHASE_A, g));
+        return 1;
+    }
+    return 0;
+}
+
+/* Case A: Hamming<=3 via pair keys */
+static int verify_case_a(const CaseFilterIndex *idx, uint32_t *visited, uint32_t gen,
+                         const QueryPlan *pl, int k) {
+    for (int oi = 0; oi < CASEFILTER_HPAIR_COUNT; ++oi) {
+        if (!scan_h_pair(idx, visited, gen, pl, pl->order[oi], k)) continue;
+        CF_STAT(stat_hit(pl, CF_PHASE_A, pl->order[oi]));
+        return 1;
+    }
+    return 0;
+}
+
+/* 段階探索 2: 距離 1 の近傍。tier1 の 2 群（pairs ならブロック {0,1} と {2,3}）は互いに素なので、1 文字の置換では
+ * どちらかの群キーが必ず一致する（長さが同じなので距離 1 は置換だけ）。2 本のリストを並べ替えなしで見て、
+ * 通れば Hamming<=k で確定 */
+static inline unsigned tier1_mask(const CfScheme *sc) {
+    return (1u << sc->tier1[0]) | (1u << sc->tier1[1]);
+}
+
+static int verify_tier1(const CaseFilterIndex *idx, uint32_t *visited, uint32_t gen, const QueryPlan *pl, int k) {
+    const CfScheme *sc = CF_SCHEME(idx);
+    for (int t = 0; t < 2; ++t) {
+        if (!scan_h_pair(idx, visited, gen, pl, sc->tier1[t], k)) continue;
+        CF_STAT(stat_hit(pl, CF_PHASE_TIER1, sc->tier1[t]));
+        return 1;
+    }
+    return 0;
+}
+
+/* acc は近傍署名の受理表（署名の無い索引は NULL）。署名で落とした id は visited に残さない
+ * （同じ id の別のポスティングが正しい組で通り得る） */
+static inline int scan_del_slot(const CaseFilterIndex *idx, uint32_t *visited, uint32_t gen,
+                                int start, int len, uint64_t qcode, int max_sub, const uint64_t *acc) {
+    if (len == 0) return 0;
+    if (acc) {
+        if (verify_kernel.scan_ds && !idx->tomb) {
+            return verify_kernel.scan_ds(idx->codes, idx->del7.idpos + start, idx->del7.id_mask, len, qcode, max_sub,
+                                         acc);
+        }
+    } else if (idx->del7.pids) {
+        if (verify_kernel.scan_dp && !idx->tomb) {
+            return verify_kernel.scan_dp(idx->codes, idx->del7.pids, &idx->pack, start, len, qcode, max_sub);
+        }
+    } else if (verify_kernel.scan_d && !idx->tomb) {
+        return verify_kernel.scan_d(idx->codes, idx->del7.idpos + start, idx->del7.id_mask, len, qcode, max_sub);
+    }
+    for (int i = start; i < start + len; ++i) {
+        if (acc && !dsig_pass(acc, idx->del7.idpos[i])) continue;
+        int id = d_id(idx, i);
+        if (visited[id] == gen) continue;
+        visited[id] = gen;
+        if (indel1_within(qcode, idx->codes[id], max_sub) && !base_dead(idx, id)) return 1;
+    }
+    return 0;
+}
+
+static inline const uint64_t *plan_dacc(const CaseFilterIndex *idx, const QueryPlan *pl, int d) {
+    return idx->del7.sig ? pl->dacc[d] : NULL;
+}
+
+#ifdef CASEFILTER_STATS
+/* 署名を通って codes を読む候補数（署名の無い索引はリスト長） */
+static uint32_t dsig_survivors(const CaseFilterIndex *idx, const QueryPlan *pl, int d) {
+    if (!idx->del7.sig) return (uint32_t)pl->dlen[d];
+    uint32_t n = 0;
+    for (int i = pl->dstart[d]; i < pl->dstart[d] + pl->dlen[d]; ++i)
+        n += (uint32_t)dsig_pass(pl->dacc[d], idx->del7.idpos[i]);
+    return n;
+}
+#endif
+
+/* Case B: delete-one -> 14char Hamming<=k-2（削除+挿入でコスト2） */
+static int verify_case_b(const CaseFilterIndex *idx, uint32_t *visited, uint32_t gen,
+                         const QueryPlan *pl, int k) {
+    if (k < 2) return 0;
+    for (int j = 0; j < pl->dslot_count; ++j) {
+        CF_STAT(pl->st->cand_b += (uint32_t)pl->dlen[j]; pl->st->cand_b_sig += dsig_survivors(idx, pl, j));
+        if (!scan_del_slot(idx, visited, gen, pl->dstart[j], pl->dlen[j], pl->qcode, k - 2, plan_dacc(idx, pl, j))) {
+            continue;
+        }
+        CF_STAT(stat_hit(pl, CF_PHASE_B, pl->dpos[j]));
+        return 1;
+    }
+    return 0;
+}
+
+/* ===== cost 計画（--planner cost） =====
+ * staged は Case A の 10 本を長さ順に見終えてから Case B に進む。cost は A 10 本と B の全スロットの長さを
+ * 先に引き、重み付きの長さが小さい順に 1 本ずつ見る（indel=1 にしか近傍が無いクエリで長い A を読まない）。
+ * 長さはクエリごとにディレクトリから正確に分かるので、prep 側の統計は持たない。
+ * visited は A と B で別の世代を使う（Hamming で落ちた id も indel1 では通り得る）。
+ */
+#define CF_COST_D_WEIGHT 2  /* indel1_within は hamming_packed15 の約 2 倍 */
+#define CF_PLAN_D 0x80u     /* visit の B 印（下位 7bit が dslot 番号） */
+
+enum { CF_PLANNER_STAGED = 0, CF_PLANNER_COST = 1 };
+static int probe_planner = CF_PLANNER_STAGED;
+
+/* name: "staged" / "cost"。スレッド起動前に 1 回呼ぶこと */
+int casefilter_select_planner(const char *name) {
+    if (strcmp(name, "staged") == 0) probe_planner = CF_PLANNER_STAGED;
+    else if (strcmp(name, "cost") == 0) probe_planner = CF_PLANNER_COST;
+    else return 0;
+    return 1;
+}
+
+/* 解決済みの A / B の長さから visit を作る（空リストは入れない）。done の A ペアは検証済み */
+static inline void plan_order_cost(QueryPlan *pl, unsigned done, int k) {
+    int cost[CASEFILTER_HPAIR_COUNT + KEYWORD_LEN * 2];
+    int n = 0;
+    for (int p = 0; p < CASEFILTER_HPAIR_COUNT; ++p) {
+        if (!pl->hlen[p] || (done >> p & 1)) continue;
+        pl->visit[n] = (uint8_t)p;
+        cost[n++] = pl->hlen[p];
+    }
+    for (int d = 0; k >= 2 && d < pl->dslot_count; ++d) {
+        if (!pl->dlen[d]) continue;
+        pl->visit[n] = (uint8_t)(CF_PLAN_D | d);
+        cost[n++] = pl->dlen[d] * CF_COST_D_WEIGHT;
+    }
+    /* 挿入ソート（高々 40 本、同じコストなら A が先） */
+    for (int i = 1; i < n; ++i) {
+        uint8_t v = pl->visit[i];
+        int c = cost[i], j = i;
+        for (; j > 0 && cost[j - 1] > c; --j) {
+            pl->visit[j] = pl->visit[j - 1];
+            cost[j] = cost[j - 1];
+        }
+        pl->visit[j] = v;
+        cost[j] = c;
+    }
+    pl->visit_count = n;
+}
+
+static int verify_cost(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, const QueryPlan *pl, int k) {
+    uint32_t gen_a = ctx_next_gen(ctx);
+    uint32_t gen_b = ctx_next_gen(ctx);
+    for (int i = 0; i < pl->visit_count; ++i) {
+        int v = pl->visit[i];
+        if (!(v & CF_PLAN_D)) {
+            if (!scan_h_pair(idx, ctx->visited, gen_a, pl, v, k)) continue;
+            CF_STAT(stat_hit(pl, CF_PHASE_A, v));
+            return 1;
+        }
+        int d = v & ~CF_PLAN_D;
+        CF_STAT(pl->st->cand_b += (uint32_t)pl->dlen[d]; pl->st->cand_b_sig += dsig_survivors(idx, pl, d));
+        if (!scan_del_slot(idx, ctx->visited, gen_b, pl->dstart[d], pl->dlen[d], pl->qcode, k - 2,
+                           plan_dacc(idx, pl, d))) {
+            continue;
+        }
+        CF_STAT(stat_hit(pl, CF_PHASE_B, pl->dpos[d]));
+        return 1;
+    }
+    return 0;
+}
+
+/* ===== 差分索引（delta）と tombstone =====
+ * 不変の base（CSR）の横に追加キーワード用の小さな可変索引を置く。Case A / B のキーは base と同じで、
+ * ポスティングは build 時と同じ PostingH / PostingDel のハッシュ連鎖（バケットは slot 番号のハッシュ）。
+ * 削除は base id の tombstone bitmap と delta id の dead bitmap。fat postings は id を持たないので、
+ * 削除した code の集合も持つ。どちらも候補が通ったときにだけ見る。
+ * casefilter_merge は生きている base + delta から新しい base を作る（下の CaseFilterLive が別スレッドで回す）。
+ */
+#define DELTA_INIT_BUCKET_BITS 10
+typedef struct CaseFilterDelta {
+    uint64_t *codes;   /* [cap]: delta id → code */
+    uint64_t *dead;    /* [OCC_WORDS(cap)]: 削除済み delta id */
+    int count;
+    int cap;
+    int dead_count;
+    PostingH **hb;     /* [1 << hb_bits] */
+    PostingDel **db;   /* [1 << db_bits] */
+    uint64_t *h_occ;   /* [OCC_WORDS(H スロット数)]: リストのあるスロット（ミスでは連鎖を辿らない） */
+    uint64_t *d_occ;   /* [OCC_WORDS(CASEFILTER_DEL_KEY_SPACE)] */
+    int hb_bits;
+    int db_bits;
+    int h_lists;
+    int d_lists;
+} CaseFilterDelta;
+
+static inline uint32_t delta_hash(uint32_t slot, int bits) {
+    return (slot * 2654435761u) >> (32 - bits);
+}
+
+static inline uint32_t posting_h_slot(const PostingH *p) {
+    return pack_key6(p->key) + (uint32_t)p->pair_id * CASEFILTER_H_KEY_SPACE;
+}
+
+static PostingH *delta_h_find(const CaseFilterDelta *dl, uint32_t slot) {
+    for (PostingH *p = dl->hb[delta_hash(slot, dl->hb_bits)]; p; p = p->next) {
+        if (posting_h_slot(p) == slot) return p;
+    }
+    return NULL;
+}
+
+static PostingDel *delta_d_find(const CaseFilterDelta *dl, uint32_t slot) {
+    for (PostingDel *p = dl->db[delta_hash(slot, dl->db_bits)]; p; p = p->next) {
+        if (pack_key7(p->key) == slot) return p;
+    }
+    return NULL;
+}
+
+static void delta_free(CaseFilterDelta *dl) {
+    if (!dl) return;
+    for (int b = 0; b < (1 << dl->hb_bits); ++b) {
+        for (PostingH *p = dl->hb[b], *next; p; p = next) {
+            next = p->next;
+            free(p->ids);
+            free(p);
+        }
+    }
+    for (int b = 0; b < (1 << dl->db_bits); ++b) {
+        for (PostingDel *p = dl->db[b], *next; p; p = next) {
+            next = p->next;
+            free(p->ids);
+            free(p->del_pos);
+            free(p);
+        }
+    }
+    free(dl->hb);
+    free(dl->db);
+    free(dl->h_occ);
+    free(dl->d_occ);
+    free(dl->codes);
+    free(dl->dead);
+    free(dl);
+}
+
+static CaseFilterDelta *delta_create(void) {
+    CaseFilterDelta *dl = (CaseFilterDelta *)calloc(1, sizeof(CaseFilterDelta));
+    if (!dl) return NULL;
+    dl->hb_bits = dl->db_bits = DELTA_INIT_BUCKET_BITS;
+    dl->hb = (PostingH **)calloc((size_t)1 << dl->hb_bits, sizeof(PostingH *));
+    dl->db = (PostingDel **)calloc((size_t)1 << dl->db_bits, sizeof(PostingDel *));
+    dl->h_occ = (uint64_t *)calloc(OCC_WORDS(CASEFILTER_HPAIR_COUNT * CASEFILTER_H_KEY_SPACE), sizeof(uint64_t));
+    dl->d_occ = (uint64_t *)calloc(OCC_WORDS(CASEFILTER_DEL_KEY_SPACE), sizeof(uint64_t));
+    if (!dl->hb || !dl->db || !dl->h_occ || !dl->d_occ) {
+        delta_free(dl);
+        return NULL;
+    }
+    return dl;
+}
+
+/* リスト数がバケット数を超えたら倍にして繋ぎ直す */
+static void delta_grow_h(CaseFilterDelta *dl) {
+    int bits = dl->hb_bits + 1;
+    PostingH **nb = (PostingH **)calloc((size_t)1 << bits, sizeof(PostingH *));
+    if (!nb) return;  /* 連鎖が伸びるだけ */
+    for (int b = 0; b < (1 << dl->hb_bits); ++b) {
+        for (PostingH *p = dl->hb[b], *next; p; p = next) {
+            next = p->next;
+            uint32_t h = delta_hash(posting_h_slot(p), bits);
+            p->next = nb[h];
+            nb[h] = p;
+        }
+    }
+    free(dl->hb);
+    dl->hb = nb;
+    dl->hb_bits = bits;
+}
+
+static void delta_grow_d(CaseFilterDelta *dl) {
+    int bits = dl->db_bits + 1;
+    PostingDel **nb = (PostingDel **)calloc((size_t)1 << bits, sizeof(PostingDel *));
+    if (!nb) return;
+    for (int b = 0; b < (1 << dl->db_bits); ++b) {
+        for (PostingDel *p = dl->db[b], *next; p; p = next) {
+            next = p->next;
+            uint32_t h = delta_hash(pack_key7(p->key), bits);
+            p->next = nb[h];
+            nb[h] = p;
+        }
+    }
+    free(dl->db);
+    dl->db = nb;
+    dl->db_bits = bits;
+}
+
+static int delta_add_h(CaseFilterDelta *dl, const char *key, int pair, int id) {
+    uint32_t slot = pack_key6(key) + (uint32_t)pair * CASEFILTER_H_KEY_SPACE;
+    PostingH *p = delta_h_find(dl, slot);
+    if (!p) {
+        p = (PostingH *)calloc(1, sizeof(PostingH));
+        if (!p) return 0;
+        memcpy(p->key, key, 6);
+        p->pair_id = (uint8_t)pair;
+        uint32_t h = delta_hash(slot, dl->hb_bits);
+        p->next = dl->hb[h];
+        dl->hb[h] = p;
+        dl->h_occ[slot >> 6] |= 1ULL << (slot & 63);
+        if (++dl->h_lists > (1 << dl->hb_bits)) delta_grow_h(dl);
+    }
+    if (p->count == p->cap) {
+        int cap = p->cap ? p->cap * 2 : 4;
+        int *ids = (int *)realloc(p->ids, sizeof(int) * (size_t)cap);
+        if (!ids) return 0;
+        p->ids = ids;
+        p->cap = cap;
+    }
+    p->ids[p->count++] = id;
+    return 1;
+}
+
+static int delta_add_d(CaseFilterDelta *dl, const char *key, int id, int del_pos) {
+    uint32_t slot = pack_key7(key);
+    PostingDel *p = delta_d_find(dl, slot);
+    if (!p) {
+        p = (PostingDel *)calloc(1, sizeof(PostingDel));
+        if (!p) return 0;
+        memcpy(p->key, key, 7);
+        uint32_t h = delta_hash(slot, dl->db_bits);
+        p->next = dl->db[h];
+        dl->db[h] = p;
+        dl->d_occ[slot >> 6] |= 1ULL << (slot & 63);
+        if (++dl->d_lists > (1 << dl->db_bits)) delta_grow_d(dl);
+    }
+    if (p->count == p->cap) {
+        int cap = p->cap ? p->cap * 2 : 4;
+        int *ids = (int *)realloc(p->ids, sizeof(int) * (size_t)cap);
+        if (!ids) return 0;
+        p->ids = ids;
+        uint8_t *pos = (uint8_t *)realloc(p->del_pos, (size_t)cap);
+        if (!pos) return 0;
+        p->del_pos = pos;
+        p->cap = cap;
+    }
+    p->ids[p->count] = id;
+    p->del_pos[p->count++] = (uint8_t)del_pos;
+    return 1;
+}
+
+static inline void delta_kill(CaseFilterDelta *dl, int id) {
+    dl->dead[id >> 6] |= 1ULL << (id & 63);
+    dl->dead_count++;
+}
+
+/* prep と同じキーで 10 本の H リストと 30 個の削除キーに載せる。途中で確保に失敗したら dead 扱いにする */
+static int delta_add(CaseFilterDelta *dl, const char *word) {
+    if (dl->count == dl->cap) {
+        int cap = dl->cap ? dl->cap * 2 : 64;
+        uint64_t *codes = (uint64_t *)realloc(dl->codes, sizeof(uint64_t) * (size_t)cap);
+        if (!codes) return 0;
+        dl->codes = codes;
+        uint64_t *dead = (uint64_t *)realloc(dl->dead, sizeof(uint64_t) * OCC_WORDS(cap));
+        if (!dead) return 0;
+        memset(dead + OCC_WORDS(dl->cap), 0, sizeof(uint64_t) * (OCC_WORDS(cap) - OCC_WORDS(dl->cap)));
+        dl->dead = dead;
+        dl->cap = cap;
+    }
+    int id = dl->count++;
+    dl->codes[id] = pack_keyword(word);
+    int ok = 1;
+    char blocks[5][3];
+    for (int b = 0; b < 5; ++b) memcpy(blocks[b], word + b * 3, 3);
+    for (int p = 0; p < CASEFILTER_HPAIR_COUNT && ok; ++p) {
+        char key[6];
+        memcpy(key, blocks[pair_i[p]], 3);
+        memcpy(key + 3, blocks[pair_j[p]], 3);
+        ok = delta_add_h(dl, key, p, id);
+    }
+    char del[KEYWORD_LEN - 1];
+    for (int pos = 0; pos < KEYWORD_LEN && ok; ++pos) {
+        memcpy(del, word, pos);
+        memcpy(del + pos, word + pos + 1, KEYWORD_LEN - pos - 1);
+        ok = delta_add_d(dl, del, id, pos) && delta_add_d(dl, del + 7, id, pos);
+    }
+    if (!ok) delta_kill(dl, id);
+    return ok;
+}
+
+/* base と同じキーで delta を引く（リストは短いのでスカラーで十分）。delta の H はいつも pairs なので、
+ * base が別の分割方式ならペアのスロットをここで出す */
+static int delta_search(const CaseFilterDelta *dl, const QueryPlan *pl, int k) {
+    const uint32_t *hslot = pl->hslot;
+    unsigned hmask = pl->hmask;
+    uint32_t pslot[CASEFILTER_HPAIR_COUNT];
+    if (pl->scheme != CF_SCHEME_PAIRS) {
+        hmask = pair_slots(pl->qcode, pl->foreign, k, pslot);
+        hslot = pslot;
+    }
+    for (int p = 0; p < CASEFILTER_HPAIR_COUNT; ++p) {
+        if (!(hmask >> p & 1) || !occ_test(dl->h_occ, hslot[p])) continue;
+        const PostingH *ph = delta_h_find(dl, hslot[p]);
+        CF_STAT(pl->st->cand_delta += ph ? (uint32_t)ph->count : 0);
+        for (int i = 0; ph && i < ph->count; ++i) {
+            int id = ph->ids[i];
+            if (!occ_test(dl->dead, (uint32_t)id) && hamming_packed15(pl->qcode, dl->codes[id]) <= k) return 1;
+        }
+    }
+    if (k < 2) return 0;
+    for (int d = 0; d < pl->dslot_count; ++d) {
+        if (!occ_test(dl->d_occ, pl->dslot[d])) continue;
+        const PostingDel *pd = delta_d_find(dl, pl->dslot[d]);
+        CF_STAT(pl->st->cand_delta += pd ? (uint32_t)pd->count : 0);
+        for (int i = 0; pd && i < pd->count; ++i) {
+            int id = pd->ids[i];
+            if (!occ_test(dl->dead, (uint32_t)id) && indel1_within(pl->qcode, dl->codes[id], k - 2)) return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int delta_live(const CaseFilterDelta *dl) {
+    return dl && dl->count > dl->dead_count;
+}
+
+static int dead_code_has(const CaseFilterIndex *idx, uint64_t code) {
+    if (!idx->dead_count) return 0;
+    for (uint32_t h = code_hash(code, (uint32_t)idx->dead_cap);; h = (h + 1) & (uint32_t)(idx->dead_cap - 1)) {
+        if (idx->dead_codes[h] == code) return 1;
+        if (idx->dead_codes[h] == CODE_SET_EMPTY) return 0;
+    }
+}
+
+/* 占有率 1/2 を超えたら倍にする */
+static int dead_code_add(CaseFilterIndex *idx, uint64_t code) {
+    if (dead_code_has(idx, code)) return 1;
+    if ((idx->dead_count + 1) * 2 > idx->dead_cap) {
+        int cap = idx->dead_cap ? idx->dead_cap * 2 : 64;
+        uint64_t *t = (uint64_t *)malloc(sizeof(uint64_t) * (size_t)cap);
+        if (!t) return 0;
+        for (int i = 0; i < cap; ++i) t[i] = CODE_SET_EMPTY;
+        for (int i = 0; i < idx->dead_cap; ++i) {
+            uint64_t c = idx->dead_codes[i];
+            if (c == CODE_SET_EMPTY) continue;
+            uint32_t h = code_hash(c, (uint32_t)cap);
+            while (t[h] != CODE_SET_EMPTY) h = (h + 1) & (uint32_t)(cap - 1);
+            t[h] = c;
+        }
+        free(idx->dead_codes);
+        idx->dead_codes = t;
+        idx->dead_cap = cap;
+    }
+    uint32_t h = code_hash(code, (uint32_t)idx->dead_cap);
+    while (idx->dead_codes[h] != CODE_SET_EMPTY) h = (h + 1) & (uint32_t)(idx->dead_cap - 1);
+    idx->dead_codes[h] = code;
+    idx->dead_count++;
+    return 1;
+}
+
+/*
+ * base から word と同じ code の id を全て tombstone にする。削除位置 7..14 の左7キーは w[0..7) なので、
+ * その D スロット 1 本だけ見れば全ての複製が見つかる
+ */
+/* id が word の複製なら tombstone を立てて 1、違えば 0、確保に失敗したら -1 */
+static int base_kill(CaseFilterIndex *idx, int id, uint64_t code) {
+    if (idx->codes[id] != code || base_dead(idx, id)) return 0;
+    if (!idx->tomb) {
+        idx->tomb = (uint64_t *)calloc(OCC_WORDS(idx->keyword_count), sizeof(uint64_t));
+        if (!idx->tomb) return -1;
+    }
+    idx->tomb[id >> 6] |= 1ULL << (id & 63);
+    return 1;
+}
+
+/* word の全ての複製は削除キー w[0..7)（左7。d_sides >= 1 の索引）に載っている。削除キーを持たない k <= 1 の
+ * 索引ではペア 0 のリスト、fat でそこにも id が無ければ codes を舐める */
+static int base_delete(CaseFilterIndex *idx, const char *word, uint64_t code) {
+    if (idx->keyword_count == 0) return 0;
+    int list = 0;  /* 1: D のリスト、2: H のリスト、0: codes 全体 */
+    int start = 0, len = idx->keyword_count;
+    if (idx->spec.d_sides) {
+        uint32_t slot = pack_key7(word);
+        if (!occ_test(idx->del7.occ, slot)) return 0;
+        len = slot_range(idx->del7.offsets, &idx->del7.sdir, slot, &start);
+        list = 1;
+    } else if (!idx->hidx.fat) {
+        uint32_t slot = group_key(code, CF_SCHEME(idx)->mask[0]);
+        if (!occ_test(idx->hidx.occ, slot)) return 0;
+        len = slot_range(idx->hidx.offsets, &idx->hidx.sdir, slot, &start);
+        list = 2;
+    }
+    int removed = 0;
+    for (int i = start; i < start + len; ++i) {
+        int id = list == 1 ? d_id(idx, i) : list == 2 ? h_id(idx, i) : i;
+        int r = base_kill(idx, id, code);
+        if (r < 0) return -1;
+        removed += r;
+    }
+    if (removed && !dead_code_add(idx, code)) return -1;
+    return removed;
+}
+
+int casefilter_delta_insert(CaseFilterIndex *idx, const char *word) {
+    if (!idx || !word || (int)strlen(word) != KEYWORD_LEN || !word_in_alphabet(word)) return 0;
+    if (!idx->delta && !(idx->delta = delta_create())) return 0;
+    int ok = delta_add(idx->delta, word);
+    if (ok) casefilter_cache_clear(idx->cache);  /* live では書きロック下なので、並行する探索が古い結果を入れ直すことはない */
+    return ok;
+}
+
+/* base / delta の両方から word を消し、消した件数を返す（確保に失敗したら -1） */
+int casefilter_delta_delete(CaseFilterIndex *idx, const char *word) {
+    if (!idx || !word || (int)strlen(word) != KEYWORD_LEN || !word_in_alphabet(word)) return 0;
+    uint64_t code = pack_keyword(word);
+    int removed = base_delete(idx, word, code);
+    if (removed < 0) return -1;
+    CaseFilterDelta *dl = idx->delta;
+    if (dl) {
+        /* pair 0 のリストに word の全ての複製が載っている */
+        char key[6];
+        memcpy(key, word, 6);
+        const PostingH *ph = delta_h_find(dl, pack_key6(key));
+        for (int i = 0; ph && i < ph->count; ++i) {
+            int id = ph->ids[i];
+            if (dl->codes[id] != code || occ_test(dl->dead, (uint32_t)id)) continue;
+            delta_kill(dl, id);
+            removed++;
+        }
+    }
+    if (removed > 0) casefilter_cache_clear(idx->cache);
+    return removed;
+}
+
+/* 更新ログ: 1 行 1 件、"+WORD" で追加、"-WORD" で削除（先頭記号なしは追加）。適用した件数、不正な行なら -1 */
+int casefilter_delta_apply(CaseFilterIndex *idx, FILE *log) {
+    char buf[KEYWORD_LEN + 3];
+    int applied = 0, line = 0;
+    while (fgets(buf, sizeof(buf), log)) {
+        line++;
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if (buf[0] == '\0') continue;
+        int del = buf[0] == '-';
+        const char *w = (buf[0] == '+' || buf[0] == '-') ? buf + 1 : buf;
+        if ((int)strlen(w) != KEYWORD_LEN) {
+            fprintf(stderr, "delta line %d: expected [+-] and %d characters\n", line, KEYWORD_LEN);
+            return -1;
+        }
+        if (!word_in_alphabet(w)) {
+            fprintf(stderr, "delta line %d: letters must be A-%c\n", line, 'A' + CASEFILTER_ALPHABET - 1);
+            return -1;
+        }
+        if (del ? casefilter_delta_delete(idx, w) < 0 : !casefilter_delta_insert(idx, w)) return -1;
+        applied++;
+    }
+    return applied;
+}
+
+/* base で外れたクエリを delta で引く */
+static inline int search_delta(const CaseFilterIndex *idx, const QueryPlan *pl, int k) {
+    if (!delta_live(idx->delta) || !delta_search(idx->delta, pl, k)) return 0;
+    CF_STAT(stat_hit(pl, CF_PHASE_DELTA, 0));
+    return 1;
+}
+
+static int search_plan(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, QueryPlan *pl, int k) {
+    uint32_t gen = ctx_next_gen(ctx);
+    unsigned done = 0;
+    if (idx->exact) {
+        if (probe_exact(idx, pl->qcode)) {
+            CF_STAT(stat_hit(pl, CF_PHASE_EXACT, 0));
+            return 1;
+        }
+        plan_resolve_h_pair(idx, pl, CF_SCHEME(idx)->tier1[0]);
+        plan_resolve_h_pair(idx, pl, CF_SCHEME(idx)->tier1[1]);
+        if (verify_tier1(idx, ctx->visited, gen, pl, k)) return 1;
+        done = tier1_mask(CF_SCHEME(idx));
+    }
+    plan_resolve_h(idx, pl, done);
+    if (probe_planner == CF_PLANNER_COST) {
+        if (k >= 2) plan_resolve_d(idx, pl);
+        plan_order_cost(pl, done, k);
+        return verify_cost(idx, ctx, pl, k) ||
+               (pl->hsub && verify_case_a_subs(idx, ctx->visited, ctx_next_gen(ctx), pl, k)) ||
+               search_delta(idx, pl, k);
+    }
+    plan_order_h(pl);
+    if (verify_case_a(idx, ctx->visited, gen, pl, k)) return 1;
+    if (pl->hsub && verify_case_a_subs(idx, ctx->visited, gen, pl, k)) return 1;
+    if (k >= 2) {
+        plan_resolve_d(idx, pl);
+        if (verify_case_b(idx, ctx->visited, ctx_next_gen(ctx), pl, k)) return 1;
+    }
+    return search_delta(idx, pl, k);
+}
+
+/* ===== クエリ結果の cache =====
+ * 同じクエリが何度も来るストリーム用。code（60bit）→ 0/1 を 8 件 = 64B の組に入れる開番地表で、組は code_hash で選ぶ。
+ * 1 件は 64bit 1 語（VALID | REF | HIT | code）なので、読み書きは relaxed の atomic で足り、ロックは無い。
+ * 満杯の組は組ごとの針で CLOCK: REF の立った件は REF を落として飛ばし、立っていない件を追い出す。
+ * 引いて当たれば REF を立て、入れたばかりの件は REF 無し（1 度しか来ないクエリから先に出る）。
+ * 競合しても壊れるのは追い出しの順だけで、どの語も同じ索引と k で求めた正しい結果を持つ。
+ */
+#define CF_CACHE_WAYS 8
+#define CF_CACHE_VALID (1ULL << 63)
+#define CF_CACHE_REF (1ULL << 62)
+#define CF_CACHE_HIT (1ULL << 61)
+#define CF_CACHE_CODE ((1ULL << (KEYWORD_LEN * 4)) - 1ULL)
+
+struct CaseFilterCache {
+    uint64_t *slots;  /* [buckets * CF_CACHE_WAYS] */
+    uint8_t *hand;    /* [buckets] CLOCK の針 */
+    uint32_t buckets; /* 2 冪 */
+    int k;
+};
+
+CaseFilterCache *casefilter_cache_create(size_t entries, int k) {
+    if (entries == 0 || k < 0 || k > MAX_EDIT_DIST) return NULL;
+    size_t buckets = 1;
+    while (buckets * CF_CACHE_WAYS < entries && buckets < (1u << 31)) buckets <<= 1;
+    CaseFilterCache *c = (CaseFilterCache *)calloc(1, sizeof(CaseFilterCache));
+    if (!c) return NULL;
+    c->slots = (uint64_t *)cf_array_alloc(sizeof(uint64_t) * CF_CACHE_WAYS * buckets, 0);
+    c->hand = (uint8_t *)calloc(buckets, 1);
+    if (!c->slots || !c->hand) {
+        cf_array_free(c->slots);
+        free(c->hand);
+        free(c);
+        return NULL;
+    }
+    c->buckets = (uint32_t)buckets;
+    c->k = k;
+    casefilter_cache_clear(c);
+    return c;
+}
+
+void casefilter_cache_clear(CaseFilterCache *c) {
+    if (!c) return;
+    size_t n = (size_t)c->buckets * CF_CACHE_WAYS;
+    for (size_t i = 0; i < n; ++i) __atomic_store_n(&c->slots[i], 0, __ATOMIC_RELAXED);
+}
+
+void casefilter_cache_free(CaseFilterCache *c) {
+    if (!c) return;
+    cf_array_free(c->slots);
+    free(c->hand);
+    free(c);
+}
+
+/* 前の cache は解放する（NULL で外すだけ） */
+void casefilter_cache_attach(CaseFilterIndex *idx, CaseFilterCache *cache) {
+    if (!idx) return;
+    casefilter_cache_free(idx->cache);
+    idx->cache = cache;
+}
+
+/* k が cache の k と違えば使わない */
+static inline CaseFilterCache *index_cache(const CaseFilterIndex *idx, int k) {
+    return idx->cache && idx->cache->k == k ? idx->cache : NULL;
+}
+
+static inline uint64_t *cache_bucket(const CaseFilterCache *c, uint64_t code) {
+    return c->slots + (size_t)code_hash(code, c->buckets) * CF_CACHE_WAYS;
+}
+
+/* 0 / 1、無ければ -1 */
+static inline int cache_lookup(CaseFilterCache *c, uint64_t code) {
+    uint64_t *b = cache_bucket(c, code);
+    for (int w = 0; w < CF_CACHE_WAYS; ++w) {
+        uint64_t e = __atomic_load_n(&b[w], __ATOMIC_RELAXED);
+        if ((e & (CF_CACHE_VALID | CF_CACHE_CODE)) != (CF_CACHE_VALID | code)) continue;
+        int hit = (e & CF_CACHE_HIT) != 0;
+        if (!(e & CF_CACHE_REF)) __atomic_compare_exchange_n(&b[w], &e, e | CF_CACHE_REF, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return hit;
+    }
+    return -1;
+}
+
+static void cache_insert(CaseFilterCache *c, uint64_t code, int hit) {
+    uint64_t *b = cache_bucket(c, code);
+    uint8_t *hand = &c->hand[code_hash(code, c->buckets)];
+    int victim = -1;
+    for (int w = 0; w < CF_CACHE_WAYS; ++w) {
+        uint64_t e = __atomic_load_n(&b[w], __ATOMIC_RELAXED);
+        if ((e & (CF_CACHE_VALID | CF_CACHE_CODE)) == (CF_CACHE_VALID | code)) return;  /* 他のスレッドが入れた */
+        if (!(e & CF_CACHE_VALID) && victim < 0) victim = w;
+    }
+    if (victim < 0) {
+        int h = __atomic_load_n(hand, __ATOMIC_RELAXED);
+        /* 全件に REF が立っていても 1 周で全て落ちるので、2 周目の頭で必ず決まる */
+        for (int step = 0; step <= CF_CACHE_WAYS; ++step, h = (h + 1) & (CF_CACHE_WAYS - 1)) {
+            uint64_t e = __atomic_load_n(&b[h], __ATOMIC_RELAXED);
+            if (!(e & CF_CACHE_REF)) break;
+            __atomic_compare_exchange_n(&b[h], &e, e & ~CF_CACHE_REF, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+        victim = h;
+        __atomic_store_n(hand, (uint8_t)((h + 1) & (CF_CACHE_WAYS - 1)), __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&b[victim], CF_CACHE_VALID | (hit ? CF_CACHE_HIT : 0) | code, __ATOMIC_RELAXED);
+}
+
+int casefilter_search_ctx(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, const char *query, int k) {
+    if (!idx || !ctx || !query || (int)strlen(query) != KEYWORD_LEN) return 0;
+    if (idx->keyword_count > ctx->cap) return 0;
+    if (k < 0 || k > (int)idx->spec.max_k) return 0;
+    if (k >= 2 && !index_wait_d(idx)) return 0;  /* 1 件ずつの経路は後回しにせず DelIndex を待つ */
+    QueryPlan pl;
+    plan_slots(&pl, CF_SCHEME(idx), query, k);
+    CaseFilterCache *cache = index_cache(idx, k);
+    if (cache) {
+        int cached = cache_lookup(cache, pl.qcode);
+        CF_STAT(ctx->stats.cache_lookups++; ctx->stats.cache_hits += cached >= 0);
+        if (cached >= 0) return cached;
+    }
+#ifdef CASEFILTER_STATS
+    QueryStats qs;
+    stat_begin(&pl, &qs);
+#endif
+    int hit = search_plan(idx, ctx, &pl, k);
+    CF_STAT(stat_fold(ctx, &qs));
+    if (cache) cache_insert(cache, pl.qcode, hit);
+    return hit;
+}
+
+/*
+ * バッチ版: CASEFILTER_BATCH 件ずつ
+ *   1) スロット計算 + H ディレクトリ先読み → 2) H 範囲解決 + ids 先頭先読み → 3) codes 先読み → 4) Case A 検証
+ *   5) 未ヒット分の D ディレクトリ先読み → 6) D 範囲解決 + idpos 先頭先読み → 7) codes 先読み → 8) Case B 検証
+ * の段に分け、同じ段を複数クエリで回すことで DRAM 待ちをクエリ間で重ねる。結果は逐次版と同一。
+ */
+#ifndef CASEFILTER_BATCH
+#define CASEFILTER_BATCH 16
+#endif
+#define CF_PREFETCH_CODES 4  /* 各リスト先頭で codes を先読みする候補数 */
+#define CF_PREFETCH(p) __builtin_prefetch((p), 0, 1)
+
+/* ディレクトリ先読み: 密なら offsets[slot]、疎ならそのスロットを含むレコード（64B = 1 ライン） */
+static inline void slot_prefetch(const int *offsets, const SlotDir *sd, uint32_t slot) {
+    if (offsets) CF_PREFETCH(&offsets[slot]);
+    else if (sd->width == 4) CF_PREFETCH(&sd->rec[slot / (SDIR_CUM_BYTES * 2)]);
+    else CF_PREFETCH(&sd->rec[slot / SDIR_CUM_BYTES]);
+}
+
+/* --exact-set の索引: 完全一致 → 距離 1 近傍の 2 段を先に回す。外れたクエリだけ plans/live の前に詰めて件数を返す。
+ * 呼ぶ前に集合のバケットと tier1 ペアのディレクトリを先読みしておく */
+static int batch_tiers(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, QueryPlan *plans, int *live, int n,
+                       int k, uint8_t *hits) {
+    int m = 0;
+    for (int j = 0; j < n; ++j) {
+        QueryPlan *pl = &plans[j];
+        if (probe_exact(idx, pl->qcode)) {
+            CF_STAT(stat_hit(pl, CF_PHASE_EXACT, 0));
+            hits[live[j]] = 1;
+            continue;
+        }
+        for (int t = 0; t < 2; ++t) {
+            int p = CF_SCHEME(idx)->tier1[t];
+            plan_resolve_h_pair(idx, pl, p);
+            if (pl->hlen[p]) CF_PREFETCH(h_vals_at(idx, pl->hstart[p]));
+        }
+        if (m != j) plans[m] = *pl;
+        live[m++] = live[j];
+    }
+    n = m;
+    m = 0;
+    for (int j = 0; j < n; ++j) {
+        QueryPlan *pl = &plans[j];
+        if (verify_tier1(idx, ctx->visited, ctx_next_gen(ctx), pl, k)) {
+            hits[live[j]] = 1;
+            continue;
+        }
+        for (int p = 0; p < CASEFILTER_HPAIR_COUNT; ++p) {
+            uint32_t slot = pl->hslot[p];
+            if ((pl->hmask & ~tier1_mask(CF_SCHEME(idx))) >> p & 1 && occ_test(idx->hidx.occ, slot)) {
+                slot_prefetch(idx->hidx.offsets, &idx->hidx.sdir, slot);
+            }
+        }
+        if (m != j) plans[m] = *pl;
+        live[m++] = live[j];
+    }
+    return m;
+}
+
+/* Case B のリスト d の codes 先読み: 先頭 1 件。近傍署名があれば先頭 CF_PREFETCH_CODES 件のうち署名を通るもの
+ * （落ちる候補の codes は読まない） */
+static inline void prefetch_d_codes(const CaseFilterIndex *idx, const QueryPlan *pl, int d) {
+    if (!idx->del7.sig) {
+        CF_PREFETCH(&idx->codes[d_id(idx, pl->dstart[d])]);
+        return;
+    }
+    const uint32_t *v = idx->del7.idpos + pl->dstart[d];
+    int lim = pl->dlen[d] < CF_PREFETCH_CODES ? pl->dlen[d] : CF_PREFETCH_CODES;
+    for (int i = 0; i < lim; ++i) {
+        if (dsig_pass(pl->dacc[d], v[i])) CF_PREFETCH(&idx->codes[v[i] & idx->del7.id_mask]);
+    }
+}
+
+/* Case B の段: ディレクトリ → リスト先頭と codes の先読み → 検証（D のスロットの先読みは呼び出し側で済ませる） */
+static void batch_case_b(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, QueryPlan *plans, const int *live,
+                         int nmiss, int k, uint8_t *hits) {
+    for (int j = 0; j < nmiss; ++j) {
+        QueryPlan *pl = &plans[j];
+        plan_resolve_d(idx, pl);
+        for (int d = 0; d < pl->dslot_count; ++d) {
+            if (pl->dlen[d]) CF_PREFETCH(d_vals_at(idx, pl->dstart[d]));
+        }
+    }
+    for (int j = 0; j < nmiss; ++j) {
+        const QueryPlan *pl = &plans[j];
+        for (int d = 0; d < pl->dslot_count; ++d) {
+            if (pl->dlen[d]) prefetch_d_codes(idx, pl, d);
+        }
+    }
+    for (int j = 0; j < nmiss; ++j) {
+        if (verify_case_b(idx, ctx->visited, ctx_next_gen(ctx), &plans[j], k)) hits[live[j]] = 1;
+    }
+}
+
+static inline void prefetch_d_slots(const CaseFilterIndex *idx, const QueryPlan *pl) {
+    for (int d = 0; d < pl->dslot_count; ++d) {
+        uint32_t slot = pl->dslot[d];
+        if (occ_test(idx->del7.occ, slot)) slot_prefetch(idx->del7.offsets, &idx->del7.sdir, slot);
+    }
+}
+
+/* staged: 2)〜8) の段。hits は q 番目のクエリに live[j] で対応する。
+ * defer なら DelIndex がまだ無いので、Case A で外れたクエリは CASEFILTER_DEFERRED にして B を引かない */
+static void batch_staged(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, QueryPlan *plans, int *live, int nlive,
+                         int k, unsigned done, int defer, uint8_t *hits) {
+    for (int j = 0; j < nlive; ++j) {
+        QueryPlan *pl = &plans[j];
+        plan_resolve_h(idx, pl, done);
+        plan_order_h(pl);
+        for (int p = 0; p < CASEFILTER_HPAIR_COUNT; ++p) {
+            if (pl->hlen[p]) CF_PREFETCH(h_vals_at(idx, pl->hstart[p]));
+        }
+    }
+    for (int j = 0; j < nlive && !idx->hidx.fat; ++j) {
+        const QueryPlan *pl = &plans[j];
+        int p = pl->order[0];
+        for (int oi = 0; oi < CASEFILTER_HPAIR_COUNT && pl->hlen[p] == 0; ++oi) p = pl->order[oi];
+        int lim = pl->hlen[p] < CF_PREFETCH_CODES ? pl->hlen[p] : CF_PREFETCH_CODES;
+        for (int i = 0; i < lim; ++i) CF_PREFETCH(&idx->codes[h_id(idx, pl->hstart[p] + i)]);
+    }
+    int nmiss = 0;
+    for (int j = 0; j < nlive; ++j) {
+        QueryPlan *pl = &plans[j];
+        uint32_t gen = ctx_next_gen(ctx);
+        if (verify_case_a(idx, ctx->visited, gen, pl, k) ||
+            (pl->hsub && verify_case_a_subs(idx, ctx->visited, gen, pl, k))) {
+            hits[live[j]] = 1;
+            continue;
+        }
+        if (k < 2) continue;
+        if (defer) {
+            hits[live[j]] = CASEFILTER_DEFERRED;
+            continue;
+        }
+        prefetch_d_slots(idx, pl);
+        if (nmiss != j) plans[nmiss] = *pl;
+        live[nmiss++] = live[j];
+    }
+    batch_case_b(idx, ctx, plans, live, nmiss, k, hits);
+}
+
+/* cost: A / B のディレクトリを同時に引き、全リストの先頭と先頭候補の codes を先読みしてから visit 順に検証する */
+static void batch_cost(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, QueryPlan *plans, const int *live,
+                       int nlive, int k, unsigned done, uint8_t *hits) {
+    for (int j = 0; j < nlive && k >= 2; ++j) {
+        const QueryPlan *pl = &plans[j];
+        for (int d = 0; d < pl->dslot_count; ++d) {
+            uint32_t slot = pl->dslot[d];
+            if (occ_test(idx->del7.occ, slot)) slot_prefetch(idx->del7.offsets, &idx->del7.sdir, slot);
+        }
+    }
+    for (int j = 0; j < nlive; ++j) {
+        QueryPlan *pl = &plans[j];
+        plan_resolve_h(idx, pl, done);
+        if (k >= 2) plan_resolve_d(idx, pl);
+        plan_order_cost(pl, done, k);
+        for (int i = 0; i < pl->visit_count; ++i) {
+            int v = pl->visit[i];
+            if (v & CF_PLAN_D) CF_PREFETCH(d_vals_at(idx, pl->dstart[v & ~CF_PLAN_D]));
+            else CF_PREFETCH(h_vals_at(idx, pl->hstart[v]));
+        }
+    }
+    /* 各リストの先頭候補の codes（短いリストが多いのでほぼ全候補になる） */
+    for (int j = 0; j < nlive; ++j) {
+        const QueryPlan *pl = &plans[j];
+        for (int i = 0; i < pl->visit_count; ++i) {
+            int v = pl->visit[i];
+            if (v & CF_PLAN_D) {
+                int d = v & ~CF_PLAN_D;
+                prefetch_d_codes(idx, pl, d);
+            } else if (!idx->hidx.fat) {
+                CF_PREFETCH(&idx->codes[h_id(idx, pl->hstart[v])]);
+            }
+        }
+    }
+    for (int j = 0; j < nlive; ++j) {
+        const QueryPlan *pl = &plans[j];
+        if (verify_cost(idx, ctx, pl, k) || (pl->hsub && verify_case_a_subs(idx, ctx->visited, ctx_next_gen(ctx), pl, k))) {
+            hits[live[j]] = 1;
+        }
+    }
+}
+
+/* b_only: casefilter_search_deferred の残り（Case A までは済んでいるので集合・tier1・A を飛ばす） */
+/* search_codes の組の q 番目を cache か組の中の重複で片付けられれば 1。cache が答えたら fold[q] = -2、
+ * live[0..nlive) に同じ code があれば fold[q] = その q */
+static inline int cache_fold(CaseFilterCache *cache, CaseFilterSearchCtx *ctx, const uint64_t *codes, const int *live,
+                             int nlive, int q, uint8_t *hits, int8_t *fold) {
+    int cached = cache_lookup(cache, codes[q]);
+    CF_STAT(ctx->stats.cache_lookups++);
+    if (cached >= 0) {
+        CF_STAT(ctx->stats.cache_hits++);
+        hits[q] = (uint8_t)cached;
+        fold[q] = -2;
+        return 1;
+    }
+    for (int j = 0; j < nlive; ++j) {
+        if (codes[live[j]] != codes[q]) continue;
+        CF_STAT(ctx->stats.cache_folded++);
+        fold[q] = (int8_t)live[j];
+        return 1;
+    }
+    (void)ctx;
+    return 0;
+}
+
+/* 組を探し終えたら重複へ結果を写し、探したクエリの結果を cache に入れる（D 待ちで後回しのものは入れない） */
+static inline void cache_settle(CaseFilterCache *cache, const uint64_t *codes, int m, uint8_t *hits, const int8_t *fold) {
+    for (int q = 0; q < m; ++q) {
+        if (fold[q] >= 0) hits[q] = hits[fold[q]];
+        else if (fold[q] == -1 && codes[q] != CASEFILTER_NO_QUERY && hits[q] != CASEFILTER_DEFERRED) {
+            cache_insert(cache, codes[q], hits[q]);
+        }
+    }
+}
+
+static void search_codes(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, const uint64_t *codes, int n, int k,
+                         int b_only, uint8_t *hits) {
+    if (k < 0 || k > (int)idx->spec.max_k) {  /* 索引が被覆しない k は引けない */
+        memset(hits, 0, (size_t)(n > 0 ? n : 0));
+        return;
+    }
+    QueryPlan plans[CASEFILTER_BATCH];
+    int live[CASEFILTER_BATCH];
+    /* cache があれば、引いて答えが出たクエリと、同じ組の前のクエリと同じ code のクエリ（fold[q] = 前の q）は探さない */
+    CaseFilterCache *cache = idx->keyword_count <= ctx->cap ? index_cache(idx, k) : NULL;
+    int8_t fold[CASEFILTER_BATCH];
+#ifdef CASEFILTER_STATS
+    QueryStats qst[CASEFILTER_BATCH];
+    uint8_t valid[CASEFILTER_BATCH];
+#endif
+    /* 段階探索では最初に引くのは集合と tier1 の 2 群だけ */
+    const CfScheme *sc = CF_SCHEME(idx);
+    unsigned done = idx->exact ? tier1_mask(sc) : 0;
+    unsigned first = idx->exact ? tier1_mask(sc) : (1u << CASEFILTER_HPAIR_COUNT) - 1;
+    for (int base = 0; base < n; base += CASEFILTER_BATCH) {
+        int m = n - base < CASEFILTER_BATCH ? n - base : CASEFILTER_BATCH;
+        int nlive = 0;
+        int defer = k >= 2 && !index_d_ready(idx);
+        for (int q = 0; q < m; ++q) {
+            hits[base + q] = 0;
+            fold[q] = -1;
+            CF_STAT(valid[q] = 0);
+            if (idx->keyword_count > ctx->cap || codes[base + q] == CASEFILTER_NO_QUERY) continue;
+            if (cache && cache_fold(cache, ctx, codes + base, live, nlive, q, hits + base, fold)) continue;
+            QueryPlan *pl = &plans[nlive];
+            plan_slots_code(pl, sc, codes[base + q], k);
+            CF_STAT(stat_begin(pl, &qst[q]); valid[q] = 1);
+            live[nlive++] = q;
+            if (b_only) {
+                prefetch_d_slots(idx, pl);
+                continue;
+            }
+            if (idx->exact) CF_PREFETCH(&idx->exact[code_hash(pl->qcode, idx->exact_cap)]);
+            for (int p = 0; p < CASEFILTER_HPAIR_COUNT; ++p) {
+                uint32_t slot = pl->hslot[p];
+                if ((first & pl->hmask) >> p & 1 && occ_test(idx->hidx.occ, slot)) {
+                    slot_prefetch(idx->hidx.offsets, &idx->hidx.sdir, slot);
+                }
+            }
+        }
+        if (b_only) {
+            if (k >= 2) batch_case_b(idx, ctx, plans, live, nlive, k, hits + base);
+        } else {
+            if (idx->exact) nlive = batch_tiers(idx, ctx, plans, live, nlive, k, hits + base);
+            /* D を待つ間は cost も A だけ引ける staged で回す */
+            if (probe_planner == CF_PLANNER_COST && !defer) batch_cost(idx, ctx, plans, live, nlive, k, done, hits + base);
+            else batch_staged(idx, ctx, plans, live, nlive, k, done, defer, hits + base);
+        }
+        /* delta は base で外れたものだけ（k < 2 で plans から落ちたクエリも含むので計画し直す） */
+        if (delta_live(idx->delta) && idx->keyword_count <= ctx->cap) {
+            const CaseFilterDelta *dl = idx->delta;
+            int nmiss = 0;
+            for (int q = 0; q < m; ++q) {
+                if (hits[base + q] || codes[base + q] == CASEFILTER_NO_QUERY || fold[q] != -1) continue;
+                QueryPlan *pl = &plans[nmiss];
+                plan_slots_code(pl, sc, codes[base + q], k);
+                CF_STAT(pl->st = &qst[q]);
+                for (int p = 0; p < CASEFILTER_HPAIR_COUNT && pl->scheme == CF_SCHEME_PAIRS; ++p) {
+                    CF_PREFETCH(&dl->h_occ[pl->hslot[p] >> 6]);
+                }
+                for (int d = 0; d < pl->dslot_count && k >= 2; ++d) CF_PREFETCH(&dl->d_occ[pl->dslot[d] >> 6]);
+                live[nmiss++] = q;
+            }
+            for (int j = 0; j < nmiss; ++j) hits[base + live[j]] = (uint8_t)search_delta(idx, &plans[j], k);
+        }
+        if (cache) cache_settle(cache, codes + base, m, hits + base, fold);
+#ifdef CASEFILTER_STATS
+        for (int q = 0; q < m; ++q) {
+            if (valid[q]) stat_fold(ctx, &qst[q]);
+        }
+#endif
+    }
+}
+
+void casefilter_search_codes(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, const uint64_t *codes, int n, int k,
+                             uint8_t *hits) {
+    if (!idx || !ctx || !codes || !hits) return;
+    search_codes(idx, ctx, codes, n, k, 0, hits);
+}
+
+/* codes は CASEFILTER_DEFERRED だったクエリだけを詰めたもの（hits は 0 / 1 で書き直す） */
+void casefilter_search_deferred(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, const uint64_t *codes, int n,
+                                int k, uint8_t *hits) {
+    if (!idx || !ctx || !codes || !hits) return;
+    if (!index_wait_d(idx)) {
+        memset(hits, 0, (size_t)(n > 0 ? n : 0));
+        return;
+    }
+    search_codes(idx, ctx, codes, n, k, 1, hits);
+}
+
+/* ===== 逆向きの探索（全件の印） =====
+ * join で小さい側（クエリ）を索引にしたとき、DB の各語から距離 k 以内の全てのクエリに印を付ける。
+ * 引くスロットと検証は staged と同じだが 1 件目で止まらない。印の付いた id は検証しないので、
+ * 同じクエリ群に近い DB 語が続くほど軽くなる。A と B は別の世代（Hamming で落ちた id も indel1 で通り得る）。
+ */
+static inline void mark_set(uint64_t *marks, int id) {
+    marks[id >> 6] |= 1ULL << (id & 63);
+}
+
+static void mark_run_h(const CaseFilterIndex *idx, uint32_t *visited, uint32_t gen, int start, int len, uint64_t code,
+                       int k, uint64_t *marks) {
+    for (int i = start; i < start + len; ++i) {
+        int id = h_id(idx, i);
+        if (visited[id] == gen || occ_test(marks, (uint32_t)id)) continue;
+        visited[id] = gen;
+        if (hamming_packed15(code, idx->codes[id]) <= k && !base_dead(idx, id)) mark_set(marks, id);
+    }
+}
+
+static void mark_run_d(const CaseFilterIndex *idx, uint32_t *visited, uint32_t gen, int start, int len, uint64_t code,
+                       int max_sub, const uint64_t *acc, uint64_t *marks) {
+    for (int i = start; i < start + len; ++i) {
+        if (acc && !dsig_pass(acc, idx->del7.idpos[i])) continue;
+        int id = d_id(idx, i);
+        if (visited[id] == gen || occ_test(marks, (uint32_t)id)) continue;
+        visited[id] = gen;
+        if (indel1_within(code, idx->codes[id], max_sub) && !base_dead(idx, id)) mark_set(marks, id);
+    }
+}
+
+int casefilter_mark_codes(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, const uint64_t *codes, int n, int k,
+                          uint64_t *marks) {
+    if (!idx || !ctx || !codes || !marks || idx->hidx.fat || idx->delta || idx->spec.h_scheme != CF_SCHEME_PAIRS) {
+        return 0;
+    }
+    if (k < 0 || k > (int)idx->spec.max_k || idx->keyword_count > ctx->cap || !index_wait_d(idx)) return 0;
+    const CfScheme *sc = CF_SCHEME(idx);
+    QueryPlan plans[CASEFILTER_BATCH];
+#ifdef CASEFILTER_STATS
+    QueryStats qst;  /* 計数は ctx に畳まない（plan_resolve_* の書き先だけ） */
+#endif
+    for (int base = 0; base < n; base += CASEFILTER_BATCH) {
+        int m = 0;
+        for (int q = base; q < n && q < base + CASEFILTER_BATCH; ++q) {
+            if (codes[q] == CASEFILTER_NO_QUERY) continue;
+            QueryPlan *pl = &plans[m++];
+            plan_slots_code(pl, sc, codes[q], k);
+            CF_STAT(stat_begin(pl, &qst));
+            for (int p = 0; p < CASEFILTER_HPAIR_COUNT; ++p) {
+                if (pl->hmask >> p & 1 && occ_test(idx->hidx.occ, pl->hslot[p])) {
+                    slot_prefetch(idx->hidx.offsets, &idx->hidx.sdir, pl->hslot[p]);
+                }
+            }
+        }
+        for (int j = 0; j < m; ++j) {
+            QueryPlan *pl = &plans[j];
+            plan_resolve_h(idx, pl, 0);
+            uint32_t gen = ctx_next_gen(ctx);
+            for (int p = 0; p < CASEFILTER_HPAIR_COUNT; ++p) {
+                mark_run_h(idx, ctx->visited, gen, pl->hstart[p], pl->hlen[p], pl->qcode, k, marks);
+            }
+            if (k < 2) continue;
+            plan_resolve_d(idx, pl);
+            gen = ctx_next_gen(ctx);
+            for (int d = 0; d < pl->dslot_count; ++d) {
+                mark_run_d(idx, ctx->visited, gen, pl->dstart[d], pl->dlen[d], pl->qcode, k - 2, plan_dacc(idx, pl, d),
+                           marks);
+            }
+        }
+    }
+    return 1;
+}
+
+void casefilter_search_batch(const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx,
+                             const char (*queries)[KEYWORD_LEN + 1], int n, int k, uint8_t *hits) {
+    if (!queries) return;
+    uint64_t codes[CASEFILTER_BATCH];
+    for (int base = 0; base < n; base += CASEFILTER_BATCH) {
+        int m = n - base < CASEFILTER_BATCH ? n - base : CASEFILTER_BATCH;
+        for (int q = 0; q < m; ++q) {
+            const char *w = queries[base + q];
+            codes[q] = (int)strlen(w) == KEYWORD_LEN ? pack_keyword(w) : CASEFILTER_NO_QUERY;
+        }
+        casefilter_search_codes(idx, ctx, codes, m, k, hits + base);
+    }
+}
+
+/* ===== クエリファイルの一括解析 =====
+ * 行の切り方は fgets(buf, 17) + strcspn("\r\n") と同じ（改行まで、ただし最大 16 バイトで切る）で、
+ * 切り出した行が 15 文字なら pack_keyword、そうでなければ CASEFILTER_NO_QUERY。
+ * ほぼ全ての行は「15 文字 + \n」の 16 バイトなので、そこは 1 行 1 回の 16 バイト読みで判定と詰めを済ませる。
+ */
+#define CODE60_MASK ((1ULL << (KEYWORD_LEN * 4)) - 1ULL)
+
+#if defined(__SSE2__) && defined(__x86_64__)
+#include <emmintrin.h>
+
+/* c - 'A'（文字種の外は CF_FOREIGN）の隣り合うバイトを 1 バイトに寄せ、8 バイトに詰めると pack_keyword と同じ並びになる */
+static inline int pack_line16(const char *p, uint64_t *code) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    int bad = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('A'));
+    __m128i in = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(CASEFILTER_ALPHABET - 1)), d);
+    d = _mm_or_si128(_mm_and_si128(in, d), _mm_andnot_si128(in, _mm_set1_epi8((char)CF_FOREIGN)));
+    d = _mm_and_si128(_mm_or_si128(d, _mm_srli_epi16(d, 4)), _mm_set1_epi16(0xFF));
+    *code = (uint64_t)_mm_cvtsi128_si64(_mm_packus_epi16(d, d)) & CODE60_MASK;
+    return nl == 1 << KEYWORD_LEN && !bad;
+}
+#else
+static inline int pack_line16(const char *p, uint64_t *code) {
+    for (int i = 0; i < KEYWORD_LEN; ++i) {
+        if (p[i] == '\n' || p[i] == '\r' || p[i] == '\0') return 0;
+    }
+    *code = pack_keyword(p);
+    return p[KEYWORD_LEN] == '\n';
+}
+#endif
+
+/* 16 バイトに収まらない行・改行の無い最終行など。消費したバイト数を返す */
+static size_t parse_line_slow(const char *p, size_t left, uint64_t *code) {
+    size_t take = 0;
+    while (take < left && take < KEYWORD_LEN + 1) {
+        if (p[take++] == '\n') break;
+    }
+    size_t len = 0;
+    while (len < take && p[len] != '\n' && p[len] != '\r' && p[len] != '\0') len++;
+    *code = len == KEYWORD_LEN ? pack_keyword(p) : CASEFILTER_NO_QUERY;
+    return take;
+}
+
+/* buf 全体を解析して *codes（呼び出し側が free）に入れ、クエリ数を返す。確保できなければ -1 */
+int casefilter_parse_queries(const char *buf, size_t len, uint64_t **codes) {
+    size_t cap = len / (KEYWORD_LEN + 1) + 1, n = 0, at = 0;
+    uint64_t *out = (uint64_t *)malloc(sizeof(uint64_t) * cap);
+    if (!out) return -1;
+    while (at < len) {
+        if (n == cap) {
+            uint64_t *t = cap < (size_t)INT_MAX ? (uint64_t *)realloc(out, sizeof(uint64_t) * cap * 2) : NULL;
+            if (!t) { free(out); return -1; }
+            out = t;
+            cap *= 2;
+        }
+        if (len - at >= KEYWORD_LEN + 1 && pack_line16(buf + at, &out[n])) {
+            n++;
+            at += KEYWORD_LEN + 1;
+            continue;
+        }
+        at += parse_line_slow(buf + at, len - at, &out[n++]);
+    }
+    if (n > (size_t)INT_MAX) { free(out); return -1; }
+    *codes = out;
+    return (int)n;
+}
+
+/* 旧API: 関数内 static のコンテキストを使うため非再入。マルチスレッドでは casefilter_search_ctx を使う */
+int casefilter_search(const CaseFilterIndex *idx, const char *query, int k) {
+    static CaseFilterSearchCtx *ctx = NULL;
+    if (!idx) return 0;
+    if (!ctx || idx->keyword_count > ctx->cap) {
+        casefilter_ctx_free(ctx);
+        ctx = casefilter_ctx_create(idx);
+        if (!ctx) return 0;
+    }
+    return casefilter_search_ctx(idx, ctx, query, k);
+}
+
+/* ===== merge: 生きている base + delta から新しい base を作る =====
+ * 新しい id は base の生存 id 昇順 → delta の生存 id 昇順。キーと emit 順は prep と同じなので、
+ * 同じキーワード列を prep した索引と同じ CSR になる（offsets は密、fat / 疎ディレクトリは使わない）。
+ * 近傍署名は元の索引が持っていて、結果が narrow に収まるときだけ付け直す。
+ */
+static int merge_emit_h(uint64_t code, const CaseFilterSpec *sp, uint32_t *slot, uint8_t *pos) {
+    const CfScheme *sc = &cf_schemes[sp->h_scheme];
+    uint32_t space = cf_scheme_key_space(sc);
+    uint32_t foreign = code_foreign(code);
+    int n = 0;
+    for (int g = 0; g < sc->groups; ++g) {
+        if (!(sp->h_pair_mask >> g & 1) || (foreign & sc->mask[g])) continue;
+        slot[n] = group_key(code, sc->mask[g]) + (uint32_t)g * space;
+        pos[n++] = 0;
+    }
+    return n;
+}
+
+/* 削除位置 pos ごとに (左7, 右7) の順（d_sides が 1 なら左7だけ）。pos は削除位置 | 側 << 4、
+ * 値は後で id | 削除位置 << id_bits（近傍署名があれば | 署名 << CF_DSIG_SHIFT）に詰める。
+ * 文字種の外の文字を含むキー（join でクエリを索引にしたときだけ起きる）は、plan_slots_code と同じく作らない */
+static int merge_emit_d(uint64_t code, const CaseFilterSpec *sp, uint32_t *slot, uint8_t *pos) {
+    if (!sp->d_sides) return 0;
+    uint32_t lo[9], hi[9];
+    del_prefix_sums(code, lo, hi);
+    uint32_t foreign = code_foreign(code);
+    int n = 0;
+    for (int q = 0; q < KEYWORD_LEN; ++q) {
+        if (!(foreign & (q <= 7 ? 0xFFu & ~(1u << q) : 0x7Fu))) {
+            slot[n] = q <= 7 ? del8_key(lo, q) : del8_key(lo, 7);
+            pos[n++] = (uint8_t)q;
+        }
+        if (sp->d_sides < 2 || (foreign & (q >= 7 ? 0x7F80u & ~(1u << q) : 0x7F00u))) continue;
+        slot[n] = q >= 7 ? del8_key(hi, q - 7) : del8_key(hi, 0);
+        pos[n++] = (uint8_t)(q | 1 << 4);
+    }
+    return n;
+}
+
+/* counts → offsets → 値の 2 パス。d なら DelIndex（値は idpos）、そうでなければ HIndex */
+static int merge_csr(CaseFilterIndex *m, int d) {
+    int slots = d ? m->del7.key_space : m->hidx.key_space * m->hidx.pair_count;
+    uint32_t *counts = (uint32_t *)calloc((size_t)slots, sizeof(uint32_t));
+    int *offsets = (int *)cf_array_alloc(sizeof(int) * ((size_t)slots + 1), 0);
+    int *cursor = (int *)malloc(sizeof(int) * (size_t)slots);
+    uint32_t *vals = NULL;
+    int ok = counts && offsets && cursor;
+    uint32_t slot[KEYWORD_LEN * 2];
+    uint8_t pos[KEYWORD_LEN * 2];
+    for (int id = 0; ok && id < m->keyword_count; ++id) {
+        int n = d ? merge_emit_d(m->codes[id], &m->spec, slot, pos) : merge_emit_h(m->codes[id], &m->spec, slot, pos);
+        for (int k = 0; k < n; ++k) counts[slot[k]]++;
+    }
+    if (ok) {
+        offsets[0] = 0;
+        for (int i = 0; i < slots; ++i) {
+            cursor[i] = offsets[i];
+            offsets[i + 1] = offsets[i] + (int)counts[i];
+        }
+        vals = (uint32_t *)cf_array_alloc(sizeof(uint32_t) * ((size_t)offsets[slots] + 1), 0);
+        ok = vals != NULL;
+    }
+    for (int id = 0; ok && id < m->keyword_count; ++id) {
+        int n = d ? merge_emit_d(m->codes[id], &m->spec, slot, pos) : merge_emit_h(m->codes[id], &m->spec, slot, pos);
+        for (int k = 0; k < n; ++k) {
+            uint32_t v = (uint32_t)id;
+            if (d) {
+                int q = pos[k] & 0xF;
+                v = ((uint32_t)id & m->del7.id_mask) | ((uint32_t)q << m->del7.id_bits);
+                if (m->del7.sig) v |= cf_dsig_at(m->codes[id], q, pos[k] >> 4) << CF_DSIG_SHIFT;
+            }
+            vals[cursor[slot[k]]++] = v;
+        }
+    }
+    free(cursor);
+    uint64_t *occ = ok ? occ_from_offsets(offsets, slots) : NULL;
+    if (!occ) {
+        free(counts);
+        cf_array_free(offsets);
+        cf_array_free(vals);
+        return 0;
+    }
+    if (d) {
+        m->del7.counts = counts;
+        m->del7.offsets = offsets;
+        m->del7.idpos = vals;
+        m->del7.occ = occ;
+    } else {
+        m->hidx.counts = counts;
+        m->hidx.offsets = offsets;
+        m->hidx.ids = (int *)vals;
+        m->hidx.occ = occ;
+    }
+    return 1;
+}
+
+/* m->codes / keyword_count / spec から CSR を組む */
+static int build_from_codes(CaseFilterIndex *m, int sig) {
+    const CfScheme *sc = &cf_schemes[m->spec.h_scheme];
+    m->hidx.key_space = (int)cf_scheme_key_space(sc);
+    m->hidx.pair_count = sc->groups;
+    m->del7.key_space = CASEFILTER_DEL_KEY_SPACE;
+    set_id_bits(&m->del7, m->keyword_count > CASEFILTER_NARROW_ID_LIMIT ? CASEFILTER_WIDE_ID_BITS
+                                                                        : CASEFILTER_NARROW_ID_BITS);
+    m->del7.sig = sig && m->keyword_count <= CASEFILTER_NARROW_ID_LIMIT;
+    return merge_csr(m, 0) && merge_csr(m, 1);
+}
+
+/* codes（所有権を受け取る）から heap の索引を作る。仕様（格納するペア・削除キー）は元の索引と同じ */
+static CaseFilterIndex *merge_from_codes(uint64_t *codes, int n, const CaseFilterSpec *spec, int sig) {
+    CaseFilterIndex *m = (CaseFilterIndex *)calloc(1, sizeof(CaseFilterIndex));
+    if (!m) {
+        cf_array_free(codes);
+        return NULL;
+    }
+    m->codes = codes;
+    m->keyword_count = m->keyword_cap = n;
+    m->spec = *spec;
+    if (!build_from_codes(m, sig)) {
+        casefilter_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+/* 生きているキーワードの code を新しい id 順に集める。件数を返し、失敗時は -1 */
+static int collect_live_codes(const CaseFilterIndex *idx, uint64_t **out) {
+    const CaseFilterDelta *dl = idx->delta;
+    long n = 0;
+    for (int id = 0; id < idx->keyword_count; ++id) n += !base_dead(idx, id);
+    for (int id = 0; dl && id < dl->count; ++id) n += !occ_test(dl->dead, (uint32_t)id);
+    if (n > CASEFILTER_MAX_KEYWORDS) return -1;
+    uint64_t *codes = (uint64_t *)cf_array_alloc(sizeof(uint64_t) * (size_t)(n > 0 ? n : 1), 0);
+    if (!codes) return -1;
+    int j = 0;
+    for (int id = 0; id < idx->keyword_count; ++id) {
+        if (!base_dead(idx, id)) codes[j++] = idx->codes[id];
+    }
+    for (int id = 0; dl && id < dl->count; ++id) {
+        if (!occ_test(dl->dead, (uint32_t)id)) codes[j++] = dl->codes[id];
+    }
+    *out = codes;
+    return j;
+}
+
+CaseFilterIndex *casefilter_merge(const CaseFilterIndex *idx) {
+    if (!idx) return NULL;
+    uint64_t *codes = NULL;
+    int n = collect_live_codes(idx, &codes);
+    return n < 0 ? NULL : merge_from_codes(codes, n, &idx->spec, idx->del7.sig);
+}
+
+/* ===== メモリ上での構築（prep の casefilter_create / insert / finalize と同じ呼び方） =====
+ * join のように、片側をその場で索引にして直ぐ引く用。serialize / load を通らないので v1 の解析も写像も無い。
+ * できる索引は merge と同じ形（密 offsets、fat / 疎ディレクトリ / 近傍署名なし）で、id は insert した順。
+ */
+CaseFilterIndex *casefilter_create(int capacity) {
+    CaseFilterIndex *idx = (CaseFilterIndex *)calloc(1, sizeof(CaseFilterIndex));
+    if (!idx) return NULL;
+    idx->keyword_cap = capacity > 0 ? capacity : 1024;
+    idx->codes = (uint64_t *)cf_array_alloc(sizeof(uint64_t) * (size_t)idx->keyword_cap, 0);
+    if (!idx->codes) {
+        free(idx);
+        return NULL;
+    }
+    idx->spec = casefilter_spec_for(MAX_EDIT_DIST, CF_SCHEME_PAIRS);
+    return idx;
+}
+
+/* 文字種の外の文字（CF_FOREIGN）はそのまま持ち、その文字を含むキーは作らない。CF_FOREIGN 同士は一致して
+ * しまうので、そういう語を入れた索引は文字種の中の語だけで引くこと（join がクエリ側を索引にする場合） */
+int casefilter_insert_code(CaseFilterIndex *idx, uint64_t code) {
+    if (!idx || idx->hidx.offsets || code == CASEFILTER_NO_QUERY) return 0;
+    if (idx->keyword_count == idx->keyword_cap) {
+        if (idx->keyword_cap >= CASEFILTER_MAX_KEYWORDS) return 0;
+        int cap = idx->keyword_cap > CASEFILTER_MAX_KEYWORDS / 2 ? CASEFILTER_MAX_KEYWORDS : idx->keyword_cap * 2;
+        uint64_t *t = (uint64_t *)cf_array_alloc(sizeof(uint64_t) * (size_t)cap, 0);
+        if (!t) return 0;
+        memcpy(t, idx->codes, sizeof(uint64_t) * (size_t)idx->keyword_count);
+        cf_array_free(idx->codes);
+        idx->codes = t;
+        idx->keyword_cap = cap;
+    }
+    idx->codes[idx->keyword_count++] = code;
+    return 1;
+}
+
+int casefilter_insert(CaseFilterIndex *idx, const char *word) {
+    if (!word || strlen(word) != KEYWORD_LEN) return 0;
+    return casefilter_insert_code(idx, pack_keyword(word));
+}
+
+int casefilter_finalize(CaseFilterIndex *idx) {
+    if (!idx) return 0;
+    if (idx->hidx.offsets) return 1;
+    return build_from_codes(idx, 0);
+}
+
+/*
+ * CaseFilterLive: 探索は acquire/release（読みロック）の間だけ現在の索引を使う。更新は書きロックで
+ * 現在の索引の delta / tombstone に入れる。merge は読みロック下で生存 code を写してから別スレッドで
+ * 組み立て、終わったら書きロックを取り、その間に来た更新を新しい索引へ再適用して差し替える。
+ * 探索が止まるのは差し替えの一瞬だけ。
+ */
+#define LIVE_OP_LEN (KEYWORD_LEN + 1)  /* '+' / '-' + 15 文字 */
+
+struct CaseFilterLive {
+    pthread_rwlock_t lock;
+    pthread_mutex_t merge_mu;  /* merge_async / merge_wait の直列化 */
+    CaseFilterIndex *cur;
+    pthread_t merger;
+    int joinable;              /* merger を起動済み（merge_wait で join する） */
+    int merging;               /* merge 中（更新を pending に積む） */
+    int merge_ok;
+    uint64_t *merge_codes;     /* merger に渡す生存 code */
+    int merge_n;
+    CaseFilterSpec merge_spec;
+    int merge_sig;             /* 元の索引が近傍署名を持つ */
+    char (*pending)[LIVE_OP_LEN];  /* merge 開始後の更新（書きロック下で追記） */
+    int pending_count;
+    int pending_cap;
+};
+
+CaseFilterLive *casefilter_live_create(CaseFilterIndex *idx) {
+    if (!idx) return NULL;
+    CaseFilterLive *lv = (CaseFilterLive *)calloc(1, sizeof(CaseFilterLive));
+    if (!lv) return NULL;
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    /* 読み手が途切れなくても差し替え（書き手）を待たせない */
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&lv->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&lv->merge_mu, NULL);
+    lv->cur = idx;
+    return lv;
+}
+
+const CaseFilterIndex *casefilter_live_acquire(CaseFilterLive *lv) {
+    pthread_rwlock_rdlock(&lv->lock);
+    return lv->cur;
+}
+
+void casefilter_live_release(CaseFilterLive *lv) {
+    pthread_rwlock_unlock(&lv->lock);
+}
+
+static int live_apply(CaseFilterIndex *idx, const char *op) {
+    return op[0] == '-' ? casefilter_delta_delete(idx, op + 1) >= 0 : casefilter_delta_insert(idx, op + 1);
+}
+
+static int live_update(CaseFilterLive *lv, char kind, const char *word) {
+    if (!word || (int)strlen(word) != KEYWORD_LEN) return 0;
+    char op[LIVE_OP_LEN];
+    op[0] = kind;
+    memcpy(op + 1, word, KEYWORD_LEN);
+    pthread_rwlock_wrlock(&lv->lock);
+    int ok = live_apply(lv->cur, op);
+    if (ok && lv->merging) {
+        if (lv->pending_count == lv->pending_cap) {
+            int cap = lv->pending_cap ? lv->pending_cap * 2 : 256;
+            char (*t)[LIVE_OP_LEN] = (char (*)[LIVE_OP_LEN])realloc(lv->pending, sizeof(*t) * (size_t)cap);
+            if (t) {
+                lv->pending = t;
+                lv->pending_cap = cap;
+            }
+        }
+        /* 積めなければこの merge の結果は捨てる（差し替え時に pending_cap < 0 で判定） */
+        if (lv->pending_count < lv->pending_cap) memcpy(lv->pending[lv->pending_count++], op, LIVE_OP_LEN);
+        else lv->pending_cap = -1;
+    }
+    pthread_rwlock_unlock(&lv->lock);
+    return ok;
+}
+
+int casefilter_live_insert(CaseFilterLive *lv, const char *word) {
+    return lv && live_update(lv, '+', word);
+}
+
+int casefilter_live_delete(CaseFilterLive *lv, const char *word) {
+    return lv && live_update(lv, '-', word);
+}
+
+static void *live_merge_thread(void *arg) {
+    CaseFilterLive *lv = (CaseFilterLive *)arg;
+    CaseFilterIndex *next = merge_from_codes(lv->merge_codes, lv->merge_n, &lv->merge_spec, lv->merge_sig);
+    lv->merge_codes = NULL;
+    CaseFilterIndex *old = NULL;
+    pthread_rwlock_wrlock(&lv->lock);
+    int ok = next != NULL && lv->pending_cap >= 0;
+    for (int i = 0; ok && i < lv->pending_count; ++i) ok = live_apply(next, lv->pending[i]);
+    if (ok) {
+        old = lv->cur;
+        lv->cur = next;
+        /* merge しても答えは変わらないので cache は引き継ぐ */
+        next->cache = old->cache;
+        old->cache = NULL;
+    } else {
+        old = next;
+    }
+    lv->merge_ok = ok;
+    lv->pending_count = 0;
+    if (lv->pending_cap < 0) lv->pending_cap = 0;
+    __atomic_store_n(&lv->merging, 0, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&lv->lock);
+    casefilter_free(old);  /* 書きロックを取れた時点で old を参照している読み手はいない */
+    return NULL;
+}
+
+/* 別スレッドで merge を始める。既に走っていれば 0 */
+int casefilter_live_merge_async(CaseFilterLive *lv) {
+    if (!lv) return 0;
+    pthread_mutex_lock(&lv->merge_mu);
+    int ok = 0;
+    if (!lv->joinable) {
+        /* 読みロック中は更新が入らないので、写した code と pending の開始点が一致する */
+        pthread_rwlock_rdlock(&lv->lock);
+        lv->merge_n = collect_live_codes(lv->cur, &lv->merge_codes);
+        lv->merge_spec = lv->cur->spec;
+        lv->merge_sig = lv->cur->del7.sig;
+        if (lv->merge_n >= 0) __atomic_store_n(&lv->merging, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&lv->lock);
+        if (lv->merge_n >= 0) {
+            lv->merge_ok = 0;
+            if (pthread_create(&lv->merger, NULL, live_merge_thread, lv) == 0) {
+                lv->joinable = 1;
+                ok = 1;
+            } else {
+                cf_array_free(lv->merge_codes);
+                lv->merge_codes = NULL;
+                __atomic_store_n(&lv->merging, 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&lv->merge_mu);
+    return ok;
+}
+
+/* merge の完了を待つ。差し替えたら 1、merge していない・失敗したら 0 */
+int casefilter_live_merge_wait(CaseFilterLive *lv) {
+    if (!lv) return 0;
+    pthread_mutex_lock(&lv->merge_mu);
+    int ok = 0;
+    if (lv->joinable) {
+        pthread_join(lv->merger, NULL);
+        lv->joinable = 0;
+        ok = lv->merge_ok;
+    }
+    pthread_mutex_unlock(&lv->merge_mu);
+    return ok;
+}
+
+/* 索引を丸ごと差し替える（--serve の索引ファイル更新）。走っている merge は待ち、その結果ごと捨てる */
+int casefilter_live_swap(CaseFilterLive *lv, CaseFilterIndex *idx) {
+    if (!lv || !idx) return 0;
+    pthread_mutex_lock(&lv->merge_mu);
+    if (lv->joinable) {
+        pthread_join(lv->merger, NULL);
+        lv->joinable = 0;
+    }
+    pthread_rwlock_wrlock(&lv->lock);
+    CaseFilterIndex *old = lv->cur;
+    lv->cur = idx;
+    pthread_rwlock_unlock(&lv->lock);
+    pthread_mutex_unlock(&lv->merge_mu);
+    casefilter_free(old);
+    return 1;
+}
+
+void casefilter_live_free(CaseFilterLive *lv) {
+    if (!lv) return;
+    casefilter_live_merge_wait(lv);
+    casefilter_free(lv->cur);
+    free(lv->pending);
+    pthread_rwlock_destroy(&lv->lock);
+    pthread_mutex_destroy(&lv->merge_mu);
+    free(lv);
+}
+
+/* ===== クエリファイルの読み込みと結果の出力（search の CLI と scripts/join_casefilter.c で共用） ===== */
+/* 通常ファイルは写像して 1 度に解析する（パイプなどは読み切ってから）。行の切り方は逐次版の fgets と同じ */
+static int read_queries(const char *path, uint64_t **codes) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -2;
+    struct stat st;
+    char *buf = NULL;
+    size_t len = 0;
+    int mapped = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        len = (size_t)st.st_size;
+        buf = (char *)mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        mapped = buf != MAP_FAILED;
+        if (mapped) madvise(buf, len, MADV_SEQUENTIAL);
+        else buf = NULL;
+    }
+    if (!mapped) {
+        size_t cap = 1 << 20;
+        len = 0;
+        buf = (char *)malloc(cap);
+        while (buf) {
+            if (len == cap) {
+                char *t = (char *)realloc(buf, cap * 2);
+                if (!t) { free(buf); buf = NULL; break; }
+                buf = t;
+                cap *= 2;
+            }
+            ssize_t r = read(fd, buf + len, cap - len);
+            if (r == 0) break;
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) { free(buf); buf = NULL; break; }
+            len += (size_t)r;
         }
-        int found = casefilter_search(index, buf, MAX_EDIT_DIST);
-        putchar(found ? '1' : '0');
     }
-    putchar('\n');
+    close(fd);
+    int n = buf ? casefilter_parse_queries(buf, len, codes) : -1;
+    if (mapped) munmap(buf, len);
+    else free(buf);
+    return n;
+}
+
+/* 結果の出力形式。bits は --serve の応答と同じ u32le n + ceil(n/8) バイト（クエリ i は byte i/8 の bit i%8） */
+enum { CF_OUTPUT_TEXT, CF_OUTPUT_BITS };
+
+static void pack_result_bits(const char *results, int n, uint8_t *out) {
+    out[0] = (uint8_t)n;
+    out[1] = (uint8_t)((uint32_t)n >> 8);
+    out[2] = (uint8_t)((uint32_t)n >> 16);
+    out[3] = (uint8_t)((uint32_t)n >> 24);
+    uint8_t *bits = out + 4;
+    int full = n / 8;
+    for (int i = 0; i < full; ++i) {
+        const char *r = results + (size_t)i * 8;
+        uint8_t v = 0;
+        for (int j = 0; j < 8; ++j) v |= (uint8_t)((r[j] == '1') << j);
+        bits[i] = v;
+    }
+    if (n % 8) {
+        uint8_t v = 0;
+        for (int j = 0; j < n % 8; ++j) v |= (uint8_t)((results[(size_t)full * 8 + j] == '1') << j);
+        bits[full] = v;
+    }
+}
+
+/* 結果は 1 つのバッファにまとめて 1 回で書く */
+static int write_results(char *results, int n, int format) {
+    if (format == CF_OUTPUT_TEXT) {
+        results[n] = '\n';
+        return fwrite(results, 1, (size_t)n + 1, stdout) == (size_t)n + 1;
+    }
+    size_t bytes = 4 + ((size_t)n + 7) / 8;
+    uint8_t *out = (uint8_t *)malloc(bytes);
+    if (!out) return 0;
+    pack_result_bits(results, n, out);
+    int ok = fwrite(out, 1, bytes, stdout) == bytes;
+    free(out);
+    return ok;
+}
+
+/* ここから下はコマンドライン本体。-DCASEFILTER_NO_MAIN で外すと scripts/bench_casefilter.c などから
+ * このファイルを #include してライブラリ部分だけを使える。 */
+#ifndef CASEFILTER_NO_MAIN
+
+/* ===== クエリを全件読み込み、チャンク単位でワーカーに配る（-j 1 は呼び出しスレッドで実行） ===== */
+#define SEARCH_CHUNK 4096
+
+static int search_k = MAX_EDIT_DIST;  /* -k: 探索する編集距離（索引の max_k 以下） */
+
+enum { CF_SCHEDULE_INPUT, CF_SCHEDULE_SORTED };
+static int query_schedule = CF_SCHEDULE_INPUT;  /* --schedule: クエリを探す順（下の schedule_order） */
+
+static size_t cache_entries;  /* --cache: 結果 cache の件数（0 なら無し）。--serve では読み直した索引ごとに作り直す */
+
+/* 索引に -k の結果 cache を付ける。確保できなければ名前を添えて 0 */
+static int attach_cache(CaseFilterIndex *idx) {
+    if (!cache_entries) return 1;
+    CaseFilterCache *c = casefilter_cache_create(cache_entries, search_k);
+    if (!c) {
+        fprintf(stderr, "failed to allocate the result cache (%zu entries)\n", cache_entries);
+        return 0;
+    }
+    casefilter_cache_attach(idx, c);
+    return 1;
+}
+
+/* 索引が -k を被覆していなければ名前を添えて 0 */
+static int index_covers_k(const CaseFilterIndex *idx, const char *path) {
+    if (search_k <= (int)idx->spec.max_k) return 1;
+    fprintf(stderr, "%s was built with --max-k %u, cannot search -k %d\n", path, idx->spec.max_k, search_k);
+    return 0;
+}
+
+typedef struct {
+    const CaseFilterIndex *index;
+    CaseFilterLive *live;                     /* 非 NULL ならチャンクごとに acquire した索引を使う */
+    const uint64_t *codes;                    /* 長さ不正の行は CASEFILTER_NO_QUERY */
+    char *results;                            /* '0'/'1'。入力順に書き込む */
+    int query_count;
+    int workers_ok;                           /* ctx 確保に成功したワーカー数 */
+    int merge;                                /* 1: results の '1' は確定済みとして飛ばし、ヒットだけ '1' にする */
+    int failed;                               /* 差し替え後の ctx を確保できずチャンクを落とした */
+    CaseFilterStats *stats;                   /* --stats: ワーカーが ctx を捨てる前に足し込む（NULL なら無し） */
+    pthread_mutex_t stats_mu;
+    CaseFilterIndex **replicas;               /* --numa replicate: ノードごとの複製（NULL なら index を共有） */
+    int nodes;
+    int next_worker;                          /* __atomic: ワーカー番号 → ノード */
+    int deferred;                             /* 2 周目: CF_RESULT_DEFERRED のクエリに Case B だけ回す */
+    int deferred_count;                       /* __atomic: 1 周目に後回しにしたクエリ数 */
+    int ranges;                               /* チャンク列を分けた連続範囲の数（sorted なら -j、他は 1） */
+    int *range_next;                          /* [ranges] __atomic: 範囲ごとの次のチャンク */
+    int next_home;                            /* __atomic: ワーカー番号 → 最初に受け持つ範囲 */
+} SearchJob;
+
+/* 範囲 r のチャンク番号は [r * chunks / ranges, (r + 1) * chunks / ranges) */
+static inline int range_first(const SearchJob *job, int r) {
+    int chunks = (job->query_count + SEARCH_CHUNK - 1) / SEARCH_CHUNK;
+    return (int)((long)r * chunks / job->ranges);
+}
+
+static void job_reset_ranges(SearchJob *job) {
+    for (int r = 0; r < job->ranges; ++r) job->range_next[r] = range_first(job, r);
+}
+
+/* 次のチャンク。自分の範囲を先頭から順に取り、尽きたら隣の範囲を手伝う（*r は今いる範囲）。無ければ -1 */
+static int job_take_chunk(SearchJob *job, int *r) {
+    for (int tries = 0; tries < job->ranges; ++tries) {
+        int c = __atomic_fetch_add(&job->range_next[*r], 1, __ATOMIC_RELAXED);
+        if (c < range_first(job, *r + 1)) return c;
+        *r = (*r + 1) % job->ranges;
+    }
+    return -1;
+}
+
+/* 1 周目の results で「DelIndex を待つ間に Case A で外れた」クエリ（2 周目で '0' / '1' に書き直す） */
+#define CF_RESULT_DEFERRED '?'
+
+static inline char result_char(uint8_t hit) {
+    return hit == CASEFILTER_DEFERRED ? CF_RESULT_DEFERRED : hit ? '1' : '0';
+}
+
+static void job_fold_stats(SearchJob *job, const CaseFilterSearchCtx *ctx) {
+    if (!job->stats) return;
+    pthread_mutex_lock(&job->stats_mu);
+    casefilter_ctx_stats(ctx, job->stats);
+    pthread_mutex_unlock(&job->stats_mu);
+}
+
+/* home はワーカーのノードの複製（replicate 時のみ。live とは併用しない） */
+static inline const CaseFilterIndex *job_acquire(SearchJob *job, const CaseFilterIndex *home) {
+    if (home) return home;
+    return job->live ? casefilter_live_acquire(job->live) : job->index;
+}
+
+static inline void job_release(SearchJob *job) {
+    if (job->live) casefilter_live_release(job->live);
+}
+
+/* merge 時はチャンクごとに未確定のクエリだけ詰めて探索する（他シャードのプロセスが立てた '1' もここで見える） */
+static void search_chunk_merge(SearchJob *job, const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, int begin,
+                               int end) {
+    uint64_t pending[SEARCH_CHUNK];
+    int qi[SEARCH_CHUNK];
+    uint8_t hits[SEARCH_CHUNK];
+    int m = 0;
+    for (int i = begin; i < end; ++i) {
+        if (__atomic_load_n(&job->results[i], __ATOMIC_RELAXED) == '1' || job->codes[i] == CASEFILTER_NO_QUERY) continue;
+        pending[m] = job->codes[i];
+        qi[m++] = i;
+    }
+    if (m == 0) return;
+    casefilter_search_codes(idx, ctx, pending, m, search_k, hits);
+    int deferred = 0;
+    for (int i = 0; i < m; ++i) {
+        if (hits[i]) __atomic_store_n(&job->results[qi[i]], result_char(hits[i]), __ATOMIC_RELAXED);
+        deferred += hits[i] == CASEFILTER_DEFERRED;
+    }
+    if (deferred) __atomic_fetch_add(&job->deferred_count, deferred, __ATOMIC_RELAXED);
+}
+
+/* 2 周目: 後回しにしたクエリだけ詰めて Case B を引く */
+static void search_chunk_deferred(SearchJob *job, const CaseFilterIndex *idx, CaseFilterSearchCtx *ctx, int begin,
+                                  int end) {
+    uint64_t pending[SEARCH_CHUNK];
+    int qi[SEARCH_CHUNK];
+    uint8_t hits[SEARCH_CHUNK];
+    int m = 0;
+    for (int i = begin; i < end; ++i) {
+        if (job->results[i] != CF_RESULT_DEFERRED) continue;
+        pending[m] = job->codes[i];
+        qi[m++] = i;
+    }
+    if (m == 0) return;
+    casefilter_search_deferred(idx, ctx, pending, m, search_k, hits);
+    for (int i = 0; i < m; ++i) job->results[qi[i]] = hits[i] ? '1' : '0';
+}
+
+static void *search_worker(void *arg) {
+    SearchJob *job = (SearchJob *)arg;
+    const CaseFilterIndex *home = NULL;
+    if (job->replicas) {
+        int node = __atomic_fetch_add(&job->next_worker, 1, __ATOMIC_RELAXED) % job->nodes;
+        casefilter_numa_pin(node);  /* 留められなくても複製は使える（遠いノードを引くことがあるだけ） */
+        home = job->replicas[node];
+    }
+    CaseFilterSearchCtx *ctx = casefilter_ctx_create(job_acquire(job, home));
+    job_release(job);
+    if (!ctx) return NULL;
+    __atomic_fetch_add(&job->workers_ok, 1, __ATOMIC_RELAXED);
+    int range = __atomic_fetch_add(&job->next_home, 1, __ATOMIC_RELAXED) % job->ranges;
+    for (;;) {
+        int chunk = job_take_chunk(job, &range);
+        if (chunk < 0) break;
+        long begin = (long)chunk * SEARCH_CHUNK;
+        int end = (int)(begin + SEARCH_CHUNK < job->query_count ? begin + SEARCH_CHUNK : job->query_count);
+        const CaseFilterIndex *idx = job_acquire(job, home);
+        if (idx->keyword_count > ctx->cap) {
+            /* merge で差し替わってキーワードが増えた */
+            CaseFilterSearchCtx *grown = casefilter_ctx_create(idx);
+            if (!grown) {
+                job_release(job);
+                __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            job_fold_stats(job, ctx);
+            casefilter_ctx_free(ctx);
+            ctx = grown;
+        }
+        if (job->deferred) {
+            search_chunk_deferred(job, idx, ctx, (int)begin, end);
+        } else if (job->merge) {
+            search_chunk_merge(job, idx, ctx, (int)begin, end);
+        } else {
+            uint8_t *hits = (uint8_t *)job->results + begin;
+            casefilter_search_codes(idx, ctx, job->codes + begin, end - (int)begin, search_k, hits);
+            int deferred = 0;
+            for (int i = 0; i < end - (int)begin; ++i) {
+                deferred += hits[i] == CASEFILTER_DEFERRED;
+                job->results[begin + i] = result_char(hits[i]);
+            }
+            if (deferred) __atomic_fetch_add(&job->deferred_count, deferred, __ATOMIC_RELAXED);
+        }
+        job_release(job);
+    }
+    job_fold_stats(job, ctx);
+    casefilter_ctx_free(ctx);
+    return NULL;
+}
+
+/*
+ * --schedule sorted: クエリを局所性順に並べてから探す。code は末尾の文字が最上位なので、上位 24bit
+ * （末尾 6 文字 = ペア {3,4} のキー）で並べると、そのペアのスロットと削除位置 ≤ 7 の右7キーのスロットが
+ * 単調に進み、隣り合うクエリが同じディレクトリのラインとリストを続けて引く。--sort-ids の索引では id も
+ * code 順なので候補の codes も寄る。どのペアが一番短いかはディレクトリを引くまで分からないので、鍵は固定。
+ * 並べ替えは安定な LSD radix（12bit × 2）で、同じ鍵の中はファイル順のまま。
+ */
+#define CF_SCHEDULE_KEY_SHIFT (KEYWORD_LEN * 4 - 24)
+
+static uint32_t *schedule_order(const uint64_t *codes, int n) {
+    enum { RADIX_BITS = 12, RADIX = 1 << RADIX_BITS };
+    uint32_t *a = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)n);
+    uint32_t *tmp = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)n);
+    if (!a || !tmp) {
+        free(a);
+        free(tmp);
+        return NULL;
+    }
+    for (int i = 0; i < n; ++i) a[i] = (uint32_t)i;
+    size_t pos[RADIX];
+    for (int shift = CF_SCHEDULE_KEY_SHIFT; shift < KEYWORD_LEN * 4; shift += RADIX_BITS) {
+        memset(pos, 0, sizeof(pos));
+        for (int i = 0; i < n; ++i) pos[(codes[a[i]] >> shift) & (RADIX - 1)]++;
+        size_t sum = 0;
+        for (int b = 0; b < RADIX; ++b) {
+            size_t c = pos[b];
+            pos[b] = sum;
+            sum += c;
+        }
+        for (int i = 0; i < n; ++i) tmp[pos[(codes[a[i]] >> shift) & (RADIX - 1)]++] = a[i];
+        uint32_t *t = a;
+        a = tmp;
+        tmp = t;
+    }
+    /* パス数が偶数なので結果は元の配列に戻っている */
+    free(tmp);
+    return a;
+}
+
+/* codes と results を局所性順に並べた写しへ置き換え、i 番目の元の位置を (*order)[i] に返す */
+static int schedule_sorted(uint64_t **codes, char **results, int n, uint32_t **order) {
+    uint32_t *o = schedule_order(*codes, n);
+    uint64_t *c = (uint64_t *)malloc(sizeof(uint64_t) * (size_t)n);
+    char *r = (char *)malloc((size_t)n + 1);
+    if (!o || !c || !r) {
+        free(o);
+        free(c);
+        free(r);
+        return 0;
+    }
+    for (int i = 0; i < n; ++i) {
+        c[i] = (*codes)[o[i]];
+        r[i] = (*results)[o[i]];
+    }
+    free(*codes);
+    free(*results);
+    *codes = c;
+    *results = r;
+    *order = o;
+    return 1;
+}
+
+/* 並べた順の results を入力順に戻す（出力は入力順のまま） */
+static int schedule_restore(char **results, int n, const uint32_t *order) {
+    char *r = (char *)malloc((size_t)n + 1);
+    if (!r) return 0;
+    for (int i = 0; i < n; ++i) r[order[i]] = (*results)[i];
+    free(*results);
+    *results = r;
+    return 1;
+}
+
+/* ノードごとの複製。1 ノードの機械や複製できない索引（delta 付き・メモリ不足）では NULL（共有のまま探す） */
+static CaseFilterIndex **make_replicas(const CaseFilterIndex *index, int *nodes) {
+    int n = casefilter_numa_nodes();
+    if (n < 2) return NULL;
+    CaseFilterIndex **r = (CaseFilterIndex **)calloc((size_t)n, sizeof(*r));
+    for (int i = 0; r && i < n; ++i) {
+        /* cache はノードごとに別（ページはそのノードのワーカーが最初に触る） */
+        if ((r[i] = casefilter_replicate(index, i)) && attach_cache(r[i])) continue;
+        casefilter_free(r[i]);
+        fprintf(stderr, "numa: node %d への複製に失敗したので索引を共有します\n", i);
+        while (i-- > 0) casefilter_free(r[i]);
+        free(r);
+        return NULL;
+    }
+    *nodes = n;
+    return r;
+}
+
+static void free_replicas(CaseFilterIndex **r, int nodes) {
+    for (int i = 0; r && i < nodes; ++i) casefilter_free(r[i]);
+    free(r);
+}
+
+static void run_workers(SearchJob *job, pthread_t *tids, int threads) {
+    job_reset_ranges(job);
+    job->next_home = 0;
+    int started = 0;
+    for (; threads > 1 && started < threads; ++started) {
+        if (pthread_create(&tids[started], NULL, search_worker, job) != 0) break;
+    }
+    if (threads == 1 || started == 0) search_worker(job);
+    for (int t = 0; t < started; ++t) pthread_join(tids[t], NULL);
+}
+
+/*
+ * 1 索引（live なら探索中に差し替わり得る）に対して全クエリを探索する。0 なら ctx を確保できなかった。
+ * --schedule sorted ではクエリ列が局所性順なので、チャンク列を -j 個の連続範囲（= スロット範囲）に分け、
+ * ワーカーごとに別の範囲から始めて互いのラインを追い出し合わないようにする。
+ */
+static int search_all(const CaseFilterIndex *index, CaseFilterIndex **replicas, int nodes, CaseFilterLive *live,
+                      const uint64_t *codes, int n, char *results, int threads, int merge, CaseFilterStats *stats) {
+    int ranges = query_schedule == CF_SCHEDULE_SORTED ? threads : 1;
+    pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)threads);
+    int *range_next = (int *)malloc(sizeof(int) * (size_t)ranges);
+    if (!tids || !range_next) {
+        free(tids);
+        free(range_next);
+        return 0;
+    }
+    SearchJob job = {index, live, codes, results, n, 0, merge, 0, stats, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0,
+                     ranges, range_next, 0};
+    job.replicas = live ? NULL : replicas;
+    job.nodes = nodes;
+    run_workers(&job, tids, threads);
+    /* casefilter_load_async の索引なら、DelIndex が揃う前に Case A で外れたクエリを 2 周目で引き直す */
+    if (job.deferred_count && job.workers_ok > 0 && !job.failed) {
+        if (index_wait_d(index)) {
+            job.deferred = 1;
+            run_workers(&job, tids, threads);
+        } else {
+            job.failed = 1;
+        }
+    }
+    free(tids);
+    free(range_next);
+    /* 1つでも生き残ったワーカーがいれば全チャンクを処理し終えている */
+    return job.workers_ok > 0 && !job.failed;
+}
 
-    fclose(qf);
+/* --known: 別ノード・別シャードの結果行。'1' のクエリは確定として探索しない */
+static int apply_known(const char *path, char *results, int n) {
+    FILE *kf = fopen(path, "r");
+    if (!kf) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 0;
+    }
+    int i = 0, c;
+    while (i < n && (c = fgetc(kf)) != EOF && c != '\n') {
+        if (c == '1') results[i] = '1';
+        i++;
+    }
+    fclose(kf);
+    return 1;
+}
+
+/* ===== シャード（prep_casefilter --shards のマニフェスト） =====
+ * シャードごとに fork した子プロセスが索引をロードし、MAP_SHARED の結果列に '1' を OR する。
+ * 同時に走る子は procs 個まで。後から始まるシャードは確定済みのクエリを飛ばすので、procs を絞るほど
+ * メモリは最大シャード procs 個分に収まり、short-circuit も効く。
+ */
+#define CASEFILTER_SHARD_MAGIC "CFSHARDS"
+#define CASEFILTER_MAX_SHARDS 4096
+
+static int is_manifest(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    char magic[sizeof(CASEFILTER_SHARD_MAGIC) - 1];
+    int ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, CASEFILTER_SHARD_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+    return ok;
+}
+
+/* シャードのパス（マニフェストのディレクトリ基準）を返す。失敗時は NULL */
+static char **load_manifest(const char *path, int *count) {
+    FILE *mf = fopen(path, "r");
+    if (!mf) return NULL;
+    char by[16];
+    int version = 0, n = 0;
+    long total = 0;
+    char **paths = NULL;
+    if (fscanf(mf, CASEFILTER_SHARD_MAGIC " %d %15s %d %ld", &version, by, &n, &total) != 4 || version != 1 ||
+        n < 1 || n > CASEFILTER_MAX_SHARDS) {
+        fclose(mf);
+        return NULL;
+    }
+    const char *slash = strrchr(path, '/');
+    size_t dlen = slash ? (size_t)(slash - path) + 1 : 0;
+    paths = (char **)calloc((size_t)n, sizeof(char *));
+    int ok = paths != NULL;
+    long sum = 0;
+    for (int s = 0; ok && s < n; ++s) {
+        char name[4096];
+        int kw;
+        if (fscanf(mf, "%d %4095s", &kw, name) != 2 || kw < 0 || name[0] == '/') {
+            ok = 0;
+            break;
+        }
+        sum += kw;
+        paths[s] = (char *)malloc(dlen + strlen(name) + 1);
+        if (!paths[s]) { ok = 0; break; }
+        memcpy(paths[s], path, dlen);
+        strcpy(paths[s] + dlen, name);
+    }
+    fclose(mf);
+    if (ok && sum != total) ok = 0;
+    if (!ok) {
+        for (int s = 0; paths && s < n; ++s) free(paths[s]);
+        free(paths);
+        return NULL;
+    }
+    *count = n;
+    return paths;
+}
+
+static int run_shard(const char *path, const uint64_t *codes, int n, char *results, int threads) {
+    CaseFilterIndex *index = casefilter_load(path);
+    if (!index) {
+        fprintf(stderr, "failed to load shard %s\n", path);
+        return 0;
+    }
+    if (!index_covers_k(index, path)) {
+        casefilter_free(index);
+        return 0;
+    }
+    int nodes = 0;
+    CaseFilterIndex **replicas =
+        numa_policy == CF_NUMA_REPLICATE && threads > 1 ? make_replicas(index, &nodes) : NULL;
+    int ok = search_all(index, replicas, nodes, NULL, codes, n, results, threads, 1, NULL);
+    if (!ok) fprintf(stderr, "failed to allocate search context (%s)\n", path);
+    free_replicas(replicas, nodes);
     casefilter_free(index);
+    return ok;
+}
+
+static int search_shards(const char *manifest, const uint64_t *codes, int n, char *results, int threads, int procs) {
+    int shards = 0;
+    char **paths = load_manifest(manifest, &shards);
+    if (!paths) {
+        fprintf(stderr, "invalid shard manifest %s\n", manifest);
+        return 0;
+    }
+    /* 子プロセスと共有する結果列 */
+    char *shared = (char *)mmap(NULL, (size_t)n + 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int ok = shared != MAP_FAILED;
+    if (ok) memcpy(shared, results, (size_t)n);
+    if (procs < 1 || procs > shards) procs = shards;
+    int running = 0;
+    for (int s = 0; ok && s < shards; ++s) {
+        if (running == procs) {
+            int status;
+            if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = 0;
+            running--;
+            if (!ok) break;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) _exit(run_shard(paths[s], codes, n, shared, threads) ? 0 : 1);
+        if (pid < 0) {
+            /* fork できなければこのプロセスで順に処理する */
+            if (!run_shard(paths[s], codes, n, shared, threads)) ok = 0;
+        } else {
+            running++;
+        }
+    }
+    for (; running > 0; --running) {
+        int status;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = 0;
+    }
+    if (ok) memcpy(results, shared, (size_t)n);
+    if (shared != MAP_FAILED) munmap(shared, (size_t)n + 1);
+    for (int s = 0; s < shards; ++s) free(paths[s]);
+    free(paths);
+    return ok;
+}
+
+/* manifest が NULL なら index（live があればそちら、replicas があればノードごとの複製）を探索し、
+ * そうでなければシャードへ fan-out する */
+static int run_batch(const CaseFilterIndex *index, CaseFilterIndex **replicas, int nodes, CaseFilterLive *live,
+                     const char *manifest, const char *query_path, int threads, int procs, const char *known, int stats,
+                     int format) {
+    uint64_t *codes = NULL;
+    int n = read_queries(query_path, &codes);
+    if (n == -2) {
+        fprintf(stderr, "cannot open %s\n", query_path);
+        return 1;
+    }
+    if (n < 0) {
+        fprintf(stderr, "out of memory reading queries\n");
+        return 1;
+    }
+    char *results = (char *)malloc((size_t)n + 1);
+    if (!results) {
+        free(codes);
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memset(results, '0', (size_t)n);
+    int merge = known != NULL;
+    int ok = !known || apply_known(known, results, n);
+    uint32_t *order = NULL;
+    if (ok && query_schedule == CF_SCHEDULE_SORTED && n > 1 && !schedule_sorted(&codes, &results, n, &order)) {
+        fprintf(stderr, "out of memory sorting queries\n");
+        ok = 0;
+    }
+    if (ok && manifest) {
+        ok = search_shards(manifest, codes, n, results, threads, procs);
+    } else if (ok) {
+        CaseFilterStats st;
+        memset(&st, 0, sizeof(st));
+        ok = search_all(index, replicas, nodes, live, codes, n, results, threads, merge, stats ? &st : NULL);
+        if (!ok && !(index && index->load && index->load->failed)) fprintf(stderr, "failed to allocate search context\n");
+        else if (stats) casefilter_stats_print(&st, stderr);
+    }
+
+    if (ok && order && !schedule_restore(&results, n, order)) {
+        fprintf(stderr, "out of memory\n");
+        ok = 0;
+    }
+    int rc = ok ? 0 : 1;
+    if (ok && !write_results(results, n, format)) rc = 1;
+    free(order);
+    free(results);
+    free(codes);
+    return rc;
+}
+
+/* ===== 段階ごとの時間（record_perf 用） =====
+ * 環境変数 CASEFILTER_PHASE_FD に fd 番号があれば、終了時に "load_seconds=… search_seconds=…" の 1 行を書く。
+ * load は索引のロードと --delta の適用、search はクエリの読み込み・探索・結果の書き出し。
+ * シャード manifest では各シャードを子プロセスが探索の中でロードし、他のシャードの探索と重なって分けられないので、
+ * load_seconds は書かず、search_seconds に manifest の読み込みからの全体を書く（record_perf では load が空になる）。
+ */
+#define CASEFILTER_PHASE_ENV "CASEFILTER_PHASE_FD"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report_phases(double load_s, double search_s) {
+    const char *env = getenv(CASEFILTER_PHASE_ENV);
+    if (!env || !*env) return;
+    char line[96];
+    int n = load_s >= 0.0 ? snprintf(line, sizeof(line), "load_seconds=%.6f search_seconds=%.6f\n", load_s, search_s)
+                          : snprintf(line, sizeof(line), "search_seconds=%.6f\n", search_s);
+    if (n > 0 && write(atoi(env), line, (size_t)n) < 0) return;  /* 記録側がいなくても探索結果には影響させない */
+}
+
+/* ===== --serve: 索引を 1 度だけロードし、フレーム単位のバッチに答え続ける =====
+ * 要求: uint32 n（LE）+ n×15 バイトのクエリ（改行なし。文字種の外の文字はどの文字とも一致しない）
+ * 応答: uint32 n（LE）+ ceil(n/8) バイト。クエリ i のヒットは byte i/8 の bit i%8
+ * n = 0 は空の応答を返すだけ（疎通確認）。n が SERVE_MAX_BATCH を超える・途中で切れたフレームは接続を閉じる。
+ * 接続ごとに 読み → 探索 → 書き を深さ SERVE_DEPTH のキューでつなぎ、次の要求の解析と前の応答の送信を探索と重ねる。
+ * 1 バッチは acquire した 1 つの索引だけを見る。索引ファイルの (dev, ino, size, mtime) が変わるか SIGHUP で
+ * ロードし直し、成功したら casefilter_live_swap で差し替える（走っているバッチが終わるまで待つ）。
+ * 書き換えは別名に書いてから rename するのが安全（書きかけは読めなければ旧索引のまま）。
+ */
+#define SERVE_MAX_BATCH (1 << 20)
+#define SERVE_DEPTH 4
+#define SERVE_WATCH_MS 500
+
+typedef struct ServeBatch {
+    int n;
+    uint64_t *codes;
+    uint8_t *reply;  /* 4 + ceil(n/8) バイト */
+    struct ServeBatch *next;
+} ServeBatch;
+
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    ServeBatch *head, *tail;
+    int len;
+    int closed;
+} ServeQueue;
+
+typedef struct {
+    int in_fd, out_fd;
+    CaseFilterLive *live;
+    int threads;
+    ServeQueue parsed;  /* 読み → 探索 */
+    ServeQueue done;    /* 探索 → 書き */
+    int write_failed;
+} ServeConn;
+
+typedef struct {
+    const char *path;
+    CaseFilterLive *live;
+    struct stat seen;  /* 最後に見た索引ファイル */
+} ServeIndex;
+
+static volatile sig_atomic_t serve_stop;
+static volatile sig_atomic_t serve_reload;
+
+static void serve_on_stop(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+static void serve_on_hup(int sig) {
+    (void)sig;
+    serve_reload = 1;
+}
+
+static void queue_init(ServeQueue *q) {
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->mu, NULL);
+    pthread_cond_init(&q->cv, NULL);
+}
+
+static void queue_destroy(ServeQueue *q) {
+    pthread_mutex_destroy(&q->mu);
+    pthread_cond_destroy(&q->cv);
+}
+
+/* 満杯なら空くまで待つ（読みが探索より先に行き過ぎない） */
+static void queue_push(ServeQueue *q, ServeBatch *b) {
+    pthread_mutex_lock(&q->mu);
+    while (q->len >= SERVE_DEPTH) pthread_cond_wait(&q->cv, &q->mu);
+    b->next = NULL;
+    if (q->tail) q->tail->next = b;
+    else q->head = b;
+    q->tail = b;
+    q->len++;
+    pthread_cond_broadcast(&q->cv);
+    pthread_mutex_unlock(&q->mu);
+}
+
+/* 閉じられて空なら NULL */
+static ServeBatch *queue_pop(ServeQueue *q) {
+    pthread_mutex_lock(&q->mu);
+    while (!q->head && !q->closed) pthread_cond_wait(&q->cv, &q->mu);
+    ServeBatch *b = q->head;
+    if (b) {
+        q->head = b->next;
+        if (!q->head) q->tail = NULL;
+        q->len--;
+        pthread_cond_broadcast(&q->cv);
+    }
+    pthread_mutex_unlock(&q->mu);
+    return b;
+}
+
+static void queue_close(ServeQueue *q) {
+    pthread_mutex_lock(&q->mu);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->cv);
+    pthread_mutex_unlock(&q->mu);
+}
+
+static void batch_free(ServeBatch *b) {
+    if (!b) return;
+    free(b->codes);
+    free(b->reply);
+    free(b);
+}
+
+/* 1: len バイト読めた / 0: 先頭で EOF / -1: 途中で切れた・エラー */
+static int read_full(int fd, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(fd, (char *)buf + got, len - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return got == 0 && r == 0 ? 0 : -1;
+        got += (size_t)r;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    size_t put = 0;
+    while (put < len) {
+        ssize_t r = write(fd, (const char *)buf + put, len - put);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return 0;
+        put += (size_t)r;
+    }
+    return 1;
+}
+
+/* 要求を 1 つ読む。EOF・不正なフレームなら NULL */
+static ServeBatch *serve_read_batch(int fd) {
+    uint8_t hdr[4];
+    if (read_full(fd, hdr, sizeof(hdr)) != 1) return NULL;
+    uint32_t n = (uint32_t)hdr[0] | (uint32_t)hdr[1] << 8 | (uint32_t)hdr[2] << 16 | (uint32_t)hdr[3] << 24;
+    if (n > SERVE_MAX_BATCH) {
+        fprintf(stderr, "serve: batch of %u queries exceeds %d, closing\n", n, SERVE_MAX_BATCH);
+        return NULL;
+    }
+    ServeBatch *b = (ServeBatch *)calloc(1, sizeof(ServeBatch));
+    char *raw = (char *)malloc((size_t)n * KEYWORD_LEN + 1);
+    if (b) {
+        b->n = (int)n;
+        b->codes = (uint64_t *)malloc(sizeof(uint64_t) * ((size_t)n + 1));
+        b->reply = (uint8_t *)malloc(4 + ((size_t)n + 7) / 8);
+    }
+    if (!b || !raw || !b->codes || !b->reply || (n && read_full(fd, raw, (size_t)n * KEYWORD_LEN) != 1)) {
+        free(raw);
+        batch_free(b);
+        return NULL;
+    }
+    /* 文字種の外の文字は一発実行と同じく「必ず不一致」の文字として引く */
+    for (uint32_t i = 0; i < n; ++i) b->codes[i] = pack_keyword(raw + (size_t)i * KEYWORD_LEN);
+    free(raw);
+    return b;
+}
+
+static void *serve_reader(void *arg) {
+    ServeConn *c = (ServeConn *)arg;
+    ServeBatch *b;
+    while ((b = serve_read_batch(c->in_fd))) queue_push(&c->parsed, b);
+    queue_close(&c->parsed);
+    return NULL;
+}
+
+/* 書けなくなっても探索側を止めないよう、残りは捨てながら読み切る */
+static void *serve_writer(void *arg) {
+    ServeConn *c = (ServeConn *)arg;
+    ServeBatch *b;
+    while ((b = queue_pop(&c->done))) {
+        if (!c->write_failed && !write_full(c->out_fd, b->reply, 4 + ((size_t)b->n + 7) / 8)) c->write_failed = 1;
+        batch_free(b);
+    }
+    return NULL;
+}
+
+static int serve_search(ServeConn *c, ServeBatch *b, char **results, int *cap) {
+    if (b->n > *cap) {
+        char *t = (char *)realloc(*results, (size_t)b->n);
+        if (!t) return 0;
+        *results = t;
+        *cap = b->n;
+    }
+    memset(*results, '0', (size_t)b->n);
+    /* 小さなバッチでチャンク数より多くスレッドを立てても遊ぶだけ */
+    int threads = (b->n + SEARCH_CHUNK - 1) / SEARCH_CHUNK;
+    if (threads > c->threads) threads = c->threads;
+    if (threads < 1) threads = 1;
+    const CaseFilterIndex *idx = casefilter_live_acquire(c->live);
+    int ok = b->n == 0 || search_all(idx, NULL, 0, NULL, b->codes, b->n, *results, threads, 0, NULL);
+    casefilter_live_release(c->live);
+    if (ok) pack_result_bits(*results, b->n, b->reply);
+    return ok;
+}
+
+/* 1 接続を最後まで処理する。呼び出しスレッドが探索を受け持つ */
+static void serve_conn(int in_fd, int out_fd, CaseFilterLive *live, int threads) {
+    ServeConn c;
+    memset(&c, 0, sizeof(c));
+    c.in_fd = in_fd;
+    c.out_fd = out_fd;
+    c.live = live;
+    c.threads = threads;
+    queue_init(&c.parsed);
+    queue_init(&c.done);
+    pthread_t rt, wt;
+    int have_r = pthread_create(&rt, NULL, serve_reader, &c) == 0;
+    int have_w = have_r && pthread_create(&wt, NULL, serve_writer, &c) == 0;
+    if (!have_r || !have_w) {
+        fprintf(stderr, "serve: cannot start connection threads\n");
+        if (have_r) {
+            shutdown(in_fd, SHUT_RD);  /* ソケットなら読みを起こす（stdin では EOF まで待つ） */
+            ServeBatch *b;
+            while ((b = queue_pop(&c.parsed))) batch_free(b);
+            pthread_join(rt, NULL);
+        }
+        queue_destroy(&c.parsed);
+        queue_destroy(&c.done);
+        return;
+    }
+    char *results = NULL;
+    int cap = 0;
+    int failed = 0;
+    ServeBatch *b;
+    while ((b = queue_pop(&c.parsed))) {
+        if (failed || !serve_search(&c, b, &results, &cap)) {
+            if (!failed) {
+                fprintf(stderr, "serve: out of memory, closing connection\n");
+                shutdown(in_fd, SHUT_RD);
+            }
+            failed = 1;
+            batch_free(b);
+            continue;
+        }
+        queue_push(&c.done, b);
+    }
+    queue_close(&c.done);
+    pthread_join(rt, NULL);
+    pthread_join(wt, NULL);
+    free(results);
+    queue_destroy(&c.parsed);
+    queue_destroy(&c.done);
+}
+
+static int same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* 索引ファイルが変わっていれば読み直して差し替える。読めなければ旧索引のまま（次に変わるまで試さない） */
+static void serve_check_index(ServeIndex *si) {
+    struct stat st;
+    int forced = serve_reload;
+    serve_reload = 0;
+    if (stat(si->path, &st) != 0 || (!forced && same_file(&st, &si->seen))) return;
+    si->seen = st;
+    CaseFilterIndex *next = casefilter_load(si->path);
+    if (!next) {
+        fprintf(stderr, "serve: failed to load %s, keeping the current index\n", si->path);
+        return;
+    }
+    if (!index_covers_k(next, si->path)) {
+        fprintf(stderr, "serve: keeping the current index\n");
+        casefilter_free(next);
+        return;
+    }
+    if (!attach_cache(next)) {
+        fprintf(stderr, "serve: keeping the current index\n");
+        casefilter_free(next);
+        return;
+    }
+    int n = next->keyword_count;
+    casefilter_live_swap(si->live, next);
+    fprintf(stderr, "serve: reloaded %s (%d keywords)\n", si->path, n);
+}
+
+typedef struct {
+    ServeIndex *si;
+    int done;
+} ServeWatch;
+
+static void *serve_watcher(void *arg) {
+    ServeWatch *w = (ServeWatch *)arg;
+    while (!__atomic_load_n(&w->done, __ATOMIC_ACQUIRE)) {
+        poll(NULL, 0, SERVE_WATCH_MS);
+        serve_check_index(w->si);
+    }
+    return NULL;
+}
+
+/* --serve -: stdin のフレームを EOF まで処理して応答を stdout に書く */
+static int serve_stdio(ServeIndex *si, int threads) {
+    ServeWatch w = {si, 0};
+    pthread_t wt;
+    int have_w = pthread_create(&wt, NULL, serve_watcher, &w) == 0;
+    serve_conn(STDIN_FILENO, STDOUT_FILENO, si->live, threads);
+    __atomic_store_n(&w.done, 1, __ATOMIC_RELEASE);
+    if (have_w) pthread_join(wt, NULL);
     return 0;
 }
+
+typedef struct {
+    int fd;
+    CaseFilterLive *live;
+    int threads;
+    int *active;
+} ServeClient;
+
+static void *serve_client(void *arg) {
+    ServeClient *cl = (ServeClient *)arg;
+    serve_conn(cl->fd, cl->fd, cl->live, cl->threads);
+    close(cl->fd);
+    __atomic_fetch_sub(cl->active, 1, __ATOMIC_RELEASE);
+    free(cl);
+    return NULL;
+}
+
+/* --serve PATH: Unix ソケットで待ち受け、接続ごとにスレッドを立てる。SIGINT / SIGTERM で受け付けをやめる */
+static int serve_socket(ServeIndex *si, const char *sock_path, int threads) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", sock_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, sock_path);
+    struct stat st;
+    if (lstat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(sock_path);  /* 前回の残り */
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 64) != 0) {
+        perror("serve");
+        if (lfd >= 0) close(lfd);
+        return 1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_on_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    fprintf(stderr, "serve: listening on %s\n", sock_path);
+    int active = 0;
+    double next_check = now_seconds() + SERVE_WATCH_MS / 1000.0;
+    while (!serve_stop) {
+        struct pollfd pfd = {lfd, POLLIN, 0};
+        int r = poll(&pfd, 1, SERVE_WATCH_MS);
+        if (serve_reload || now_seconds() >= next_check) {
+            serve_check_index(si);
+            next_check = now_seconds() + SERVE_WATCH_MS / 1000.0;
+        }
+        if (r <= 0 || !(pfd.revents & POLLIN)) continue;
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0) continue;
+        ServeClient *cl = (ServeClient *)malloc(sizeof(ServeClient));
+        pthread_t t;
+        if (cl) *cl = (ServeClient){cfd, si->live, threads, &active};
+        __atomic_fetch_add(&active, 1, __ATOMIC_RELAXED);
+        if (!cl || pthread_create(&t, NULL, serve_client, cl) != 0) {
+            __atomic_fetch_sub(&active, 1, __ATOMIC_RELAXED);
+            free(cl);
+            close(cfd);
+            continue;
+        }
+        pthread_detach(t);
+    }
+    close(lfd);
+    unlink(sock_path);
+    /* 処理中の接続には書き終わるまで付き合うが、繋ぎっぱなしの相手は待たない */
+    for (int i = 0; i < 50 && __atomic_load_n(&active, __ATOMIC_ACQUIRE) > 0; ++i) poll(NULL, 0, 100);
+    return __atomic_load_n(&active, __ATOMIC_ACQUIRE) > 0 ? 2 : 0;
+}
+
+/* ===== main/search_casefilter.c の main() ===== */
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <query_file> <index_file|shard_manifest> [-j N] [-k K] [--kernel auto|scalar|avx2|avx512]\n"
+            "          [--planner staged|cost] [--shard-procs P] [--known RESULT] [--delta LOG [--merge]]\n"
+            "          [--stats] [--hugepages off|thp|2m|1g] [--numa off|interleave|replicate] [--output text|bits]\n"
+            "          [--schedule input|sorted] [--cache N]\n"
+            "       %s --serve SOCKET|- <index_file> [-j N] [-k K] [--kernel ...] [--planner ...] [--hugepages ...]\n"
+            "          [--numa off|interleave] [--cache N]\n"
+            "  -j N           N スレッドで並列検索（出力順は入力順のまま。シャードでは子プロセスごと）\n"
+            "  -k K           編集距離 K 以内を探す（0〜3、既定 3。索引の --max-k を超えられない）\n"
+            "  --kernel       候補検証カーネル（既定 auto: CPUID で最速を選ぶ）\n"
+            "  --planner      staged: Case A を全て見てから Case B（既定） / cost: A・B の全リストを短い順に見る\n"
+            "  --shard-procs  同時にロードするシャード数（既定: 全シャード）\n"
+            "  --known        既存の結果行で '1' のクエリは探索せず 1 とする（ノード間で結果を OR する用）\n"
+            "  --delta        更新ログ（+WORD 追加 / -WORD 削除）をロード後の索引に差分として適用する\n"
+            "  --merge        探索と並行して差分を base に統合し、できた索引へ差し替える\n"
+            "  --stats        スロット・候補・段ごとのヒット数と仕事量の分布を stderr に出す（-DCASEFILTER_STATS 版のみ）\n"
+            "  --hugepages    索引配列を huge page に置く（thp: madvise / 2m・1g: MAP_HUGETLB、足りなければ小さいページへ）\n"
+            "  --numa         interleave: 索引配列を全ノードに散らす / replicate: -j でノードごとに複製し、ワーカーを留める\n"
+            "  --output       text: '0'/'1' の 1 行（既定） / bits: u32le n + ceil(n/8) バイト（--serve の応答と同じ）\n"
+            "  --schedule     input: ファイル順に探す（既定） / sorted: 末尾 6 文字の順に並べて同じスロットを続けて引き、\n"
+            "                 -j ではその順の連続範囲をスレッドに分ける（出力は入力順のまま）\n"
+            "  --cache N      同じ code のクエリの結果を N 件まで覚えて答える（8 件の組ごとの CLOCK、既定 0 = 無し）。\n"
+            "                 16 件の組の中の重複は 1 度だけ探す。--serve ではバッチを跨いで効き、索引を読み直すと空になる\n"
+            "  --serve        索引を 1 度ロードして常駐し、Unix ソケット（- なら stdin/stdout）のフレーム要求に答える。\n"
+            "                 要求 u32le n + n×15 バイト → 応答 u32le n + ceil(n/8) バイトのヒットビット。\n"
+            "                 索引ファイルが置き換わるか SIGHUP でロードし直して差し替える\n",
+            prog, prog);
+}
+
+int main(int argc, char **argv) {
+    const char *query_path = NULL;
+    const char *index_path = NULL;
+    int threads = 1;
+    int procs = 0;
+    const char *kernel = "auto";
+    const char *planner = "staged";
+    const char *known = NULL;
+    const char *delta_path = NULL;
+    int merge = 0;
+    int stats = 0;
+    const char *hugepages = "off";
+    const char *numa = "off";
+    const char *serve = NULL;
+    int output = CF_OUTPUT_TEXT;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            threads = atoi(argv[++i]);
+            if (threads < 1) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "-k") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            search_k = atoi(argv[++i]);
+            if (search_k < 0 || search_k > MAX_EDIT_DIST) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--kernel") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            kernel = argv[++i];
+        } else if (strcmp(argv[i], "--planner") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            planner = argv[++i];
+        } else if (strcmp(argv[i], "--shard-procs") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            procs = atoi(argv[++i]);
+            if (procs < 1) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--known") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            known = argv[++i];
+        } else if (strcmp(argv[i], "--delta") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            delta_path = argv[++i];
+        } else if (strcmp(argv[i], "--merge") == 0) {
+            merge = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--hugepages") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            hugepages = argv[++i];
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            numa = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            serve = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            ++i;
+            if (strcmp(argv[i], "text") == 0) output = CF_OUTPUT_TEXT;
+            else if (strcmp(argv[i], "bits") == 0) output = CF_OUTPUT_BITS;
+            else { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            char *end = NULL;
+            long long v = strtoll(argv[++i], &end, 10);
+            if (!end || *end || v < 0 || v > (1LL << 34)) { usage(argv[0]); return 1; }
+            cache_entries = (size_t)v;
+        } else if (strcmp(argv[i], "--schedule") == 0) {
+            if (i + 1 >= argc) { usage(argv[0]); return 1; }
+            ++i;
+            if (strcmp(argv[i], "input") == 0) query_schedule = CF_SCHEDULE_INPUT;
+            else if (strcmp(argv[i], "sorted") == 0) query_schedule = CF_SCHEDULE_SORTED;
+            else { usage(argv[0]); return 1; }
+        } else if (!query_path) {
+            query_path = argv[i];
+        } else if (!index_path) {
+            index_path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (serve && query_path && !index_path) {
+        index_path = query_path;  /* --serve はクエリファイルを取らない */
+        query_path = NULL;
+    }
+    if ((!serve && !query_path) || (serve && query_path) || !index_path || (merge && !delta_path)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!casefilter_select_kernel(kernel)) {
+        fprintf(stderr, "kernel %s is not supported on this CPU\n", kernel);
+        return 1;
+    }
+    if (!casefilter_select_planner(planner)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!casefilter_set_hugepages(hugepages) || !casefilter_set_numa(numa)) {
+        fprintf(stderr, "unsupported --hugepages %s / --numa %s\n", hugepages, numa);
+        return 1;
+    }
+    if (numa_policy == CF_NUMA_REPLICATE && delta_path) {
+        fprintf(stderr, "--numa replicate cannot be combined with --delta\n");
+        return 1;
+    }
+    if (serve && (delta_path || known || stats || numa_policy == CF_NUMA_REPLICATE ||
+                  query_schedule != CF_SCHEDULE_INPUT)) {
+        fprintf(stderr, "--serve does not take --delta / --known / --stats / --numa replicate / --schedule\n");
+        return 1;
+    }
+    if (access(index_path, R_OK) != 0) {
+        fprintf(stderr, "cannot open %s\n", index_path);
+        return 1;
+    }
+#ifndef CASEFILTER_STATS
+    if (stats) {
+        fprintf(stderr, "--stats needs a build with -DCASEFILTER_STATS\n");
+        return 1;
+    }
+#endif
+    double t_load = now_seconds();
+    int sharded = is_manifest(index_path);
+    if (sharded && (delta_path || stats || serve || cache_entries)) {
+        fprintf(stderr, "--delta / --stats / --serve / --cache are not supported with a shard manifest\n");
+        return 1;
+    }
+    /* 1 回きりの探索は v1 の DelIndex を組み終える前に始める（Case B はクエリごとに後回し）。
+     * delta・merge・serve・複製は完成した索引が要り、--stats は 1 クエリの仕事量を 1 周で数えるので待つ */
+    int early = !delta_path && !serve && !stats && numa_policy != CF_NUMA_REPLICATE;
+    CaseFilterIndex *index = sharded ? NULL : casefilter_load_async(index_path, threads);
+    if (index && !early && !casefilter_load_wait(index)) {
+        casefilter_free(index);
+        index = NULL;
+    }
+    if (!sharded && !index) {
+        fprintf(stderr, "failed to load index\n");
+        return 1;
+    }
+    if (index && !index_covers_k(index, index_path)) {
+        casefilter_free(index);
+        return 1;
+    }
+    if (delta_path) {
+        FILE *lf = fopen(delta_path, "r");
+        int applied = lf ? casefilter_delta_apply(index, lf) : -1;
+        if (lf) fclose(lf);
+        if (applied < 0) {
+            fprintf(stderr, "failed to apply delta %s\n", delta_path);
+            casefilter_free(index);
+            return 1;
+        }
+    }
+    /* --numa replicate -j では複製（cache も複製ごと）だけを引くので base には付けない。
+     * 1 ノードの機械や複製に失敗して共有に戻るときは、探すのは base だけなのでそちらに付ける */
+    CaseFilterIndex **replicas = NULL;
+    int nodes = 0;
+    if (index && numa_policy == CF_NUMA_REPLICATE && threads > 1) replicas = make_replicas(index, &nodes);
+    if (index && !replicas && !attach_cache(index)) {
+        casefilter_free(index);
+        return 1;
+    }
+    CaseFilterLive *live = NULL;
+    int merging = 0;
+    if (merge) {
+        live = casefilter_live_create(index);
+        if (!live) {
+            fprintf(stderr, "out of memory\n");
+            casefilter_free(index);
+            return 1;
+        }
+        index = NULL;  /* 以降は live が所有する */
+        merging = casefilter_live_merge_async(live);
+        if (!merging) fprintf(stderr, "failed to start merge, searching base + delta\n");
+    }
+
+    if (serve) {
+        ServeIndex si = {index_path, casefilter_live_create(index), {0}};
+        if (!si.live) {
+            fprintf(stderr, "out of memory\n");
+            casefilter_free(index);
+            return 1;
+        }
+        stat(index_path, &si.seen);
+        signal(SIGPIPE, SIG_IGN);  /* 相手が切れたら write の失敗として扱う */
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = serve_on_hup;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGHUP, &sa, NULL);
+        int rc = strcmp(serve, "-") == 0 ? serve_stdio(&si, threads) : serve_socket(&si, serve, threads);
+        if (rc == 2) return 0;  /* 接続がまだ索引を使っているので解放せずに終える */
+        casefilter_live_free(si.live);
+        return rc;
+    }
+
+    double t_search = now_seconds();
+    int rc = run_batch(index, replicas, nodes, live, sharded ? index_path : NULL, query_path, threads, procs, known, stats,
+                       output);
+    if (fflush(stdout) != 0) rc = 1;
+    if (index && !casefilter_load_wait(index)) {
+        fprintf(stderr, "failed to load index\n");  /* 裏で組んでいた DelIndex が壊れていた */
+        rc = 1;
+    }
+    if (sharded) report_phases(-1.0, now_seconds() - t_load);
+    else report_phases(t_search - t_load, now_seconds() - t_search);
+
+    if (merging && !casefilter_live_merge_wait(live)) fprintf(stderr, "merge failed, the delta was kept as is\n");
+    casefilter_live_free(live);
+    free_replicas(replicas, nodes);
+    casefilter_free(index);
+    return rc;
+}
+#endif /* CASEFILTER_NO_MAIN */